@@ -10,6 +10,9 @@ struct token_pos_info {
 	const char           *p_line;
 	uint_fast32_t         line_nb;
 	uint_fast32_t         char_pos;
+	const char           *p_end; /* end of the document; p_line is not necessarily NUL terminated */
+	/* p_line and p_end are NULL for locations in documents loaded through an
+	 * ejson_parser as the text is not kept. */
 };
 
 struct ejson_error_handler {
@@ -18,14 +21,144 @@ struct ejson_error_handler {
 };
 
 
+/* Reject documents which are not well-formed UTF-8 before parsing them. */
+#define EJSON_FLAG_VALIDATE_UTF8 (1u << 0)
+
+/* The document is plain JSON. It is parsed directly into a compact tape and
+ * anything which is not plain JSON (including defines and expressions) is an
+ * error. Without this flag, lists and dicts in a document which turn out to
+ * be plain JSON are still parsed this way. */
+#define EJSON_FLAG_PLAIN_JSON    (1u << 1)
+
+/* Do not replace expressions which only involve constants with their values
+ * while parsing (for debugging). */
+#define EJSON_FLAG_NO_FOLD       (1u << 2)
+
+/* Print the tree of every define and of the document expression to stderr
+ * after it has been parsed (and folded) but before it is evaluated (for
+ * debugging). */
+#define EJSON_FLAG_DUMP_AST      (1u << 3)
+
+/* Maps of up to 1024 elements remember the values of their elements which
+ * are numbers, bools or nulls once they have been evaluated, so that reading
+ * an element again (e.g. with access) does not call the function again. The
+ * memo is allocated and cleared every time a map is created, which only pays
+ * for itself when elements of the same map are read more than once. */
+#define EJSON_FLAG_MEMO_MAPS     (1u << 4)
+
+#define EJSON_DEFAULT_MAX_DEPTH  (4096)
+
+/* Counters which are updated as documents are loaded and as their values
+ * are read. */
+struct ejson_stats {
+	/* Expressions which were replaced by their values (or by the taken
+	 * branch of an if) while parsing because their operands were constant. */
+	unsigned long folded_nodes;
+
+	/* References to defines which used the value the define was given when
+	 * the document was loaded rather than evaluating the define again.
+	 *
+	 * Every define which is not a constant is evaluated exactly once, as
+	 * soon as the document has been parsed, whether or not it is ever used.
+	 * It is not evaluated on first use because a use can happen in an
+	 * allocator which is about to be rewound (even the one the document was
+	 * loaded into) or on several threads at once, and a value which outlives
+	 * that needs an allocator which nothing ever rewinds. A define which
+	 * fails to evaluate is evaluated again at each use (and the use is not
+	 * counted here) so that its error is reported where it is used. */
+	unsigned long define_hits;
+
+	/* Elements of maps which were taken from the memo of the map rather than
+	 * by calling its function again (see EJSON_FLAG_MEMO_MAPS). */
+	unsigned long memo_hits;
+};
+
 struct evaluation_context {
 	struct cop_strdict_node *p_workspace;
+
+	/* The parsed document (and the value of its root) is allocated from
+	 * p_alloc and lives for as long as the values which are loaded from it.
+	 * Temporaries which are only needed while parsing (such as the working
+	 * of constant expressions which are folded) come from p_scratch, which
+	 * is rewound as soon as each one is finished with. p_scratch is the
+	 * same as p_alloc by default; making it a separate allocator keeps the
+	 * parsed document packed together.
+	 *
+	 * Elements of lists and values of dicts are evaluated using the
+	 * allocator which is passed to the jnode functions which fetch them, so
+	 * the caller decides how long they live (jnode_print() rewinds it after
+	 * each one). Once a document has been loaded, its values may be read on
+	 * several threads at once as long as each thread passes its own
+	 * allocator (see jnode_fprint_parallel()). */
 	struct cop_salloc_iface *p_alloc;
+	struct cop_salloc_iface *p_scratch;
+
 	unsigned                 stack_depth;
+	unsigned                 flags; /* EJSON_FLAG_* (zero by default) */
+
+	/* Limit on how deeply expressions may be nested in a document and on how
+	 * deeply evaluation may recurse (e.g. through function calls) before an
+	 * error is raised. */
+	unsigned                 max_depth; /* EJSON_DEFAULT_MAX_DEPTH by default */
+
+	struct ejson_stats       stats; /* zeroed by evaluation_context_init() */
 
 };
 
 void evaluation_context_init(struct evaluation_context *p_ctx, struct cop_salloc_iface *p_alloc);
+
+/* Loads the len byte document at p_document. The document does not need to be
+ * NUL terminated and no byte outside of it is ever read (the vectorised
+ * scanners only load whole blocks which lie within it), so it may be a slice
+ * of a larger buffer or end right before unmapped memory. The document must
+ * remain valid while p_node is in use as errors raised while expanding lazily
+ * generated values refer to it. */
+int ejson_load_n(struct jnode *p_node, struct evaluation_context *p_workspace, const char *p_document, size_t len, struct ejson_error_handler *p_error_handler);
+
+/* Loads the NUL terminated document at p_document. */
 int ejson_load(struct jnode *p_node, struct evaluation_context *p_workspace, const char *p_document, struct ejson_error_handler *p_error_handler);
 
+/* A document which has been loaded and frozen so that it can be shared
+ * between threads. ejson_document_load_n() parses the document as
+ * ejson_load_n() does (which evaluates all of its defines) but leaves the
+ * document expression for each reader to evaluate, so every reader gets its
+ * own root with its own allocator and error handler (see
+ * ejson_document_root()). Reading the document never writes to it and
+ * never takes a lock: concatenations which start with one of its values are
+ * copied into the reader's allocator rather than added to in place and
+ * EJSON_FLAG_MEMO_MAPS is ignored. The document is allocated from the
+ * workspace allocator and lives for as long as the memory it was given; the
+ * workspace itself is not used again. Uses of defines are not counted in the
+ * workspace stats. Returns NULL on error. */
+struct ejson_document;
+struct ejson_document *ejson_document_load_n(struct evaluation_context *p_workspace, const char *p_document, size_t len, struct ejson_error_handler *p_error_handler);
+struct ejson_document *ejson_document_load(struct evaluation_context *p_workspace, const char *p_document, struct ejson_error_handler *p_error_handler);
+
+/* Gets the root of a frozen document. Every value read through p_node is
+ * evaluated in p_alloc and errors raised while evaluating it go to
+ * p_error_handler. Any number of threads may each get their own root and
+ * read it at the same time, as long as each one uses its own allocator.
+ * Getting a root only evaluates the top level of the document expression so
+ * it is cheap to do for every request. Returns non-zero on error. */
+int ejson_document_root(struct jnode *p_node, const struct ejson_document *p_document, struct cop_salloc_iface *p_alloc, const struct ejson_error_handler *p_error_handler);
+
+/* Incremental loading of a document which arrives in pieces (e.g. from a pipe
+ * or socket). The document is tokenised and parsed as each chunk is fed so
+ * that neither the chunks nor their tokens need to be kept; only the AST
+ * built so far, the few tokens which the parser has not reduced yet and any
+ * partial token at the end of the last chunk are held. ejson_parser_finish()
+ * parses whatever is left and evaluates the document.
+ *
+ * The parser is allocated from the workspace allocator. Chunks may be split
+ * anywhere (including within tokens and UTF-8 sequences).
+ * ejson_parser_finish() must be called once the last chunk has been fed (or
+ * to abandon the document) to release the memory held by the parser; it
+ * produces the same result as ejson_load_n() would for the concatenation of
+ * every chunk. ejson_parser_feed() returns non-zero if an error was found in
+ * the document, after which ejson_parser_finish() will also fail. */
+struct ejson_parser;
+struct ejson_parser *ejson_parser_create(struct evaluation_context *p_workspace, struct ejson_error_handler *p_error_handler);
+int ejson_parser_feed(struct ejson_parser *p_parser, const char *p_chunk, size_t len);
+int ejson_parser_finish(struct ejson_parser *p_parser, struct jnode *p_node);
+
 #endif /* EJSON_H */
@@ -27,6 +27,9 @@ struct jnode;
  * the lifetime of the jnode value is only for the lifetime of the callback function. */
 typedef int (jdict_enumerate_fn)(struct jnode *p_dest, const char *p_key, void *p_userctx);
 
+/* as jdict_enumerate_fn but only given the key. */
+typedef int (jdict_key_fn)(const char *p_key, void *p_userctx);
+
 struct jnode {
 	int cls;
 	union {
@@ -51,6 +54,12 @@ struct jnode {
 
 			/* return < 0 for error, > 0 for key not found or 0 for successful */
 			int       (*get_by_key)(struct jnode *p_dest, void *ctx, struct cop_salloc_iface *p_alloc, const char *p_key);
+
+			/* as enumerate but only the keys are given and no value is
+			 * fetched. The keys must come in the same order as they do from
+			 * enumerate. May be NULL, in which case the dict is never split
+			 * by jnode_fprint_parallel(). */
+			int       (*enumerate_keys)(jdict_key_fn *p_fn, void *ctx, void *p_userctx);
 		} dict;
 	} d;
 };
@@ -1,18 +1,22 @@
 #include "cop/cop_main.h"
 #include "ejson/ejson.h"
 #include "ejson/json_iface_utils.h"
+#include "cop/cop_filemap.h"
 #include <stdio.h>
+#include <string.h>
 
 static void on_parser_error(void *p_context, const struct token_pos_info *p_location, const char *p_format, va_list args) {
 	if (p_location != NULL) {
 		const char *p_line = p_location->p_line;
 		fprintf(stderr, "  on line %d character %d: ", p_location->line_nb, p_location->char_pos);
 		vfprintf(stderr, p_format, args);
-		fprintf(stderr, "    '");
-		while (*p_line != '\0' && *p_line != '\n' && *p_line != '\r')
-			fprintf(stderr, "%c", *p_line++);
-		fprintf(stderr, "'\n");
-		fprintf(stderr, "    %*s^\n", p_location->char_pos, "");
+		if (p_line != NULL) {
+			fprintf(stderr, "    '");
+			while (p_line < p_location->p_end && *p_line != '\n' && *p_line != '\r')
+				fprintf(stderr, "%c", *p_line++);
+			fprintf(stderr, "'\n");
+			fprintf(stderr, "    %*s^\n", p_location->char_pos, "");
+		}
 	} else {
 		fprintf(stderr, "  ");
 		vfprintf(stderr, p_format, args);
@@ -20,67 +24,134 @@ static void on_parser_error(void *p_context, const struct token_pos_info *p_loca
 }
 
 
-static void *load_text_to_memory(const char *fname) {
-	FILE *f = fopen(fname, "rb");
-	if (f != NULL) {
-		if (fseek(f, 0, SEEK_END) == 0) {
-			long fsz = ftell(f);
-			if (fsz >= 0) {
-				if (fseek(f, 0, SEEK_SET) == 0) {
-					unsigned char *fbuf = malloc(fsz + 1);
-					if (fbuf != NULL) {
-						if (fread(fbuf, 1, fsz, f) == fsz) {
-							fclose(f);
-							fbuf[fsz] = '\0';
-							return fbuf;
-						}
-						free(fbuf);
-					}
-				}
-			}
-		}
-		fclose(f);
+/* Loads the document from f by feeding it to an ejson_parser as it is read.
+ * Used for inputs which can not be mapped (pipes, terminals and stdin) so
+ * that parsing overlaps with reading and neither the text nor its tokens are
+ * ever held in full. */
+static int load_stream(struct jnode *p_node, struct evaluation_context *p_ws, FILE *f, struct ejson_error_handler *p_err) {
+	static char          buf[65536];
+	struct ejson_parser *p_parser;
+	size_t               n;
+	if ((p_parser = ejson_parser_create(p_ws, p_err)) == NULL)
+		return -1;
+	while ((n = fread(buf, 1, sizeof(buf), f)) != 0) {
+		if (ejson_parser_feed(p_parser, buf, n))
+			break;
 	}
-	return NULL;
+	if (ferror(f)) {
+		fprintf(stderr, "failed to read file\n");
+		ejson_parser_finish(p_parser, p_node);
+		return -1;
+	}
+	return ejson_parser_finish(p_parser, p_node);
+}
+
+static void usage(const char *p_argv0) {
+	fprintf(stderr, "usage: %s [--validate-utf8] [--json] [--no-fold] [--dump-ast] [--memo-maps] [--stats] [--max-depth N] [-j N] filename\n", p_argv0);
+	fprintf(stderr, "  a filename of - reads the document from stdin\n");
+	fprintf(stderr, "  -j N evaluates the elements of lists and values of dicts on N threads\n");
 }
 
 int expand_main(int argc, char *argv[]) {
+	const char *p_fname = NULL;
+	unsigned    flags   = 0;
+	unsigned    depth   = EJSON_DEFAULT_MAX_DEPTH;
+	unsigned    threads = 1;
+	int         stats   = 0;
+	int         i;
+
+	for (i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "--validate-utf8")) {
+			flags |= EJSON_FLAG_VALIDATE_UTF8;
+		} else if (!strcmp(argv[i], "--json")) {
+			flags |= EJSON_FLAG_PLAIN_JSON;
+		} else if (!strcmp(argv[i], "--no-fold")) {
+			flags |= EJSON_FLAG_NO_FOLD;
+		} else if (!strcmp(argv[i], "--dump-ast")) {
+			flags |= EJSON_FLAG_DUMP_AST;
+		} else if (!strcmp(argv[i], "--memo-maps")) {
+			flags |= EJSON_FLAG_MEMO_MAPS;
+		} else if (!strcmp(argv[i], "--stats")) {
+			stats = 1;
+		} else if (!strcmp(argv[i], "--max-depth") && i + 1 < argc) {
+			depth = (unsigned)strtoul(argv[++i], NULL, 10);
+		} else if (!strcmp(argv[i], "-j") && i + 1 < argc) {
+			threads = (unsigned)strtoul(argv[++i], NULL, 10);
+		} else if ((argv[i][0] == '-' && argv[i][1] != '\0') || p_fname != NULL) {
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		} else {
+			p_fname = argv[i];
+		}
+	}
 
-	if (argc > 1) {
-		char *data;
+	if (p_fname != NULL) {
+		struct cop_filemap map;
+		int mapped = 0;
 		struct jnode dut;
 		struct evaluation_context ws;
 		struct ejson_error_handler err;
 		struct cop_salloc_iface alloc;
 		struct cop_alloc_grp_temps mem;
+		struct cop_salloc_iface scratch;
+		struct cop_alloc_grp_temps scratch_mem;
 
 		err.on_parser_error = on_parser_error;
 		err.p_context = NULL;
 
-		if (cop_alloc_grp_temps_init(&mem, &alloc, 1024, 1024*1024, 16)) {
+		/* The document is kept in alloc. Everything else, including the
+		 * elements of the document as they are printed, is made in scratch
+		 * (or in the allocators of the worker threads when printing with
+		 * -j) and rewound as soon as it has been used. */
+		if  (   cop_alloc_grp_temps_init(&mem, &alloc, 1024, 1024*1024, 16)
+		    ||  cop_alloc_grp_temps_init(&scratch_mem, &scratch, 1024, 1024*1024, 16)
+		    ) {
 			abort();
 		}
 
 		evaluation_context_init(&ws, &alloc);
-
-		if ((data = load_text_to_memory(argv[1])) == NULL) {
-			fprintf(stderr, "failed to load file\n");
-			return EXIT_FAILURE;
-		}
-
-		if (ejson_load(&dut, &ws, data, &err)) {
-			fprintf(stderr, "failed to parse document\n");
-			return EXIT_FAILURE;
+		ws.p_scratch = &scratch;
+		ws.flags     = flags;
+		ws.max_depth = depth;
+
+		/* Map the input if we can so that tokenising starts straight away
+		 * without copying it. Anything which can not be mapped is streamed
+		 * through an ejson_parser instead. */
+		if (strcmp(p_fname, "-") && !cop_filemap_open(&map, p_fname, COP_FILEMAP_FLAG_R)) {
+			mapped = 1;
+			if (ejson_load_n(&dut, &ws, map.ptr, map.size, &err)) {
+				fprintf(stderr, "failed to parse document\n");
+				return EXIT_FAILURE;
+			}
+		} else {
+			FILE *f = (strcmp(p_fname, "-")) ? fopen(p_fname, "rb") : stdin;
+			int   failed;
+			if (f == NULL) {
+				fprintf(stderr, "failed to load file\n");
+				return EXIT_FAILURE;
+			}
+			failed = load_stream(&dut, &ws, f, &err);
+			if (f != stdin)
+				fclose(f);
+			if (failed) {
+				fprintf(stderr, "failed to parse document\n");
+				return EXIT_FAILURE;
+			}
 		}
 
-		if (jnode_print(&dut, &alloc, 0)) {
+		if (jnode_fprint_parallel(stdout, &dut, &scratch, 0, threads)) {
 			fprintf(stderr, "failed to print root node\n");
 			return EXIT_FAILURE;
 		}
 
+		if (mapped)
+			cop_filemap_close(&map);
 
-
-		free(data);
+		if (stats) {
+			fprintf(stderr, "folded expressions: %lu\n", ws.stats.folded_nodes);
+			fprintf(stderr, "define cache hits: %lu\n", ws.stats.define_hits);
+			fprintf(stderr, "map memo hits: %lu\n", ws.stats.memo_hits);
+		}
 	}
 	
 
@@ -10,7 +10,7 @@ static void on_parser_error(void *p_context, const struct token_pos_info *p_loca
 		fprintf(stdout, "  on line %d character %d: ", p_location->line_nb, p_location->char_pos);
 		vfprintf(stdout, p_format, args);
 		fprintf(stdout, "    '");
-		while (*p_line != '\0' && *p_line != '\n' && *p_line != '\r')
+		while (p_line < p_location->p_end && *p_line != '\n' && *p_line != '\r')
 			fprintf(stdout, "%c", *p_line++);
 		fprintf(stdout, "'\n");
 		fprintf(stdout, "    %*s^\n", p_location->char_pos, "");
@@ -34,6 +34,8 @@ int main(int argc, char **argv) {
 		struct ejson_error_handler err;
 		struct cop_salloc_iface alloc;
 		struct cop_alloc_grp_temps mem;
+		struct cop_salloc_iface scratch;
+		struct cop_alloc_grp_temps scratch_mem;
 		struct evaluation_context ws;
 		struct jnode node;
 
@@ -57,18 +59,24 @@ int main(int argc, char **argv) {
 		err.on_parser_error = on_parser_error;
 		err.p_context       = NULL;
 
-		if (cop_alloc_grp_temps_init(&mem, &alloc, 1024, 1024*1024, 16)) {
+		/* The document is kept in alloc. Everything else, including the
+		 * elements of the document as they are printed, is made in scratch
+		 * and rewound as soon as it has been used. */
+		if  (   cop_alloc_grp_temps_init(&mem, &alloc, 1024, 1024*1024, 16)
+		    ||  cop_alloc_grp_temps_init(&scratch_mem, &scratch, 1024, 1024*1024, 16)
+		    ) {
 			abort();
 		}
 
 		evaluation_context_init(&ws, &alloc);
+		ws.p_scratch = &scratch;
 
 		if (ejson_load(&node, &ws, buf, &err)) {
 			fprintf(stdout, "failed to parse document\n> ");
 			continue;
 		}
 
-		if (jnode_print(&node, &alloc, 0)) {
+		if (jnode_print(&node, &scratch, 0)) {
 			fprintf(stdout, "failed to print root node\n> ");
 			continue;
 		}
@@ -2,11 +2,33 @@
 #define JSON_IFACE_UTILS_H
 
 #include <stdlib.h>
+#include <stdio.h>
 #include "ejson_iface.h"
 
-/* returns non zero on error */
+/* returns non zero on error. each element is fetched using p_alloc, which is
+ * rewound once the element has been printed. */
 int jnode_print(struct jnode *p_root, struct cop_salloc_iface *p_alloc, unsigned indent);
 
+/* as jnode_print() but prints to f. */
+int jnode_fprint(FILE *f, struct jnode *p_root, struct cop_salloc_iface *p_alloc, unsigned indent);
+
+/* as jnode_fprint() but the elements of lists and the values of dicts are
+ * fetched and printed on nb_threads threads (including the calling one) at
+ * once. Whenever a thread comes to a list or dict while another is idle, it
+ * splits it into runs of elements or keys, at any depth, and the idle
+ * threads steal them. Each thread has its own allocator and the text of
+ * each piece is written out in order so the output is the same as
+ * jnode_fprint() gives. Elements and values must be able to be fetched from
+ * several threads at once (the values of ejson documents can be). Splitting
+ * a dict needs its enumerate_keys; a dict which does not have one is
+ * printed by one thread. Each value of a dict which is split is fetched
+ * once, by the thread which prints it. Once a fetch fails no thread starts
+ * another, and errors raised while evaluating ejson documents are only
+ * passed to the error handler by the first thread which failed, so one
+ * error is reported as it is by jnode_fprint() (though with several
+ * failing elements it need not be the first one in the document). */
+int jnode_fprint_parallel(FILE *f, struct jnode *p_root, struct cop_salloc_iface *p_alloc, unsigned indent, unsigned nb_threads);
+
 /* returns < 0 on error.
  * returns > 0 for different.
  * returns 0 for same. */
@@ -1,11 +1,22 @@
 #include "ejson/ejson.h"
-#include "cop/cop_filemap.h"
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include "ejson_thread.h"
+#include "json_tape.h"
 #include "parse_helpers.h"
+#include "parse_number.h"
+#include "scan_helpers.h"
+
+/* Stops the compiler from merging functions which need a lot of stack into
+ * evaluate_ast(), which recurses. */
+#if defined(_MSC_VER) && !defined(__clang__)
+#define EJSON_NOINLINE __declspec(noinline)
+#else
+#define EJSON_NOINLINE __attribute__((noinline))
+#endif
 
 /* IDEA: the evaluate ast function should return a pointer to an evaluated ast node object.
  *
@@ -14,15 +25,17 @@
  * 
  * Or maybe this would just be messy? */
 
-#define MAX_TOK_STRING (4096)
-
 struct token {
 	const struct tok_def  *cls;
 	struct token_pos_info  posinfo;
 	union {
 		struct {
-			size_t len;
-			char   str[MAX_TOK_STRING];
+			/* Slice of the source document (excluding quotes for strings).
+			 * needs_unescape is set when the slice contains at least one
+			 * escape sequence which must be decoded before use. */
+			const char *p_data;
+			size_t      len;
+			int         needs_unescape;
 		} strident;
 		long long tint;
 		double    tflt;
@@ -50,7 +63,7 @@ struct tok_def {
 
 #ifndef ejson_error
 static int ejson_error_fn(const struct ejson_error_handler *p_handler, const struct token_pos_info *p_location, const char *p_format, ...) {
-	if (p_handler != NULL) {
+	if (p_handler != NULL && ejson_thread_may_report_error()) {
 		va_list args;
 		va_start(args, p_format);
 		p_handler->on_parser_error(p_handler->p_context, p_location, p_format, args);
@@ -72,14 +85,62 @@ static int ejson_error_fn(const struct ejson_error_handler *p_handler, const str
 
 struct ast_node;
 
+/* Every class has an op which the evaluator switches on rather than
+ * comparing the class against each of the classes in turn. The binary
+ * operators which are evaluated by evaluate_binop() are kept together so
+ * that is_binop() is a range check. */
+enum ast_op {
+	AST_OP_LITERAL_NULL,
+	AST_OP_LITERAL_INT,
+	AST_OP_LITERAL_FLOAT,
+	AST_OP_LITERAL_STRING,
+	AST_OP_LITERAL_BOOL,
+	AST_OP_LITERAL_LIST,
+	AST_OP_LITERAL_DICT,
+	AST_OP_LIST_GENERATOR,
+	AST_OP_READY_DICT,
+	AST_OP_TAPE_DICT,
+	AST_OP_NEG,
+	AST_OP_LOGNOT,
+	AST_OP_DIV,
+	AST_OP_ADD,
+	AST_OP_SUB,
+	AST_OP_MUL,
+	AST_OP_MOD,
+	AST_OP_EXP,
+	AST_OP_BITAND,
+	AST_OP_BITOR,
+	AST_OP_LOGAND,
+	AST_OP_LOGOR,
+	AST_OP_EQ,
+	AST_OP_NEQ,
+	AST_OP_LT,
+	AST_OP_LEQ,
+	AST_OP_GEQ,
+	AST_OP_GT,
+	AST_OP_RANGE,
+	AST_OP_FUNCTION,
+	AST_OP_CALL,
+	AST_OP_ACCESS,
+	AST_OP_MAP,
+	AST_OP_FORMAT,
+	AST_OP_STACKREF,
+	AST_OP_IF,
+	AST_OP_DEFINE,
+
+	AST_OP_FIRST_BINOP = AST_OP_ADD,
+	AST_OP_LAST_BINOP  = AST_OP_GT
+};
+
 struct ast_cls {
 	const char  *p_name;
+	enum ast_op  op;
 	int        (*to_jnode)(struct ast_node *p_node, struct jnode *p_dest);
 	void       (*debug_print)(const struct ast_node *p_node, FILE *p_f, unsigned depth);
 };
 
-#define DEF_AST_CLS(name_, to_jnode_fn_, debug_print_fn_) \
-	static const struct ast_cls name_ = { #name_, to_jnode_fn_, debug_print_fn_ }
+#define DEF_AST_CLS(name_, op_, to_jnode_fn_, debug_print_fn_) \
+	static const struct ast_cls name_ = { #name_, op_, to_jnode_fn_, debug_print_fn_ }
 
 #define EJSON_TYPE_NULL     (0)
 #define EJSON_TYPE_STRING   (1)
@@ -90,16 +151,26 @@ struct ast_cls {
 #define EJSON_TYPE_LIST     (6)
 #define EJSON_TYPE_FUNCTION (7)
 
-struct ev_ast_node {
-	const struct ast_node      *p_node;
-	const struct ev_ast_node  **pp_stack;
-	unsigned                    stack_size;
+struct ev_ast_node;
 
+/* The source line that AST nodes came from. Positions are only needed when
+ * errors are raised, so rather than each node carrying a full
+ * token_pos_info, the nodes from a line share one of these and only hold
+ * their column (see ast_location()). */
+struct ast_line {
+	const char            *p_line;
+	const char            *p_end;
+	uint_fast32_t          line_nb;
 };
 
 struct ast_node {
 	const struct ast_cls  *cls;
-	struct token_pos_info  doc_pos;
+	const struct ast_line *p_line;
+	uint32_t               char_pos;
+
+	/* The number of elements of an AST_CLS_LIST_GENERATOR. This is kept
+	 * out of the union so that it fills the space after char_pos. */
+	uint32_t               nb_elements;
 
 	union {
 		long long                   i; /* AST_CLS_LITERAL_INT, AST_CLS_LITERAL_BOOL */
@@ -143,40 +214,179 @@ struct ast_node {
 		struct {
 			const struct ast_node  *p_function;
 			const struct ast_node  *p_input_list;
+			struct ejson_stats     *p_memo_stats; /* NULL unless the map keeps a memo */
 		} map;
 		struct {
 			const struct ast_node  *p_data;
 			const struct ast_node  *p_key;
 		} access;
+		struct {
+			const struct ast_node  *p_expr;
+			struct define_value    *p_value;
+		} define; /* AST_CLS_DEFINE */
 
 		struct {
 			unsigned                 nb_keys;
 			struct cop_strdict_node *p_root;
 		} rdict;
+		const struct json_tape      *p_tape; /* AST_CLS_TAPE_DICT */
 		struct {
-			int (*get_element)(struct ev_ast_node *p_node, const struct ev_ast_node *p_list, unsigned element, struct cop_salloc_iface *p_alloc, const struct ejson_error_handler *p_error_handler);
+			int (*get_element)(struct ev_ast_node *p_node, const struct ev_ast_node *p_list, unsigned element, unsigned depth, struct cop_salloc_iface *p_alloc, const struct ejson_error_handler *p_error_handler);
 			union {
 				struct {
 					long long first;
 					long long step;
 				} range;
-				struct {
-					const struct ev_ast_node *p_function;
-					const struct ev_ast_node *p_key;
-				} map;
+				struct map_generator *p_map;
 				struct {
 					const struct ast_node **pp_values;
 				} literal;
 				struct {
-					const struct ast_node *p_first;
-					const struct ast_node *p_second;
+					struct list_cat       *p_cat;
+					unsigned               nb_parts;
 				} cat;
+				const struct json_tape *p_tape;
 			} d;
-			uint_fast32_t     nb_elements;
-		} lgen; /* AST_CLS_LIST_GENERATOR */
+		} lgen; /* AST_CLS_LIST_GENERATOR (and nb_elements) */
+
+	} d;
+
+};
+
+/* The arguments of one function call, linked to the stack which the called
+ * function captured when it was created. A call pushes a single frame rather
+ * than copying the whole of the captured stack, so its cost does not depend
+ * on how deeply functions are nested. */
+struct ev_frame {
+	const struct ev_frame     *p_parent;
+	const struct ev_ast_node  *p_args;
+	unsigned                   nb_args;
+};
+
+/* An evaluated expression. Lists, dicts and functions are nodes in the
+ * allocator which may refer to the stack they were evaluated with. Scalars
+ * (null, bools, integers, reals and strings) which are produced while
+ * evaluating are instead stored in value with p_node pointing at it, so that
+ * arithmetic or reading the elements of a range allocates nothing. Copies
+ * must be made with ev_copy() and p_node must not be kept for longer than
+ * the ev_ast_node which it came from (unless it is a list, dict or
+ * function). */
+struct ev_ast_node {
+	const struct ast_node      *p_node;
+	const struct ev_frame      *p_stack;
+	unsigned                    stack_size;
+	struct ast_node             value;
+
+};
+
+/* Returns the value in p_stack which was pushed idx values ago (the last
+ * argument of the innermost call is 1). */
+static const struct ev_ast_node *ev_stack_get(const struct ev_frame *p_stack, unsigned idx) {
+	while (idx > p_stack->nb_args) {
+		idx     -= p_stack->nb_args;
+		p_stack  = p_stack->p_parent;
+	}
+	return &(p_stack->p_args[p_stack->nb_args - idx]);
+}
+
+static void ev_copy(struct ev_ast_node *p_dest, const struct ev_ast_node *p_src) {
+	*p_dest = *p_src;
+	if (p_src->p_node == &(p_src->value))
+		p_dest->p_node = &(p_dest->value);
+}
 
+/* Makes p_dest hold a scalar and returns the node to store it in. */
+static struct ast_node *ev_scalar(struct ev_ast_node *p_dest) {
+	p_dest->p_node     = &(p_dest->value);
+	p_dest->p_stack    = NULL;
+	p_dest->stack_size = 0;
+	return &(p_dest->value);
+}
+
+/* With EJSON_FLAG_MEMO_MAPS, maps of up to this many elements remember the
+ * values of their elements which are scalars (other than strings) once they
+ * have been evaluated, so that reading an element again (e.g. with access)
+ * does not call the function again. Only these values are kept as they need
+ * no memory besides the memo itself, which is allocated along with the
+ * map. */
+#define MAP_MEMO_MAX_ELEMENTS (1024)
+
+#define MAP_MEMO_EMPTY   (0)
+#define MAP_MEMO_WRITING (1)
+#define MAP_MEMO_READY   (2)
+
+/* An element is claimed by changing state from MAP_MEMO_EMPTY to
+ * MAP_MEMO_WRITING with a compare-and-swap, so that the same map may be read
+ * on several threads at once. cls and d are only read once state is
+ * MAP_MEMO_READY. */
+struct map_memo {
+	unsigned              state;
+	const struct ast_cls *cls;
+	union {
+		long long         i;
+		double            f;
 	} d;
+};
 
+/* A map of one or more functions over a list. A map of a map is fused into
+ * a single generator when it is created: it takes the list and functions of
+ * the map it is given and adds its own function to the end, so the element
+ * of a pipeline of maps is found by applying each function in turn to an
+ * element of list (which is never itself a map) rather than by recursing
+ * through a generator for every stage. */
+struct map_generator {
+	struct ev_ast_node    list;
+	struct ev_ast_node   *p_functions;
+	unsigned              nb_functions;
+	struct map_memo      *p_memo;  /* NULL if there is no memo */
+	struct ejson_stats   *p_stats; /* counts hits in p_memo */
+};
+
+/* The stack frame for a call to a function which takes one argument. */
+struct ev_frame1 {
+	struct ev_frame       frame;
+	struct ev_ast_node    arg;
+};
+
+/* The lists which are joined by a chain of + operators. Each part keeps the
+ * stack it was evaluated with and p_ends[i] is the number of elements in
+ * parts 0 to i, so an element is found with a binary search. The parts are
+ * shared by every concatenation which was built by adding to the end of
+ * another one: a node only uses the first nb_parts of them and nb_used
+ * counts how many have been claimed, so a list can be added to the end in
+ * place if no other node has done so already. That is only done by an
+ * evaluation which allocates from p_alloc, the allocator the parts were
+ * made in; anything else (such as a reader of a frozen document adding to
+ * one of its defines) copies them instead so that it never writes to memory
+ * it does not own. Parts are still claimed with a compare-and-swap on
+ * nb_used in case two allocators which are in use at once share the same
+ * interface. */
+struct list_cat {
+	unsigned                 nb_used;
+	unsigned                 nb_alloc;
+	struct ev_ast_node      *p_parts;
+	unsigned                *p_ends;
+	struct cop_salloc_iface *p_alloc;
+};
+
+#define DEFINE_PENDING (0)
+#define DEFINE_READY   (1)
+#define DEFINE_FAILED  (2)
+
+/* The value of a define which is not a constant. Every define is evaluated
+ * into the allocator the document is loaded into once the whole document
+ * has been parsed (see evaluate_defines()), so that the value is never
+ * rewound by something which happens to use the define first and nothing
+ * about the define is written once the document has been loaded. A define
+ * which could not be evaluated is DEFINE_FAILED and is evaluated again in
+ * the allocator of every use so that the error is raised there. p_stats is
+ * NULL for frozen documents (see ejson_document_load_n()). */
+struct define_value {
+	const char               *p_name;
+	struct ev_ast_node        value;
+	unsigned                  state;
+	struct ejson_stats       *p_stats;
+	const struct ast_node    *p_next; /* the next define of the document */
 };
 
 struct dictnode {
@@ -184,6 +394,41 @@ struct dictnode {
 	const struct ast_node   *data; /* Unevaluated nodes */
 };
 
+/* Fills p_tpi with the position of p_node and returns it. */
+static const struct token_pos_info *ast_location(struct token_pos_info *p_tpi, const struct ast_node *p_node) {
+	p_tpi->p_line   = p_node->p_line->p_line;
+	p_tpi->p_end    = p_node->p_line->p_end;
+	p_tpi->line_nb  = p_node->p_line->line_nb;
+	p_tpi->char_pos = p_node->char_pos;
+	return p_tpi;
+}
+
+static void ast_copy_location(struct ast_node *p_dest, const struct ast_node *p_src) {
+	p_dest->p_line   = p_src->p_line;
+	p_dest->char_pos = p_src->char_pos;
+}
+
+/* Raises an error at the position of p_node. This is a function rather than
+ * a macro so that the token_pos_info it needs is not part of the stack frame
+ * of every function which can raise an error (evaluate_ast() in particular
+ * recurses). */
+#ifndef ast_location_error
+#ifdef EJSON_NO_ERROR_MESSAGES
+#define ast_location_error(p_handler_, p_node_, p_format, ...) (-1)
+#else
+static int ast_location_error(const struct ejson_error_handler *p_handler, const struct ast_node *p_node, const char *p_format, ...) {
+	if (p_handler != NULL && ejson_thread_may_report_error()) {
+		struct token_pos_info tpi;
+		va_list               args;
+		va_start(args, p_format);
+		p_handler->on_parser_error(p_handler->p_context, ast_location(&tpi, p_node), p_format, args);
+		va_end(args);
+	}
+	return -1;
+}
+#endif
+#endif
+
 #define TOK_DECL(name_, precedence_, right_associative_, binop_ast_cls_, unary_precedence_, unop_ast_cls_) \
 	static const struct tok_def name_ = {#name_, precedence_, right_associative_, binop_ast_cls_, unop_ast_cls_, unary_precedence_}
 
@@ -256,6 +501,12 @@ static void debug_ready_dict(const struct ast_node *p_node, FILE *p_f, unsigned
 	fprintf(p_f, "%*s%s\n", depth, "", p_node->cls->p_name);
 	/* TODO */
 }
+static void debug_tape_dict(const struct ast_node *p_node, FILE *p_f, unsigned depth) {
+	fprintf(p_f, "%*s%s(%u)\n", depth, "", p_node->cls->p_name, (unsigned)p_node->d.p_tape->nb);
+}
+static void debug_print_define(const struct ast_node *p_node, FILE *p_f, unsigned depth) {
+	fprintf(p_f, "%*s%s(%s)\n", depth, "", p_node->cls->p_name, p_node->d.define.p_value->p_name);
+}
 static void debug_print_ifexpr(const struct ast_node *p_node, FILE *p_f, unsigned depth) {
 	fprintf(p_f, "%*s%s\n", depth, "", p_node->cls->p_name);
 	p_node->d.ifexpr.p_test->cls->debug_print(p_node->d.ifexpr.p_test, p_f, depth + 1);
@@ -264,43 +515,45 @@ static void debug_print_ifexpr(const struct ast_node *p_node, FILE *p_f, unsigne
 }
 
 
-DEF_AST_CLS(AST_CLS_LITERAL_NULL,    NULL, debug_print_null);
-DEF_AST_CLS(AST_CLS_LITERAL_INT,     NULL, debug_print_int_like);
-DEF_AST_CLS(AST_CLS_LITERAL_FLOAT,   NULL, debug_print_real);
-DEF_AST_CLS(AST_CLS_LITERAL_STRING,  NULL, debug_print_string);
-DEF_AST_CLS(AST_CLS_LITERAL_BOOL,    NULL, debug_print_bool);
-DEF_AST_CLS(AST_CLS_LITERAL_LIST,    NULL, debug_print_list);
-DEF_AST_CLS(AST_CLS_LITERAL_DICT,    NULL, debug_print_dict);
-DEF_AST_CLS(AST_CLS_NEG,             NULL, debug_print_unop);
-DEF_AST_CLS(AST_CLS_BITAND,          NULL, debug_print_binop);
-DEF_AST_CLS(AST_CLS_BITOR,           NULL, debug_print_binop);
-DEF_AST_CLS(AST_CLS_LOGNOT,          NULL, debug_print_unop);
-DEF_AST_CLS(AST_CLS_LOGAND,          NULL, debug_print_binop);
-DEF_AST_CLS(AST_CLS_LOGOR,           NULL, debug_print_binop);
-DEF_AST_CLS(AST_CLS_ADD,             NULL, debug_print_binop);
-DEF_AST_CLS(AST_CLS_SUB,             NULL, debug_print_binop);
-DEF_AST_CLS(AST_CLS_MUL,             NULL, debug_print_binop);
-DEF_AST_CLS(AST_CLS_DIV,             NULL, debug_print_binop);
-DEF_AST_CLS(AST_CLS_MOD,             NULL, debug_print_binop);
-DEF_AST_CLS(AST_CLS_EXP,             NULL, debug_print_binop);
-DEF_AST_CLS(AST_CLS_EQ,              NULL, debug_print_binop);
-DEF_AST_CLS(AST_CLS_NEQ,             NULL, debug_print_binop);
-DEF_AST_CLS(AST_CLS_LT,              NULL, debug_print_binop);
-DEF_AST_CLS(AST_CLS_LEQ,             NULL, debug_print_binop);
-DEF_AST_CLS(AST_CLS_GEQ,             NULL, debug_print_binop);
-DEF_AST_CLS(AST_CLS_GT,              NULL, debug_print_binop);
-DEF_AST_CLS(AST_CLS_RANGE,           NULL, debug_print_builtin);
-DEF_AST_CLS(AST_CLS_FUNCTION,        NULL, debug_print_function);
-DEF_AST_CLS(AST_CLS_CALL,            NULL, debug_print_call);
-DEF_AST_CLS(AST_CLS_ACCESS,          NULL, debug_print_access);
-DEF_AST_CLS(AST_CLS_MAP,             NULL, debug_print_map);
-DEF_AST_CLS(AST_CLS_FORMAT,          NULL, debug_print_builtin);
-DEF_AST_CLS(AST_CLS_STACKREF,        NULL, debug_print_int_like);
-DEF_AST_CLS(AST_CLS_IF,              NULL, debug_print_ifexpr);
-
-
-DEF_AST_CLS(AST_CLS_LIST_GENERATOR,  NULL, debug_list_generator);
-DEF_AST_CLS(AST_CLS_READY_DICT,      NULL, debug_ready_dict);
+DEF_AST_CLS(AST_CLS_LITERAL_NULL,   AST_OP_LITERAL_NULL,   NULL, debug_print_null);
+DEF_AST_CLS(AST_CLS_LITERAL_INT,    AST_OP_LITERAL_INT,    NULL, debug_print_int_like);
+DEF_AST_CLS(AST_CLS_LITERAL_FLOAT,  AST_OP_LITERAL_FLOAT,  NULL, debug_print_real);
+DEF_AST_CLS(AST_CLS_LITERAL_STRING, AST_OP_LITERAL_STRING, NULL, debug_print_string);
+DEF_AST_CLS(AST_CLS_LITERAL_BOOL,   AST_OP_LITERAL_BOOL,   NULL, debug_print_bool);
+DEF_AST_CLS(AST_CLS_LITERAL_LIST,   AST_OP_LITERAL_LIST,   NULL, debug_print_list);
+DEF_AST_CLS(AST_CLS_LITERAL_DICT,   AST_OP_LITERAL_DICT,   NULL, debug_print_dict);
+DEF_AST_CLS(AST_CLS_NEG,            AST_OP_NEG,            NULL, debug_print_unop);
+DEF_AST_CLS(AST_CLS_BITAND,         AST_OP_BITAND,         NULL, debug_print_binop);
+DEF_AST_CLS(AST_CLS_BITOR,          AST_OP_BITOR,          NULL, debug_print_binop);
+DEF_AST_CLS(AST_CLS_LOGNOT,         AST_OP_LOGNOT,         NULL, debug_print_unop);
+DEF_AST_CLS(AST_CLS_LOGAND,         AST_OP_LOGAND,         NULL, debug_print_binop);
+DEF_AST_CLS(AST_CLS_LOGOR,          AST_OP_LOGOR,          NULL, debug_print_binop);
+DEF_AST_CLS(AST_CLS_ADD,            AST_OP_ADD,            NULL, debug_print_binop);
+DEF_AST_CLS(AST_CLS_SUB,            AST_OP_SUB,            NULL, debug_print_binop);
+DEF_AST_CLS(AST_CLS_MUL,            AST_OP_MUL,            NULL, debug_print_binop);
+DEF_AST_CLS(AST_CLS_DIV,            AST_OP_DIV,            NULL, debug_print_binop);
+DEF_AST_CLS(AST_CLS_MOD,            AST_OP_MOD,            NULL, debug_print_binop);
+DEF_AST_CLS(AST_CLS_EXP,            AST_OP_EXP,            NULL, debug_print_binop);
+DEF_AST_CLS(AST_CLS_EQ,             AST_OP_EQ,             NULL, debug_print_binop);
+DEF_AST_CLS(AST_CLS_NEQ,            AST_OP_NEQ,            NULL, debug_print_binop);
+DEF_AST_CLS(AST_CLS_LT,             AST_OP_LT,             NULL, debug_print_binop);
+DEF_AST_CLS(AST_CLS_LEQ,            AST_OP_LEQ,            NULL, debug_print_binop);
+DEF_AST_CLS(AST_CLS_GEQ,            AST_OP_GEQ,            NULL, debug_print_binop);
+DEF_AST_CLS(AST_CLS_GT,             AST_OP_GT,             NULL, debug_print_binop);
+DEF_AST_CLS(AST_CLS_RANGE,          AST_OP_RANGE,          NULL, debug_print_builtin);
+DEF_AST_CLS(AST_CLS_FUNCTION,       AST_OP_FUNCTION,       NULL, debug_print_function);
+DEF_AST_CLS(AST_CLS_CALL,           AST_OP_CALL,           NULL, debug_print_call);
+DEF_AST_CLS(AST_CLS_ACCESS,         AST_OP_ACCESS,         NULL, debug_print_access);
+DEF_AST_CLS(AST_CLS_MAP,            AST_OP_MAP,            NULL, debug_print_map);
+DEF_AST_CLS(AST_CLS_FORMAT,         AST_OP_FORMAT,         NULL, debug_print_builtin);
+DEF_AST_CLS(AST_CLS_STACKREF,       AST_OP_STACKREF,       NULL, debug_print_int_like);
+DEF_AST_CLS(AST_CLS_IF,             AST_OP_IF,             NULL, debug_print_ifexpr);
+DEF_AST_CLS(AST_CLS_DEFINE,         AST_OP_DEFINE,         NULL, debug_print_define);
+
+
+DEF_AST_CLS(AST_CLS_LIST_GENERATOR, AST_OP_LIST_GENERATOR, NULL, debug_list_generator);
+DEF_AST_CLS(AST_CLS_READY_DICT,     AST_OP_READY_DICT,     NULL, debug_ready_dict);
+DEF_AST_CLS(AST_CLS_TAPE_DICT,      AST_OP_TAPE_DICT,      NULL, debug_tape_dict);
 
 /* Numeric literals */
 TOK_DECL(TOK_INT,        -1, 0, NULL, -1, NULL); /* 13123 */
@@ -354,22 +607,126 @@ TOK_DECL(TOK_ASSIGN,     -1, 0, NULL, -1, NULL); /* = */
 TOK_DECL(TOK_COLON,      -1, 0, NULL, -1, NULL); /* : */
 TOK_DECL(TOK_SEMI,       -1, 0, NULL, -1, NULL); /* ; */
 
+/* Keyword recognition.
+ *
+ * Every word token is looked up in keyword_table with a single probe using a
+ * perfect hash of its length and its first and last characters. To add a
+ * keyword, add a line to EJSON_KEYWORDS giving the word, its first and last
+ * characters and its token definition. If the new word collides with an
+ * existing one, the keyword_hash_is_perfect check will fail to compile and
+ * KEYWORD_HASH needs adjusting (or KEYWORD_HASH_BITS increasing). */
+#define KEYWORD_HASH_BITS (5)
+#define KEYWORD_HASH(len_, first_, last_) \
+	(((unsigned)(len_) + (unsigned char)(first_) + ((unsigned)(unsigned char)(last_) << 2)) & ((1u << KEYWORD_HASH_BITS) - 1u))
+
+#define EJSON_KEYWORDS(X_) \
+	X_("true",   't', 'e', TOK_TRUE) \
+	X_("false",  'f', 'e', TOK_FALSE) \
+	X_("null",   'n', 'l', TOK_NULL) \
+	X_("range",  'r', 'e', TOK_RANGE) \
+	X_("call",   'c', 'l', TOK_CALL) \
+	X_("func",   'f', 'c', TOK_FUNC) \
+	X_("define", 'd', 'e', TOK_DEFINE) \
+	X_("access", 'a', 's', TOK_ACCESS) \
+	X_("map",    'm', 'p', TOK_MAP) \
+	X_("format", 'f', 't', TOK_FORMAT) \
+	X_("and",    'a', 'd', TOK_LOGAND) \
+	X_("or",     'o', 'r', TOK_LOGOR) \
+	X_("not",    'n', 't', TOK_LOGNOT) \
+	X_("if",     'i', 'f', TOK_IF)
+
+struct keyword {
+	const char           *p_word;
+	size_t                len;
+	const struct tok_def *p_def;
+};
+
+#define KEYWORD_ENTRY(word_, first_, last_, def_) \
+	[KEYWORD_HASH(sizeof(word_) - 1, first_, last_)] = {word_, sizeof(word_) - 1, &def_},
+#define KEYWORD_BIT_SUM(word_, first_, last_, def_) (1ull << KEYWORD_HASH(sizeof(word_) - 1, first_, last_)) +
+#define KEYWORD_BIT_OR(word_, first_, last_, def_)  (1ull << KEYWORD_HASH(sizeof(word_) - 1, first_, last_)) |
+
+/* The sum of the slot bits only equals their union if no two keywords share a slot. */
+typedef char keyword_hash_is_perfect[((EJSON_KEYWORDS(KEYWORD_BIT_SUM) 0ull) == (EJSON_KEYWORDS(KEYWORD_BIT_OR) 0ull)) ? 1 : -1];
+
+static const struct keyword keyword_table[1u << KEYWORD_HASH_BITS] = {
+	EJSON_KEYWORDS(KEYWORD_ENTRY)
+};
+
+static const struct tok_def *keyword_lookup(const char *p_word, size_t len) {
+	const struct keyword *p_kw = &(keyword_table[KEYWORD_HASH(len, p_word[0], p_word[len - 1])]);
+	if (p_kw->len == len && !memcmp(p_kw->p_word, p_word, len))
+		return p_kw->p_def;
+	return &TOK_IDENTIFIER;
+}
+
 struct tokeniser {
 	uint_fast32_t line_nb;
 	const char   *p_line_start;
 
 	const char   *buf;
+	const char   *p_end;
+
+	/* Set when more of the document may follow p_end (see tok_scan()) or the
+	 * end of the tape (see tok_need()). */
+	int           partial;
+
+	/* When p_tape is not NULL, tokens are taken from the tape_len tokens it
+	 * points to rather than being scanned. */
+	struct token *p_tape;
+	size_t        tape_len;
+	size_t        tape_pos;
 
 	struct token  *p_current;
 	struct token  *p_next;
 
 	struct token  curx;
 	struct token  nextx;
+
+	/* Scratch stack of nodes used while parsing list, dict and function
+	 * literals (see scratch_push()). Released by tokeniser_free(). */
+	const struct ast_node **pp_scratch;
+	size_t                  scratch_len;
+	size_t                  scratch_cap;
+
+	/* Stack of expressions which the parser is part way through (see
+	 * parse_run()) and the number of PARSE_EXPR frames on it. Also released
+	 * by tokeniser_free(). p_value is the value which is waiting to be given
+	 * to the innermost frame or NULL if it is waiting for a primary
+	 * expression. */
+	struct parse_frame     *p_frames;
+	size_t                  frames_len;
+	size_t                  frames_cap;
+	unsigned                expr_depth;
+	const struct ast_node  *p_value;
+
+	/* Where parse_document_expr() is in the document: the define whose
+	 * expression is being parsed, the defines which have been parsed so far
+	 * and the root expression once it has been. */
+	int                      doc_state;
+	struct cop_strdict_node *p_define;
+	const struct ast_node   *p_defines;
+	const struct ast_node  **pp_defines_tail;
+	const struct ast_node   *p_root;
+
+	/* Builds the tapes of plain JSON values (see parse_json()). */
+	struct json_tape_builder json;
+
+	/* The line record shared by the nodes created for tokens on the most
+	 * recent line (see tok_ast_line()). */
+	const struct ast_line  *p_ast_line;
 };
 
+/* The states of parse_document_expr() */
+#define DOC_START  (0) /* the next token begins a define or the root expression */
+#define DOC_DEFINE (1) /* the expression of p_define is being parsed */
+#define DOC_SEMI   (2) /* the expression of a define has been parsed */
+#define DOC_ROOT   (3) /* the root expression is being parsed */
+#define DOC_END    (4) /* the root expression has been parsed */
+
 static void token_print(const struct token *p_token) {
 	if (p_token->cls == &TOK_IDENTIFIER || p_token->cls == &TOK_STRING) {
-		printf("%s:'%s'\n", p_token->cls->name, p_token->t.strident.str);
+		printf("%s:'%.*s'\n", p_token->cls->name, (int)p_token->t.strident.len, p_token->t.strident.p_data);
 	} else if (p_token->cls == &TOK_FLOAT) {
 		printf("%s:%f\n", p_token->cls->name, p_token->t.tflt);
 	} else if (p_token->cls == &TOK_INT) {
@@ -379,6 +736,92 @@ static void token_print(const struct token *p_token) {
 	}
 }
 
+/* Writes the UTF-8 encoding of the code point cp to p_out and returns a
+ * pointer to the byte following it. */
+static char *utf8_encode(char *p_out, unsigned long cp) {
+	if (cp < 0x80) {
+		*p_out++ = (char)cp;
+	} else if (cp < 0x800) {
+		*p_out++ = (char)(0xC0 | (cp >> 6));
+		*p_out++ = (char)(0x80 | (cp & 0x3F));
+	} else if (cp < 0x10000) {
+		*p_out++ = (char)(0xE0 | (cp >> 12));
+		*p_out++ = (char)(0x80 | ((cp >> 6) & 0x3F));
+		*p_out++ = (char)(0x80 | (cp & 0x3F));
+	} else {
+		*p_out++ = (char)(0xF0 | (cp >> 18));
+		*p_out++ = (char)(0x80 | ((cp >> 12) & 0x3F));
+		*p_out++ = (char)(0x80 | ((cp >> 6) & 0x3F));
+		*p_out++ = (char)(0x80 | (cp & 0x3F));
+	}
+	return p_out;
+}
+
+/* Decodes the escape sequences in the len bytes at p_src (which must have
+ * already been validated by tok_read()) into p_dest and returns the number of
+ * bytes written. p_dest must have room for at least len bytes: no escape
+ * sequence produces more bytes than it occupies (a "\uXXXX" escape produces
+ * at most three bytes of UTF-8 and a surrogate pair of escapes produces
+ * four). */
+static size_t token_unescape(char *p_dest, const char *p_src, size_t len) {
+	const char *p_end = p_src + len;
+	char       *p_out = p_dest;
+	while (p_src < p_end) {
+		const char *p_esc = memchr(p_src, '\\', p_end - p_src);
+		size_t      run   = ((p_esc != NULL) ? p_esc : p_end) - p_src;
+		memcpy(p_out, p_src, run);
+		p_out += run;
+		p_src += run;
+		if (p_esc == NULL)
+			break;
+		switch (p_src[1]) {
+		case 'b': *p_out++ = '\b'; break;
+		case 'f': *p_out++ = '\f'; break;
+		case 'n': *p_out++ = '\n'; break;
+		case 'r': *p_out++ = '\r'; break;
+		case 't': *p_out++ = '\t'; break;
+		case 'u':
+			{
+				unsigned      hi, lo;
+				unsigned long cp;
+				p_src += 2;
+				(void)expect_codepoint_digits(&p_src, &hi);
+				cp = hi;
+				if (hi >= 0xD800u && hi <= 0xDBFFu) {
+					p_src += 2;
+					(void)expect_codepoint_digits(&p_src, &lo);
+					cp = 0x10000ul + (((unsigned long)hi - 0xD800u) << 10) + (lo - 0xDC00u);
+				}
+				p_out = utf8_encode(p_out, cp);
+			}
+			continue;
+		default:  *p_out++ = p_src[1]; break; /* \\, \" and \/ */
+		}
+		p_src += 2;
+	}
+	return p_out - p_dest;
+}
+
+/* Copies the string or identifier slice of p_token into a NUL terminated
+ * buffer obtained from p_alloc, decoding escape sequences if there are any.
+ * This is the only place string data gets copied out of the document. */
+static char *token_string_dup(const struct token *p_token, struct cop_salloc_iface *p_alloc, size_t *p_len) {
+	char  *p_buf;
+	size_t len;
+	if ((p_buf = cop_salloc(p_alloc, p_token->t.strident.len + 1, 1)) == NULL)
+		return NULL;
+	if (p_token->t.strident.needs_unescape) {
+		len = token_unescape(p_buf, p_token->t.strident.p_data, p_token->t.strident.len);
+	} else {
+		len = p_token->t.strident.len;
+		memcpy(p_buf, p_token->t.strident.p_data, len);
+	}
+	p_buf[len] = '\0';
+	if (p_len != NULL)
+		*p_len = len;
+	return p_buf;
+}
+
 /* init: load something into next */
 /* peek: return p_next */
 /* next: load next thing into p_current, swap p_current and p_next, return p_current */
@@ -391,198 +834,168 @@ void tok_get_nearest_location(const struct tokeniser *p_tokeniser, struct token_
 	*p_tpi = (p_tokeniser->p_next != NULL) ? p_tokeniser->p_next->posinfo : p_tokeniser->p_current->posinfo;
 }
 
-const struct token *tok_read(struct tokeniser *p_tokeniser, const struct ejson_error_handler *p_error_handler) {
-	struct token *p_temp;
+#define TOK_SCAN_ERROR     (-1)
+#define TOK_SCAN_OK        (0)
+#define TOK_SCAN_END       (1)
+#define TOK_SCAN_NEED_MORE (2)
+
+/* Returns non-zero if the run of characters which could belong to a numeric
+ * literal starting at p reaches p_end. */
+static int numeric_run_reaches_end(const char *p, const char *p_end) {
+	char c;
+	while
+	    (   p < p_end
+	    &&  (   ((c = *p) >= '0' && c <= '9')
+	        ||  (c >= 'a' && c <= 'z')
+	        ||  (c >= 'A' && c <= 'Z')
+	        ||  c == '.' || c == '+' || c == '-'
+	        )
+	    )
+		p++;
+	return p == p_end;
+}
+
+/* Skips whitespace and comments and reads the next token into p_temp.
+ *
+ * Returns TOK_SCAN_END if there are no more tokens before p_end. If
+ * p_tokeniser->partial is set, p_end is not necessarily the end of the
+ * document and TOK_SCAN_NEED_MORE is returned if the token might continue
+ * past it; the token must then be scanned again once more of the document is
+ * available. */
+static int tok_scan(struct tokeniser *p_tokeniser, struct token *p_temp, const struct ejson_error_handler *p_error_handler) {
+	const int partial = p_tokeniser->partial;
 	char c, nc;
-	int in_comment;
 
 	/* eat whitespace and comments */
-	c          = *(p_tokeniser->buf++);
-	in_comment = (c == '#');
-	while (c == ' ' || c == '\t' || c == '\r' || c == '\n' || in_comment) {
-		nc = *(p_tokeniser->buf++);
-		if (c == '\r' || c == '\n') {
-			in_comment = 0;
-			p_tokeniser->p_line_start = p_tokeniser->buf - 1;
-			p_tokeniser->line_nb++;
-			if (c == '\r' && nc == '\n') { /* windows style */
-				nc                        = *(p_tokeniser->buf++);
-				p_tokeniser->p_line_start = p_tokeniser->buf - 1;
-			}
-		}
-		if (nc == '#') {
-			in_comment = 1;
-		}
-		c = nc;
-	}
+	p_tokeniser->buf = scan_skip_space_and_comments(p_tokeniser->buf, p_tokeniser->p_end, &(p_tokeniser->line_nb), &(p_tokeniser->p_line_start));
 
 	/* nothing left */
-	if (c == '\0') {
-		p_tokeniser->buf--;
-		if (p_tokeniser->p_next != NULL) {
-			p_tokeniser->p_current = p_tokeniser->p_next;
-			p_tokeniser->p_next = NULL;
-			return p_tokeniser->p_current;
-		}
-		return ejson_location_error_null(p_error_handler, &(p_tokeniser->p_current->posinfo), "expected another token\n");
-	}
+	if (p_tokeniser->buf == p_tokeniser->p_end)
+		return TOK_SCAN_END;
 
-	nc = *(p_tokeniser->buf);
+	c  = *(p_tokeniser->buf++);
+	nc = (p_tokeniser->buf < p_tokeniser->p_end) ? *(p_tokeniser->buf) : '\0';
 
 	assert(c != '#');
 
-	p_temp                   = p_tokeniser->p_current;
+	/* Every token which can be longer than one character starts with one of
+	 * these. */
+	if (partial && p_tokeniser->buf == p_tokeniser->p_end && (c == '.' || c == '!' || c == '=' || c == '<' || c == '>'))
+		return TOK_SCAN_NEED_MORE;
+
 	p_temp->posinfo.p_line   = p_tokeniser->p_line_start;
 	p_temp->posinfo.char_pos = p_tokeniser->buf - p_tokeniser->p_line_start;
 	p_temp->posinfo.line_nb  = p_tokeniser->line_nb;
+	p_temp->posinfo.p_end    = p_tokeniser->p_end;
 
 	/* quoted string */
 	if (c == '\"') {
-		p_temp->cls            = &TOK_STRING;
-		p_temp->t.strident.len = 0;
-		while ((c = *(p_tokeniser->buf++)) != '\"') {
+		p_temp->cls                       = &TOK_STRING;
+		p_temp->t.strident.p_data         = p_tokeniser->buf;
+		p_temp->t.strident.needs_unescape = 0;
+		for (;;) {
+			/* skip to the next quote, escape or invalid character */
+			p_tokeniser->buf = scan_find_string_special(p_tokeniser->buf, p_tokeniser->p_end);
+			if (p_tokeniser->buf == p_tokeniser->p_end)
+				return (partial) ? TOK_SCAN_NEED_MORE : ejson_location_error(p_error_handler, &(p_temp->posinfo), "unterminated string\n");
+
+			if ((c = *(p_tokeniser->buf++)) == '\"')
+				break;
+
 			if (c == '\0')
-				return ejson_location_error_null(p_error_handler, &(p_temp->posinfo), "unterminated string\n");
+				return ejson_location_error(p_error_handler, &(p_temp->posinfo), "strings may not contain NUL characters\n");
 
 			if (c == '\n' || c == '\r')
-				return ejson_location_error_null(p_error_handler, &(p_temp->posinfo), "newline encountered in string\n");
+				return ejson_location_error(p_error_handler, &(p_temp->posinfo), "newline encountered in string\n");
 
 			if (c == '\\') {
+				/* Only validate the escape sequence here. It gets decoded by
+				 * token_unescape() when the string is copied into its final
+				 * storage. */
+				p_temp->t.strident.needs_unescape = 1;
+				if (p_tokeniser->buf == p_tokeniser->p_end)
+					return (partial) ? TOK_SCAN_NEED_MORE : ejson_location_error(p_error_handler, &(p_temp->posinfo), "unterminated string\n");
 				c = *(p_tokeniser->buf++);
-				if (c == '\\')
-					c = '\\';
-				else if (c == '\"')
-					c = '\"';
-				else if (c == '/')
-					c = '/';
-				else if (c == 'b')
-					c = '\b';
-				else if (c == 'f')
-					c = '\f';
-				else if (c == 'n')
-					c = '\n';
-				else if (c == 'r')
-					c = '\r';
-				else if (c == 't')
-					c = '\t';
-				else if (c == 'u') {
-					unsigned h;
-					if  (   expect_hex_digit(&(p_tokeniser->buf), &h)
-					    ||  expect_hex_digit_accumulate(&(p_tokeniser->buf), &h)
-					    ||  expect_hex_digit_accumulate(&(p_tokeniser->buf), &h)
-					    ||  expect_hex_digit_accumulate(&(p_tokeniser->buf), &h)
-					    )
-						return ejson_location_error_null(p_error_handler, &(p_temp->posinfo), "invalid json codepoint escape sequence\n");
-					/* Convert to UTF-8 now. */
-					return ejson_location_error_null(p_error_handler, &(p_temp->posinfo), "do not support json codepoint escape sequences\n");
-				} else
-					return ejson_location_error_null(p_error_handler, &(p_temp->posinfo), "invalid json codepoint escape sequence\n");
+				if (c == 'u') {
+					unsigned cp;
+					if (partial && p_tokeniser->p_end - p_tokeniser->buf < 10)
+						return TOK_SCAN_NEED_MORE; /* enough for a surrogate pair */
+					if (p_tokeniser->p_end - p_tokeniser->buf < 4 || expect_codepoint_digits(&(p_tokeniser->buf), &cp))
+						return ejson_location_error(p_error_handler, &(p_temp->posinfo), "invalid json codepoint escape sequence\n");
+					if (cp >= 0xD800u && cp <= 0xDBFFu) {
+						/* A high surrogate must be followed by an escaped low
+						 * surrogate. */
+						if  (   p_tokeniser->p_end - p_tokeniser->buf < 6
+						    ||  expect_char(&(p_tokeniser->buf), '\\')
+						    ||  expect_char(&(p_tokeniser->buf), 'u')
+						    ||  expect_codepoint_digits(&(p_tokeniser->buf), &cp)
+						    ||  cp < 0xDC00u
+						    ||  cp > 0xDFFFu
+						    )
+							return ejson_location_error(p_error_handler, &(p_temp->posinfo), "unpaired surrogate in json codepoint escape sequence\n");
+					} else if (cp >= 0xDC00u && cp <= 0xDFFFu) {
+						return ejson_location_error(p_error_handler, &(p_temp->posinfo), "unpaired surrogate in json codepoint escape sequence\n");
+					} else if (cp == 0) {
+						return ejson_location_error(p_error_handler, &(p_temp->posinfo), "strings may not contain NUL characters\n");
+					}
+				} else if (c != '\\' && c != '\"' && c != '/' && c != 'b' && c != 'f' && c != 'n' && c != 'r' && c != 't')
+					return ejson_location_error(p_error_handler, &(p_temp->posinfo), "invalid json codepoint escape sequence\n");
 			}
-
-			p_temp->t.strident.str[p_temp->t.strident.len++] = c;
 		}
-		p_temp->t.strident.str[p_temp->t.strident.len] = '\0';
+		p_temp->t.strident.len = (p_tokeniser->buf - 1) - p_temp->t.strident.p_data;
 	} else if
-	    (   (c == '.' && p_tokeniser->buf[0] >= '0' && p_tokeniser->buf[0] <= '9')
+	    (   (c == '.' && nc >= '0' && nc <= '9')
 	    ||  (c >= '0' && c <= '9')
 	    ) {
-		unsigned long long ull = 0;
-		int ishex;
+		if (partial && numeric_run_reaches_end(p_tokeniser->buf, p_tokeniser->p_end))
+			return TOK_SCAN_NEED_MORE;
 		p_temp->cls = &TOK_INT;
-		ishex = c == '0' && p_tokeniser->buf[0] == 'x';
-		if (ishex) {
+		if (c == '0' && nc == 'x') {
+			unsigned long long ull = 0;
 			unsigned uu;
 			++p_tokeniser->buf;
-			if (expect_hex_digit(&(p_tokeniser->buf), &uu))
-				return ejson_location_error_null(p_error_handler, &(p_temp->posinfo), "invalid extended json numeric\n");
+			if (p_tokeniser->buf == p_tokeniser->p_end || expect_hex_digit(&(p_tokeniser->buf), &uu))
+				return ejson_location_error(p_error_handler, &(p_temp->posinfo), "invalid extended json numeric\n");
 			do {
+				if (ull >> 60)
+					return ejson_location_error(p_error_handler, &(p_temp->posinfo), "hexadecimal numeric does not fit in 64 bits\n");
 				ull *= 16;
 				ull += uu;
-			} while (!expect_hex_digit(&(p_tokeniser->buf), &uu));
+			} while (p_tokeniser->buf < p_tokeniser->p_end && !expect_hex_digit(&(p_tokeniser->buf), &uu));
 			p_temp->t.tint = ull;
 		} else {
-			while (c >= '0' && c <= '9') {
-				ull *= 10;
-				ull += c - '0';
-				c    = *(p_tokeniser->buf++);
-			}
-			if (c == '.') {
-				double frac = 0.1;
-				p_temp->cls    = &TOK_FLOAT;
-				p_temp->t.tflt = ull;
-				c = *(p_tokeniser->buf++);
-				if (c < '0' || c > '9')
-					return ejson_location_error_null(p_error_handler, &(p_temp->posinfo), "invalid json numeric\n");
-				while (c >= '0' && c <= '9') {
-					p_temp->t.tflt += (c - '0') * frac;
-					frac *= 0.1;
-					c = *(p_tokeniser->buf++);
-				}
-			}
-			if (c == 'e' || c == 'E') {
-				int eneg = 0;
-				int eval;
-				c = *(p_tokeniser->buf++);
-				if (c == '-') {
-					eneg = 1;
-					c = *(p_tokeniser->buf++);
-				} else if (c == '+') {
-					c = *(p_tokeniser->buf++);
-				}
-				if (c < '0' || c > '9')
-					return ejson_location_error_null(p_error_handler, &(p_temp->posinfo), "invalid json numeric\n");
-				eval = c - '0';
-				c = *(p_tokeniser->buf++);
-				while (c >= '0' && c <= '9') {
-					eval = eval * 10 + (c - '0');
-					c = *(p_tokeniser->buf++);
-				}
-				eval = (eneg) ? -eval : eval;
-				if (p_temp->cls == &TOK_FLOAT) {
-					p_temp->t.tflt *= pow(10.0, eval);
-				} else {
-					p_temp->cls = &TOK_FLOAT;
-					p_temp->t.tflt = ull * pow(10.0, eval);
-				}
-			}
-			if (p_temp->cls == &TOK_INT) {
-				p_temp->t.tint = ull;
-			}
+			int is_real;
 			p_tokeniser->buf--;
+			switch (ejson_parse_number(&(p_tokeniser->buf), p_tokeniser->p_end, &(p_temp->t.tint), &(p_temp->t.tflt), &is_real)) {
+			case EJSON_NUMBER_MALFORMED:
+				return ejson_location_error(p_error_handler, &(p_temp->posinfo), "invalid json numeric\n");
+			case EJSON_NUMBER_OUT_OF_RANGE:
+				return ejson_location_error(p_error_handler, &(p_temp->posinfo), "numeric is too large to be represented\n");
+			default:
+				break;
+			}
+			if (is_real)
+				p_temp->cls = &TOK_FLOAT;
 		}
 	} else if
 	    (   (c >= 'a' && c <= 'z')
 	    ||  (c >= 'A' && c <= 'Z')
 	    ) {
-		char nc = *(p_tokeniser->buf);
-		p_temp->t.strident.str[0] = c;
-		p_temp->t.strident.len = 1;
+		p_temp->t.strident.p_data         = p_tokeniser->buf - 1;
+		p_temp->t.strident.needs_unescape = 0;
 		while
 		    (   (nc >= 'a' && nc <= 'z')
 		    ||  (nc >= 'A' && nc <= 'Z')
 		    ||  (nc >= '0' && nc <= '9')
 		    ||  (nc == '_')
 		    ) {
-			p_temp->t.strident.str[p_temp->t.strident.len++] = nc;
-			nc = *(++p_tokeniser->buf);
+			nc = (++p_tokeniser->buf < p_tokeniser->p_end) ? *(p_tokeniser->buf) : '\0';
 		}
-		p_temp->t.strident.str[p_temp->t.strident.len] = '\0';
-
-		if (!strcmp(p_temp->t.strident.str, "true")) { p_temp->cls = &TOK_TRUE;
-		} else if (!strcmp(p_temp->t.strident.str, "false")) { p_temp->cls = &TOK_FALSE;
-		} else if (!strcmp(p_temp->t.strident.str, "null")) { p_temp->cls = &TOK_NULL;
-		} else if (!strcmp(p_temp->t.strident.str, "range")) { p_temp->cls = &TOK_RANGE;
-		} else if (!strcmp(p_temp->t.strident.str, "call")) { p_temp->cls = &TOK_CALL;
-		} else if (!strcmp(p_temp->t.strident.str, "func")) { p_temp->cls = &TOK_FUNC;
-		} else if (!strcmp(p_temp->t.strident.str, "define")) { p_temp->cls = &TOK_DEFINE;
-		} else if (!strcmp(p_temp->t.strident.str, "access")) { p_temp->cls = &TOK_ACCESS;
-		} else if (!strcmp(p_temp->t.strident.str, "map")) { p_temp->cls = &TOK_MAP;
-		} else if (!strcmp(p_temp->t.strident.str, "format")) { p_temp->cls = &TOK_FORMAT;
-		} else if (!strcmp(p_temp->t.strident.str, "and")) { p_temp->cls = &TOK_LOGAND;
-		} else if (!strcmp(p_temp->t.strident.str, "or")) { p_temp->cls = &TOK_LOGOR;
-		} else if (!strcmp(p_temp->t.strident.str, "not")) { p_temp->cls = &TOK_LOGNOT;
-		} else if (!strcmp(p_temp->t.strident.str, "if")) { p_temp->cls = &TOK_IF;
-		} else { p_temp->cls = &TOK_IDENTIFIER; }
+		if (partial && p_tokeniser->buf == p_tokeniser->p_end)
+			return TOK_SCAN_NEED_MORE;
+		p_temp->t.strident.len = p_tokeniser->buf - p_temp->t.strident.p_data;
+
+		p_temp->cls = keyword_lookup(p_temp->t.strident.p_data, p_temp->t.strident.len);
 
 	} else if (c == '!' && nc == '=') {
 		p_tokeniser->buf++;
@@ -626,7 +1039,35 @@ const struct token *tok_read(struct tokeniser *p_tokeniser, const struct ejson_e
 	} else if (c == '|') { p_temp->cls = &TOK_BITOR;
 	} else if (c == '&') { p_temp->cls = &TOK_BITAND;
 	} else {
-		return ejson_location_error_null(p_error_handler, &(p_temp->posinfo), "invalid token\n");
+		return ejson_location_error(p_error_handler, &(p_temp->posinfo), "invalid token\n");
+	}
+
+	return TOK_SCAN_OK;
+}
+
+const struct token *tok_read(struct tokeniser *p_tokeniser, const struct ejson_error_handler *p_error_handler) {
+	struct token *p_temp;
+
+	if (p_tokeniser->p_tape != NULL) {
+		if (p_tokeniser->p_next == NULL)
+			return ejson_location_error_null(p_error_handler, &(p_tokeniser->p_current->posinfo), "expected another token\n");
+		p_tokeniser->p_current = p_tokeniser->p_next;
+		p_tokeniser->p_next    = (++p_tokeniser->tape_pos < p_tokeniser->tape_len) ? &(p_tokeniser->p_tape[p_tokeniser->tape_pos]) : NULL;
+		return p_tokeniser->p_current;
+	}
+
+	switch (tok_scan(p_tokeniser, p_tokeniser->p_current, p_error_handler)) {
+	case TOK_SCAN_OK:
+		break;
+	case TOK_SCAN_END:
+		if (p_tokeniser->p_next != NULL) {
+			p_tokeniser->p_current = p_tokeniser->p_next;
+			p_tokeniser->p_next = NULL;
+			return p_tokeniser->p_current;
+		}
+		return ejson_location_error_null(p_error_handler, &(p_tokeniser->p_current->posinfo), "expected another token\n");
+	default:
+		return NULL;
 	}
 
 	p_temp                 = p_tokeniser->p_next;
@@ -636,99 +1077,368 @@ const struct token *tok_read(struct tokeniser *p_tokeniser, const struct ejson_e
 	return p_temp;
 }
 
-static int tokeniser_start(struct tokeniser *p_tokeniser, const char *buf) {
+/* Returns non-zero if the next n tokens are available or there are no more
+ * to come. The tape of a streamed document only holds the tokens which have
+ * arrived so far, so the parser checks this before each step which reads
+ * tokens and stops to wait for more of the document if it fails (see
+ * parse_run()) rather than running out part way through the step. */
+static int tok_need(const struct tokeniser *p_tokeniser, size_t n) {
+	return p_tokeniser->p_tape == NULL || !p_tokeniser->partial || p_tokeniser->tape_len - p_tokeniser->tape_pos >= n;
+}
+
+static void tokeniser_init_scratch(struct tokeniser *p_tokeniser) {
+	p_tokeniser->pp_scratch  = NULL;
+	p_tokeniser->scratch_len = 0;
+	p_tokeniser->scratch_cap = 0;
+	p_tokeniser->p_frames    = NULL;
+	p_tokeniser->frames_len  = 0;
+	p_tokeniser->frames_cap  = 0;
+	p_tokeniser->expr_depth  = 0;
+	p_tokeniser->p_value     = NULL;
+	p_tokeniser->doc_state   = DOC_START;
+	p_tokeniser->p_define    = NULL;
+	p_tokeniser->p_defines   = NULL;
+	p_tokeniser->pp_defines_tail = &(p_tokeniser->p_defines);
+	p_tokeniser->p_root      = NULL;
+	p_tokeniser->p_ast_line  = NULL;
+	json_tape_builder_init(&(p_tokeniser->json));
+}
+
+static void tokeniser_free(struct tokeniser *p_tokeniser) {
+	free(p_tokeniser->pp_scratch);
+	free(p_tokeniser->p_frames);
+	json_tape_builder_free(&(p_tokeniser->json));
+	tokeniser_init_scratch(p_tokeniser);
+}
+
+/* Pushes p_node onto the scratch stack. Literals collect their children on
+ * the stack as they are parsed and then move them into an array of exactly
+ * the right size with scratch_pop(); nested literals push above their parent
+ * so one stack serves the whole document. */
+static int scratch_push(struct tokeniser *p_tokeniser, const struct ast_node *p_node) {
+	if (p_tokeniser->scratch_len == p_tokeniser->scratch_cap) {
+		size_t                  cap  = (p_tokeniser->scratch_cap) ? p_tokeniser->scratch_cap * 2 : 256;
+		const struct ast_node **pp_s = realloc((void *)p_tokeniser->pp_scratch, cap * sizeof(const struct ast_node *));
+		if (pp_s == NULL)
+			return -1;
+		p_tokeniser->pp_scratch  = pp_s;
+		p_tokeniser->scratch_cap = cap;
+	}
+	p_tokeniser->pp_scratch[p_tokeniser->scratch_len++] = p_node;
+	return 0;
+}
+
+/* Moves the nodes above base on the scratch stack into an array allocated
+ * from p_alloc. */
+static const struct ast_node **scratch_pop(struct tokeniser *p_tokeniser, size_t base, struct cop_salloc_iface *p_alloc) {
+	size_t                  nb = p_tokeniser->scratch_len - base;
+	const struct ast_node **pp_nodes;
+	if ((pp_nodes = cop_salloc(p_alloc, sizeof(const struct ast_node *) * nb, 0)) == NULL)
+		return NULL;
+	memcpy(pp_nodes, p_tokeniser->pp_scratch + base, sizeof(const struct ast_node *) * nb);
+	p_tokeniser->scratch_len = base;
+	return pp_nodes;
+}
+
+/* Returns the line record for the position p_pos. Tokens arrive in document
+ * order so consecutive nodes nearly always share the record of the previous
+ * one and a new record is only allocated from p_alloc when the line changes.
+ * Records are never released while the document is being parsed (the only
+ * parser which restores p_alloc does so before creating any nodes). */
+static const struct ast_line *tok_ast_line(struct tokeniser *p_tokeniser, struct cop_salloc_iface *p_alloc, const struct token_pos_info *p_pos) {
+	const struct ast_line *p_line = p_tokeniser->p_ast_line;
+	struct ast_line       *p_new;
+	if (p_line != NULL && p_line->line_nb == p_pos->line_nb && p_line->p_line == p_pos->p_line && p_line->p_end == p_pos->p_end)
+		return p_line;
+	if ((p_new = cop_salloc(p_alloc, sizeof(struct ast_line), 0)) == NULL)
+		return NULL;
+	p_new->p_line           = p_pos->p_line;
+	p_new->p_end            = p_pos->p_end;
+	p_new->line_nb          = p_pos->line_nb;
+	p_tokeniser->p_ast_line = p_new;
+	return p_new;
+}
+
+/* Sets the position of p_node to p_pos. Returns non-zero if memory could not
+ * be allocated. */
+static int tok_set_location(struct tokeniser *p_tokeniser, struct cop_salloc_iface *p_alloc, struct ast_node *p_node, const struct token_pos_info *p_pos) {
+	if ((p_node->p_line = tok_ast_line(p_tokeniser, p_alloc, p_pos)) == NULL)
+		return -1;
+	p_node->char_pos = (uint32_t)p_pos->char_pos;
+	return 0;
+}
+
+static int tokeniser_start(struct tokeniser *p_tokeniser, const char *buf, size_t len) {
 	p_tokeniser->line_nb                  = 1;
 	p_tokeniser->p_line_start             = buf;
 	p_tokeniser->buf                      = buf;
+	p_tokeniser->p_end                    = buf + len;
+	p_tokeniser->partial                  = 0;
+	p_tokeniser->p_tape                   = NULL;
+	tokeniser_init_scratch(p_tokeniser);
 	p_tokeniser->p_current                = &(p_tokeniser->curx);
 	p_tokeniser->p_next                   = &(p_tokeniser->nextx);
 	p_tokeniser->p_next->posinfo.p_line   = buf;
 	p_tokeniser->p_next->posinfo.char_pos = 0;
 	p_tokeniser->p_next->posinfo.line_nb  = 1;
+	p_tokeniser->p_next->posinfo.p_end    = buf + len;
 	return (tok_read(p_tokeniser, NULL) == NULL) ? 1 : 0;
 }
 
 
 void evaluation_context_init(struct evaluation_context *p_ctx, struct cop_salloc_iface *p_alloc) {
 	p_ctx->p_alloc     = p_alloc;
+	p_ctx->p_scratch   = p_alloc;
 	p_ctx->stack_depth = 0;
+	p_ctx->flags       = 0;
+	p_ctx->max_depth   = EJSON_DEFAULT_MAX_DEPTH;
+	memset(&(p_ctx->stats), 0, sizeof(p_ctx->stats));
 	p_ctx->p_workspace = cop_strdict_init();
 }
 
-const struct ast_node *expect_expression(struct evaluation_context *p_workspace, struct tokeniser *p_tokeniser, unsigned min_prec, const struct ejson_error_handler *p_error_handler);
-
-const struct ast_node *parse_primary(struct evaluation_context *p_workspace, struct tokeniser *p_tokeniser, const struct ejson_error_handler *p_error_handler) {
-	const struct ast_node *p_temp_nodes[128];
-	struct ast_node *p_ret = NULL;
-	const struct token *p_token;
+static int get_tape_element(struct ev_ast_node *p_dest, const struct ev_ast_node *p_src, unsigned element, unsigned depth, struct cop_salloc_iface *p_alloc, const struct ejson_error_handler *p_error_handler);
+static int get_literal_element_fn(struct ev_ast_node *p_dest, const struct ev_ast_node *p_src, unsigned element, unsigned depth, struct cop_salloc_iface *p_alloc, const struct ejson_error_handler *p_error_handler);
+
+/* Fills p_ret with the tape value p_entry. Lists become list generators
+ * which index the tape directly. */
+static void tape_fill_ast(struct ast_node *p_ret, const struct json_tape *p_entry, const struct ast_line *p_line, uint32_t char_pos) {
+	p_ret->p_line   = p_line;
+	p_ret->char_pos = char_pos;
+	switch (p_entry->cls) {
+	case JNODE_CLS_NULL:
+		p_ret->cls = &AST_CLS_LITERAL_NULL;
+		break;
+	case JNODE_CLS_BOOL:
+		p_ret->cls = &AST_CLS_LITERAL_BOOL;
+		p_ret->d.i = p_entry->d.i;
+		break;
+	case JNODE_CLS_INTEGER:
+		p_ret->cls = &AST_CLS_LITERAL_INT;
+		p_ret->d.i = p_entry->d.i;
+		break;
+	case JNODE_CLS_REAL:
+		p_ret->cls = &AST_CLS_LITERAL_FLOAT;
+		p_ret->d.f = p_entry->d.f;
+		break;
+	case JNODE_CLS_STRING:
+		p_ret->cls          = &AST_CLS_LITERAL_STRING;
+		p_ret->d.str.len    = p_entry->nb;
+		p_ret->d.str.p_data = p_entry->d.p_str;
+		break;
+	case JNODE_CLS_LIST:
+		p_ret->cls                   = &AST_CLS_LIST_GENERATOR;
+		p_ret->d.lgen.get_element    = get_tape_element;
+		p_ret->nb_elements           = p_entry->nb;
+		p_ret->d.lgen.d.p_tape       = p_entry;
+		break;
+	default:
+		assert(p_entry->cls == JNODE_CLS_DICT);
+		p_ret->cls      = &AST_CLS_TAPE_DICT;
+		p_ret->d.p_tape = p_entry;
+		break;
+	}
+}
 
-	if ((p_token = tok_read(p_tokeniser, p_error_handler)) == NULL)
+/* Returns a new AST node for the tape value p_entry. */
+static struct ast_node *tape_to_ast(const struct json_tape *p_entry, const struct ast_line *p_line, uint32_t char_pos, struct cop_salloc_iface *p_alloc) {
+	struct ast_node *p_ret;
+	if ((p_ret = cop_salloc(p_alloc, sizeof(struct ast_node), 0)) == NULL)
 		return NULL;
+	tape_fill_ast(p_ret, p_entry, p_line, char_pos);
+	return p_ret;
+}
+
+/* Sets p_dest to the tape value p_entry, which is positioned at p_from for
+ * error reporting. Only lists and dicts need a node to be allocated. */
+static int tape_to_ev(struct ev_ast_node *p_dest, const struct json_tape *p_entry, const struct ast_node *p_from, struct cop_salloc_iface *p_alloc) {
+	if (p_entry->cls != JNODE_CLS_LIST && p_entry->cls != JNODE_CLS_DICT) {
+		tape_fill_ast(ev_scalar(p_dest), p_entry, p_from->p_line, p_from->char_pos);
+		return 0;
+	}
+	if ((p_dest->p_node = tape_to_ast(p_entry, p_from->p_line, p_from->char_pos, p_alloc)) == NULL)
+		return -1;
+	p_dest->p_stack    = NULL;
+	p_dest->stack_size = 0;
+	return 0;
+}
+
+/* The parser keeps the expressions which it is part way through on an
+ * explicit stack of frames rather than recursing so that the nesting depth
+ * of a document is only limited by max_depth. Every sub-expression gets a
+ * PARSE_EXPR frame which collects binary operators; the other frames belong
+ * to the construct which the sub-expression is a part of and say what to do
+ * with its value. As everything the parser has still to do is on the stack,
+ * it can stop between any two steps and carry on later, which is how a
+ * streamed document is parsed as it arrives. */
+#define PARSE_EXPR  (0) /* operand of a binary operator */
+#define PARSE_PAREN (1) /* parenthesised expression */
+#define PARSE_SLOTS (2) /* fixed number of operands written to pp_slots */
+#define PARSE_LIST  (3) /* list literal element */
+#define PARSE_DICT  (4) /* dict literal key (nb_slots == 0) or value */
+#define PARSE_FUNC  (5) /* function body */
+#define PARSE_JSON  (6) /* plain JSON value (see parse_json()) */
+
+/* The states of a PARSE_JSON frame */
+#define JSON_VALUE (0) /* the next token begins a value */
+#define JSON_KEY   (1) /* the next token is a dict key */
+#define JSON_AFTER (2) /* a value has just been completed */
+
+struct parse_frame {
+	int                     kind;
+
+	/* PARSE_EXPR. p_op is the operator waiting for its right hand side or
+	 * NULL if p_lhs has not been set yet. */
+	unsigned                min_prec;
+	const struct ast_node  *p_lhs;
+	const struct tok_def   *p_op;
+	struct token_pos_info   op_pos;
+
+	/* Other frames */
+	struct ast_node        *p_node;
+	const struct ast_node **pp_slots[3];
+	unsigned                nb_slots;
+	unsigned                slot;
+	size_t                  base;    /* PARSE_LIST, PARSE_DICT and PARSE_FUNC scratch stack height */
+	unsigned                nb_args; /* PARSE_FUNC */
+
+	/* PARSE_JSON. The value is only being tried if json_trial is set. If
+	 * json_negated is set, the last value which was added was the number
+	 * json_neg[1] negated by the minus json_neg[0]. */
+	unsigned                json_state;
+	int                     json_trial;
+	struct token_pos_info   json_pos;
+	int                     json_negated;
+	struct token            json_neg[2];
+};
+
+static struct parse_frame *parse_push(struct tokeniser *p_tokeniser, int kind, const struct ejson_error_handler *p_error_handler) {
+	struct parse_frame *p_frame;
+	if (p_tokeniser->frames_len == p_tokeniser->frames_cap) {
+		size_t              cap      = (p_tokeniser->frames_cap) ? p_tokeniser->frames_cap * 2 : 64;
+		struct parse_frame *p_frames = realloc(p_tokeniser->p_frames, cap * sizeof(struct parse_frame));
+		if (p_frames == NULL)
+			return ejson_error_null(p_error_handler, "out of memory\n");
+		p_tokeniser->p_frames   = p_frames;
+		p_tokeniser->frames_cap = cap;
+	}
+	p_frame       = &(p_tokeniser->p_frames[p_tokeniser->frames_len++]);
+	p_frame->kind = kind;
+	return p_frame;
+}
+
+/* Pushes a frame for a sub-expression which may only contain binary
+ * operators with a precedence of at least min_prec. */
+static int parse_push_expr(struct evaluation_context *p_workspace, struct tokeniser *p_tokeniser, unsigned min_prec, const struct token_pos_info *p_posinfo, const struct ejson_error_handler *p_error_handler) {
+	struct parse_frame *p_frame;
+	if (p_tokeniser->expr_depth >= p_workspace->max_depth)
+		return ejson_location_error(p_error_handler, p_posinfo, "expressions are nested more than %u levels deep\n", p_workspace->max_depth);
+	if ((p_frame = parse_push(p_tokeniser, PARSE_EXPR, p_error_handler)) == NULL)
+		return -1;
+	p_frame->min_prec = min_prec;
+	p_frame->p_lhs    = NULL;
+	p_frame->p_op     = NULL;
+	p_tokeniser->expr_depth++;
+	return 0;
+}
+
+/* Pushes a frame which will store the next n_slots sub-expressions in
+ * pp_slots and then produce p_node. The first of the sub-expressions may
+ * only contain binary operators with a precedence of at least min_prec. */
+static int parse_push_slots(struct evaluation_context *p_workspace, struct tokeniser *p_tokeniser, struct ast_node *p_node, unsigned min_prec, const struct ast_node **pp_s0, const struct ast_node **pp_s1, const struct ast_node **pp_s2, const struct token_pos_info *p_posinfo, const struct ejson_error_handler *p_error_handler) {
+	struct parse_frame *p_frame;
+	if ((p_frame = parse_push(p_tokeniser, PARSE_SLOTS, p_error_handler)) == NULL)
+		return -1;
+	p_frame->p_node      = p_node;
+	p_frame->pp_slots[0] = pp_s0;
+	p_frame->pp_slots[1] = pp_s1;
+	p_frame->pp_slots[2] = pp_s2;
+	p_frame->nb_slots    = (pp_s2 != NULL) ? 3 : (pp_s1 != NULL) ? 2 : 1;
+	p_frame->slot        = 0;
+	return parse_push_expr(p_workspace, p_tokeniser, min_prec, p_posinfo, p_error_handler);
+}
+
+/* Pushes a frame which parses the plain JSON value starting with the next
+ * token. If trial is set, the value does not need to be plain JSON. */
+static int parse_push_json(struct tokeniser *p_tokeniser, int trial, const struct ejson_error_handler *p_error_handler) {
+	struct parse_frame *p_frame;
+	if ((p_frame = parse_push(p_tokeniser, PARSE_JSON, p_error_handler)) == NULL)
+		return -1;
+	p_frame->json_state = JSON_VALUE;
+	p_frame->json_trial = trial;
+	p_frame->json_negated = 0;
+	tok_get_nearest_location(p_tokeniser, &(p_frame->json_pos));
+	return 0;
+}
+
+/* Parses the primary expression which begins with p_token (which has just
+ * been read). Stores the expression in *pp_value if it has no
+ * sub-expressions. Otherwise, pushes the frames for the sub-expression which
+ * needs to be parsed next and leaves *pp_value alone. */
+static int parse_token(struct evaluation_context *p_workspace, struct tokeniser *p_tokeniser, const struct token *p_token, const struct ast_node **pp_value, const struct ejson_error_handler *p_error_handler) {
+	struct ast_node *p_ret = NULL;
+	struct parse_frame *p_frame;
 
 	if (p_token->cls == &TOK_LPAREN) {
-		const struct ast_node *p_subexpr;
-		if ((p_subexpr = expect_expression(p_workspace, p_tokeniser, 0, p_error_handler)) == NULL)
-			return NULL;
-		if ((p_token = tok_read(p_tokeniser, p_error_handler)) == NULL)
-			return NULL;
-		if (p_token->cls != &TOK_RPAREN)
-			return ejson_location_error_null(p_error_handler, &(p_token->posinfo), "expected close parenthesis\n");
-		return p_subexpr;
+		if (parse_push(p_tokeniser, PARSE_PAREN, p_error_handler) == NULL)
+			return -1;
+		return parse_push_expr(p_workspace, p_tokeniser, 0, &(p_token->posinfo), p_error_handler);
 	}
 
 	if (p_token->cls == &TOK_IDENTIFIER) {
 		const struct ast_node *node;
-		if (cop_strdict_get_by_cstr(p_workspace->p_workspace, p_token->t.strident.str, (void **)&node))
-			return ejson_location_error_null(p_error_handler, &(p_token->posinfo), "'%s' was not found in the workspace\n", p_token->t.strident.str);
+		size_t save = cop_salloc_save(p_workspace->p_scratch);
+		char  *p_name;
+		int    not_found;
+
+		/* The workspace is keyed by C strings so a temporary terminated copy
+		 * of the identifier is needed for the lookup. */
+		if ((p_name = token_string_dup(p_token, p_workspace->p_scratch, NULL)) == NULL)
+			return ejson_error(p_error_handler, "out of memory\n");
+		not_found = cop_strdict_get_by_cstr(p_workspace->p_workspace, p_name, (void **)&node);
+		cop_salloc_restore(p_workspace->p_scratch, save);
+		if (not_found)
+			return ejson_location_error(p_error_handler, &(p_token->posinfo), "'%.*s' was not found in the workspace\n", (int)p_token->t.strident.len, p_token->t.strident.p_data);
 		assert(node != NULL);
 
 		/* if the node is not a stack reference, it is definitely a define'ed workspace expression. */
-		if (node->cls != &AST_CLS_STACKREF)
-			return node;
+		if (node->cls != &AST_CLS_STACKREF) {
+			*pp_value = node;
+			return 0;
+		}
 
 		/* otherwise, the node is absolutely a reference to a function argument which needs to be adjusted based on the current stack position. */
 		if ((p_ret = cop_salloc(p_workspace->p_alloc, sizeof(struct ast_node), 0)) == NULL)
-			return ejson_error_null(p_error_handler, "out of memory\n");
+			return ejson_error(p_error_handler, "out of memory\n");
 
-		p_ret->doc_pos = p_token->posinfo;
+		if (tok_set_location(p_tokeniser, p_workspace->p_alloc, p_ret, &(p_token->posinfo)))
+			return ejson_error(p_error_handler, "out of memory\n");
 		p_ret->cls     = &AST_CLS_STACKREF;
 		p_ret->d.i     = 1 + p_workspace->stack_depth - node->d.i;
-		return p_ret;
+		*pp_value      = p_ret;
+		return 0;
 	}
 
-
-	if ((p_ret = cop_salloc(p_workspace->p_alloc, sizeof(struct ast_node), 0)) == NULL)
-		return ejson_error_null(p_error_handler, "out of memory\n");
-	p_ret->doc_pos = p_token->posinfo;
+	if  (   (p_ret = cop_salloc(p_workspace->p_alloc, sizeof(struct ast_node), 0)) == NULL
+	    ||  tok_set_location(p_tokeniser, p_workspace->p_alloc, p_ret, &(p_token->posinfo))
+	    )
+		return ejson_error(p_error_handler, "out of memory\n");
 
 	if (p_token->cls->unary_op_cls != NULL) {
 		p_ret->cls           = p_token->cls->unary_op_cls;
-		if ((p_ret->d.binop.p_lhs = expect_expression(p_workspace, p_tokeniser, p_token->cls->unary_precedence, p_error_handler)) == NULL)
-			return NULL;
 		p_ret->d.binop.p_rhs = NULL;
-		return p_ret;
+		return parse_push_slots(p_workspace, p_tokeniser, p_ret, p_token->cls->unary_precedence, &(p_ret->d.binop.p_lhs), NULL, NULL, &(p_token->posinfo), p_error_handler);
 	}
 
 	if (p_token->cls == &TOK_ACCESS) {
 		p_ret->cls        = &AST_CLS_ACCESS;
-		if ((p_ret->d.access.p_data = expect_expression(p_workspace, p_tokeniser, 0, p_error_handler)) == NULL)
-			return NULL;
-		if ((p_ret->d.access.p_key = expect_expression(p_workspace, p_tokeniser, 0, p_error_handler)) == NULL)
-			return NULL;
+		return parse_push_slots(p_workspace, p_tokeniser, p_ret, 0, &(p_ret->d.access.p_data), &(p_ret->d.access.p_key), NULL, &(p_token->posinfo), p_error_handler);
 	} else if (p_token->cls == &TOK_MAP) {
-		p_ret->cls        = &AST_CLS_MAP;
-		if ((p_ret->d.map.p_function = expect_expression(p_workspace, p_tokeniser, 0, p_error_handler)) == NULL)
-			return NULL;
-		if ((p_ret->d.map.p_input_list = expect_expression(p_workspace, p_tokeniser, 0, p_error_handler)) == NULL)
-			return NULL;
+		p_ret->cls                = &AST_CLS_MAP;
+		p_ret->d.map.p_memo_stats = (p_workspace->flags & EJSON_FLAG_MEMO_MAPS) ? &(p_workspace->stats) : NULL;
+		return parse_push_slots(p_workspace, p_tokeniser, p_ret, 0, &(p_ret->d.map.p_function), &(p_ret->d.map.p_input_list), NULL, &(p_token->posinfo), p_error_handler);
 	} else if (p_token->cls == &TOK_IF) {
 		p_ret->cls = &AST_CLS_IF;
-		if ((p_ret->d.ifexpr.p_test = expect_expression(p_workspace, p_tokeniser, 0, p_error_handler)) == NULL)
-			return NULL;
-		if ((p_ret->d.ifexpr.p_true = expect_expression(p_workspace, p_tokeniser, 0, p_error_handler)) == NULL)
-			return NULL;
-		if ((p_ret->d.ifexpr.p_false = expect_expression(p_workspace, p_tokeniser, 0, p_error_handler)) == NULL)
-			return NULL;
+		return parse_push_slots(p_workspace, p_tokeniser, p_ret, 0, &(p_ret->d.ifexpr.p_test), &(p_ret->d.ifexpr.p_true), &(p_ret->d.ifexpr.p_false), &(p_token->posinfo), p_error_handler);
 	} else if (p_token->cls == &TOK_INT) {
 		p_ret->cls        = &AST_CLS_LITERAL_INT;
 		p_ret->d.i        = p_token->t.tint;
@@ -736,82 +1446,56 @@ const struct ast_node *parse_primary(struct evaluation_context *p_workspace, str
 		p_ret->cls        = &AST_CLS_LITERAL_FLOAT;
 		p_ret->d.f        = p_token->t.tflt;
 	} else if (p_token->cls == &TOK_STRING) {
-		size_t sl = strlen(p_token->t.strident.str);
+		size_t sl;
 		char *p_strbuf;
-		if ((p_strbuf = cop_salloc(p_workspace->p_alloc, sl + 1, 1)) == NULL)
-			return ejson_error_null(p_error_handler, "out of memory\n");
-		memcpy(p_strbuf, p_token->t.strident.str, sl + 1);
+		if ((p_strbuf = token_string_dup(p_token, p_workspace->p_alloc, &sl)) == NULL)
+			return ejson_error(p_error_handler, "out of memory\n");
 		p_ret->cls          = &AST_CLS_LITERAL_STRING;
 		p_ret->d.str.len    = sl;
 		p_ret->d.str.p_data = p_strbuf;
 	} else if (p_token->cls == &TOK_LBRACE) {
-		uint_fast32_t    nb_kvs = 0;
 		const struct token *p_next;
 		if ((p_next = tok_peek(p_tokeniser)) == NULL) {
 			struct token_pos_info tpi;
 			tok_get_nearest_location(p_tokeniser, &tpi);
-			return ejson_location_error_null(p_error_handler, &tpi, "a dict expression must be terminated\n");
+			return ejson_location_error(p_error_handler, &tpi, "a dict expression must be terminated\n");
 		}
+		p_ret->cls                     = &AST_CLS_LITERAL_DICT;
+		p_ret->d.ldict.nb_keys         = 0;
+		p_ret->d.ldict.elements        = NULL;
 		if (p_next->cls != &TOK_RBRACE) {
-			do {
-				if ((p_temp_nodes[2*nb_kvs+0] = expect_expression(p_workspace, p_tokeniser, 0, p_error_handler)) == NULL)
-					return NULL;
-				if ((p_token = tok_read(p_tokeniser, p_error_handler)) == NULL)
-					return NULL;
-				if (p_token->cls != &TOK_COLON)
-					return ejson_location_error_null(p_error_handler, &(p_token->posinfo), "expected a :\n");
-				if ((p_temp_nodes[2*nb_kvs+1] = expect_expression(p_workspace, p_tokeniser, 0, p_error_handler)) == NULL)
-					return NULL;
-				nb_kvs++;
-				if ((p_token = tok_read(p_tokeniser, p_error_handler)) == NULL)
-					return NULL;
-				if (p_token->cls != &TOK_RBRACE && p_token->cls != &TOK_COMMA)
-					return ejson_location_error_null(p_error_handler, &(p_token->posinfo), "expected a , or }\n");
-			} while (p_token->cls != &TOK_RBRACE);
-		} else {
-			p_token = tok_read(p_tokeniser, p_error_handler);
-			assert(p_token != NULL && "peeked a valid token but could not skip over it");
-		}
-		p_ret->cls             = &AST_CLS_LITERAL_DICT;
-		p_ret->d.ldict.nb_keys = nb_kvs;
-		if (nb_kvs) {
-			if ((p_ret->d.ldict.elements = cop_salloc(p_workspace->p_alloc, sizeof(struct ast_node *) * nb_kvs * 2, 0 )) == NULL)
-				return ejson_error_null(p_error_handler, "out of memory\n");
-			memcpy(p_ret->d.ldict.elements, p_temp_nodes, sizeof(struct ast_node *) * nb_kvs * 2);
-		} else {
-			p_ret->d.ldict.elements = NULL;
+			if ((p_frame = parse_push(p_tokeniser, PARSE_DICT, p_error_handler)) == NULL)
+				return -1;
+			p_frame->p_node   = p_ret;
+			p_frame->base     = p_tokeniser->scratch_len;
+			p_frame->nb_slots = 0;
+			return parse_push_expr(p_workspace, p_tokeniser, 0, &(p_token->posinfo), p_error_handler);
 		}
+		/* Reading the closing token scans the one after it which may be
+		 * invalid. */
+		if (tok_read(p_tokeniser, p_error_handler) == NULL)
+			return -1;
 	} else if (p_token->cls == &TOK_LSQBR) {
-		uint_fast32_t nb_list = 0;
 		const struct token *p_next;
 		if ((p_next = tok_peek(p_tokeniser)) == NULL) {
 			struct token_pos_info tpi;
 			tok_get_nearest_location(p_tokeniser, &tpi);
-			return ejson_location_error_null(p_error_handler, &tpi, "a list expression must be terminated\n");
+			return ejson_location_error(p_error_handler, &tpi, "a list expression must be terminated\n");
 		}
+		p_ret->cls                 = &AST_CLS_LITERAL_LIST;
+		p_ret->d.llist.nb_elements = 0;
+		p_ret->d.llist.elements    = NULL;
 		if (p_next->cls != &TOK_RSQBR) {
-			do {
-				if ((p_temp_nodes[nb_list] = expect_expression(p_workspace, p_tokeniser, 0, p_error_handler)) == NULL)
-					return NULL;
-				nb_list++;
-				if ((p_token = tok_read(p_tokeniser, p_error_handler)) == NULL)
-					return NULL;
-				if (p_token->cls != &TOK_RSQBR && p_token->cls != &TOK_COMMA)
-					return ejson_location_error_null(p_error_handler, &(p_token->posinfo), "expected either a , or ]\n");
-			} while (p_token->cls != &TOK_RSQBR);
-		} else {
-			p_token = tok_read(p_tokeniser, p_error_handler);
-			assert(p_token != NULL && "peeked a valid token but could not skip over it");
-		}
-		p_ret->cls        = &AST_CLS_LITERAL_LIST;
-		p_ret->d.llist.nb_elements = nb_list;
-		if (nb_list) {
-			if ((p_ret->d.llist.elements = cop_salloc(p_workspace->p_alloc, sizeof(struct ast_node *) * nb_list, 0)) == NULL)
-				return ejson_error_null(p_error_handler, "out of memory\n");
-			memcpy(p_ret->d.llist.elements, p_temp_nodes, sizeof(struct ast_node *) * nb_list);
-		} else {
-			p_ret->d.llist.elements = NULL;
+			if ((p_frame = parse_push(p_tokeniser, PARSE_LIST, p_error_handler)) == NULL)
+				return -1;
+			p_frame->p_node = p_ret;
+			p_frame->base   = p_tokeniser->scratch_len;
+			return parse_push_expr(p_workspace, p_tokeniser, 0, &(p_token->posinfo), p_error_handler);
 		}
+		/* Reading the closing token scans the one after it which may be
+		 * invalid. */
+		if (tok_read(p_tokeniser, p_error_handler) == NULL)
+			return -1;
 	} else if (p_token->cls == &TOK_NULL) {
 		p_ret->cls   = &AST_CLS_LITERAL_NULL;
 	} else if (p_token->cls == &TOK_TRUE) {
@@ -822,53 +1506,56 @@ const struct ast_node *parse_primary(struct evaluation_context *p_workspace, str
 		p_ret->d.i = 0;
 	} else if (p_token->cls == &TOK_RANGE) {
 		p_ret->cls   = &AST_CLS_RANGE;
-		if ((p_ret->d.builtin.p_args = expect_expression(p_workspace, p_tokeniser, 0, p_error_handler)) == NULL)
-			return NULL;
+		return parse_push_slots(p_workspace, p_tokeniser, p_ret, 0, &(p_ret->d.builtin.p_args), NULL, NULL, &(p_token->posinfo), p_error_handler);
 	} else if (p_token->cls == &TOK_FORMAT) {
 		p_ret->cls   = &AST_CLS_FORMAT;
-		if ((p_ret->d.builtin.p_args = expect_expression(p_workspace, p_tokeniser, 0, p_error_handler)) == NULL)
-			return NULL;
+		return parse_push_slots(p_workspace, p_tokeniser, p_ret, 0, &(p_ret->d.builtin.p_args), NULL, NULL, &(p_token->posinfo), p_error_handler);
 	} else if (p_token->cls == &TOK_FUNC) {
+		struct token_pos_info funcpos = p_token->posinfo;
+		size_t          base    = p_tokeniser->scratch_len;
 		unsigned        nb_args = 0;
-		unsigned        i;
-		struct cop_strh argnames[64];
 		if ((p_token = tok_read(p_tokeniser, p_error_handler)) == NULL)
-			return NULL;
+			return -1;
 		if (p_token->cls != &TOK_LSQBR)
-			return ejson_location_error_null(p_error_handler, &(p_token->posinfo), "expected a [\n");
+			return ejson_location_error(p_error_handler, &(p_token->posinfo), "expected a [\n");
 		if ((p_token = tok_read(p_tokeniser, p_error_handler)) == NULL)
-			return NULL;
+			return -1;
 
 		if (p_token->cls != &TOK_RSQBR) {
 			do {
 				struct token_pos_info identpos;
+				struct cop_strh ident;
 				struct ast_node *p_arg;
 				struct cop_strdict_node *p_wsnode;
 				identpos = p_token->posinfo;
 				if (p_token->cls != &TOK_IDENTIFIER)
-					return ejson_location_error_null(p_error_handler, &(p_token->posinfo), "expected a parameter name literal but got a %s token\n", p_token->cls->name);
-				cop_strh_init_shallow(&(argnames[nb_args]), p_token->t.strident.str);
-				if ((p_arg = cop_salloc(p_workspace->p_alloc, sizeof(struct ast_node), 0)) == NULL)
-					return ejson_error_null(p_error_handler, "out of memory\n");
+					return ejson_location_error(p_error_handler, &(p_token->posinfo), "expected a parameter name literal but got a %s token\n", p_token->cls->name);
+				/* The workspace node for the parameter (followed by its name)
+				 * immediately follows the stack reference so that it can be
+				 * found again to remove it once the body has been parsed. */
 				/* todo, this memory will be used forever. could go on stack with aalloc(). */
-				if ((p_wsnode = cop_salloc(p_workspace->p_alloc, sizeof(struct ast_node) + argnames[nb_args].len + 1, 0)) == NULL)
-					return ejson_error_null(p_error_handler, "out of memory\n");
-				memcpy((char *)(p_wsnode + 1), p_token->t.strident.str, argnames[nb_args].len + 1);
-				argnames[nb_args].ptr = (unsigned char *)(p_wsnode + 1);
-				cop_strdict_node_init(p_wsnode, &(argnames[nb_args]), p_arg);
+				if ((p_arg = cop_salloc(p_workspace->p_alloc, sizeof(struct ast_node) + sizeof(struct cop_strdict_node) + p_token->t.strident.len + 1, 0)) == NULL)
+					return ejson_error(p_error_handler, "out of memory\n");
+				p_wsnode = (struct cop_strdict_node *)(p_arg + 1);
+				memcpy((char *)(p_wsnode + 1), p_token->t.strident.p_data, p_token->t.strident.len);
+				((char *)(p_wsnode + 1))[p_token->t.strident.len] = '\0';
+				cop_strh_init_shallow(&ident, (char *)(p_wsnode + 1));
+				cop_strdict_node_init(p_wsnode, &ident, p_arg);
 				if (cop_strdict_insert(&(p_workspace->p_workspace), p_wsnode))
-					return ejson_location_error_null(p_error_handler, &identpos, "function parameter names may only appear once and must not alias workspace variables\n");
+					return ejson_location_error(p_error_handler, &identpos, "function parameter names may only appear once and must not alias workspace variables\n");
+				if (scratch_push(p_tokeniser, p_arg))
+					return ejson_error(p_error_handler, "out of memory\n");
 				if ((p_token = tok_read(p_tokeniser, p_error_handler)) == NULL)
-					return NULL;
+					return -1;
 				if (p_token->cls != &TOK_COMMA && p_token->cls != &TOK_RSQBR)
-					return ejson_location_error_null(p_error_handler, &(p_token->posinfo), "expected a , or ]\n");
+					return ejson_location_error(p_error_handler, &(p_token->posinfo), "expected a , or ]\n");
 				p_arg->cls = &AST_CLS_STACKREF;
 				p_arg->d.i = p_workspace->stack_depth + nb_args + 1;
 				nb_args++;
 				if (p_token->cls == &TOK_RSQBR)
 					break;
 				if ((p_token = tok_read(p_tokeniser, p_error_handler)) == NULL)
-					return NULL;
+					return -1;
 			} while (1);
 		}
 
@@ -876,67 +1563,666 @@ const struct ast_node *parse_primary(struct evaluation_context *p_workspace, str
 		p_ret->d.fn.nb_args                     = nb_args;
 
 		p_workspace->stack_depth += nb_args;
-		if ((p_ret->d.fn.node = expect_expression(p_workspace, p_tokeniser, 0, p_error_handler)) == NULL)
-			return NULL;
-		p_workspace->stack_depth -= nb_args;
-
-		for (i = 0; i < nb_args; i++) {
-			if (cop_strdict_delete(&(p_workspace->p_workspace), &(argnames[i])) == NULL) {
-				fprintf(stderr, "ICE\n");
-				abort();
-			}
-		}
+		if ((p_frame = parse_push(p_tokeniser, PARSE_FUNC, p_error_handler)) == NULL)
+			return -1;
+		p_frame->p_node  = p_ret;
+		p_frame->base    = base;
+		p_frame->nb_args = nb_args;
+		return parse_push_expr(p_workspace, p_tokeniser, 0, &funcpos, p_error_handler);
 	} else if (p_token->cls == &TOK_CALL) {
 		p_ret->cls        = &AST_CLS_CALL;
-		if ((p_ret->d.call.fn = expect_expression(p_workspace, p_tokeniser, 0, p_error_handler)) == NULL)
-			return NULL;
-		if ((p_ret->d.call.p_args  = expect_expression(p_workspace, p_tokeniser, 0, p_error_handler)) == NULL)
-			return NULL;
+		return parse_push_slots(p_workspace, p_tokeniser, p_ret, 0, &(p_ret->d.call.fn), &(p_ret->d.call.p_args), NULL, &(p_token->posinfo), p_error_handler);
 	} else {
 		token_print(p_token);
 		abort();
 	}
 
-	assert(p_ret != NULL);
-	return p_ret;
+	*pp_value = p_ret;
+	return 0;
 }
 
-const struct ast_node *expect_expression(struct evaluation_context *p_workspace, struct tokeniser *p_tokeniser, unsigned min_prec, const struct ejson_error_handler *p_error_handler) {
-	const struct ast_node *p_lhs;
+/* Parses the primary expression which begins with the next token like
+ * parse_token(). Lists and dicts are tried as plain JSON first (see
+ * parse_json()) unless they are too deeply nested to be. */
+static int parse_primary(struct evaluation_context *p_workspace, struct tokeniser *p_tokeniser, const struct ast_node **pp_value, const struct ejson_error_handler *p_error_handler) {
 	const struct token *p_token;
+	if  (   (p_token = tok_peek(p_tokeniser)) != NULL
+	    &&  (p_token->cls == &TOK_LSQBR || p_token->cls == &TOK_LBRACE)
+	    &&  p_tokeniser->expr_depth < p_workspace->max_depth
+	    )
+		return parse_push_json(p_tokeniser, 1, p_error_handler);
+	if ((p_token = tok_read(p_tokeniser, p_error_handler)) == NULL)
+		return -1;
+	return parse_token(p_workspace, p_tokeniser, p_token, pp_value, p_error_handler);
+}
 
-	p_lhs = parse_primary(p_workspace, p_tokeniser, p_error_handler);
-	if (p_lhs == NULL)
-		return NULL;
-
-	while
-		(   (p_token = tok_peek(p_tokeniser)) != NULL
-		&&  p_token->cls->bin_op_cls != NULL
-		&&  p_token->cls->binary_precedence >= min_prec
-		) {
-		const struct ast_node *p_rhs;
-		struct ast_node       *p_comb;
-		struct token_pos_info  loc_info = p_token->posinfo;
-		const struct tok_def  *p_cls    = p_token->cls;
-		unsigned               q        = (p_cls->right_associative) ? p_token->cls->binary_precedence : (p_token->cls->binary_precedence + 1);
 
+/* Hands a value which has turned out not to be plain JSON part way through
+ * (see parse_json()) over to the EJSON parser without parsing any of it
+ * again. Every list and dict which is still open gets the frames which
+ * parse_token() would have pushed for it and the elements which it has
+ * already been given are put on the scratch stack as tape values. If
+ * complete is set, the last of those is taken off the stack again to be the
+ * value which is waiting for the innermost frame (the token which follows it
+ * was not plain JSON). Otherwise, the innermost frame waits for the primary
+ * expression which begins with the next token, or with p_read if it has
+ * already been read. */
+static int json_promote(struct evaluation_context *p_workspace, struct tokeniser *p_tokeniser, int complete, const struct token *p_read, const struct ast_node **pp_value, const struct ejson_error_handler *p_error_handler) {
+	struct json_tape_builder *p_builder = &(p_tokeniser->json);
+	size_t                    depth     = json_tape_builder_depth(p_builder);
+	struct parse_frame       *p_frame   = &(p_tokeniser->p_frames[p_tokeniser->frames_len - 1]);
+	int                       negated   = complete && p_frame->json_negated;
+	struct token              neg[2];
+	const struct json_tape   *p_tape;
+	size_t                    i;
+
+	assert(depth > 0);
+	if (negated) {
+		neg[0] = p_frame->json_neg[0];
+		neg[1] = p_frame->json_neg[1];
+	}
+	p_tokeniser->frames_len--;
+	if ((p_tape = json_tape_copy_open(p_builder, p_workspace->p_alloc)) == NULL)
+		goto out_of_memory;
+
+	for (i = 0; i < depth; i++) {
+		const struct token_pos_info *p_pos     = json_tape_builder_open_position(p_builder, i);
+		int                          innermost = (i + 1 == depth);
+		const uint32_t              *p_elements;
+		const struct ast_line       *p_line;
+		struct ast_node             *p_node;
+		struct ast_node             *p_element;
+		size_t                       nb, j;
+		uint32_t                     nb_values;
+
+		p_elements = json_tape_builder_open_elements(p_builder, i, &nb, &nb_values);
+		if  (   (p_node = cop_salloc(p_workspace->p_alloc, sizeof(struct ast_node), 0)) == NULL
+		    ||  tok_set_location(p_tokeniser, p_workspace->p_alloc, p_node, p_pos)
+		    )
+			goto out_of_memory;
+		p_line = p_node->p_line;
+
+		if (json_tape_builder_open_cls(p_builder, i) == JNODE_CLS_LIST) {
+			p_node->cls                 = &AST_CLS_LITERAL_LIST;
+			p_node->d.llist.nb_elements = 0;
+			p_node->d.llist.elements    = NULL;
+			if ((p_frame = parse_push(p_tokeniser, PARSE_LIST, p_error_handler)) == NULL)
+				return -1;
+			p_frame->base = p_tokeniser->scratch_len;
+			/* The last element of an enclosing list is the one being parsed. */
+			if (!innermost)
+				nb--;
+			for (j = 0; j < nb; j++)
+				if ((p_element = tape_to_ast(p_tape + p_elements[j], p_line, p_node->char_pos, p_workspace->p_alloc)) == NULL || scratch_push(p_tokeniser, p_element))
+					goto out_of_memory;
+		} else {
+			p_node->cls             = &AST_CLS_LITERAL_DICT;
+			p_node->d.ldict.nb_keys = 0;
+			p_node->d.ldict.elements = NULL;
+			if ((p_frame = parse_push(p_tokeniser, PARSE_DICT, p_error_handler)) == NULL)
+				return -1;
+			p_frame->base     = p_tokeniser->scratch_len;
+			p_frame->nb_slots = 0;
+			/* The value of the last key is being parsed unless this is the
+			 * innermost dict and the value has already been added. */
+			for (j = 0; j < nb; j++) {
+				const struct json_tape *p_key = p_tape + p_elements[j];
+				if ((p_element = tape_to_ast(p_key, p_line, p_node->char_pos, p_workspace->p_alloc)) == NULL || scratch_push(p_tokeniser, p_element))
+					goto out_of_memory;
+				if (j + 1 < nb || (innermost && !(nb_values & 1))) {
+					if ((p_element = tape_to_ast(p_key + 1, p_line, p_node->char_pos, p_workspace->p_alloc)) == NULL || scratch_push(p_tokeniser, p_element))
+						goto out_of_memory;
+				} else {
+					p_frame->nb_slots = 1;
+				}
+			}
+		}
+		p_frame->p_node = p_node;
+
+		if (parse_push_expr(p_workspace, p_tokeniser, 0, p_pos, p_error_handler))
+			return -1;
+	}
+
+	json_tape_builder_reset(p_builder);
+
+	if (complete) {
+		p_frame           = &(p_tokeniser->p_frames[p_tokeniser->frames_len - 2]);
+		p_frame->nb_slots = !p_frame->nb_slots;
+		*pp_value         = p_tokeniser->pp_scratch[--p_tokeniser->scratch_len];
+		if (!negated)
+			return 0;
+		/* The minus binds less tightly than whatever follows the number (as
+		 * in -2 ^ 2), so it is parsed again as an operator. */
+		*pp_value = NULL;
+		if (parse_token(p_workspace, p_tokeniser, &(neg[0]), pp_value, p_error_handler))
+			return -1;
+		return parse_token(p_workspace, p_tokeniser, &(neg[1]), pp_value, p_error_handler);
+	}
+
+	return (p_read != NULL) ? parse_token(p_workspace, p_tokeniser, p_read, pp_value, p_error_handler) : 0;
+
+out_of_memory:
+	return ejson_error(p_error_handler, "out of memory\n");
+}
+
+/* Parses the plain JSON value of the PARSE_JSON frame p_frame into a tape in
+ * a single pass without creating any AST nodes for its contents. Stores the
+ * value in *pp_value and pops the frame once it is complete or returns 1 if
+ * the tokens of a streamed document run out first.
+ *
+ * If the value is only being tried and anything in it is not plain JSON, the
+ * lists and dicts which are open at that point are given to the EJSON parser
+ * (see json_promote()) to finish. Otherwise, the value must be plain JSON and
+ * -1 is returned after reporting an error if it is not. */
+static int parse_json(struct evaluation_context *p_workspace, struct tokeniser *p_tokeniser, struct parse_frame *p_frame, const struct ast_node **pp_value, const struct ejson_error_handler *p_error_handler) {
+	struct json_tape_builder         *p_builder = &(p_tokeniser->json);
+	const struct ejson_error_handler *p_json_eh = (p_frame->json_trial) ? NULL : p_error_handler;
+	const struct token               *p_read    = NULL;
+	const struct token               *p_token;
+	const struct json_tape           *p_tape;
+	const struct ast_line            *p_line;
+	struct ast_node                  *p_ret;
+	int                               complete  = 0;
+	int                               cls;
+
+	/* No step reads more than two tokens. */
+	while (tok_need(p_tokeniser, 3)) {
+		size_t depth = json_tape_builder_depth(p_builder);
+
+		p_token = tok_peek(p_tokeniser);
+
+		if (p_frame->json_state == JSON_AFTER) {
+			int r;
+			/* Close the containers which end here and move on to the next
+			 * value of the innermost one which does not. */
+			if (depth == 0)
+				goto done;
+			complete = 1;
+			cls      = json_tape_builder_open_cls(p_builder, depth - 1);
+			if (p_token == NULL)
+				goto end_of_document;
+			if (p_token->cls == ((cls == JNODE_CLS_LIST) ? &TOK_RSQBR : &TOK_RBRACE)) {
+				if ((r = json_tape_close(p_builder)) < 0)
+					goto out_of_memory;
+				p_frame->json_negated = 0;
+				if (r > 0) {
+					ejson_location_error(p_json_eh, &(p_token->posinfo), "the dictionary ending here contains a duplicate key\n");
+					goto not_json;
+				}
+			} else if (p_token->cls == &TOK_COMMA) {
+				p_frame->json_state = (cls == JNODE_CLS_LIST) ? JSON_VALUE : JSON_KEY;
+			} else {
+				ejson_location_error(p_json_eh, &(p_token->posinfo), (cls == JNODE_CLS_LIST) ? "expected either a , or ]\n" : "expected a , or }\n");
+				goto not_json;
+			}
+			if (tok_read(p_tokeniser, p_error_handler) == NULL)
+				goto fail;
+			complete = 0;
+			continue;
+		}
+
+		if (p_token == NULL)
+			goto end_of_document;
+
+		if (p_frame->json_state == JSON_KEY) {
+			char  *p_key;
+			size_t len;
+			if (p_token->cls != &TOK_STRING) {
+				ejson_location_error(p_json_eh, &(p_token->posinfo), "expected a string dict key but got a %s token\n", p_token->cls->name);
+				goto not_json;
+			}
+			if ((p_key = token_string_dup(p_token, p_workspace->p_alloc, &len)) == NULL || json_tape_add_string(p_builder, p_key, len))
+				goto out_of_memory;
+			if (tok_read(p_tokeniser, p_error_handler) == NULL)
+				goto fail;
+			complete = 1;
+			if ((p_token = tok_peek(p_tokeniser)) == NULL)
+				goto end_of_document;
+			if (p_token->cls != &TOK_COLON) {
+				ejson_location_error(p_json_eh, &(p_token->posinfo), "expected a :\n");
+				goto not_json;
+			}
+			if (tok_read(p_tokeniser, p_error_handler) == NULL)
+				goto fail;
+			complete            = 0;
+			p_frame->json_state = JSON_VALUE;
+			continue;
+		}
+
+		/* p_token begins a value */
+		p_frame->json_negated = 0;
+		if (p_token->cls == &TOK_LSQBR || p_token->cls == &TOK_LBRACE) {
+			const struct tok_def *p_close;
+			cls     = (p_token->cls == &TOK_LSQBR) ? JNODE_CLS_LIST : JNODE_CLS_DICT;
+			p_close = (cls == JNODE_CLS_LIST) ? &TOK_RSQBR : &TOK_RBRACE;
+			if (p_tokeniser->expr_depth + depth >= p_workspace->max_depth) {
+				ejson_location_error(p_json_eh, &(p_token->posinfo), "expressions are nested more than %u levels deep\n", p_workspace->max_depth);
+				goto not_json;
+			}
+			if (json_tape_open(p_builder, cls, &(p_token->posinfo)))
+				goto out_of_memory;
+			if (tok_read(p_tokeniser, p_error_handler) == NULL)
+				goto fail;
+			if ((p_token = tok_peek(p_tokeniser)) != NULL && p_token->cls == p_close) {
+				if (json_tape_close(p_builder) < 0)
+					goto out_of_memory;
+				if (tok_read(p_tokeniser, p_error_handler) == NULL)
+					goto fail;
+				p_frame->json_state = JSON_AFTER;
+			} else {
+				p_frame->json_state = (cls == JNODE_CLS_LIST) ? JSON_VALUE : JSON_KEY;
+			}
+			continue;
+		}
+
+		if (p_token->cls == &TOK_STRING) {
+			char  *p_str;
+			size_t len;
+			if ((p_str = token_string_dup(p_token, p_workspace->p_alloc, &len)) == NULL || json_tape_add_string(p_builder, p_str, len))
+				goto out_of_memory;
+		} else if (p_token->cls == &TOK_INT) {
+			if (json_tape_add_int(p_builder, p_token->t.tint))
+				goto out_of_memory;
+		} else if (p_token->cls == &TOK_FLOAT) {
+			if (json_tape_add_real(p_builder, p_token->t.tflt))
+				goto out_of_memory;
+		} else if (p_token->cls == &TOK_TRUE || p_token->cls == &TOK_FALSE) {
+			if (json_tape_add_bool(p_builder, p_token->cls == &TOK_TRUE))
+				goto out_of_memory;
+		} else if (p_token->cls == &TOK_NULL) {
+			if (json_tape_add_null(p_builder))
+				goto out_of_memory;
+		} else if (p_token->cls == &TOK_SUB) {
+			/* Only the token after the minus says whether it negates a
+			 * number, so the minus has to be read first. */
+			if ((p_read = tok_read(p_tokeniser, p_error_handler)) == NULL)
+				goto fail;
+			if ((p_token = tok_peek(p_tokeniser)) == NULL || (p_token->cls != &TOK_INT && p_token->cls != &TOK_FLOAT)) {
+				ejson_location_error(p_json_eh, &(p_read->posinfo), "expected a JSON value but got a %s token\n", p_read->cls->name);
+				goto not_json;
+			}
+			p_frame->json_negated = 1;
+			p_frame->json_neg[0]  = *p_read;
+			p_frame->json_neg[1]  = *p_token;
+			p_read                = NULL;
+			if  (   (p_token->cls == &TOK_INT)
+			    ?   json_tape_add_int(p_builder, (long long)(0ull - (unsigned long long)p_token->t.tint))
+			    :   json_tape_add_real(p_builder, -p_token->t.tflt)
+			    )
+				goto out_of_memory;
+		} else {
+			ejson_location_error(p_json_eh, &(p_token->posinfo), "expected a JSON value but got a %s token\n", p_token->cls->name);
+			goto not_json;
+		}
 		if (tok_read(p_tokeniser, p_error_handler) == NULL)
-			abort();
+			goto fail;
+		p_frame->json_state = JSON_AFTER;
+	}
+
+	return 1;
 
-		if ((p_rhs = expect_expression(p_workspace, p_tokeniser, q, p_error_handler)) == NULL)
+done:
+	if  (   (p_tape = json_tape_finish(p_builder, p_workspace->p_alloc)) == NULL
+	    ||  (p_line = tok_ast_line(p_tokeniser, p_workspace->p_alloc, &(p_frame->json_pos))) == NULL
+	    ||  (p_ret = tape_to_ast(p_tape, p_line, (uint32_t)p_frame->json_pos.char_pos, p_workspace->p_alloc)) == NULL
+	    )
+		goto out_of_memory;
+	p_tokeniser->frames_len--;
+	*pp_value = p_ret;
+	return 0;
+
+end_of_document:
+	/* Reading past the end reports it. */
+	(void)tok_read(p_tokeniser, p_json_eh);
+not_json:
+	if (p_frame->json_trial)
+		return json_promote(p_workspace, p_tokeniser, complete, p_read, pp_value, p_error_handler);
+	goto fail;
+out_of_memory:
+	ejson_error(p_error_handler, "out of memory\n");
+fail:
+	json_tape_builder_reset(p_builder);
+	return -1;
+}
+
+/* Returns non-zero if p_node is a value which is fully built and does not
+ * depend on anything (so evaluating it gives back the node itself). List
+ * generators and ready dicts only appear in a parsed tree when they are
+ * constant (see prebuild_literal()). */
+static int is_constant(const struct ast_node *p_node) {
+	return  (   p_node->cls == &AST_CLS_LITERAL_INT
+	        ||  p_node->cls == &AST_CLS_LITERAL_BOOL
+	        ||  p_node->cls == &AST_CLS_LITERAL_STRING
+	        ||  p_node->cls == &AST_CLS_LITERAL_FLOAT
+	        ||  p_node->cls == &AST_CLS_LITERAL_NULL
+	        ||  p_node->cls == &AST_CLS_LIST_GENERATOR
+	        ||  p_node->cls == &AST_CLS_READY_DICT
+	        ||  p_node->cls == &AST_CLS_TAPE_DICT
+	        );
+}
+
+/* Turns the list or dict literal p_node into the list generator or ready
+ * dict which evaluating it would produce if all of its elements are
+ * constant, so that it is built once rather than every time it is
+ * evaluated (e.g. in a function body). Dicts with duplicate keys are left
+ * alone so that the error is raised when they are evaluated. Returns
+ * non-zero if memory could not be allocated. */
+static int prebuild_literal(struct ast_node *p_node, struct cop_salloc_iface *p_alloc) {
+	if (p_node->cls == &AST_CLS_LITERAL_LIST) {
+		const struct ast_node **pp_elements = p_node->d.llist.elements;
+		unsigned                nb_elements = p_node->d.llist.nb_elements;
+		unsigned                i;
+		for (i = 0; i < nb_elements; i++)
+			if (!is_constant(pp_elements[i]))
+				return 0;
+		p_node->cls                        = &AST_CLS_LIST_GENERATOR;
+		p_node->nb_elements                = nb_elements;
+		p_node->d.lgen.d.literal.pp_values = pp_elements;
+		p_node->d.lgen.get_element         = get_literal_element_fn;
+		return 0;
+	} else {
+		struct cop_strdict_node *p_root = cop_strdict_init();
+		size_t                   save   = cop_salloc_save(p_alloc);
+		unsigned                 nb_keys;
+		unsigned                 i;
+		assert(p_node->cls == &AST_CLS_LITERAL_DICT);
+		nb_keys = p_node->d.ldict.nb_keys;
+		for (i = 0; i < 2 * nb_keys; i++)
+			if (!is_constant(p_node->d.ldict.elements[i]) || (!(i & 1) && p_node->d.ldict.elements[i]->cls != &AST_CLS_LITERAL_STRING))
+				return 0;
+		for (i = 0; i < nb_keys; i++) {
+			const struct ast_node *p_key = p_node->d.ldict.elements[2*i+0];
+			struct cop_strh        key;
+			struct dictnode       *p_dn;
+			if ((p_dn = cop_salloc(p_alloc, sizeof(struct dictnode), 0)) == NULL)
+				return -1;
+			cop_strh_init_shallow(&key, p_key->d.str.p_data);
+			cop_strdict_node_init(&(p_dn->node), &key, p_dn);
+			p_dn->data = p_node->d.ldict.elements[2*i+1];
+			if (cop_strdict_insert(&p_root, &(p_dn->node))) {
+				cop_salloc_restore(p_alloc, save);
+				return 0;
+			}
+		}
+		p_node->cls             = &AST_CLS_READY_DICT;
+		p_node->d.rdict.nb_keys = nb_keys;
+		p_node->d.rdict.p_root  = p_root;
+		return 0;
+	}
+}
+
+static int is_binop(const struct ast_cls *cls) {
+	return cls->op >= AST_OP_FIRST_BINOP && cls->op <= AST_OP_LAST_BINOP;
+}
+
+static int evaluate_ast(struct ev_ast_node *p_dest, const struct ast_node *p_src, const struct ev_frame *p_stackx, unsigned stack_sizex, unsigned depth, struct cop_salloc_iface *p_alloc, const struct ejson_error_handler *p_error_handler);
+
+/* Evaluates the constant expression p_node for fold_constant() and returns a
+ * new node holding its value, or NULL if it can not be folded. When there is
+ * a separate scratch allocator, the expression is evaluated in it and only a
+ * scalar value is copied out. Lists and dicts may refer to the temporaries
+ * which were made while evaluating them so they are evaluated again directly
+ * in the persistent allocator. */
+static struct ast_node *fold_evaluate(struct evaluation_context *p_workspace, const struct ast_node *p_node) {
+	struct cop_salloc_iface *p_alloc   = p_workspace->p_alloc;
+	struct cop_salloc_iface *p_scratch = p_workspace->p_scratch;
+	struct ast_node         *p_ret;
+	struct ev_ast_node       value;
+	size_t                   save;
+
+	if (p_scratch != p_alloc) {
+		const struct ast_cls *cls;
+		save = cop_salloc_save(p_scratch);
+		if (evaluate_ast(&value, p_node, NULL, 0, p_workspace->max_depth, p_scratch, NULL)) {
+			cop_salloc_restore(p_scratch, save);
 			return NULL;
+		}
+		cls = value.p_node->cls;
+		if (cls == &AST_CLS_LITERAL_STRING) {
+			size_t len = value.p_node->d.str.len;
+			if ((p_ret = cop_salloc(p_alloc, sizeof(struct ast_node) + len + 1, 0)) != NULL) {
+				*p_ret = *(value.p_node);
+				memcpy((char *)(p_ret + 1), value.p_node->d.str.p_data, len + 1);
+				p_ret->d.str.p_data = (char *)(p_ret + 1);
+			}
+			cop_salloc_restore(p_scratch, save);
+			return p_ret;
+		}
+		if (cls == &AST_CLS_LITERAL_INT || cls == &AST_CLS_LITERAL_BOOL || cls == &AST_CLS_LITERAL_FLOAT || cls == &AST_CLS_LITERAL_NULL) {
+			if ((p_ret = cop_salloc(p_alloc, sizeof(struct ast_node), 0)) != NULL)
+				*p_ret = *(value.p_node);
+			cop_salloc_restore(p_scratch, save);
+			return p_ret;
+		}
+		cop_salloc_restore(p_scratch, save);
+		if (!is_constant(value.p_node))
+			return NULL;
+	}
 
-		if ((p_comb = cop_salloc(p_workspace->p_alloc, sizeof(struct ast_node), 0)) == NULL)
-			return ejson_error_null(p_error_handler, "out of memory\n");
+	save = cop_salloc_save(p_alloc);
+	if  (   evaluate_ast(&value, p_node, NULL, 0, p_workspace->max_depth, p_alloc, NULL)
+	    ||  !is_constant(value.p_node)
+	    ||  (p_ret = cop_salloc(p_alloc, sizeof(struct ast_node), 0)) == NULL
+	    ) {
+		cop_salloc_restore(p_alloc, save);
+		return NULL;
+	}
+	*p_ret = *(value.p_node);
+	return p_ret;
+}
+
+/* Returns the value of the expression p_node (which has just been parsed) if
+ * everything it depends on is constant or p_node itself otherwise. The value
+ * is found by evaluating the expression, so anything which would raise an
+ * error is left alone to raise it if and when it is actually evaluated. */
+static const struct ast_node *fold_constant(struct evaluation_context *p_workspace, const struct ast_node *p_node) {
+	const struct ast_cls  *cls = p_node->cls;
+	struct ast_node       *p_ret;
+
+	if (p_workspace->flags & EJSON_FLAG_NO_FOLD)
+		return p_node;
+
+	/* The branch which is not taken is dropped. The one which is keeps its
+	 * own position for errors raised while evaluating it. */
+	if (cls == &AST_CLS_IF) {
+		if (p_node->d.ifexpr.p_test->cls != &AST_CLS_LITERAL_BOOL)
+			return p_node;
+		p_workspace->stats.folded_nodes++;
+		return (p_node->d.ifexpr.p_test->d.i) ? p_node->d.ifexpr.p_true : p_node->d.ifexpr.p_false;
+	}
+
+	if  (   !(is_binop(cls) && is_constant(p_node->d.binop.p_lhs) && is_constant(p_node->d.binop.p_rhs))
+	    &&  !((cls == &AST_CLS_NEG || cls == &AST_CLS_LOGNOT) && is_constant(p_node->d.binop.p_lhs))
+	    &&  !((cls == &AST_CLS_FORMAT || cls == &AST_CLS_RANGE) && is_constant(p_node->d.builtin.p_args))
+	    &&  !(cls == &AST_CLS_ACCESS && is_constant(p_node->d.access.p_data) && is_constant(p_node->d.access.p_key))
+	    )
+		return p_node;
+
+	/* The value takes the place of the expression, including its position
+	 * for any errors which are raised about it later. */
+	if ((p_ret = fold_evaluate(p_workspace, p_node)) == NULL)
+		return p_node;
+	ast_copy_location(p_ret, p_node);
+	p_workspace->stats.folded_nodes++;
+	return p_ret;
+}
+
+/* Gives *pp_value, the value of the sub-expression which has just been
+ * parsed, to the frame p_frame which was waiting for it. If the frame is
+ * complete, it is popped and *pp_value is replaced by the value of the
+ * frame's construct. Otherwise, the frames for the next sub-expression which
+ * is needed are pushed and *pp_value is set to NULL. */
+static int parse_reduce(struct evaluation_context *p_workspace, struct tokeniser *p_tokeniser, struct parse_frame *p_frame, const struct ast_node **pp_value, const struct ejson_error_handler *p_error_handler) {
+	const struct ast_node *p_value = *pp_value;
+	const struct token    *p_token;
+	struct token_pos_info  tpi;
+
+	*pp_value = NULL;
+
+	if (p_frame->kind == PARSE_SLOTS) {
+		*(p_frame->pp_slots[p_frame->slot++]) = p_value;
+		if (p_frame->slot < p_frame->nb_slots)
+			return parse_push_expr(p_workspace, p_tokeniser, 0, ast_location(&tpi, p_value), p_error_handler);
+		*pp_value = fold_constant(p_workspace, p_frame->p_node);
+		p_tokeniser->frames_len--;
+		return 0;
+	}
+
+	if (p_frame->kind == PARSE_FUNC) {
+		size_t i;
+		p_frame->p_node->d.fn.node = p_value;
+		p_workspace->stack_depth  -= p_frame->nb_args;
+		for (i = p_frame->base; i < p_tokeniser->scratch_len; i++) {
+			struct cop_strh key;
+			cop_strdict_node_to_key((struct cop_strdict_node *)(p_tokeniser->pp_scratch[i] + 1), &key);
+			if (cop_strdict_delete(&(p_workspace->p_workspace), &key) == NULL) {
+				fprintf(stderr, "ICE\n");
+				abort();
+			}
+		}
+		p_tokeniser->scratch_len = p_frame->base;
+		*pp_value = p_frame->p_node;
+		p_tokeniser->frames_len--;
+		return 0;
+	}
+
+	if ((p_token = tok_read(p_tokeniser, p_error_handler)) == NULL)
+		return -1;
+
+	if (p_frame->kind == PARSE_PAREN) {
+		if (p_token->cls != &TOK_RPAREN)
+			return ejson_location_error(p_error_handler, &(p_token->posinfo), "expected close parenthesis\n");
+		*pp_value = p_value;
+		p_tokeniser->frames_len--;
+		return 0;
+	}
+
+	if (scratch_push(p_tokeniser, p_value))
+		return ejson_error(p_error_handler, "out of memory\n");
+
+	if (p_frame->kind == PARSE_DICT) {
+		if (p_frame->nb_slots == 0) {
+			if (p_token->cls != &TOK_COLON)
+				return ejson_location_error(p_error_handler, &(p_token->posinfo), "expected a :\n");
+			p_frame->nb_slots = 1;
+			return parse_push_expr(p_workspace, p_tokeniser, 0, &(p_token->posinfo), p_error_handler);
+		}
+		if (p_token->cls != &TOK_RBRACE && p_token->cls != &TOK_COMMA)
+			return ejson_location_error(p_error_handler, &(p_token->posinfo), "expected a , or }\n");
+		p_frame->nb_slots = 0;
+		if (p_token->cls == &TOK_COMMA)
+			return parse_push_expr(p_workspace, p_tokeniser, 0, &(p_token->posinfo), p_error_handler);
+		p_frame->p_node->d.ldict.nb_keys = (p_tokeniser->scratch_len - p_frame->base) / 2;
+		if  (   (p_frame->p_node->d.ldict.elements = scratch_pop(p_tokeniser, p_frame->base, p_workspace->p_alloc)) == NULL
+		    ||  prebuild_literal(p_frame->p_node, p_workspace->p_alloc)
+		    )
+			return ejson_error(p_error_handler, "out of memory\n");
+		*pp_value = p_frame->p_node;
+		p_tokeniser->frames_len--;
+		return 0;
+	}
+
+	assert(p_frame->kind == PARSE_LIST);
+	if (p_token->cls != &TOK_RSQBR && p_token->cls != &TOK_COMMA)
+		return ejson_location_error(p_error_handler, &(p_token->posinfo), "expected either a , or ]\n");
+	if (p_token->cls == &TOK_COMMA)
+		return parse_push_expr(p_workspace, p_tokeniser, 0, &(p_token->posinfo), p_error_handler);
+	p_frame->p_node->d.llist.nb_elements = p_tokeniser->scratch_len - p_frame->base;
+	if  (   (p_frame->p_node->d.llist.elements = scratch_pop(p_tokeniser, p_frame->base, p_workspace->p_alloc)) == NULL
+	    ||  prebuild_literal(p_frame->p_node, p_workspace->p_alloc)
+	    )
+		return ejson_error(p_error_handler, "out of memory\n");
+	*pp_value = p_frame->p_node;
+	p_tokeniser->frames_len--;
+	return 0;
+}
+
+/* Gives *pp_value, the value of an operand which has just been parsed, to
+ * the PARSE_EXPR frame p_frame. If a binary operator which the frame may
+ * contain follows, the frames for its right hand side are pushed and
+ * *pp_value is set to NULL. Otherwise, the frame is popped and *pp_value is
+ * replaced by the value of the whole expression. */
+static int parse_operator(struct evaluation_context *p_workspace, struct tokeniser *p_tokeniser, struct parse_frame *p_frame, const struct ast_node **pp_value, const struct ejson_error_handler *p_error_handler) {
+	const struct token *p_token;
+
+	if (p_frame->p_op != NULL) {
+		struct ast_node *p_comb;
+		if  (   (p_comb = cop_salloc(p_workspace->p_alloc, sizeof(struct ast_node), 0)) == NULL
+		    ||  tok_set_location(p_tokeniser, p_workspace->p_alloc, p_comb, &(p_frame->op_pos))
+		    )
+			return ejson_error(p_error_handler, "out of memory\n");
+		p_comb->cls           = p_frame->p_op->bin_op_cls;
+		p_comb->d.binop.p_lhs = p_frame->p_lhs;
+		p_comb->d.binop.p_rhs = *pp_value;
+		*pp_value             = fold_constant(p_workspace, p_comb);
+	}
 
-		p_comb->cls           = p_cls->bin_op_cls;
-		p_comb->doc_pos       = loc_info;
-		p_comb->d.binop.p_lhs = p_lhs;
-		p_comb->d.binop.p_rhs = p_rhs;
-		p_lhs = p_comb;
+	if  (   (p_token = tok_peek(p_tokeniser)) != NULL
+	    &&  p_token->cls->bin_op_cls != NULL
+	    &&  p_token->cls->binary_precedence >= p_frame->min_prec
+	    ) {
+		const struct tok_def *p_cls = p_token->cls;
+		unsigned              q     = (p_cls->right_associative) ? p_cls->binary_precedence : (p_cls->binary_precedence + 1);
+		p_frame->p_lhs  = *pp_value;
+		p_frame->p_op   = p_cls;
+		p_frame->op_pos = p_token->posinfo;
+		*pp_value       = NULL;
+		if (tok_read(p_tokeniser, p_error_handler) == NULL)
+			return -1;
+		return parse_push_expr(p_workspace, p_tokeniser, q, &(p_frame->op_pos), p_error_handler);
 	}
 
-	return p_lhs;
+	p_tokeniser->frames_len--;
+	p_tokeniser->expr_depth--;
+	return 0;
+}
+
+/* Returns non-zero if every token which the next step of parse_run() will
+ * read is available (see tok_need()). No step reads more than two tokens
+ * other than the one for a function literal, which reads the whole of its
+ * parameter list. */
+static int parse_step_ready(const struct tokeniser *p_tokeniser) {
+	size_t i;
+	if (!tok_need(p_tokeniser, 3))
+		return 0;
+	if  (   p_tokeniser->p_tape == NULL
+	    ||  !p_tokeniser->partial
+	    ||  p_tokeniser->p_value != NULL
+	    ||  p_tokeniser->p_tape[p_tokeniser->tape_pos].cls != &TOK_FUNC
+	    )
+		return 1;
+	for (i = p_tokeniser->tape_pos + 2; i < p_tokeniser->tape_len; i++)
+		if (p_tokeniser->p_tape[i].cls != &TOK_IDENTIFIER && p_tokeniser->p_tape[i].cls != &TOK_COMMA)
+			return i + 1 < p_tokeniser->tape_len;
+	return 0;
+}
+
+/* Parses until every frame above base has been reduced to a single value and
+ * stores it in *pp_value. Returns 1 if the tokens of a streamed document run
+ * out first, in which case the parser carries on from where it stopped when
+ * this is called again. */
+static int parse_run(struct evaluation_context *p_workspace, struct tokeniser *p_tokeniser, size_t base, const struct ast_node **pp_value, const struct ejson_error_handler *p_error_handler) {
+	int r = 0;
+
+	while (p_tokeniser->frames_len > base) {
+		struct parse_frame *p_frame = &(p_tokeniser->p_frames[p_tokeniser->frames_len - 1]);
+		if (p_frame->kind == PARSE_JSON)
+			r = parse_json(p_workspace, p_tokeniser, p_frame, &(p_tokeniser->p_value), p_error_handler);
+		else if (!parse_step_ready(p_tokeniser))
+			r = 1;
+		else if (p_tokeniser->p_value == NULL)
+			r = parse_primary(p_workspace, p_tokeniser, &(p_tokeniser->p_value), p_error_handler);
+		else if (p_frame->kind == PARSE_EXPR)
+			r = parse_operator(p_workspace, p_tokeniser, p_frame, &(p_tokeniser->p_value), p_error_handler);
+		else
+			r = parse_reduce(p_workspace, p_tokeniser, p_frame, &(p_tokeniser->p_value), p_error_handler);
+		if (r)
+			return r;
+	}
+
+	*pp_value            = p_tokeniser->p_value;
+	p_tokeniser->p_value = NULL;
+	return 0;
 }
 
 struct jnode_data {
@@ -946,7 +2232,7 @@ struct jnode_data {
 
 };
 
-static int to_jnode(struct jnode *p_node, const struct ev_ast_node *p_src, struct cop_salloc_iface *p_alloc, const struct ejson_error_handler *p_error_handler);
+static int to_jnode(struct jnode *p_node, const struct ev_ast_node *p_src, unsigned depth, struct cop_salloc_iface *p_alloc, const struct ejson_error_handler *p_error_handler);
 
 struct list_element_fn_data {
 	struct p_error_handler  *p_error_handler;
@@ -960,10 +2246,11 @@ struct list_element_fn_data {
 struct execution_context {
 	struct ev_ast_node                object;
 	const struct ejson_error_handler *p_error_handler;
+	unsigned                          depth; /* remaining evaluation depth */
 
 };
 
-static int evaluate_ast(struct ev_ast_node *p_dest, const struct ast_node *p_src, const struct ev_ast_node **pp_stackx, unsigned stack_sizex, struct cop_salloc_iface *p_alloc, const struct ejson_error_handler *p_error_handler);
+static int evaluate_ast(struct ev_ast_node *p_dest, const struct ast_node *p_src, const struct ev_frame *p_stackx, unsigned stack_sizex, unsigned depth, struct cop_salloc_iface *p_alloc, const struct ejson_error_handler *p_error_handler);
 
 struct lrange {
 	long long first;
@@ -972,250 +2259,866 @@ struct lrange {
 
 };
 
-static int ast_list_generator_get_element(struct ev_ast_node *p_ret, const struct ev_ast_node *p_list, unsigned element, struct cop_salloc_iface *p_alloc, const struct ejson_error_handler *p_error_handler) {
+static int ast_list_generator_get_element(struct ev_ast_node *p_ret, const struct ev_ast_node *p_list, unsigned element, unsigned depth, struct cop_salloc_iface *p_alloc, const struct ejson_error_handler *p_error_handler) {
 	struct ast_node *p_dest;
 	assert(p_list->p_node->cls == &AST_CLS_LIST_GENERATOR);
-	if (element >= p_list->p_node->d.lgen.nb_elements)
+	if (element >= p_list->p_node->nb_elements)
 		return ejson_error(p_error_handler, "list index out of range\n");
-	if ((p_dest = cop_salloc(p_alloc, sizeof(struct ast_node), 0)) == NULL)
-		return ejson_error(p_error_handler, "out of memory\n");
-	p_dest->doc_pos   = p_list->p_node->doc_pos;
-	p_dest->cls       = &AST_CLS_LITERAL_INT;
-	p_dest->d.i       = p_list->p_node->d.lgen.d.range.first + p_list->p_node->d.lgen.d.range.step * (long long)element;
-	p_ret->p_node     = p_dest;
-	p_ret->pp_stack   = NULL;
-	p_ret->stack_size = 0;
+	p_dest      = ev_scalar(p_ret);
+	ast_copy_location(p_dest, p_list->p_node);
+	p_dest->cls = &AST_CLS_LITERAL_INT;
+	p_dest->d.i = p_list->p_node->d.lgen.d.range.first + p_list->p_node->d.lgen.d.range.step * (long long)element;
 	return 0;
 }
 
-static int get_literal_element_fn(struct ev_ast_node *p_dest, const struct ev_ast_node *p_src, unsigned element, struct cop_salloc_iface *p_alloc, const struct ejson_error_handler *p_error_handler) {
+static int get_literal_element_fn(struct ev_ast_node *p_dest, const struct ev_ast_node *p_src, unsigned element, unsigned depth, struct cop_salloc_iface *p_alloc, const struct ejson_error_handler *p_error_handler) {
 	assert(p_src->p_node->cls == &AST_CLS_LIST_GENERATOR);
-	if (element >= p_src->p_node->d.lgen.nb_elements)
+	if (element >= p_src->p_node->nb_elements)
 		return ejson_error(p_error_handler, "list index out of bounds\n");
-	return evaluate_ast(p_dest, p_src->p_node->d.lgen.d.literal.pp_values[element], p_src->pp_stack, p_src->stack_size, p_alloc, p_error_handler);
+	return evaluate_ast(p_dest, p_src->p_node->d.lgen.d.literal.pp_values[element], p_src->p_stack, p_src->stack_size, depth, p_alloc, p_error_handler);
+}
+
+static int get_list_cat(struct ev_ast_node *p_dest, const struct ev_ast_node *p_src, unsigned element, unsigned depth, struct cop_salloc_iface *p_alloc, const struct ejson_error_handler *p_error_handler) {
+	const struct list_cat *p_cat;
+	unsigned lo, hi;
+	assert(p_src->p_node->cls == &AST_CLS_LIST_GENERATOR);
+	if (element >= p_src->p_node->nb_elements)
+		return ejson_error(p_error_handler, "list index out of range\n");
+
+	/* Find the first part which ends after element. */
+	p_cat = p_src->p_node->d.lgen.d.cat.p_cat;
+	lo    = 0;
+	hi    = p_src->p_node->d.lgen.d.cat.nb_parts - 1;
+	while (lo < hi) {
+		unsigned mid = lo + (hi - lo) / 2;
+		if (element < p_cat->p_ends[mid])
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	if (lo)
+		element -= p_cat->p_ends[lo - 1];
+
+	return p_cat->p_parts[lo].p_node->d.lgen.get_element(p_dest, &(p_cat->p_parts[lo]), element, depth, p_alloc, p_error_handler);
+}
+
+/* Stores the parts of p_list (one, or several if it is a concatenation) in
+ * p_cat from index pos, which must have room for them. Returns the index
+ * after the last part. */
+static unsigned list_cat_put(struct list_cat *p_cat, unsigned pos, const struct ev_ast_node *p_list) {
+	const struct ev_ast_node *p_parts = p_list;
+	unsigned                  nb      = 1;
+	unsigned                  i;
+	if (p_list->p_node->d.lgen.get_element == get_list_cat) {
+		p_parts = p_list->p_node->d.lgen.d.cat.p_cat->p_parts;
+		nb      = p_list->p_node->d.lgen.d.cat.nb_parts;
+	}
+	for (i = 0; i < nb; i++, pos++) {
+		unsigned start = (pos) ? p_cat->p_ends[pos - 1] : 0;
+		ev_copy(&(p_cat->p_parts[pos]), &(p_parts[i]));
+		p_cat->p_ends[pos] = start + p_parts[i].p_node->nb_elements;
+	}
+	return pos;
+}
+
+/* If the ranges p_lhs and p_rhs follow on from each other, sets p_dest to a
+ * single range which holds both and returns 1. */
+static int make_range_cat(struct ast_node *p_dest, const struct ast_node *p_lhs, const struct ast_node *p_rhs) {
+	long long step;
+
+	if (p_lhs->nb_elements == 0 || p_rhs->nb_elements == 0 || p_lhs->nb_elements + p_rhs->nb_elements < p_lhs->nb_elements)
+		return 0;
+	if (p_lhs->nb_elements > 1)
+		step = p_lhs->d.lgen.d.range.step;
+	else if (p_rhs->nb_elements > 1)
+		step = p_rhs->d.lgen.d.range.step;
+	else
+		step = p_rhs->d.lgen.d.range.first - p_lhs->d.lgen.d.range.first;
+	if  (   (p_lhs->nb_elements > 1 && p_lhs->d.lgen.d.range.step != step)
+	    ||  (p_rhs->nb_elements > 1 && p_rhs->d.lgen.d.range.step != step)
+	    ||  p_rhs->d.lgen.d.range.first != p_lhs->d.lgen.d.range.first + step * (long long)p_lhs->nb_elements
+	    )
+		return 0;
+
+	p_dest->cls                  = &AST_CLS_LIST_GENERATOR;
+	p_dest->nb_elements          = p_lhs->nb_elements + p_rhs->nb_elements;
+	p_dest->d.lgen.get_element   = ast_list_generator_get_element;
+	p_dest->d.lgen.d.range.first = p_lhs->d.lgen.d.range.first;
+	p_dest->d.lgen.d.range.step  = step;
+	return 1;
 }
 
-static int get_list_cat(struct ev_ast_node *p_dest, const struct ev_ast_node *p_src, unsigned element, struct cop_salloc_iface *p_alloc, const struct ejson_error_handler *p_error_handler) {
-	struct ev_ast_node f;
-	struct ev_ast_node s;
+/* Sets p_dest to the concatenation of the lists p_lhs and p_rhs. Any
+ * concatenations they are themselves made of are flattened into it and
+ * ranges which follow on from each other are joined into one range. */
+static int make_list_cat(struct ev_ast_node *p_dest, const struct ast_node *p_src, const struct ev_ast_node *p_lhs, const struct ev_ast_node *p_rhs, struct cop_salloc_iface *p_alloc) {
+	struct ast_node *p_ret;
+	struct list_cat *p_cat    = NULL;
+	unsigned         nb_lhs   = 1;
+	unsigned         nb_rhs   = 1;
+
+	if (p_lhs->p_node->d.lgen.get_element == get_list_cat) {
+		p_cat  = p_lhs->p_node->d.lgen.d.cat.p_cat;
+		nb_lhs = p_lhs->p_node->d.lgen.d.cat.nb_parts;
+	}
+	if (p_rhs->p_node->d.lgen.get_element == get_list_cat)
+		nb_rhs = p_rhs->p_node->d.lgen.d.cat.nb_parts;
+
+	if ((p_ret = cop_salloc(p_alloc, sizeof(struct ast_node), 0)) == NULL)
+		return -1;
+
+	if  (   p_lhs->p_node->d.lgen.get_element == ast_list_generator_get_element
+	    &&  p_rhs->p_node->d.lgen.get_element == ast_list_generator_get_element
+	    &&  make_range_cat(p_ret, p_lhs->p_node, p_rhs->p_node)
+	    ) {
+		ast_copy_location(p_ret, p_src);
+		p_dest->p_node     = p_ret;
+		p_dest->p_stack    = NULL;
+		p_dest->stack_size = 0;
+		return 0;
+	}
+
+	/* Building a list with a chain of + operators adds to the end of the
+	 * same parts each time. Otherwise they are copied into new storage with
+	 * room to grow. */
+	if  (   p_cat == NULL
+	    ||  p_cat->p_alloc != p_alloc
+	    ||  p_cat->nb_alloc - nb_lhs < nb_rhs
+	    ||  !ejson_atomic_cas(&(p_cat->nb_used), nb_lhs, nb_lhs + nb_rhs)
+	    ) {
+		struct list_cat *p_new;
+		unsigned         nb_alloc = 2 * (nb_lhs + nb_rhs);
+		if  (   (p_new = cop_salloc(p_alloc, sizeof(struct list_cat), 0)) == NULL
+		    ||  (p_new->p_parts = cop_salloc(p_alloc, sizeof(struct ev_ast_node) * nb_alloc, 0)) == NULL
+		    ||  (p_new->p_ends = cop_salloc(p_alloc, sizeof(unsigned) * nb_alloc, 0)) == NULL
+		    )
+			return -1;
+		p_new->nb_used  = nb_lhs + nb_rhs;
+		p_new->nb_alloc = nb_alloc;
+		p_new->p_alloc  = p_alloc;
+		list_cat_put(p_new, 0, p_lhs);
+		p_cat = p_new;
+	}
+	list_cat_put(p_cat, nb_lhs, p_rhs);
+
+	ast_copy_location(p_ret, p_src);
+	p_ret->cls                   = &AST_CLS_LIST_GENERATOR;
+	p_ret->nb_elements           = p_cat->p_ends[nb_lhs + nb_rhs - 1];
+	p_ret->d.lgen.get_element    = get_list_cat;
+	p_ret->d.lgen.d.cat.p_cat    = p_cat;
+	p_ret->d.lgen.d.cat.nb_parts = nb_lhs + nb_rhs;
+	p_dest->p_node               = p_ret;
+	p_dest->p_stack              = NULL;
+	p_dest->stack_size           = 0;
+	return 0;
+}
+
+static int get_tape_element(struct ev_ast_node *p_dest, const struct ev_ast_node *p_src, unsigned element, unsigned depth, struct cop_salloc_iface *p_alloc, const struct ejson_error_handler *p_error_handler) {
 	assert(p_src->p_node->cls == &AST_CLS_LIST_GENERATOR);
-	f.p_node = p_src->p_node->d.lgen.d.cat.p_first;
-	s.p_node = p_src->p_node->d.lgen.d.cat.p_second;
-	assert(f.p_node->cls == &AST_CLS_LIST_GENERATOR);
-	assert(s.p_node->cls == &AST_CLS_LIST_GENERATOR);
-	if (element < f.p_node->d.lgen.nb_elements)
-		return f.p_node->d.lgen.get_element(p_dest, &f, element, p_alloc, p_error_handler);
-	element -= f.p_node->d.lgen.nb_elements;
-	return s.p_node->d.lgen.get_element(p_dest, &s, element, p_alloc, p_error_handler);
-}
-
-static int ast_list_generator_map(struct ev_ast_node *p_dest, const struct ev_ast_node *p_src, unsigned element, struct cop_salloc_iface *p_alloc, const struct ejson_error_handler *p_error_handler) {
-	struct ev_ast_node *p_argument;
-	const struct ev_ast_node **pp_tmp;
-	const struct ev_ast_node *p_function;
+	if (element >= p_src->p_node->nb_elements)
+		return ejson_error(p_error_handler, "list index out of bounds\n");
+	if (tape_to_ev(p_dest, json_tape_element(p_src->p_node->d.lgen.d.p_tape, element), p_src->p_node, p_alloc))
+		return ejson_error(p_error_handler, "out of memory\n");
+	return 0;
+}
+
+static int ast_list_generator_map(struct ev_ast_node *p_dest, const struct ev_ast_node *p_src, unsigned element, unsigned depth, struct cop_salloc_iface *p_alloc, const struct ejson_error_handler *p_error_handler) {
+	const struct map_generator *p_map;
 	const struct ev_ast_node *p_list;
+	struct ev_frame1 *p_calls;
+	struct map_memo *p_memo;
+	const struct ast_cls *cls;
+	unsigned i;
 
 	assert(p_src->p_node->cls == &AST_CLS_LIST_GENERATOR);
-	p_function  = p_src->p_node->d.lgen.d.map.p_function;
-	p_list      = p_src->p_node->d.lgen.d.map.p_key;
-	assert(p_function->p_node->cls == &AST_CLS_FUNCTION);
+	p_map       = p_src->p_node->d.lgen.d.p_map;
+	p_list      = &(p_map->list);
 	assert(p_list->p_node->cls == &AST_CLS_LIST_GENERATOR);
 
-	if (element >= p_list->p_node->d.lgen.nb_elements)
+	if (element >= p_list->p_node->nb_elements)
 		return ejson_error(p_error_handler, "list index out of range\n");
-	if  (   (pp_tmp     = cop_salloc(p_alloc, sizeof(struct ev_ast_node *) * (p_function->stack_size + 1), 0)) == NULL
-	    ||  (p_argument = cop_salloc(p_alloc, sizeof(struct ev_ast_node), 0)) == NULL
+
+	p_memo = p_map->p_memo;
+	if (p_memo != NULL && ejson_atomic_load(&(p_memo[element].state)) == MAP_MEMO_READY) {
+		struct ast_node *p_value = ev_scalar(p_dest);
+		ejson_atomic_inc(&(p_map->p_stats->memo_hits));
+		ast_copy_location(p_value, p_src->p_node);
+		p_value->cls = p_memo[element].cls;
+		if (p_value->cls == &AST_CLS_LITERAL_FLOAT)
+			p_value->d.f = p_memo[element].d.f;
+		else
+			p_value->d.i = p_memo[element].d.i;
+		return 0;
+	}
+
+	/* One frame for every function. The result of each function is the
+	 * argument of the next one and the last writes to p_dest. */
+	if ((p_calls = cop_salloc(p_alloc, sizeof(struct ev_frame1) * p_map->nb_functions, 0)) == NULL)
+		return ejson_error(p_error_handler, "out of memory\n");
+
+	if (p_list->p_node->d.lgen.get_element == ast_list_generator_get_element) {
+		struct ast_node *p_value = ev_scalar(&(p_calls[0].arg));
+		ast_copy_location(p_value, p_list->p_node);
+		p_value->cls = &AST_CLS_LITERAL_INT;
+		p_value->d.i = p_list->p_node->d.lgen.d.range.first + p_list->p_node->d.lgen.d.range.step * (long long)element;
+	} else if (p_list->p_node->d.lgen.get_element(&(p_calls[0].arg), p_list, element, depth, p_alloc, p_error_handler)) {
+		return -1;
+	}
+
+	for (i = 0; i < p_map->nb_functions; i++) {
+		const struct ev_ast_node *p_function = &(p_map->p_functions[i]);
+		struct ev_ast_node       *p_result   = (i + 1 < p_map->nb_functions) ? &(p_calls[i + 1].arg) : p_dest;
+		assert(p_function->p_node->cls == &AST_CLS_FUNCTION);
+		p_calls[i].frame.p_parent = p_function->p_stack;
+		p_calls[i].frame.p_args   = &(p_calls[i].arg);
+		p_calls[i].frame.nb_args  = 1;
+		if (evaluate_ast(p_result, p_function->p_node->d.fn.node, &(p_calls[i].frame), p_function->stack_size + 1, depth, p_alloc, p_error_handler))
+			return -1;
+	}
+
+	cls = p_dest->p_node->cls;
+	if  (   p_memo != NULL
+	    &&  (cls == &AST_CLS_LITERAL_FLOAT || cls == &AST_CLS_LITERAL_INT || cls == &AST_CLS_LITERAL_BOOL || cls == &AST_CLS_LITERAL_NULL)
+	    &&  ejson_atomic_cas(&(p_memo[element].state), MAP_MEMO_EMPTY, MAP_MEMO_WRITING)
+	    ) {
+		if (cls == &AST_CLS_LITERAL_FLOAT)
+			p_memo[element].d.f = p_dest->p_node->d.f;
+		else
+			p_memo[element].d.i = p_dest->p_node->d.i;
+		p_memo[element].cls = cls;
+		ejson_atomic_store(&(p_memo[element].state), MAP_MEMO_READY);
+	}
+	return 0;
+}
+
+/* Creates a map generator. If the list is itself a map, the two are fused
+ * (see struct map_generator). This is kept out of evaluate_ast() so that its
+ * locals do not make every level of evaluation use more stack. */
+static EJSON_NOINLINE int evaluate_map(struct ev_ast_node *p_dest, const struct ast_node *p_src, const struct ev_frame *p_stackx, unsigned stack_sizex, unsigned depth, struct cop_salloc_iface *p_alloc, const struct ejson_error_handler *p_error_handler) {
+	struct ast_node            *p_tmp;
+	struct map_generator       *p_map;
+	const struct map_generator *p_inner = NULL;
+	struct ev_ast_node          function;
+	struct ev_ast_node          list;
+	unsigned                    nb_functions = 1;
+	unsigned                    i;
+
+	if (evaluate_ast(&function, p_src->d.map.p_function, p_stackx, stack_sizex, depth, p_alloc, p_error_handler))
+		return -1;
+	if (function.p_node->cls != &AST_CLS_FUNCTION || function.p_node->d.fn.nb_args != 1)
+		return ast_location_error(p_error_handler, p_src, "map expects a function argument that takes one argument\n");
+
+	if (evaluate_ast(&list, p_src->d.map.p_input_list, p_stackx, stack_sizex, depth, p_alloc, p_error_handler))
+		return -1;
+	if (list.p_node->cls != &AST_CLS_LIST_GENERATOR)
+		return ast_location_error(p_error_handler, p_src, "map expected a list argument following the function\n");
+
+	if (list.p_node->d.lgen.get_element == ast_list_generator_map) {
+		p_inner      = list.p_node->d.lgen.d.p_map;
+		nb_functions = p_inner->nb_functions + 1;
+	}
+
+	if  (   (p_map = cop_salloc(p_alloc, sizeof(struct map_generator), 0)) == NULL
+	    ||  (p_map->p_functions = cop_salloc(p_alloc, sizeof(struct ev_ast_node) * nb_functions, 0)) == NULL
+	    ||  (p_tmp = cop_salloc(p_alloc, sizeof(struct ast_node), 0)) == NULL
 	    )
 		return ejson_error(p_error_handler, "out of memory\n");
 
-	/* Evaluate argument, shove on stack, execute function. */
-	if (p_list->p_node->d.lgen.get_element(p_argument, p_list, element, p_alloc, p_error_handler))
+	if (p_inner != NULL) {
+		ev_copy(&(p_map->list), &(p_inner->list));
+		for (i = 0; i < p_inner->nb_functions; i++)
+			ev_copy(&(p_map->p_functions[i]), &(p_inner->p_functions[i]));
+	} else {
+		ev_copy(&(p_map->list), &list);
+	}
+	ev_copy(&(p_map->p_functions[nb_functions - 1]), &function);
+	p_map->nb_functions = nb_functions;
+
+	p_map->p_memo  = NULL;
+	p_map->p_stats = p_src->d.map.p_memo_stats;
+	if (p_map->p_stats != NULL && list.p_node->nb_elements > 0 && list.p_node->nb_elements <= MAP_MEMO_MAX_ELEMENTS) {
+		size_t memo_size = sizeof(struct map_memo) * list.p_node->nb_elements;
+		if ((p_map->p_memo = cop_salloc(p_alloc, memo_size, 0)) == NULL)
+			return ejson_error(p_error_handler, "out of memory\n");
+		memset(p_map->p_memo, 0, memo_size);
+	}
+
+	p_tmp->cls                = &AST_CLS_LIST_GENERATOR;
+	ast_copy_location(p_tmp, p_src);
+	p_tmp->d.lgen.d.p_map     = p_map;
+	p_tmp->d.lgen.get_element = ast_list_generator_map;
+	p_tmp->nb_elements        = list.p_node->nb_elements;
+	p_dest->p_node            = p_tmp;
+	p_dest->p_stack           = NULL;
+	p_dest->stack_size        = 0;
+	return 0;
+}
+
+/* Evaluates a format expression given its evaluated argument list. This is
+ * kept out of evaluate_ast() so that the buffer it needs does not make every
+ * level of evaluation use more stack. */
+static EJSON_NOINLINE int evaluate_format(struct ev_ast_node *p_dest, const struct ast_node *p_src, const struct ev_ast_node *p_args, unsigned depth, struct cop_salloc_iface *p_alloc, const struct ejson_error_handler *p_error_handler) {
+	char strbuf[8192];
+	unsigned i;
+	unsigned argidx;
+	const struct ast_node *p_fmtstr;
+	struct ast_node *p_ret;
+	const char *cp;
+	char *ob;
+	char c;
+	struct ev_ast_node n;
+
+	if (p_args->p_node->cls != &AST_CLS_LIST_GENERATOR || p_args->p_node->nb_elements < 1)
+		return ejson_error(p_error_handler, "format expects a list argument with at least a format string\n");
+	if (p_args->p_node->d.lgen.get_element(&n, p_args, 0, depth, p_alloc, p_error_handler))
+		return -1;
+	p_fmtstr = n.p_node;
+	if (p_fmtstr->cls != &AST_CLS_LITERAL_STRING)
+		return ejson_error(p_error_handler, "first argument of format must be a string\n");
+	
+	cp = p_fmtstr->d.str.p_data;
+	i = 0;
+	argidx = 1;
+	while ((c = *cp++) != '\0') {
+		if (c == '%') {
+			char fmtspec[32];
+			unsigned specpos = 1;
+			fmtspec[0] = '%';
+
+			/* Leave room for "lld" and the terminator. */
+			c = *cp++;
+			while (c != '\0' && c != 's' && c != 'd' && c != '%') {
+				if (c > '0' && c <= '9') {
+					do {
+						if (specpos + 4 >= sizeof(fmtspec))
+							return ejson_error(p_error_handler, "format specifier is too long\n");
+						fmtspec[specpos++] = c;
+						c = *cp++;
+					} while (c >= '0' && c <= '9');
+					break;
+				}
+				if (specpos + 4 >= sizeof(fmtspec))
+					return ejson_error(p_error_handler, "format specifier is too long\n");
+				if (c == '+' || c == '-' || c == '0') {
+					fmtspec[specpos++] = c;
+				} else {
+					return ejson_error(p_error_handler, "unsupported format flag '%c'\n", c);
+				}
+				c = *cp++;
+			}
+
+			if (c == '%') {
+				if (i + 1 >= sizeof(strbuf))
+					return ejson_error(p_error_handler, "formatted string is longer than %u characters\n", (unsigned)sizeof(strbuf) - 1);
+				strbuf[i] = c;
+				i++;
+			} else if (c == 'd') {
+				int len;
+				const struct ast_node *p_argval;
+				if (argidx >= p_args->p_node->nb_elements)
+					return ejson_error(p_error_handler, "not enough arguments given to format\n");
+				if (p_args->p_node->d.lgen.get_element(&n, p_args, argidx++, depth, p_alloc, p_error_handler))
+					return -1;
+				p_argval = n.p_node;
+				if (p_argval->cls != &AST_CLS_LITERAL_INT)
+					return ejson_error(p_error_handler, "%%d expects an integer argument\n");
+				fmtspec[specpos++] = 'l';
+				fmtspec[specpos++] = 'l';
+				fmtspec[specpos++] = 'd';
+				fmtspec[specpos++] = '\0';
+				len = snprintf(&(strbuf[i]), sizeof(strbuf) - i, fmtspec, p_argval->d.i);
+				if (len < 0 || (size_t)len >= sizeof(strbuf) - i)
+					return ejson_error(p_error_handler, "formatted string is longer than %u characters\n", (unsigned)sizeof(strbuf) - 1);
+				i += len;
+			} else if (c == 's') {
+				const struct ast_node *p_argval;
+				if (argidx >= p_args->p_node->nb_elements)
+					return ejson_error(p_error_handler, "not enough arguments given to format\n");
+				if (p_args->p_node->d.lgen.get_element(&n, p_args, argidx++, depth, p_alloc, p_error_handler))
+					return -1;
+				p_argval = n.p_node;
+				if (p_argval->cls != &AST_CLS_LITERAL_STRING)
+					return ejson_error(p_error_handler, "%%s expects a string argument (%s)\n", p_argval->cls->p_name);
+				if (p_argval->d.str.len >= sizeof(strbuf) - i)
+					return ejson_error(p_error_handler, "formatted string is longer than %u characters\n", (unsigned)sizeof(strbuf) - 1);
+				memcpy(&(strbuf[i]), p_argval->d.str.p_data, p_argval->d.str.len);
+				i += p_argval->d.str.len;
+			} else {
+				return ejson_error(p_error_handler, "invalid escape sequence (%%%c)\n", c);
+			}
+		} else {
+			if (i + 1 >= sizeof(strbuf))
+				return ejson_error(p_error_handler, "formatted string is longer than %u characters\n", (unsigned)sizeof(strbuf) - 1);
+			strbuf[i] = c;
+			i++;
+		}
+	}
+	strbuf[i] = '\0';
+
+	if ((p_ret = cop_salloc(p_alloc, sizeof(struct ast_node) + i + 1, 0)) == NULL)
+		return -1;
+	ob = (char *)(p_ret + 1);
+	memcpy(ob, strbuf, i+1);
+
+	p_ret->cls          = &AST_CLS_LITERAL_STRING;
+	ast_copy_location(p_ret, p_src);
+	p_ret->d.str.p_data = ob;
+	p_ret->d.str.len    = i;
+
+	p_dest->p_node = p_ret;
+	return 0;
+}
+
+/* Applies the arithmetic, bitwise or comparison operator op to two integers
+ * and stores the result in p_ret. Returns 1 if op can not be applied to
+ * integers or -1 if it is a modulo by zero. */
+static int binop_int(struct ast_node *p_ret, enum ast_op op, long long lhs, long long rhs) {
+	switch (op) {
+	case AST_OP_ADD:
+		p_ret->cls = &AST_CLS_LITERAL_INT;
+		p_ret->d.i = lhs + rhs;
+		return 0;
+	case AST_OP_SUB:
+		p_ret->cls = &AST_CLS_LITERAL_INT;
+		p_ret->d.i = lhs - rhs;
+		return 0;
+	case AST_OP_MUL:
+		p_ret->cls = &AST_CLS_LITERAL_INT;
+		p_ret->d.i = lhs * rhs;
+		return 0;
+	case AST_OP_MOD:
+		if (rhs == 0)
+			return -1;
+		p_ret->cls = &AST_CLS_LITERAL_INT;
+		lhs = (rhs == -1) ? 0 : lhs % rhs;
+		p_ret->d.i = lhs + ((lhs < 0) ? rhs : 0);
+		return 0;
+	case AST_OP_BITAND:
+		p_ret->cls = &AST_CLS_LITERAL_INT;
+		p_ret->d.i = lhs & rhs;
+		return 0;
+	case AST_OP_BITOR:
+		p_ret->cls = &AST_CLS_LITERAL_INT;
+		p_ret->d.i = lhs | rhs;
+		return 0;
+	case AST_OP_EQ:
+		p_ret->cls = &AST_CLS_LITERAL_BOOL;
+		p_ret->d.i = lhs == rhs;
+		return 0;
+	case AST_OP_NEQ:
+		p_ret->cls = &AST_CLS_LITERAL_BOOL;
+		p_ret->d.i = lhs != rhs;
+		return 0;
+	case AST_OP_LT:
+		p_ret->cls = &AST_CLS_LITERAL_BOOL;
+		p_ret->d.i = lhs < rhs;
+		return 0;
+	case AST_OP_LEQ:
+		p_ret->cls = &AST_CLS_LITERAL_BOOL;
+		p_ret->d.i = lhs <= rhs;
+		return 0;
+	case AST_OP_GEQ:
+		p_ret->cls = &AST_CLS_LITERAL_BOOL;
+		p_ret->d.i = lhs >= rhs;
+		return 0;
+	case AST_OP_GT:
+		p_ret->cls = &AST_CLS_LITERAL_BOOL;
+		p_ret->d.i = lhs > rhs;
+		return 0;
+	default:
+		return 1;
+	}
+}
+
+/* Applies the arithmetic or comparison operator op to two reals and stores
+ * the result in p_ret. Returns 1 if op can not be applied to reals. */
+static int binop_real(struct ast_node *p_ret, enum ast_op op, double lhs, double rhs) {
+	switch (op) {
+	case AST_OP_EXP:
+		p_ret->cls = &AST_CLS_LITERAL_FLOAT;
+		p_ret->d.f = pow(lhs, rhs);
+		return 0;
+	case AST_OP_ADD:
+		p_ret->cls = &AST_CLS_LITERAL_FLOAT;
+		p_ret->d.f = lhs + rhs;
+		return 0;
+	case AST_OP_SUB:
+		p_ret->cls = &AST_CLS_LITERAL_FLOAT;
+		p_ret->d.f = lhs - rhs;
+		return 0;
+	case AST_OP_MUL:
+		p_ret->cls = &AST_CLS_LITERAL_FLOAT;
+		p_ret->d.f = lhs * rhs;
+		return 0;
+	case AST_OP_MOD:
+		p_ret->cls = &AST_CLS_LITERAL_FLOAT;
+		p_ret->d.f = fmod(lhs, rhs);
+		return 0;
+	case AST_OP_EQ:
+		p_ret->cls = &AST_CLS_LITERAL_BOOL;
+		p_ret->d.i = lhs == rhs;
+		return 0;
+	case AST_OP_NEQ:
+		p_ret->cls = &AST_CLS_LITERAL_BOOL;
+		p_ret->d.i = lhs != rhs;
+		return 0;
+	case AST_OP_LT:
+		p_ret->cls = &AST_CLS_LITERAL_BOOL;
+		p_ret->d.i = lhs < rhs;
+		return 0;
+	case AST_OP_LEQ:
+		p_ret->cls = &AST_CLS_LITERAL_BOOL;
+		p_ret->d.i = lhs <= rhs;
+		return 0;
+	case AST_OP_GEQ:
+		p_ret->cls = &AST_CLS_LITERAL_BOOL;
+		p_ret->d.i = lhs >= rhs;
+		return 0;
+	case AST_OP_GT:
+		p_ret->cls = &AST_CLS_LITERAL_BOOL;
+		p_ret->d.i = lhs > rhs;
+		return 0;
+	default:
+		return 1;
+	}
+}
+
+/* Evaluates the binary operator p_src given the value of its left hand side.
+ * p_dest may be the same as p_lhs_value. */
+static EJSON_NOINLINE int evaluate_binop(struct ev_ast_node *p_dest, const struct ast_node *p_src, const struct ev_ast_node *p_lhs_value, const struct ev_frame *p_stackx, unsigned stack_sizex, unsigned depth, struct cop_salloc_iface *p_alloc, const struct ejson_error_handler *p_error_handler) {
+	const enum ast_op op = p_src->cls->op;
+	const struct ast_node *p_lhs;
+	const struct ast_node *p_rhs;
+	struct ast_node result;
+	size_t save;
+	struct ev_ast_node rhs;
+	int err;
+
+	save = cop_salloc_save(p_alloc);
+
+	if (evaluate_ast(&rhs, p_src->d.binop.p_rhs, p_stackx, stack_sizex, depth, p_alloc, p_error_handler))
+		return -1;
+
+	p_lhs = p_lhs_value->p_node;
+	p_rhs = rhs.p_node;
+
+	/* Operators applied to two integers or two reals are by far the most
+	 * common so they are tried first. Anything else (including invalid
+	 * operands) is dealt with by the checks which follow. */
+	if (p_lhs->cls == &AST_CLS_LITERAL_INT && p_rhs->cls == &AST_CLS_LITERAL_INT && op != AST_OP_EXP) {
+		if ((err = binop_int(&result, op, p_lhs->d.i, p_rhs->d.i)) < 0)
+			return ast_location_error(p_error_handler, p_src, "modulo by zero\n");
+		if (err == 0)
+			goto scalar;
+	} else if (p_lhs->cls == &AST_CLS_LITERAL_FLOAT && p_rhs->cls == &AST_CLS_LITERAL_FLOAT) {
+		if (binop_real(&result, op, p_lhs->d.f, p_rhs->d.f) == 0)
+			goto scalar;
+	}
+
+	if (p_src->cls == &AST_CLS_LOGAND || p_src->cls == &AST_CLS_LOGOR) {
+		if (p_lhs->cls != &AST_CLS_LITERAL_BOOL)
+			return ast_location_error(p_error_handler, p_src, "lhs of logical operator was not boolean\n");
+		if (p_rhs->cls != &AST_CLS_LITERAL_BOOL)
+			return ast_location_error(p_error_handler, p_src, "rhs of logical operator was not boolean\n");
+		result.cls = &AST_CLS_LITERAL_BOOL;
+		result.d.i = (p_src->cls == &AST_CLS_LOGAND) ? (p_lhs->d.i && p_rhs->d.i) : (p_lhs->d.i || p_rhs->d.i);
+		goto scalar;
+	}
+
+	if (p_src->cls == &AST_CLS_BITAND || p_src->cls == &AST_CLS_BITOR) {
+		if (p_lhs->cls != &AST_CLS_LITERAL_INT)
+			return ast_location_error(p_error_handler, p_src, "lhs of bitwise operator was not integer\n");
+		if (p_rhs->cls != &AST_CLS_LITERAL_INT)
+			return ast_location_error(p_error_handler, p_src, "rhs of bitwise operator was not integer\n");
+		result.cls = &AST_CLS_LITERAL_INT;
+		result.d.i = (p_src->cls == &AST_CLS_BITAND) ? (p_lhs->d.i & p_rhs->d.i) : (p_lhs->d.i | p_rhs->d.i);
+		goto scalar;
+	}
+
+	if ((p_src->cls == &AST_CLS_EQ || p_src->cls == &AST_CLS_NEQ) && (p_lhs->cls == &AST_CLS_LITERAL_BOOL || p_rhs->cls == &AST_CLS_LITERAL_BOOL)) {
+		if (p_lhs->cls != &AST_CLS_LITERAL_BOOL)
+			return ast_location_error(p_error_handler, p_src, "lhs must be boolean if rhs is\n");
+		if (p_rhs->cls != &AST_CLS_LITERAL_BOOL)
+			return ast_location_error(p_error_handler, p_src, "rhs must be boolean if lhs is\n");
+		result.cls = &AST_CLS_LITERAL_BOOL;
+		result.d.i = (p_src->cls == &AST_CLS_EQ) ? (!p_lhs->d.i == !p_rhs->d.i) : (p_lhs->d.i != p_rhs->d.i);
+		goto scalar;
+	}
+
+	if (p_src->cls == &AST_CLS_ADD && (p_lhs->cls == &AST_CLS_LIST_GENERATOR || p_rhs->cls == &AST_CLS_LIST_GENERATOR)) {
+		if (p_lhs->cls != p_rhs->cls)
+			return ast_location_error(p_error_handler, p_src, "expected lhs and rhs to both be lists\n");
+		if (make_list_cat(p_dest, p_src, p_lhs_value, &rhs, p_alloc))
+			return ejson_error(p_error_handler, "out of memory\n");
+		return 0;
+	}
+
+	/* Promote types */
+	if (p_lhs->cls == &AST_CLS_LITERAL_FLOAT || p_rhs->cls == &AST_CLS_LITERAL_FLOAT || p_src->cls == &AST_CLS_EXP) {
+		double lhs, rhs;
+
+		if (p_lhs->cls == &AST_CLS_LITERAL_FLOAT)
+			lhs = p_lhs->d.f;
+		else if (p_lhs->cls == &AST_CLS_LITERAL_INT)
+			lhs = (double)(p_lhs->d.i);
+		else
+			return -1;
+
+		if (p_rhs->cls == &AST_CLS_LITERAL_FLOAT)
+			rhs = p_rhs->d.f;
+		else if (p_rhs->cls == &AST_CLS_LITERAL_INT)
+			rhs = (double)(p_rhs->d.i);
+		else
+			return -1;
+
+		if (binop_real(&result, op, lhs, rhs))
+			abort();
+
+		goto scalar;
+	}
+	
+	if (p_lhs->cls == &AST_CLS_LITERAL_INT && p_rhs->cls == &AST_CLS_LITERAL_INT) {
+		if ((err = binop_int(&result, op, p_lhs->d.i, p_rhs->d.i)) < 0)
+			return ast_location_error(p_error_handler, p_src, "modulo by zero\n");
+		if (err)
+			abort();
+
+		goto scalar;
+	}
+
+	return ast_location_error(p_error_handler, p_src, "the types given for binary operator %s were invalid (%s, %s)\n", p_src->cls->p_name, p_lhs->cls->p_name, p_rhs->cls->p_name);
+
+	/* The result is only written once the operands are no longer needed as
+	 * the left hand side may be stored in p_dest. */
+scalar:
+	cop_salloc_restore(p_alloc, save);
+	ast_copy_location(&result, p_src);
+	*ev_scalar(p_dest) = result;
+	return 0;
+}
+
+/* The number of operators in a chain which evaluate_binop_chain() can
+ * evaluate without allocating. */
+#define BINOP_CHAIN_LOCAL (16)
+
+/* Evaluates the chain of binary operators which nest down the left hand
+ * sides from p_src (e.g. 1 + 2 + ... + n) from the inside out. The operators
+ * are collected into a small array on the stack or, for a chain too long to
+ * fit, into one from malloc() which is freed again so that nothing outlives
+ * the evaluation. This is kept out of evaluate_ast() for the same reason as
+ * evaluate_range(). */
+static EJSON_NOINLINE int evaluate_binop_chain(struct ev_ast_node *p_dest, const struct ast_node *p_src, const struct ev_frame *p_stackx, unsigned stack_sizex, unsigned depth, struct cop_salloc_iface *p_alloc, const struct ejson_error_handler *p_error_handler) {
+	const struct ast_node  *local[BINOP_CHAIN_LOCAL];
+	const struct ast_node **pp_chain = local;
+	const struct ast_node  *p_node;
+	struct ev_ast_node      value;
+	size_t                  nb_ops = 0;
+	int                     ret    = -1;
+
+	for (p_node = p_src; is_binop(p_node->cls); p_node = p_node->d.binop.p_lhs)
+		nb_ops++;
+	if (nb_ops > BINOP_CHAIN_LOCAL && (pp_chain = malloc(sizeof(const struct ast_node *) * nb_ops)) == NULL)
+		return ejson_error(p_error_handler, "out of memory\n");
+	nb_ops = 0;
+	for (p_node = p_src; is_binop(p_node->cls); p_node = p_node->d.binop.p_lhs)
+		pp_chain[nb_ops++] = p_node;
+
+	if (evaluate_ast(&value, p_node, p_stackx, stack_sizex, depth, p_alloc, p_error_handler))
+		goto done;
+	while (nb_ops--)
+		if (evaluate_binop(&value, pp_chain[nb_ops], &value, p_stackx, stack_sizex, depth, p_alloc, p_error_handler))
+			goto done;
+	ev_copy(p_dest, &value);
+	ret = 0;
+
+done:
+	if (pp_chain != local)
+		free(pp_chain);
+	return ret;
+}
+
+/* Evaluates a range expression into a list generator. This is kept out of
+ * evaluate_ast() as the values it needs would otherwise add to the stack used
+ * by every level of evaluation. */
+static EJSON_NOINLINE int evaluate_range(struct ev_ast_node *p_dest, const struct ast_node *p_src, const struct ev_frame *p_stackx, unsigned stack_sizex, unsigned depth, struct cop_salloc_iface *p_alloc, const struct ejson_error_handler *p_error_handler) {
+	struct ast_node       *p_result;
+	size_t                 save;
+	struct lrange          lrange;
+	struct ev_ast_node     p;
+	struct ev_ast_node     args;
+
+	if ((p_result = cop_salloc(p_alloc, sizeof(struct ast_node), 0)) == NULL)
+		return ejson_error(p_error_handler, "out of memory\n");
+	save = cop_salloc_save(p_alloc);
+	if (evaluate_ast(&args, p_src->d.builtin.p_args, p_stackx, stack_sizex, depth, p_alloc, p_error_handler))
 		return -1;
+	if (args.p_node->cls != &AST_CLS_LIST_GENERATOR)
+		return ast_location_error(p_error_handler, p_src, "range expects a list argument\n");
+	if (args.p_node->nb_elements < 1 || args.p_node->nb_elements > 3)
+		return ast_location_error(p_error_handler, p_src, "range expects between 1 and 3 arguments\n");
 
-	if (p_function->stack_size)
-		memcpy(pp_tmp, p_function->pp_stack, p_function->stack_size * sizeof(struct ev_ast_node *));
-	pp_tmp[p_function->stack_size] = p_argument;
+	if (args.p_node->nb_elements == 1) {
+		const struct ast_node *p_first;
 
-	return evaluate_ast(p_dest, p_function->p_node->d.fn.node, pp_tmp, p_function->stack_size + 1, p_alloc, p_error_handler);
+		if (args.p_node->d.lgen.get_element(&p, &args, 0, depth, p_alloc, p_error_handler))
+			return -1;
+		p_first = p.p_node;
+		if (p_first->cls != &AST_CLS_LITERAL_INT)
+			return ejson_error(p_error_handler, "single argument range expects an integer number of items\n");
+
+		lrange.first     = 0;
+		lrange.step_size = 1;
+		lrange.numel     = p_first->d.i;
+	} else if (args.p_node->nb_elements == 2) {
+		const struct ast_node *p_first, *p_last;
+		struct ev_ast_node     p1, p2;
+
+		if  (    args.p_node->d.lgen.get_element(&p1, &args, 0, depth, p_alloc, p_error_handler)
+		    ||   args.p_node->d.lgen.get_element(&p2, &args, 1, depth, p_alloc, p_error_handler)
+		    )
+			return -1;
+		p_first = p1.p_node;
+		p_last  = p2.p_node;
+		if (p_first->cls != &AST_CLS_LITERAL_INT || p_last->cls != &AST_CLS_LITERAL_INT)
+			return ejson_error(p_error_handler, "dual argument range expects an integer first and last index\n");
+
+		lrange.first     = p_first->d.i;
+		lrange.step_size = (p_first->d.i > p_last->d.i) ? -1 : 1;
+		lrange.numel     = ((p_first->d.i > p_last->d.i) ? (p_first->d.i - p_last->d.i) : (p_last->d.i - p_first->d.i)) + 1;
+	} else {
+		const struct ast_node *p_first, *p_step, *p_last;
+		struct ev_ast_node     p1, p2, p3;
+
+		if  (   args.p_node->d.lgen.get_element(&p1, &args, 0, depth, p_alloc, p_error_handler)
+		    ||  args.p_node->d.lgen.get_element(&p2, &args, 1, depth, p_alloc, p_error_handler)
+		    ||  args.p_node->d.lgen.get_element(&p3, &args, 2, depth, p_alloc, p_error_handler)
+		    )
+			return -1;
+		p_first = p1.p_node;
+		p_step = p2.p_node;
+		p_last = p3.p_node;			
+		if  (   p_first->cls != &AST_CLS_LITERAL_INT || p_step->cls != &AST_CLS_LITERAL_INT ||  p_last->cls != &AST_CLS_LITERAL_INT
+		    ||  p_step->d.i == 0
+		    ||  (p_step->d.i > 0 && (p_first->d.i > p_last->d.i))
+		    ||  (p_step->d.i < 0 && (p_first->d.i < p_last->d.i))
+		    )
+			return ejson_error(p_error_handler, "triple argument range expects an integer first, step and last values. step must be non-zero and have the correct sign for the range.\n");
+
+		lrange.first     = p_first->d.i;
+		lrange.step_size = p_step->d.i;
+		lrange.numel     = (p_last->d.i - p_first->d.i) / p_step->d.i + 1;
+	}
+
+	cop_salloc_restore(p_alloc, save);
+	
+	p_result->cls                  = &AST_CLS_LIST_GENERATOR;
+	ast_copy_location(p_result, p_src);
+	p_result->d.lgen.get_element   = ast_list_generator_get_element;
+	p_result->nb_elements          = lrange.numel;
+	p_result->d.lgen.d.range.first = lrange.first;
+	p_result->d.lgen.d.range.step  = lrange.step_size;
+	p_dest->p_node                 = p_result;
+	p_dest->p_stack                = NULL;
+	p_dest->stack_size             = 0;
+	return 0;
 }
 
-static int evaluate_ast(struct ev_ast_node *p_dest, const struct ast_node *p_src, const struct ev_ast_node **pp_stackx, unsigned stack_sizex, struct cop_salloc_iface *p_alloc, const struct ejson_error_handler *p_error_handler) {
+static int evaluate_ast(struct ev_ast_node *p_dest, const struct ast_node *p_src, const struct ev_frame *p_stackx, unsigned stack_sizex, unsigned depth, struct cop_salloc_iface *p_alloc, const struct ejson_error_handler *p_error_handler) {
 	/* Move through stack references. */
 	assert(p_src != NULL);
 	assert(p_src->cls != NULL);
 	assert(p_src->cls->p_name != NULL);
 
-	if (p_src->cls == &AST_CLS_STACKREF) {
-		assert(pp_stackx != NULL);
+	if (depth == 0)
+		return ast_location_error(p_error_handler, p_src, "evaluation exceeded the maximum depth (is there unbounded recursion?)\n");
+
+	switch (p_src->cls->op) {
+	case AST_OP_STACKREF:
+		assert(p_stackx != NULL);
 		assert(p_src->d.i > 0 && p_src->d.i <= stack_sizex);
-		*p_dest = pp_stackx[stack_sizex - p_src->d.i][0];
+		ev_copy(p_dest, ev_stack_get(p_stackx, (unsigned)p_src->d.i));
 		return 0;
-	}	
 
 	/* Shortcuts for fully simplified objects. */
-	if  (   p_src->cls == &AST_CLS_LITERAL_INT
-	    ||  p_src->cls == &AST_CLS_LITERAL_BOOL
-	    ||  p_src->cls == &AST_CLS_LITERAL_STRING
-	    ||  p_src->cls == &AST_CLS_LITERAL_FLOAT
-	    ||  p_src->cls == &AST_CLS_LITERAL_NULL
-	    ||  p_src->cls == &AST_CLS_LIST_GENERATOR
-	    ||  p_src->cls == &AST_CLS_READY_DICT
-	    ) {
+	case AST_OP_LITERAL_INT:
+	case AST_OP_LITERAL_BOOL:
+	case AST_OP_LITERAL_STRING:
+	case AST_OP_LITERAL_FLOAT:
+	case AST_OP_LITERAL_NULL:
+	case AST_OP_LIST_GENERATOR:
+	case AST_OP_READY_DICT:
+	case AST_OP_TAPE_DICT:
 		p_dest->stack_size = stack_sizex;
-		p_dest->pp_stack   = pp_stackx;
+		p_dest->p_stack    = p_stackx;
 		p_dest->p_node     = p_src;
 		return 0;
-	}
 
-	if (p_src->cls == &AST_CLS_FUNCTION) {
+	case AST_OP_FUNCTION: {
 		struct ast_node *p_ret;
 		//FIXME??? WHY CAN THIS NOT BE ASSERTED?  assert(p_src->d.fn.pp_stack == NULL);
 		if (stack_sizex == 0) {
 			p_dest->stack_size = stack_sizex;
-			p_dest->pp_stack   = pp_stackx;
+			p_dest->p_stack    = p_stackx;
 			p_dest->p_node     = p_src;
 			return 0;
 		}
 		if ((p_ret = cop_salloc(p_alloc, sizeof(struct ast_node), 0)) == NULL)
 			return ejson_error(p_error_handler, "out of memory\n");
 		p_ret->cls          = p_src->cls;
-		p_ret->doc_pos      = p_src->doc_pos;
+		ast_copy_location(p_ret, p_src);
 		p_ret->d.fn.nb_args = p_src->d.fn.nb_args;
 		p_ret->d.fn.node    = p_src->d.fn.node;
 		p_dest->stack_size  = stack_sizex;
-		p_dest->pp_stack    = pp_stackx;
+		p_dest->p_stack     = p_stackx;
 		p_dest->p_node      = p_ret;
 		return 0;
 	}
 
-	if  (p_src->cls == &AST_CLS_IF) {
+	case AST_OP_DEFINE: {
+		struct define_value *p_def = p_src->d.define.p_value;
+		if (p_def->state != DEFINE_READY)
+			return evaluate_ast(p_dest, p_src->d.define.p_expr, NULL, 0, depth - 1, p_alloc, p_error_handler);
+		if (p_def->p_stats != NULL)
+			ejson_atomic_inc(&(p_def->p_stats->define_hits));
+		ev_copy(p_dest, &(p_def->value));
+		return 0;
+	}
+
+	case AST_OP_IF: {
 		struct ev_ast_node test;
-		if (evaluate_ast(&test, p_src->d.ifexpr.p_test, pp_stackx, stack_sizex, p_alloc, p_error_handler))
+		if (evaluate_ast(&test, p_src->d.ifexpr.p_test, p_stackx, stack_sizex, depth - 1, p_alloc, p_error_handler))
 			return -1;
 		if (test.p_node->cls != &AST_CLS_LITERAL_BOOL)
-			return ejson_location_error(p_error_handler, &(p_src->d.ifexpr.p_test->doc_pos), "first argument to if must be a boolean\n");
+			return ast_location_error(p_error_handler, p_src->d.ifexpr.p_test, "first argument to if must be a boolean\n");
 		if (test.p_node->d.i)
-			return evaluate_ast(p_dest, p_src->d.ifexpr.p_true, pp_stackx, stack_sizex, p_alloc, p_error_handler);
-		return evaluate_ast(p_dest, p_src->d.ifexpr.p_false, pp_stackx, stack_sizex, p_alloc, p_error_handler);
+			return evaluate_ast(p_dest, p_src->d.ifexpr.p_true, p_stackx, stack_sizex, depth - 1, p_alloc, p_error_handler);
+		return evaluate_ast(p_dest, p_src->d.ifexpr.p_false, p_stackx, stack_sizex, depth - 1, p_alloc, p_error_handler);
 	}
 
 	/* Convert lists into list generators - fixme: this should happen while building the ast. */
-	if  (p_src->cls == &AST_CLS_LITERAL_LIST) {
+	case AST_OP_LITERAL_LIST: {
 		struct ast_node *p_ret;
 		if ((p_ret = cop_salloc(p_alloc, sizeof(struct ast_node), 0)) == NULL)
 			return ejson_error(p_error_handler, "out of memory\n");
 		p_ret->cls                        = &AST_CLS_LIST_GENERATOR;
-		p_ret->doc_pos                    = p_src->doc_pos;
-		p_ret->d.lgen.nb_elements         = p_src->d.llist.nb_elements;
+		ast_copy_location(p_ret, p_src);
+		p_ret->nb_elements                = p_src->d.llist.nb_elements;
 		p_ret->d.lgen.d.literal.pp_values = p_src->d.llist.elements;
 		p_ret->d.lgen.get_element         = get_literal_element_fn;
 		p_dest->stack_size                = stack_sizex;
-		p_dest->pp_stack                  = pp_stackx;
+		p_dest->p_stack                   = p_stackx;
 		p_dest->p_node                    = p_ret;
 		return 0;
 	}
 
-	if (p_src->cls == &AST_CLS_FORMAT) {
-		char strbuf[8192];
-		unsigned i;
-		unsigned argidx;
-		const struct ast_node *p_fmtstr;
-		struct ast_node *p_ret;
-		const char *cp;
-		char *ob;
-		char c;
-		struct ev_ast_node n;
+	case AST_OP_FORMAT: {
 		struct ev_ast_node args;
-
-		if (evaluate_ast(&args, p_src->d.builtin.p_args, pp_stackx, stack_sizex, p_alloc, p_error_handler))
-			return -1;
-		if (args.p_node->cls != &AST_CLS_LIST_GENERATOR || args.p_node->d.lgen.nb_elements < 1)
-			return ejson_error(p_error_handler, "format expects a list argument with at least a format string\n");
-		if (args.p_node->d.lgen.get_element(&n, &args, 0, p_alloc, p_error_handler))
-			return -1;
-		p_fmtstr = n.p_node;
-		if (p_fmtstr->cls != &AST_CLS_LITERAL_STRING)
-			return ejson_error(p_error_handler, "first argument of format must be a string\n");
-		
-		cp = p_fmtstr->d.str.p_data;
-		i = 0;
-		argidx = 1;
-		while ((c = *cp++) != '\0') {
-			if (c == '%') {
-				char fmtspec[32];
-				unsigned specpos = 1;
-				fmtspec[0] = '%';
-
-				c = *cp++;
-				while (c != '\0' && c != 's' && c != 'd' && c != '%') {
-					if (c > '0' && c <= '9') {
-						do {
-							fmtspec[specpos++] = c;
-							c = *cp++;
-						} while (c >= '0' && c <= '9');
-						break;
-					}
-					if (c == '+' || c == '-' || c == '0') {
-						fmtspec[specpos++] = c;
-					} else {
-						return ejson_error(p_error_handler, "unsupported format flag '%c'\n", c);
-					}
-					c = *cp++;
-				}
-
-				if (c == '%') {
-					strbuf[i] = c;
-					i++;
-				} else if (c == 'd') {
-					const struct ast_node *p_argval;
-					if (argidx >= args.p_node->d.lgen.nb_elements)
-						return ejson_error(p_error_handler, "not enough arguments given to format\n");
-					if (args.p_node->d.lgen.get_element(&n, &args, argidx++, p_alloc, p_error_handler))
-						return -1;
-					p_argval = n.p_node;
-					if (p_argval->cls != &AST_CLS_LITERAL_INT)
-						return ejson_error(p_error_handler, "%%d expects an integer argument\n");
-					fmtspec[specpos++] = 'l';
-					fmtspec[specpos++] = 'l';
-					fmtspec[specpos++] = 'd';
-					fmtspec[specpos++] = '\0';
-					i += sprintf(&(strbuf[i]), fmtspec, p_argval->d.i);
-				} else if (c == 's') {
-					const struct ast_node *p_argval;
-					if (argidx >= args.p_node->d.lgen.nb_elements)
-						return ejson_error(p_error_handler, "not enough arguments given to format\n");
-					if (args.p_node->d.lgen.get_element(&n, &args, argidx++, p_alloc, p_error_handler))
-						return -1;
-					p_argval = n.p_node;
-					if (p_argval->cls != &AST_CLS_LITERAL_STRING)
-						return ejson_error(p_error_handler, "%%s expects a string argument (%s)\n", p_argval->cls->p_name);
-					memcpy(&(strbuf[i]), p_argval->d.str.p_data, p_argval->d.str.len);
-					i += p_argval->d.str.len;
-				} else {
-					return ejson_error(p_error_handler, "invalid escape sequence (%%%c)\n", c);
-				}
-			} else {
-				strbuf[i] = c;
-				i++;
-			}
-		}
-		strbuf[i] = '\0';
-
-		if ((p_ret = cop_salloc(p_alloc, sizeof(struct ast_node) + i + 1, 0)) == NULL)
+		if (evaluate_ast(&args, p_src->d.builtin.p_args, p_stackx, stack_sizex, depth - 1, p_alloc, p_error_handler))
 			return -1;
-		ob = (char *)(p_ret + 1);
-		memcpy(ob, strbuf, i+1);
-
-		p_ret->cls          = &AST_CLS_LITERAL_STRING;
-		p_ret->doc_pos      = p_src->doc_pos;
-		p_ret->d.str.p_data = ob;
-		p_ret->d.str.len    = i;
-
-		p_dest->p_node = p_ret;
-		return 0;
+		return evaluate_format(p_dest, p_src, &args, depth - 1, p_alloc, p_error_handler);
 	}
 
-	if  (p_src->cls == &AST_CLS_LITERAL_DICT) {
+	case AST_OP_LITERAL_DICT: {
 		struct ast_node *p_ret;
 		unsigned i;
 		struct cop_strdict_node *p_root = cop_strdict_init();
@@ -1227,11 +3130,11 @@ static int evaluate_ast(struct ev_ast_node *p_dest, const struct ast_node *p_src
 			struct dictnode *p_dn;
 			struct ev_ast_node p;
 
-			if (evaluate_ast(&p, p_src->d.ldict.elements[2*i+0], pp_stackx, stack_sizex, p_alloc, p_error_handler))
+			if (evaluate_ast(&p, p_src->d.ldict.elements[2*i+0], p_stackx, stack_sizex, depth - 1, p_alloc, p_error_handler))
 				return -1;
 			p_key = p.p_node;
 			if (p_key->cls != &AST_CLS_LITERAL_STRING)
-				return ejson_location_error(p_error_handler, &(p_src->doc_pos), "a key expression in the dictionary did not evaluate to a string\n");
+				return ast_location_error(p_error_handler, p_src, "a key expression in the dictionary did not evaluate to a string\n");
 
 			/* fixme: there is no need to keep another copy of the string. ideally, we would have a separate stack as we don't need to keep hold of the above node and all memory that was needed to figure it out */
 			cop_strh_init_shallow(&key, p_key->d.str.p_data);
@@ -1243,448 +3146,184 @@ static int evaluate_ast(struct ev_ast_node *p_dest, const struct ast_node *p_src
 			p_dn->data = p_src->d.ldict.elements[2*i+1];
 
 			if (cop_strdict_insert(&p_root, &(p_dn->node)))
-				return ejson_location_error(p_error_handler, &(p_src->d.ldict.elements[2*i+0]->doc_pos), "attempted to add a key to a dictionary that already existed (%s)\n", p_key->d.str.p_data);
-		}
-
-		if ((p_ret = cop_salloc(p_alloc, sizeof(struct ast_node), 0)) == NULL)
-			return ejson_error(p_error_handler, "out of memory\n");
-		p_ret->cls                = &AST_CLS_READY_DICT;
-		p_ret->doc_pos            = p_src->doc_pos;
-		p_ret->d.rdict.nb_keys    = p_src->d.ldict.nb_keys;
-		p_ret->d.rdict.p_root     = p_root;
-		p_dest->stack_size        = stack_sizex;
-		p_dest->pp_stack          = pp_stackx;
-		p_dest->p_node            = p_ret;
-		return 0;
-	}
-
-	if (p_src->cls == &AST_CLS_ACCESS) {
-		struct ev_ast_node obj;
-		struct ev_ast_node p;
-
-		if (evaluate_ast(&obj, p_src->d.access.p_data, pp_stackx, stack_sizex, p_alloc, p_error_handler))
-			return -1;
-
-		if (obj.p_node->cls == &AST_CLS_LIST_GENERATOR) {
-			const struct ast_node *p_idx;
-			long long idx;
-			size_t save = cop_salloc_save(p_alloc);
-
-			if (evaluate_ast(&p, p_src->d.access.p_key, pp_stackx, stack_sizex, p_alloc, p_error_handler))
-				return -1;
-			p_idx = p.p_node;
-
-			if (p_idx->cls != &AST_CLS_LITERAL_INT)
-				return ejson_location_error(p_error_handler, &(p_src->d.access.p_key->doc_pos), "the key expression for a list access did not evaluate to an integer\n");
-			idx = p_idx->d.i;
-			cop_salloc_restore(p_alloc, save);
-
-			return obj.p_node->d.lgen.get_element(p_dest, &obj, idx, p_alloc, p_error_handler);
-		}
-		
-		if (obj.p_node->cls == &AST_CLS_READY_DICT) {
-			const struct ast_node *p_key;
-			struct dictnode *p_node;
-
-			if (evaluate_ast(&p, p_src->d.access.p_key, pp_stackx, stack_sizex, p_alloc, p_error_handler))
-				return -1;
-			p_key = p.p_node;
-			if (p_key->cls != &AST_CLS_LITERAL_STRING)
-				return ejson_location_error(p_error_handler, &(p_src->d.access.p_key->doc_pos), "the key expression for dict access did not evaluate to a string\n");
-			if (cop_strdict_get_by_cstr(obj.p_node->d.rdict.p_root, p_key->d.str.p_data, (void **)&p_node))
-				return ejson_location_error(p_error_handler, &(p_src->d.access.p_key->doc_pos), "key '%s' not in dict\n", p_key->d.str.p_data);
-			return evaluate_ast(p_dest, p_node->data, pp_stackx, stack_sizex, p_alloc, p_error_handler);
-		}
-
-		return ejson_location_error(p_error_handler, &(p_src->d.access.p_data->doc_pos), "the list expression for access did not evaluate to a list or a dictionary\n");
-	}
-
-	/* Function call */
-	if (p_src->cls == &AST_CLS_CALL) {
-		const struct ev_ast_node **pp_stack2;
-		struct ev_ast_node args;
-		struct ev_ast_node function;
-
-		if (evaluate_ast(&function, p_src->d.call.fn, pp_stackx, stack_sizex, p_alloc, p_error_handler))
-			return -1;
-		if (function.p_node->cls != &AST_CLS_FUNCTION)
-			return ejson_error(p_error_handler, "the function expression for call did not evaluate to a function\n");
-
-		if (evaluate_ast(&args, p_src->d.call.p_args, pp_stackx, stack_sizex, p_alloc, p_error_handler))
-			return -1;
-		if (args.p_node->cls != &AST_CLS_LIST_GENERATOR)
-			return ejson_error(p_error_handler, "the argument expression for call did not evaluate to a list\n");
-
-		if (args.p_node->d.lgen.nb_elements != function.p_node->d.fn.nb_args)
-			return ejson_location_error(p_error_handler, &(p_src->doc_pos), "the number of arguments supplied to function was incorrect (expected %u but got %u)\n", function.p_node->d.fn.nb_args, args.p_node->d.lgen.nb_elements);
-
-		pp_stack2 = function.pp_stack;
-		if (args.p_node->d.lgen.nb_elements) {
-			struct ev_ast_node *p_nargs;
-			unsigned i;
-			if  (   (pp_stack2 = cop_salloc(p_alloc, sizeof(struct ev_ast_node *) * (function.stack_size + args.p_node->d.lgen.nb_elements), 0)) == NULL
-			    ||  (p_nargs = cop_salloc(p_alloc, sizeof(struct ev_ast_node) * args.p_node->d.lgen.nb_elements, 0)) == NULL
-			    )
-				return ejson_error(p_error_handler, "out of memory\n");
-			if (function.stack_size)
-				memcpy(pp_stack2, function.pp_stack, function.stack_size * sizeof(struct ev_ast_node *));
-			for (i = 0; i < args.p_node->d.lgen.nb_elements; i++) {
-				if (args.p_node->d.lgen.get_element(&(p_nargs[i]), &args, i, p_alloc, p_error_handler))
-					return -1;
-				pp_stack2[function.stack_size + i] = &(p_nargs[i]);
-			}
-		}
-		return evaluate_ast(p_dest, function.p_node->d.fn.node, pp_stack2, function.stack_size + args.p_node->d.lgen.nb_elements, p_alloc, p_error_handler);
-	}
-
-	/* Unary negation */
-	if (p_src->cls == &AST_CLS_NEG || p_src->cls == &AST_CLS_LOGNOT) {
-		const struct ast_node *p_result;
-		struct ast_node       *p_tmp2;
-		size_t                 save;
-		struct ev_ast_node     p;
-
-		if ((p_tmp2 = cop_salloc(p_alloc, sizeof(struct ast_node), 0)) == NULL)
-			return ejson_error(p_error_handler, "out of memory\n");
-		save = cop_salloc_save(p_alloc);
-
-
-		if (evaluate_ast(&p, p_src->d.binop.p_lhs, pp_stackx, stack_sizex, p_alloc, p_error_handler))
-			return -1;
-		p_result = p.p_node;
-
-		if (p_src->cls == &AST_CLS_NEG) {
-			if (p_result->cls == &AST_CLS_LITERAL_INT) {
-				p_tmp2->cls = &AST_CLS_LITERAL_INT;
-				p_tmp2->d.i = -p_result->d.i;
-				cop_salloc_restore(p_alloc, save);
-				p_dest->p_node = p_tmp2;
-				return 0;
-			}
-
-			if (p_result->cls == &AST_CLS_LITERAL_FLOAT) {
-				p_tmp2->cls = &AST_CLS_LITERAL_FLOAT;
-				p_tmp2->d.f = -p_result->d.f;
-				cop_salloc_restore(p_alloc, save);
-				p_dest->p_node = p_tmp2;
-				return 0;
-			}
-
-			return ejson_location_error(p_error_handler, &(p_src->doc_pos), "the expression for the unary negation operator did not evaluate to a numeric type\n");
-		}
-
-		if (p_result->cls == &AST_CLS_LITERAL_BOOL) {
-			p_tmp2->cls = &AST_CLS_LITERAL_BOOL;
-			p_tmp2->d.i = !p_result->d.i;
-			cop_salloc_restore(p_alloc, save);
-			p_dest->p_node = p_tmp2;
-			return 0;
-		}
-
-		return ejson_location_error(p_error_handler, &(p_src->doc_pos), "the expression for the unary not operator did not evaluate to a boolean type\n");
-	}
-
-	/* Convert range into an accessor object */
-	if (p_src->cls == &AST_CLS_RANGE) {
-		struct ast_node       *p_result;
-		size_t                 save;
-		struct lrange          lrange;
-		struct ev_ast_node     p;
-		struct ev_ast_node     args;
-
-		if ((p_result = cop_salloc(p_alloc, sizeof(struct ast_node), 0)) == NULL)
-			return ejson_error(p_error_handler, "out of memory\n");
-		save = cop_salloc_save(p_alloc);
-		if (evaluate_ast(&args, p_src->d.builtin.p_args, pp_stackx, stack_sizex, p_alloc, p_error_handler))
-			return -1;
-		if (args.p_node->cls != &AST_CLS_LIST_GENERATOR)
-			return ejson_location_error(p_error_handler, &(p_src->doc_pos), "range expects a list argument\n");
-		if (args.p_node->d.lgen.nb_elements < 1 || args.p_node->d.lgen.nb_elements > 3)
-			return ejson_location_error(p_error_handler, &(p_src->doc_pos), "range expects between 1 and 3 arguments\n");
-
-		if (args.p_node->d.lgen.nb_elements == 1) {
-			const struct ast_node *p_first;
-
-			if (args.p_node->d.lgen.get_element(&p, &args, 0, p_alloc, p_error_handler))
-				return -1;
-			p_first = p.p_node;
-			if (p_first->cls != &AST_CLS_LITERAL_INT)
-				return ejson_error(p_error_handler, "single argument range expects an integer number of items\n");
-
-			lrange.first     = 0;
-			lrange.step_size = 1;
-			lrange.numel     = p_first->d.i;
-		} else if (args.p_node->d.lgen.nb_elements == 2) {
-			const struct ast_node *p_first, *p_last;
-			struct ev_ast_node     p1, p2;
-
-			if  (    args.p_node->d.lgen.get_element(&p1, &args, 0, p_alloc, p_error_handler)
-			    ||   args.p_node->d.lgen.get_element(&p2, &args, 1, p_alloc, p_error_handler)
-			    )
-				return -1;
-			p_first = p1.p_node;
-			p_last  = p2.p_node;
-			if (p_first->cls != &AST_CLS_LITERAL_INT || p_last->cls != &AST_CLS_LITERAL_INT)
-				return ejson_error(p_error_handler, "dual argument range expects an integer first and last index\n");
-
-			lrange.first     = p_first->d.i;
-			lrange.step_size = (p_first->d.i > p_last->d.i) ? -1 : 1;
-			lrange.numel     = ((p_first->d.i > p_last->d.i) ? (p_first->d.i - p_last->d.i) : (p_last->d.i - p_first->d.i)) + 1;
-		} else {
-			const struct ast_node *p_first, *p_step, *p_last;
-			struct ev_ast_node     p1, p2, p3;
-
-			if  (   args.p_node->d.lgen.get_element(&p1, &args, 0, p_alloc, p_error_handler)
-			    ||  args.p_node->d.lgen.get_element(&p2, &args, 1, p_alloc, p_error_handler)
-			    ||  args.p_node->d.lgen.get_element(&p3, &args, 2, p_alloc, p_error_handler)
-			    )
-				return -1;
-			p_first = p1.p_node;
-			p_step = p2.p_node;
-			p_last = p3.p_node;			
-			if  (   p_first->cls != &AST_CLS_LITERAL_INT || p_step->cls != &AST_CLS_LITERAL_INT ||  p_last->cls != &AST_CLS_LITERAL_INT
-			    ||  p_step->d.i == 0
-			    ||  (p_step->d.i > 0 && (p_first->d.i > p_last->d.i))
-			    ||  (p_step->d.i < 0 && (p_first->d.i < p_last->d.i))
-			    )
-				return ejson_error(p_error_handler, "triple argument range expects an integer first, step and last values. step must be non-zero and have the correct sign for the range.\n");
-
-			lrange.first     = p_first->d.i;
-			lrange.step_size = p_step->d.i;
-			lrange.numel     = (p_last->d.i - p_first->d.i) / p_step->d.i + 1;
+				return ast_location_error(p_error_handler, p_src->d.ldict.elements[2*i+0], "attempted to add a key to a dictionary that already existed (%s)\n", p_key->d.str.p_data);
 		}
 
-		cop_salloc_restore(p_alloc, save);
-		
-		p_result->cls                  = &AST_CLS_LIST_GENERATOR;
-		p_result->doc_pos              = p_src->doc_pos;
-		p_result->d.lgen.get_element   = ast_list_generator_get_element;
-		p_result->d.lgen.nb_elements   = lrange.numel;
-		p_result->d.lgen.d.range.first = lrange.first;
-		p_result->d.lgen.d.range.step  = lrange.step_size;
-		p_dest->p_node                 = p_result;
-		p_dest->pp_stack               = NULL;
-		p_dest->stack_size             = 0;
+		if ((p_ret = cop_salloc(p_alloc, sizeof(struct ast_node), 0)) == NULL)
+			return ejson_error(p_error_handler, "out of memory\n");
+		p_ret->cls                = &AST_CLS_READY_DICT;
+		ast_copy_location(p_ret, p_src);
+		p_ret->d.rdict.nb_keys    = p_src->d.ldict.nb_keys;
+		p_ret->d.rdict.p_root     = p_root;
+		p_dest->stack_size        = stack_sizex;
+		p_dest->p_stack           = p_stackx;
+		p_dest->p_node            = p_ret;
 		return 0;
 	}
 
-	if (p_src->cls == &AST_CLS_MAP) {
-		struct ast_node *p_tmp;
-		struct ev_ast_node *p_function;
-		struct ev_ast_node *p_list;
-		
-		if  (   (p_function = cop_salloc(p_alloc, sizeof(struct ev_ast_node), 0)) == NULL
-		    ||  (p_list = cop_salloc(p_alloc, sizeof(struct ev_ast_node), 0)) == NULL
-			||  (p_tmp = cop_salloc(p_alloc, sizeof(struct ast_node), 0)) == NULL
-		    )
-			return ejson_error(p_error_handler, "out of memory\n");
-
-		if (evaluate_ast(p_function, p_src->d.map.p_function, pp_stackx, stack_sizex, p_alloc, p_error_handler))
-			return -1;
-		if (p_function->p_node->cls != &AST_CLS_FUNCTION || p_function->p_node->d.fn.nb_args != 1)
-			return ejson_location_error(p_error_handler, &(p_src->doc_pos), "map expects a function argument that takes one argument\n");
+	case AST_OP_ACCESS: {
+		struct ev_ast_node obj;
+		struct ev_ast_node p;
 
-		if (evaluate_ast(p_list, p_src->d.map.p_input_list, pp_stackx, stack_sizex, p_alloc, p_error_handler))
+		if (evaluate_ast(&obj, p_src->d.access.p_data, p_stackx, stack_sizex, depth - 1, p_alloc, p_error_handler))
 			return -1;
-		if (p_list->p_node->cls != &AST_CLS_LIST_GENERATOR)
-			return ejson_location_error(p_error_handler, &(p_src->doc_pos), "map expected a list argument following the function\n");
-
-		p_tmp->cls                     = &AST_CLS_LIST_GENERATOR;
-		p_tmp->doc_pos                 = p_src->doc_pos;
-		p_tmp->d.lgen.d.map.p_function = p_function;
-		p_tmp->d.lgen.d.map.p_key      = p_list;
-		p_tmp->d.lgen.get_element      = ast_list_generator_map;
-		p_tmp->d.lgen.nb_elements      = p_list->p_node->d.lgen.nb_elements;
-		p_dest->p_node                 = p_tmp;
-		p_dest->pp_stack               = NULL;
-		p_dest->stack_size             = 0;
-		return 0;
-	}
-
-	/* Ops */
-	if  (p_src->cls == &AST_CLS_ADD || p_src->cls == &AST_CLS_SUB || p_src->cls == &AST_CLS_MUL || p_src->cls == &AST_CLS_MOD
-	    || p_src->cls == &AST_CLS_BITOR || p_src->cls == &AST_CLS_BITAND
-	    || p_src->cls == &AST_CLS_LOGAND || p_src->cls == &AST_CLS_LOGOR
-	    || p_src->cls == &AST_CLS_EQ || p_src->cls == &AST_CLS_NEQ || p_src->cls == &AST_CLS_GT || p_src->cls == &AST_CLS_GEQ || p_src->cls == &AST_CLS_LEQ || p_src->cls == &AST_CLS_LT
-	    || p_src->cls == &AST_CLS_EXP
-	    ) {
-		const struct ast_node *p_lhs;
-		const struct ast_node *p_rhs;
-		struct ast_node *p_ret;
-		size_t save;
-		struct ev_ast_node lhs;
-		struct ev_ast_node rhs;
 
-		if ((p_ret = cop_salloc(p_alloc, sizeof(struct ast_node), 0)) == NULL)
-			return ejson_error(p_error_handler, "out of memory\n");
-		p_ret->doc_pos = p_src->doc_pos;
+		if (obj.p_node->cls == &AST_CLS_LIST_GENERATOR) {
+			const struct ast_node *p_idx;
+			long long idx;
+			size_t save = cop_salloc_save(p_alloc);
 
-		save = cop_salloc_save(p_alloc);
+			if (evaluate_ast(&p, p_src->d.access.p_key, p_stackx, stack_sizex, depth - 1, p_alloc, p_error_handler))
+				return -1;
+			p_idx = p.p_node;
 
-		if (evaluate_ast(&lhs, p_src->d.binop.p_lhs, pp_stackx, stack_sizex, p_alloc, p_error_handler))
-			return -1;
-		if (evaluate_ast(&rhs, p_src->d.binop.p_rhs, pp_stackx, stack_sizex, p_alloc, p_error_handler))
-			return -1;
+			if (p_idx->cls != &AST_CLS_LITERAL_INT)
+				return ast_location_error(p_error_handler, p_src->d.access.p_key, "the key expression for a list access did not evaluate to an integer\n");
+			idx = p_idx->d.i;
+			cop_salloc_restore(p_alloc, save);
 
-		p_lhs = lhs.p_node;
-		p_rhs = rhs.p_node;
-
-		if (p_src->cls == &AST_CLS_LOGAND || p_src->cls == &AST_CLS_LOGOR) {
-			if (p_lhs->cls != &AST_CLS_LITERAL_BOOL)
-				return ejson_location_error(p_error_handler, &p_src->doc_pos, "lhs of logical operator was not boolean\n");
-			if (p_rhs->cls != &AST_CLS_LITERAL_BOOL)
-				return ejson_location_error(p_error_handler, &p_src->doc_pos, "rhs of logical operator was not boolean\n");
-			p_ret->cls = &AST_CLS_LITERAL_BOOL;
-			p_ret->d.i = (p_src->cls == &AST_CLS_LOGAND) ? (p_lhs->d.i && p_rhs->d.i) : (p_lhs->d.i || p_rhs->d.i);
-			p_dest->p_node = p_ret;
-			return 0;
+			return obj.p_node->d.lgen.get_element(p_dest, &obj, idx, depth - 1, p_alloc, p_error_handler);
 		}
+		
+		if (obj.p_node->cls == &AST_CLS_READY_DICT) {
+			const struct ast_node *p_key;
+			struct dictnode *p_node;
 
-		if (p_src->cls == &AST_CLS_BITAND || p_src->cls == &AST_CLS_BITOR) {
-			if (p_lhs->cls != &AST_CLS_LITERAL_INT)
-				return ejson_location_error(p_error_handler, &p_src->doc_pos, "lhs of bitwise operator was not integer\n");
-			if (p_rhs->cls != &AST_CLS_LITERAL_INT)
-				return ejson_location_error(p_error_handler, &p_src->doc_pos, "rhs of bitwise operator was not integer\n");
-			p_ret->cls = &AST_CLS_LITERAL_INT;
-			p_ret->d.i = (p_src->cls == &AST_CLS_BITAND) ? (p_lhs->d.i & p_rhs->d.i) : (p_lhs->d.i | p_rhs->d.i);
-			p_dest->p_node = p_ret;
-			return 0;
+			if (evaluate_ast(&p, p_src->d.access.p_key, p_stackx, stack_sizex, depth - 1, p_alloc, p_error_handler))
+				return -1;
+			p_key = p.p_node;
+			if (p_key->cls != &AST_CLS_LITERAL_STRING)
+				return ast_location_error(p_error_handler, p_src->d.access.p_key, "the key expression for dict access did not evaluate to a string\n");
+			if (cop_strdict_get_by_cstr(obj.p_node->d.rdict.p_root, p_key->d.str.p_data, (void **)&p_node))
+				return ast_location_error(p_error_handler, p_src->d.access.p_key, "key '%s' not in dict\n", p_key->d.str.p_data);
+			return evaluate_ast(p_dest, p_node->data, p_stackx, stack_sizex, depth - 1, p_alloc, p_error_handler);
 		}
 
-		if ((p_src->cls == &AST_CLS_EQ || p_src->cls == &AST_CLS_NEQ) && (p_lhs->cls == &AST_CLS_LITERAL_BOOL || p_rhs->cls == &AST_CLS_LITERAL_BOOL)) {
-			if (p_lhs->cls != &AST_CLS_LITERAL_BOOL)
-				return ejson_location_error(p_error_handler, &p_src->doc_pos, "lhs must be boolean if rhs is\n");
-			if (p_rhs->cls != &AST_CLS_LITERAL_BOOL)
-				return ejson_location_error(p_error_handler, &p_src->doc_pos, "rhs must be boolean if lhs is\n");
-			p_ret->cls = &AST_CLS_LITERAL_BOOL;
-			p_ret->d.i = (p_src->cls == &AST_CLS_EQ) ? (!p_lhs->d.i == !p_rhs->d.i) : (p_lhs->d.i != p_rhs->d.i);
-			p_dest->p_node = p_ret;
-			return 0;
-		}
+		if (obj.p_node->cls == &AST_CLS_TAPE_DICT) {
+			const struct ast_node  *p_key;
+			const struct json_tape *p_value;
 
-		if (p_src->cls == &AST_CLS_ADD && (p_lhs->cls == &AST_CLS_LIST_GENERATOR || p_rhs->cls == &AST_CLS_LIST_GENERATOR)) {
-			if (p_lhs->cls != p_rhs->cls)
-				return ejson_location_error(p_error_handler, &p_src->doc_pos, "expected lhs and rhs to both be lists\n");
-			p_ret->cls                   = &AST_CLS_LIST_GENERATOR;
-			p_ret->d.lgen.nb_elements    = p_lhs->d.lgen.nb_elements + p_rhs->d.lgen.nb_elements;
-			p_ret->d.lgen.get_element    = get_list_cat;
-			p_ret->d.lgen.d.cat.p_first  = p_lhs;
-			p_ret->d.lgen.d.cat.p_second = p_rhs;
-			p_dest->p_node               = p_ret;
-			p_dest->pp_stack             = pp_stackx;
-			p_dest->stack_size           = stack_sizex;
+			if (evaluate_ast(&p, p_src->d.access.p_key, p_stackx, stack_sizex, depth - 1, p_alloc, p_error_handler))
+				return -1;
+			p_key = p.p_node;
+			if (p_key->cls != &AST_CLS_LITERAL_STRING)
+				return ast_location_error(p_error_handler, p_src->d.access.p_key, "the key expression for dict access did not evaluate to a string\n");
+			if ((p_value = json_tape_dict_find(obj.p_node->d.p_tape, p_key->d.str.p_data)) == NULL)
+				return ast_location_error(p_error_handler, p_src->d.access.p_key, "key '%s' not in dict\n", p_key->d.str.p_data);
+			if (tape_to_ev(p_dest, p_value, obj.p_node, p_alloc))
+				return ejson_error(p_error_handler, "out of memory\n");
 			return 0;
 		}
 
-		/* Promote types */
-		if (p_lhs->cls == &AST_CLS_LITERAL_FLOAT || p_rhs->cls == &AST_CLS_LITERAL_FLOAT || p_src->cls == &AST_CLS_EXP) {
-			double lhs, rhs;
+		return ast_location_error(p_error_handler, p_src->d.access.p_data, "the list expression for access did not evaluate to a list or a dictionary\n");
+	}
 
-			if (p_lhs->cls == &AST_CLS_LITERAL_FLOAT)
-				lhs = p_lhs->d.f;
-			else if (p_lhs->cls == &AST_CLS_LITERAL_INT)
-				lhs = (double)(p_lhs->d.i);
-			else
-				return -1;
+	/* Function call */
+	case AST_OP_CALL: {
+		const struct ev_frame *p_stack2;
+		struct ev_ast_node args;
+		struct ev_ast_node function;
 
-			if (p_rhs->cls == &AST_CLS_LITERAL_FLOAT)
-				rhs = p_rhs->d.f;
-			else if (p_rhs->cls == &AST_CLS_LITERAL_INT)
-				rhs = (double)(p_rhs->d.i);
-			else
-				return -1;
+		if (evaluate_ast(&function, p_src->d.call.fn, p_stackx, stack_sizex, depth - 1, p_alloc, p_error_handler))
+			return -1;
+		if (function.p_node->cls != &AST_CLS_FUNCTION)
+			return ejson_error(p_error_handler, "the function expression for call did not evaluate to a function\n");
 
-			cop_salloc_restore(p_alloc, save);
+		if (evaluate_ast(&args, p_src->d.call.p_args, p_stackx, stack_sizex, depth - 1, p_alloc, p_error_handler))
+			return -1;
+		if (args.p_node->cls != &AST_CLS_LIST_GENERATOR)
+			return ejson_error(p_error_handler, "the argument expression for call did not evaluate to a list\n");
 
-			if (p_src->cls == &AST_CLS_EXP) {
-				p_ret->cls = &AST_CLS_LITERAL_FLOAT;
-				p_ret->d.f = pow(lhs, rhs);
-			} else if (p_src->cls == &AST_CLS_ADD) {
-				p_ret->cls = &AST_CLS_LITERAL_FLOAT;
-				p_ret->d.f = lhs + rhs;
-			} else if (p_src->cls == &AST_CLS_SUB) {
-				p_ret->cls = &AST_CLS_LITERAL_FLOAT;
-				p_ret->d.f = lhs - rhs;
-			} else if (p_src->cls == &AST_CLS_MUL) {
-				p_ret->cls = &AST_CLS_LITERAL_FLOAT;
-				p_ret->d.f = lhs * rhs;
-			} else if (p_src->cls == &AST_CLS_MOD) {
-				p_ret->cls = &AST_CLS_LITERAL_FLOAT;
-				p_ret->d.f = fmod(lhs, rhs);
-			} else if (p_src->cls == &AST_CLS_EQ) {
-				p_ret->cls = &AST_CLS_LITERAL_BOOL;
-				p_ret->d.i = lhs == rhs;
-			} else if (p_src->cls == &AST_CLS_NEQ) {
-				p_ret->cls = &AST_CLS_LITERAL_BOOL;
-				p_ret->d.i = lhs != rhs;
-			} else if (p_src->cls == &AST_CLS_LT) {
-				p_ret->cls = &AST_CLS_LITERAL_BOOL;
-				p_ret->d.i = lhs < rhs;
-			} else if (p_src->cls == &AST_CLS_LEQ) {
-				p_ret->cls = &AST_CLS_LITERAL_BOOL;
-				p_ret->d.i = lhs <= rhs;
-			} else if (p_src->cls == &AST_CLS_GEQ) {
-				p_ret->cls = &AST_CLS_LITERAL_BOOL;
-				p_ret->d.i = lhs >= rhs;
-			} else if (p_src->cls == &AST_CLS_GT) {
-				p_ret->cls = &AST_CLS_LITERAL_BOOL;
-				p_ret->d.i = lhs > rhs;
-			} else {
-				abort();
-			}
+		if (args.p_node->nb_elements != function.p_node->d.fn.nb_args)
+			return ast_location_error(p_error_handler, p_src, "the number of arguments supplied to function was incorrect (expected %u but got %u)\n", function.p_node->d.fn.nb_args, args.p_node->nb_elements);
 
-			p_dest->p_node = p_ret;
-			return 0;
+		p_stack2 = function.p_stack;
+		if (args.p_node->nb_elements) {
+			struct ev_frame *p_frame;
+			struct ev_ast_node *p_nargs;
+			unsigned i;
+			if  (   (p_frame = cop_salloc(p_alloc, sizeof(struct ev_frame), 0)) == NULL
+			    ||  (p_nargs = cop_salloc(p_alloc, sizeof(struct ev_ast_node) * args.p_node->nb_elements, 0)) == NULL
+			    )
+				return ejson_error(p_error_handler, "out of memory\n");
+			for (i = 0; i < args.p_node->nb_elements; i++)
+				if (args.p_node->d.lgen.get_element(&(p_nargs[i]), &args, i, depth - 1, p_alloc, p_error_handler))
+					return -1;
+			p_frame->p_parent = function.p_stack;
+			p_frame->p_args   = p_nargs;
+			p_frame->nb_args  = args.p_node->nb_elements;
+			p_stack2          = p_frame;
 		}
-		
-		if (p_lhs->cls == &AST_CLS_LITERAL_INT && p_rhs->cls == &AST_CLS_LITERAL_INT) {
-			long long lhs, rhs;
+		return evaluate_ast(p_dest, function.p_node->d.fn.node, p_stack2, function.stack_size + args.p_node->nb_elements, depth - 1, p_alloc, p_error_handler);
+	}
+
+	/* Unary negation */
+	case AST_OP_NEG:
+	case AST_OP_LOGNOT: {
+		const struct ast_node *p_result;
+		struct ast_node        result;
+		size_t                 save;
+		struct ev_ast_node     p;
 
-			lhs = p_lhs->d.i;
-			rhs = p_rhs->d.i;
+		save = cop_salloc_save(p_alloc);
 
-			cop_salloc_restore(p_alloc, save);
+		if (evaluate_ast(&p, p_src->d.binop.p_lhs, p_stackx, stack_sizex, depth - 1, p_alloc, p_error_handler))
+			return -1;
+		p_result = p.p_node;
 
-			if (p_src->cls == &AST_CLS_ADD) {
-				p_ret->cls = &AST_CLS_LITERAL_INT;
-				p_ret->d.i = lhs + rhs;
-			} else if (p_src->cls == &AST_CLS_SUB) {
-				p_ret->cls = &AST_CLS_LITERAL_INT;
-				p_ret->d.i = lhs - rhs;
-			} else if (p_src->cls == &AST_CLS_MUL) {
-				p_ret->cls = &AST_CLS_LITERAL_INT;
-				p_ret->d.i = lhs * rhs;
-			} else if (p_src->cls == &AST_CLS_MOD) {
-				p_ret->cls = &AST_CLS_LITERAL_INT;
-				lhs = lhs % rhs;
-				p_ret->d.i = lhs + ((lhs < 0) ? rhs : 0);
-			} else if (p_src->cls == &AST_CLS_EQ) {
-				p_ret->cls = &AST_CLS_LITERAL_BOOL;
-				p_ret->d.i = lhs == rhs;
-			} else if (p_src->cls == &AST_CLS_NEQ) {
-				p_ret->cls = &AST_CLS_LITERAL_BOOL;
-				p_ret->d.i = lhs != rhs;
-			} else if (p_src->cls == &AST_CLS_LT) {
-				p_ret->cls = &AST_CLS_LITERAL_BOOL;
-				p_ret->d.i = lhs < rhs;
-			} else if (p_src->cls == &AST_CLS_LEQ) {
-				p_ret->cls = &AST_CLS_LITERAL_BOOL;
-				p_ret->d.i = lhs <= rhs;
-			} else if (p_src->cls == &AST_CLS_GEQ) {
-				p_ret->cls = &AST_CLS_LITERAL_BOOL;
-				p_ret->d.i = lhs >= rhs;
-			} else if (p_src->cls == &AST_CLS_GT) {
-				p_ret->cls = &AST_CLS_LITERAL_BOOL;
-				p_ret->d.i = lhs > rhs;
+		if (p_src->cls == &AST_CLS_NEG) {
+			if (p_result->cls == &AST_CLS_LITERAL_INT) {
+				result.cls = &AST_CLS_LITERAL_INT;
+				result.d.i = -p_result->d.i;
+			} else if (p_result->cls == &AST_CLS_LITERAL_FLOAT) {
+				result.cls = &AST_CLS_LITERAL_FLOAT;
+				result.d.f = -p_result->d.f;
 			} else {
-				abort();
+				return ast_location_error(p_error_handler, p_src, "the expression for the unary negation operator did not evaluate to a numeric type\n");
 			}
-
-			p_dest->p_node = p_ret;
-			return 0;
+		} else if (p_result->cls == &AST_CLS_LITERAL_BOOL) {
+			result.cls = &AST_CLS_LITERAL_BOOL;
+			result.d.i = !p_result->d.i;
+		} else {
+			return ast_location_error(p_error_handler, p_src, "the expression for the unary not operator did not evaluate to a boolean type\n");
 		}
 
-		return ejson_location_error(p_error_handler, &(p_ret->doc_pos), "the types given for binary operator %s were invalid (%s, %s)\n", p_src->cls->p_name, p_lhs->cls->p_name, p_rhs->cls->p_name);
+		cop_salloc_restore(p_alloc, save);
+		ast_copy_location(&result, p_src);
+		*ev_scalar(p_dest) = result;
+		return 0;
+	}
+
+	/* Convert range into an accessor object */
+	case AST_OP_RANGE:
+		return evaluate_range(p_dest, p_src, p_stackx, stack_sizex, depth - 1, p_alloc, p_error_handler);
+
+	case AST_OP_MAP:
+		return evaluate_map(p_dest, p_src, p_stackx, stack_sizex, depth - 1, p_alloc, p_error_handler);
+
+	/* Ops. Chains of left associative operators (e.g. 1 + 2 + ... + n) nest
+	 * to the left and can be very long, so they are evaluated from the inside
+	 * out in a loop rather than by recursing down the left hand sides (see
+	 * evaluate_binop_chain()). */
+	case AST_OP_ADD:
+	case AST_OP_SUB:
+	case AST_OP_MUL:
+	case AST_OP_MOD:
+	case AST_OP_EXP:
+	case AST_OP_BITAND:
+	case AST_OP_BITOR:
+	case AST_OP_LOGAND:
+	case AST_OP_LOGOR:
+	case AST_OP_EQ:
+	case AST_OP_NEQ:
+	case AST_OP_LT:
+	case AST_OP_LEQ:
+	case AST_OP_GEQ:
+	case AST_OP_GT:
+		return evaluate_binop_chain(p_dest, p_src, p_stackx, stack_sizex, depth - 1, p_alloc, p_error_handler);
+
+	default:
+		break;
 	}
 
 	fprintf(stderr, "what?\n");
@@ -1700,16 +3339,17 @@ static int jnode_list_get_element(struct jnode *p_dest, void *ctx, struct cop_sa
 	struct execution_context *ec   = ctx;
 	struct ev_ast_node p;
 
-	if (ec->object.p_node->d.lgen.get_element(&p, &(ec->object), idx, p_alloc, ec->p_error_handler))
+	if (ec->object.p_node->d.lgen.get_element(&p, &(ec->object), idx, (ec->depth) ? (ec->depth - 1) : 0, p_alloc, ec->p_error_handler))
 		return -1;
 
-	return to_jnode(p_dest, &p, p_alloc, ec->p_error_handler);
+	return to_jnode(p_dest, &p, (ec->depth) ? (ec->depth - 1) : 0, p_alloc, ec->p_error_handler);
 }
 
 struct enum_args {
 	const struct ejson_error_handler  *p_handler;
-	const struct ev_ast_node         **pp_stack;
+	const struct ev_frame             *p_stack;
 	unsigned                           stack_size;
+	unsigned                           depth;
 	struct cop_salloc_iface           *p_alloc;
 	void                              *p_user_context;
 	jdict_enumerate_fn                *p_fn;
@@ -1727,9 +3367,9 @@ static int enumerate_dict_keys2(void *p_context, struct cop_strdict_node *p_node
 	p_dn = cop_strdict_node_to_data(p_node);
 	cop_strdict_node_to_key(p_node, &key);
 	save = cop_salloc_save(p_eargs->p_alloc);
-	if (evaluate_ast(&p, p_dn->data, p_eargs->pp_stack, p_eargs->stack_size, p_eargs->p_alloc, p_eargs->p_handler))
+	if (evaluate_ast(&p, p_dn->data, p_eargs->p_stack, p_eargs->stack_size, p_eargs->depth, p_eargs->p_alloc, p_eargs->p_handler))
 		return -1;
-	if (to_jnode(&tmp, &p, p_eargs->p_alloc, p_eargs->p_handler))
+	if (to_jnode(&tmp, &p, p_eargs->depth, p_eargs->p_alloc, p_eargs->p_handler))
 		return -1;
 	ret = p_eargs->p_fn(&tmp, (char *)key.ptr, p_eargs->p_user_context);
 	cop_salloc_restore(p_eargs->p_alloc, save);
@@ -1740,26 +3380,48 @@ static int enumerate_dict_keys(jdict_enumerate_fn *p_fn, void *p_ctx, struct cop
 	struct execution_context *ec = p_ctx;
 	struct enum_args eargs;
 	eargs.p_handler      = ec->p_error_handler;
-	eargs.pp_stack       = ec->object.pp_stack;
+	eargs.p_stack        = ec->object.p_stack;
 	eargs.stack_size     = ec->object.stack_size;
+	eargs.depth          = (ec->depth) ? (ec->depth - 1) : 0;
 	eargs.p_alloc        = p_alloc;
 	eargs.p_user_context = p_userctx;
 	eargs.p_fn           = p_fn;
 	return cop_strdict_enumerate(ec->object.p_node->d.rdict.p_root, enumerate_dict_keys2, &eargs);
 }
 
+struct enum_keys_args {
+	void                              *p_user_context;
+	jdict_key_fn                      *p_fn;
+
+};
+
+static int enumerate_dict_keys_only2(void *p_context, struct cop_strdict_node *p_node, int depth) {
+	struct enum_keys_args *p_kargs = p_context;
+	struct cop_strh        key;
+	cop_strdict_node_to_key(p_node, &key);
+	return p_kargs->p_fn((char *)key.ptr, p_kargs->p_user_context);
+}
+
+static int enumerate_dict_keys_only(jdict_key_fn *p_fn, void *p_ctx, void *p_userctx) {
+	struct execution_context *ec = p_ctx;
+	struct enum_keys_args kargs;
+	kargs.p_user_context = p_userctx;
+	kargs.p_fn           = p_fn;
+	return cop_strdict_enumerate(ec->object.p_node->d.rdict.p_root, enumerate_dict_keys_only2, &kargs);
+}
+
 static int jnode_get_dict_element(struct jnode *p_dest, void *p_ctx, struct cop_salloc_iface *p_alloc, const char *p_key) {
 	struct execution_context *ec = p_ctx;
 	struct dictnode          *dn;
 	struct ev_ast_node        p;
 	if (cop_strdict_get_by_cstr(ec->object.p_node->d.rdict.p_root, p_key, (void **)&dn))
 		return 1; /* Not found */
-	if (evaluate_ast(&p, dn->data, ec->object.pp_stack, ec->object.stack_size, p_alloc, ec->p_error_handler))
+	if (evaluate_ast(&p, dn->data, ec->object.p_stack, ec->object.stack_size, (ec->depth) ? (ec->depth - 1) : 0, p_alloc, ec->p_error_handler))
 		return -1;
-	return to_jnode(p_dest, &p, p_alloc, ec->p_error_handler);
+	return to_jnode(p_dest, &p, (ec->depth) ? (ec->depth - 1) : 0, p_alloc, ec->p_error_handler);
 }
 
-static int to_jnode(struct jnode *p_node, const struct ev_ast_node *p_ast, struct cop_salloc_iface *p_alloc, const struct ejson_error_handler *p_error_handler) {
+static int to_jnode(struct jnode *p_node, const struct ev_ast_node *p_ast, unsigned depth, struct cop_salloc_iface *p_alloc, const struct ejson_error_handler *p_error_handler) {
 	struct execution_context *p_ec;
 
 	if (p_ast->p_node->cls == &AST_CLS_LITERAL_INT) {
@@ -1791,88 +3453,642 @@ static int to_jnode(struct jnode *p_node, const struct ev_ast_node *p_ast, struc
 		return 0;
 	}
 
+	/* Tapes can be read directly. */
+	if (p_ast->p_node->cls == &AST_CLS_TAPE_DICT) {
+		json_tape_to_jnode(p_node, p_ast->p_node->d.p_tape);
+		return 0;
+	}
+	if (p_ast->p_node->cls == &AST_CLS_LIST_GENERATOR && p_ast->p_node->d.lgen.get_element == get_tape_element) {
+		json_tape_to_jnode(p_node, p_ast->p_node->d.lgen.d.p_tape);
+		return 0;
+	}
+
 	if ((p_ec = cop_salloc(p_alloc, sizeof(struct execution_context), 0)) == NULL)
 		return ejson_error(p_error_handler, "out of memory\n");
 
 	p_ec->p_error_handler       = p_error_handler;
-	p_ec->object                = *p_ast;
+	ev_copy(&(p_ec->object), p_ast);
+	p_ec->depth                 = depth;
 
 	if (p_ast->p_node->cls == &AST_CLS_READY_DICT) {
 		p_node->cls               = JNODE_CLS_DICT;
-		p_node->d.dict.nb_keys    = p_ast->p_node->d.rdict.nb_keys;
-		p_node->d.dict.ctx        = p_ec;
-		p_node->d.dict.get_by_key = jnode_get_dict_element;
-		p_node->d.dict.enumerate  = enumerate_dict_keys;
+		p_node->d.dict.nb_keys        = p_ast->p_node->d.rdict.nb_keys;
+		p_node->d.dict.ctx            = p_ec;
+		p_node->d.dict.get_by_key     = jnode_get_dict_element;
+		p_node->d.dict.enumerate      = enumerate_dict_keys;
+		p_node->d.dict.enumerate_keys = enumerate_dict_keys_only;
 		return 0;
 	}
 
 	if (p_ast->p_node->cls == &AST_CLS_LIST_GENERATOR) {
 		p_node->cls                  = JNODE_CLS_LIST;
 		p_node->d.list.ctx           = p_ec;
-		p_node->d.list.nb_elements   = p_ast->p_node->d.lgen.nb_elements;
+		p_node->d.list.nb_elements   = p_ast->p_node->nb_elements;
 		p_node->d.list.get_elemenent = jnode_list_get_element;
 		return 0;
 	}
 
-	return ejson_location_error(p_error_handler, &(p_ast->p_node->doc_pos), "the given root node class (%s) cannot be represented using JSON\n", p_ast->p_node->cls->p_name);
+	return ast_location_error(p_error_handler, p_ast->p_node, "the given root node class (%s) cannot be represented using JSON\n", p_ast->p_node->cls->p_name);
 }
 
-int parse_document(struct jnode *p_node, struct evaluation_context *p_workspace, struct tokeniser *p_tokeniser, struct ejson_error_handler *p_error_handler) {
+/* Returns a node which gives the value of p_expr (the expression of the
+ * define named p_name) to every reference to it once evaluate_defines() has
+ * evaluated it. Defines are at the top level of the document so p_expr has
+ * no references into the stack and its value is the same wherever it is
+ * used. */
+static const struct ast_node *make_define(struct evaluation_context *p_workspace, const char *p_name, const struct ast_node *p_expr) {
+	struct ast_node     *p_ret;
+	struct define_value *p_def;
+	if  (   (p_ret = cop_salloc(p_workspace->p_alloc, sizeof(struct ast_node), 0)) == NULL
+	    ||  (p_def = cop_salloc(p_workspace->p_alloc, sizeof(struct define_value), 0)) == NULL
+	    )
+		return NULL;
+	p_def->p_name           = p_name;
+	p_def->state            = DEFINE_PENDING;
+	p_def->p_stats          = NULL;
+	p_def->p_next           = NULL;
+	p_ret->cls              = &AST_CLS_DEFINE;
+	ast_copy_location(p_ret, p_expr);
+	p_ret->d.define.p_expr  = p_expr;
+	p_ret->d.define.p_value = p_def;
+	return p_ret;
+}
+
+/* Parses a document into p_tokeniser->p_root, the expression of its root.
+ * p_tokeniser->p_defines is set to the first of its defines which are not
+ * constants (the rest follow through p_next in the order they appear).
+ * Returns 1 if the tokens of a streamed document run out first, in which case
+ * parsing carries on from where it stopped when this is called again. */
+static int parse_document_expr(struct evaluation_context *p_workspace, struct tokeniser *p_tokeniser, struct ejson_error_handler *p_error_handler) {
 	const struct ast_node *p_obj;
 	const struct token *p_token;
-	struct ev_ast_node p;
-	while ((p_token = tok_peek(p_tokeniser)) != NULL && p_token->cls == &TOK_DEFINE) {
-		struct cop_strh ident;
-		struct cop_strdict_node *p_wsnode;
-		p_token = tok_read(p_tokeniser, p_error_handler); assert(p_token != NULL);
-		if ((p_token = tok_read(p_tokeniser, p_error_handler)) == NULL)
-			return 1;
-		if (p_token->cls != &TOK_IDENTIFIER)
-			return ejson_location_error(p_error_handler, &(p_token->posinfo), "expected an identifier, got a %s\n", p_token->cls->name);
-		cop_strh_init_shallow(&ident, p_token->t.strident.str);
-		if ((p_wsnode = cop_salloc(p_workspace->p_alloc, sizeof(struct ast_node) + ident.len + 1, 0)) == NULL)
-			return ejson_error(p_error_handler, "out of memory\n");
-		memcpy((char *)(p_wsnode + 1), p_token->t.strident.str, ident.len + 1);
-		ident.ptr = (unsigned char *)(p_wsnode + 1);
-		if ((p_token = tok_read(p_tokeniser, p_error_handler)) == NULL)
-			return 1;
-		if (p_token->cls != &TOK_ASSIGN)
-			return ejson_location_error(p_error_handler, &(p_token->posinfo), "expected '='\n");
-		if ((p_obj = expect_expression(p_workspace, p_tokeniser, 0, p_error_handler)) == NULL)
-			return ejson_error(p_error_handler, "expected an expression\n");
-		if ((p_token = tok_read(p_tokeniser, p_error_handler)) == NULL)
-			return 1;
-		if (p_token->cls != &TOK_SEMI)
-			return ejson_location_error(p_error_handler, &(p_token->posinfo), "expected ';'\n");
-		cop_strdict_node_init(p_wsnode, &ident, (void *)p_obj);
-		if (cop_strdict_insert(&(p_workspace->p_workspace), p_wsnode))
-			return ejson_error(p_error_handler, "cannot redefine variable '%s'\n", ident.ptr);
-#if 0
-		printf("-%s-\n", ident.ptr);
-		p_obj->cls->debug_print(p_obj, stdout, 0);
-#endif
+	struct token_pos_info tpi;
+	int r;
+
+	for (;;) {
+		switch (p_tokeniser->doc_state) {
+		case DOC_START:
+			if (!tok_need(p_tokeniser, 4))
+				return 1;
+			if (p_workspace->flags & EJSON_FLAG_PLAIN_JSON) {
+				if (parse_push_json(p_tokeniser, 0, p_error_handler))
+					return -1;
+				p_tokeniser->doc_state = DOC_ROOT;
+				break;
+			}
+			if ((p_token = tok_peek(p_tokeniser)) == NULL || p_token->cls != &TOK_DEFINE) {
+				tok_get_nearest_location(p_tokeniser, &tpi);
+				if (parse_push_expr(p_workspace, p_tokeniser, 0, &tpi, p_error_handler))
+					return -1;
+				p_tokeniser->doc_state = DOC_ROOT;
+				break;
+			} else {
+				struct cop_strdict_node *p_wsnode;
+				if (tok_read(p_tokeniser, p_error_handler) == NULL)
+					return -1;
+				if ((p_token = tok_read(p_tokeniser, p_error_handler)) == NULL)
+					return -1;
+				if (p_token->cls != &TOK_IDENTIFIER)
+					return ejson_location_error(p_error_handler, &(p_token->posinfo), "expected an identifier, got a %s\n", p_token->cls->name);
+				if ((p_wsnode = cop_salloc(p_workspace->p_alloc, sizeof(struct ast_node) + p_token->t.strident.len + 1, 0)) == NULL)
+					return ejson_error(p_error_handler, "out of memory\n");
+				memcpy((char *)(p_wsnode + 1), p_token->t.strident.p_data, p_token->t.strident.len);
+				((char *)(p_wsnode + 1))[p_token->t.strident.len] = '\0';
+				if ((p_token = tok_read(p_tokeniser, p_error_handler)) == NULL)
+					return -1;
+				if (p_token->cls != &TOK_ASSIGN)
+					return ejson_location_error(p_error_handler, &(p_token->posinfo), "expected '='\n");
+				tok_get_nearest_location(p_tokeniser, &tpi);
+				if (parse_push_expr(p_workspace, p_tokeniser, 0, &tpi, p_error_handler))
+					return -1;
+				p_tokeniser->p_define  = p_wsnode;
+				p_tokeniser->doc_state = DOC_DEFINE;
+			}
+			break;
+		case DOC_DEFINE:
+			{
+				struct cop_strdict_node *p_wsnode = p_tokeniser->p_define;
+				struct cop_strh          ident;
+				if ((r = parse_run(p_workspace, p_tokeniser, 0, &p_obj, p_error_handler)) != 0)
+					return (r < 0) ? ejson_error(p_error_handler, "expected an expression\n") : r;
+				cop_strh_init_shallow(&ident, (char *)(p_wsnode + 1));
+				if (!is_constant(p_obj) && p_obj->cls != &AST_CLS_FUNCTION) {
+					if ((p_obj = make_define(p_workspace, (const char *)ident.ptr, p_obj)) == NULL)
+						return ejson_error(p_error_handler, "out of memory\n");
+					*(p_tokeniser->pp_defines_tail) = p_obj;
+					p_tokeniser->pp_defines_tail    = &(p_obj->d.define.p_value->p_next);
+				}
+				cop_strdict_node_init(p_wsnode, &ident, (void *)p_obj);
+				if (cop_strdict_insert(&(p_workspace->p_workspace), p_wsnode))
+					return ejson_error(p_error_handler, "cannot redefine variable '%s'\n", ident.ptr);
+				if (p_workspace->flags & EJSON_FLAG_DUMP_AST) {
+					fprintf(stderr, "%s =\n", ident.ptr);
+					p_obj->cls->debug_print(p_obj, stderr, 1);
+				}
+				p_tokeniser->doc_state = DOC_SEMI;
+			}
+			break;
+		case DOC_SEMI:
+			if (!tok_need(p_tokeniser, 2))
+				return 1;
+			if ((p_token = tok_read(p_tokeniser, p_error_handler)) == NULL)
+				return -1;
+			if (p_token->cls != &TOK_SEMI)
+				return ejson_location_error(p_error_handler, &(p_token->posinfo), "expected ';'\n");
+			p_tokeniser->doc_state = DOC_START;
+			break;
+		case DOC_ROOT:
+			if ((r = parse_run(p_workspace, p_tokeniser, 0, &(p_tokeniser->p_root), p_error_handler)) != 0)
+				return r;
+			if ((p_workspace->flags & (EJSON_FLAG_DUMP_AST | EJSON_FLAG_PLAIN_JSON)) == EJSON_FLAG_DUMP_AST) {
+				fprintf(stderr, "document =\n");
+				p_tokeniser->p_root->cls->debug_print(p_tokeniser->p_root, stderr, 1);
+			}
+			p_tokeniser->doc_state = DOC_END;
+			break;
+		default:
+			assert(p_tokeniser->doc_state == DOC_END);
+			if (!tok_need(p_tokeniser, 1))
+				return 1;
+			if ((p_token = tok_peek(p_tokeniser)) != NULL)
+				return ejson_location_error(p_error_handler, &(p_token->posinfo), "expected no more tokens at end of document\n");
+			return 0;
+		}
+	}
+}
+
+/* Evaluates every define in the list starting at p_defines (see
+ * parse_document_expr()) into the workspace allocator. This is only done
+ * once the whole document has been parsed as parsing rewinds the allocator
+ * when it tries things which fail. The defines are evaluated in order, so
+ * everything that one which fails refers to has already been evaluated and
+ * rewinding the allocator only frees what the failed one allocated. Errors
+ * are not reported here: a define which fails raises its error each time it
+ * is used (and not at all if it never is). Uses are counted in p_stats
+ * unless it is NULL. */
+static void evaluate_defines(struct evaluation_context *p_workspace, const struct ast_node *p_defines, struct ejson_stats *p_stats) {
+	while (p_defines != NULL) {
+		struct define_value *p_def = p_defines->d.define.p_value;
+		size_t               save  = cop_salloc_save(p_workspace->p_alloc);
+		if (evaluate_ast(&(p_def->value), p_defines->d.define.p_expr, NULL, 0, p_workspace->max_depth, p_workspace->p_alloc, NULL)) {
+			cop_salloc_restore(p_workspace->p_alloc, save);
+			p_def->state = DEFINE_FAILED;
+		} else {
+			p_def->state = DEFINE_READY;
+		}
+		p_def->p_stats = p_stats;
+		p_defines      = p_def->p_next;
 	}
-	if ((p_obj = expect_expression(p_workspace, p_tokeniser, 0, p_error_handler)) == NULL)
+}
+
+int parse_document(struct jnode *p_node, struct evaluation_context *p_workspace, struct tokeniser *p_tokeniser, struct ejson_error_handler *p_error_handler) {
+	struct ev_ast_node p;
+	if (parse_document_expr(p_workspace, p_tokeniser, p_error_handler))
 		return 1;
-	if ((p_token = tok_peek(p_tokeniser)) != NULL)
-		return ejson_location_error(p_error_handler, &(p_token->posinfo), "expected no more tokens at end of document\n", p_token->cls->name);
-#if 0
-	printf("---\n");
-	p_obj->cls->debug_print(p_obj, stdout, 0);
-#endif
-	if (evaluate_ast(&p, p_obj, NULL, 0, p_workspace->p_alloc, p_error_handler))
+	evaluate_defines(p_workspace, p_tokeniser->p_defines, &(p_workspace->stats));
+	if (evaluate_ast(&p, p_tokeniser->p_root, NULL, 0, p_workspace->max_depth, p_workspace->p_alloc, p_error_handler))
 		return 1;
-	return to_jnode(p_node, &p, p_workspace->p_alloc, p_error_handler);
+	return to_jnode(p_node, &p, p_workspace->max_depth, p_workspace->p_alloc, p_error_handler);
 }
 
-int ejson_load(struct jnode *p_node, struct evaluation_context *p_workspace, const char *p_document, struct ejson_error_handler *p_error_handler) {
-	struct tokeniser t;
+/* Finds the line and character position of p (which must be before p_end)
+ * within p_document. This is only needed for error reporting so it makes no
+ * attempt to be fast. */
+static void document_location(struct token_pos_info *p_posinfo, const char *p_document, const char *p_end, const char *p) {
+	const char   *p_line  = p_document;
+	uint_fast32_t line_nb = 1;
+	for (; p_document < p; p_document++) {
+		if (*p_document == '\n' || (*p_document == '\r' && p_document[1] != '\n')) {
+			line_nb++;
+			p_line = p_document + 1;
+		}
+	}
+	p_posinfo->p_line   = p_line;
+	p_posinfo->line_nb  = line_nb;
+	p_posinfo->char_pos = (p - p_line) + 1;
+	p_posinfo->p_end    = p_end;
+}
 
-	if (tokeniser_start(&t, p_document))
+/* Validates the len byte document at p_document if the workspace asks for
+ * it and starts tokenising it. */
+static int load_start(struct tokeniser *p_tokeniser, struct evaluation_context *p_workspace, const char *p_document, size_t len, struct ejson_error_handler *p_error_handler) {
+	if (p_workspace->flags & EJSON_FLAG_VALIDATE_UTF8) {
+		const char *p_bad = scan_find_invalid_utf8(p_document, p_document + len);
+		if (p_bad != p_document + len) {
+			struct token_pos_info posinfo;
+			document_location(&posinfo, p_document, p_document + len, p_bad);
+			return ejson_location_error(p_error_handler, &posinfo, "document is not valid UTF-8\n");
+		}
+	}
+
+	if (tokeniser_start(p_tokeniser, p_document, len))
 		return ejson_error(p_error_handler, "could not initialise tokeniser\n");
 
-	return parse_document(p_node, p_workspace, &t, p_error_handler);
+	return 0;
+}
+
+int ejson_load_n(struct jnode *p_node, struct evaluation_context *p_workspace, const char *p_document, size_t len, struct ejson_error_handler *p_error_handler) {
+	struct tokeniser t;
+	int              ret;
+
+	if (load_start(&t, p_workspace, p_document, len, p_error_handler))
+		return -1;
+
+	ret = parse_document(p_node, p_workspace, &t, p_error_handler);
+	tokeniser_free(&t);
+	return ret;
+}
+
+int ejson_load(struct jnode *p_node, struct evaluation_context *p_workspace, const char *p_document, struct ejson_error_handler *p_error_handler) {
+	return ejson_load_n(p_node, p_workspace, p_document, strlen(p_document), p_error_handler);
+}
+
+struct ejson_document {
+	const struct ast_node *p_root; /* unevaluated */
+	unsigned               max_depth;
+};
+
+struct ejson_document *ejson_document_load_n(struct evaluation_context *p_workspace, const char *p_document, size_t len, struct ejson_error_handler *p_error_handler) {
+	struct tokeniser       t;
+	struct ejson_document *p_ret;
+	unsigned               flags = p_workspace->flags;
+
+	if (load_start(&t, p_workspace, p_document, len, p_error_handler))
+		return NULL;
+
+	/* Maps in a frozen document never keep memos as readers would have to
+	 * write to them. */
+	p_workspace->flags &= ~EJSON_FLAG_MEMO_MAPS;
+	if ((p_ret = cop_salloc(p_workspace->p_alloc, sizeof(struct ejson_document), 0)) == NULL) {
+		ejson_error(p_error_handler, "out of memory\n");
+	} else if (parse_document_expr(p_workspace, &t, p_error_handler)) {
+		p_ret = NULL;
+	} else {
+		p_ret->p_root    = t.p_root;
+		p_ret->max_depth = p_workspace->max_depth;
+		evaluate_defines(p_workspace, t.p_defines, NULL);
+	}
+	p_workspace->flags = flags;
+	tokeniser_free(&t);
+	return p_ret;
+}
+
+struct ejson_document *ejson_document_load(struct evaluation_context *p_workspace, const char *p_document, struct ejson_error_handler *p_error_handler) {
+	return ejson_document_load_n(p_workspace, p_document, strlen(p_document), p_error_handler);
+}
+
+int ejson_document_root(struct jnode *p_node, const struct ejson_document *p_document, struct cop_salloc_iface *p_alloc, const struct ejson_error_handler *p_error_handler) {
+	struct ev_ast_node p;
+	if (evaluate_ast(&p, p_document->p_root, NULL, 0, p_document->max_depth, p_alloc, p_error_handler))
+		return 1;
+	return to_jnode(p_node, &p, p_document->max_depth, p_alloc, p_error_handler);
+}
+
+/* The number of tokens which are scanned from a chunk before the parser is
+ * given them. */
+#define STREAM_PARSE_TOKENS (1024)
+
+struct ejson_parser {
+	struct evaluation_context  *p_workspace;
+	struct ejson_error_handler *p_error_handler;
+
+	/* Forwards errors raised while tokenising p_region to p_error_handler
+	 * (see stream_region_error()). */
+	struct ejson_error_handler  region_error_handler;
+	const char                 *p_region;
+
+	int                         failed;
+
+	/* Position in the document of the first byte which has not been
+	 * tokenised. column is the number of characters which precede it on its
+	 * line. */
+	uint_fast32_t               line_nb;
+	size_t                      column;
+
+	/* Bytes of the document which have been fed but could not be tokenised
+	 * yet. Nothing is scanned again until the carry has grown to
+	 * carry_wanted bytes so that a token split over many small chunks does
+	 * not get rescanned from the start for every one of them. */
+	char                       *p_carry;
+	size_t                      carry_len;
+	size_t                      carry_cap;
+	size_t                      carry_wanted;
+
+	/* Tokens which have been scanned but not parsed yet. The parser takes
+	 * them as they arrive and they are dropped as soon as it has, so only a
+	 * few are ever held (see parse_run()). p_text holds the text of the
+	 * string and identifier tokens which are held from one chunk to the
+	 * next. */
+	struct token               *p_tape;
+	size_t                      tape_len;
+	size_t                      tape_cap;
+	char                       *p_text;
+
+	/* The parser. It reads its tokens from p_tape. */
+	struct tokeniser            tokens;
+};
+
+/* Tokens and errors from a streamed document do not have the text of their
+ * line available once the chunk which contained them is gone. Line and
+ * character positions are still correct. */
+static void stream_fix_location(const struct ejson_parser *p_parser, struct token_pos_info *p_posinfo) {
+	if (p_posinfo->p_line == p_parser->p_region)
+		p_posinfo->char_pos += p_parser->column;
+	p_posinfo->p_line = NULL;
+	p_posinfo->p_end  = NULL;
+}
+
+static void stream_region_error(void *p_context, const struct token_pos_info *p_location, const char *p_format, va_list args) {
+	const struct ejson_parser *p_parser = p_context;
+	struct token_pos_info      posinfo;
+	if (p_parser->p_error_handler == NULL)
+		return;
+	if (p_location != NULL && p_location->p_line == p_parser->p_region) {
+		posinfo = *p_location;
+		stream_fix_location(p_parser, &posinfo);
+		p_location = &posinfo;
+	}
+	p_parser->p_error_handler->on_parser_error(p_parser->p_error_handler->p_context, p_location, p_format, args);
+}
+
+static int stream_push_token(struct ejson_parser *p_parser, const struct token *p_token) {
+	struct token *p_dest;
+	if (p_parser->tape_len == p_parser->tape_cap) {
+		size_t        cap    = p_parser->tape_cap * 2;
+		struct token *p_tape = realloc(p_parser->p_tape, cap * sizeof(struct token));
+		if (p_tape == NULL)
+			return ejson_error(p_parser->p_error_handler, "out of memory\n");
+		p_parser->p_tape   = p_tape;
+		p_parser->tape_cap = cap;
+	}
+	p_dest  = &(p_parser->p_tape[p_parser->tape_len++]);
+	*p_dest = *p_token;
+	stream_fix_location(p_parser, &(p_dest->posinfo));
+	return 0;
+}
+
+/* Gives the tokens on the tape to the parser and drops the ones which it
+ * has taken. If last is set, no more tokens will follow them. */
+static int stream_parse(struct ejson_parser *p_parser, int last) {
+	struct tokeniser *p_tokeniser = &(p_parser->tokens);
+	size_t            left;
+
+	p_tokeniser->partial  = !last;
+	p_tokeniser->p_tape   = p_parser->p_tape;
+	p_tokeniser->tape_len = p_parser->tape_len;
+	p_tokeniser->tape_pos = 0;
+	p_tokeniser->p_next   = (p_parser->tape_len) ? p_parser->p_tape : NULL;
+	if (parse_document_expr(p_parser->p_workspace, p_tokeniser, p_parser->p_error_handler) < 0)
+		return -1;
+
+	/* The last token which was read gives the location of some errors. */
+	if (p_tokeniser->p_current != &(p_tokeniser->curx)) {
+		p_tokeniser->curx      = *(p_tokeniser->p_current);
+		p_tokeniser->p_current = &(p_tokeniser->curx);
+	}
+	left = p_parser->tape_len - p_tokeniser->tape_pos;
+	memmove(p_parser->p_tape, p_parser->p_tape + p_tokeniser->tape_pos, left * sizeof(struct token));
+	p_parser->tape_len    = left;
+	p_tokeniser->tape_len = left;
+	p_tokeniser->tape_pos = 0;
+	p_tokeniser->p_next   = (left) ? p_parser->p_tape : NULL;
+	return 0;
+}
+
+/* Copies the text of the string and identifier tokens which are still on
+ * the tape into p_text so that it outlives the chunk (or carry) which it was
+ * scanned from. */
+static int stream_keep_text(struct ejson_parser *p_parser) {
+	size_t i, len = 0;
+	char  *p_text = NULL;
+	char  *p;
+	for (i = 0; i < p_parser->tape_len; i++)
+		if (p_parser->p_tape[i].cls == &TOK_STRING || p_parser->p_tape[i].cls == &TOK_IDENTIFIER)
+			len += p_parser->p_tape[i].t.strident.len;
+	if (len && (p_text = malloc(len)) == NULL)
+		return ejson_error(p_parser->p_error_handler, "out of memory\n");
+	for (i = 0, p = p_text; i < p_parser->tape_len; i++) {
+		struct token *p_token = &(p_parser->p_tape[i]);
+		if (p_token->cls == &TOK_STRING || p_token->cls == &TOK_IDENTIFIER) {
+			memcpy(p, p_token->t.strident.p_data, p_token->t.strident.len);
+			p_token->t.strident.p_data = p;
+			p += p_token->t.strident.len;
+		}
+	}
+	free(p_parser->p_text);
+	p_parser->p_text = p_text;
+	return 0;
+}
+
+/* Checks that the bytes from *pp_checked up to p_to of the region which
+ * starts at buf are valid UTF-8 if the workspace asks for it. */
+static int stream_validate(struct ejson_parser *p_parser, const char *buf, const char **pp_checked, const char *p_to) {
+	if ((p_parser->p_workspace->flags & EJSON_FLAG_VALIDATE_UTF8) && p_to > *pp_checked) {
+		const char *p_bad = scan_find_invalid_utf8(*pp_checked, p_to);
+		if (p_bad != p_to) {
+			struct token_pos_info posinfo;
+			document_location(&posinfo, buf, p_to, p_bad);
+			posinfo.line_nb += p_parser->line_nb - 1;
+			return ejson_location_error(&(p_parser->region_error_handler), &posinfo, "document is not valid UTF-8\n");
+		}
+	}
+	*pp_checked = p_to;
+	return 0;
+}
+
+/* Tokenises as much of the len bytes at buf (which start at the parser's
+ * current position in the document) as possible and parses the tokens. If
+ * partial is set, more of the document may follow and only complete tokens
+ * are taken. The number of bytes which were consumed is stored in
+ * *p_consumed. */
+static int stream_tokenise(struct ejson_parser *p_parser, const char *buf, size_t len, int partial, size_t *p_consumed) {
+	const struct ejson_error_handler *p_eh = &(p_parser->region_error_handler);
+	struct tokeniser                  t;
+	struct token                      tok;
+	const char                       *p_checked         = buf;
+	const char                       *p_safe            = buf;
+	const char                       *p_safe_line_start = buf;
+	uint_fast32_t                     safe_line_nb      = p_parser->line_nb;
+	int                               r;
+
+	p_parser->p_region = buf;
+	t.line_nb          = p_parser->line_nb;
+	t.p_line_start     = buf;
+	t.buf              = buf;
+	t.p_end            = buf + len;
+	t.partial          = partial;
+	t.p_tape           = NULL;
+
+	while ((r = tok_scan(&t, &tok, p_eh)) == TOK_SCAN_OK) {
+		if (stream_push_token(p_parser, &tok))
+			return -1;
+		p_safe            = t.buf;
+		p_safe_line_start = t.p_line_start;
+		safe_line_nb      = t.line_nb;
+		if  (   p_parser->tape_len >= STREAM_PARSE_TOKENS
+		    &&  (stream_validate(p_parser, buf, &p_checked, p_safe) || stream_parse(p_parser, 0))
+		    )
+			return -1;
+	}
+
+	if (r == TOK_SCAN_ERROR)
+		return -1;
+
+	if (r == TOK_SCAN_END && !partial) {
+		p_safe            = t.buf;
+		p_safe_line_start = t.p_line_start;
+		safe_line_nb      = t.line_nb;
+	} else if (r == TOK_SCAN_END) {
+		/* Whitespace can be dropped but a comment or a CR which might be the
+		 * first half of a CRLF pair needs to be seen again. */
+		t.p_line_start = p_safe_line_start;
+		t.line_nb      = safe_line_nb;
+		p_safe = scan_skip_space(p_safe, (buf[len - 1] == '\r') ? (buf + len - 1) : (buf + len), &(t.line_nb), &(t.p_line_start));
+		p_safe_line_start = t.p_line_start;
+		safe_line_nb      = t.line_nb;
+	}
+
+	if  (   stream_validate(p_parser, buf, &p_checked, p_safe)
+	    ||  stream_parse(p_parser, !partial)
+	    ||  stream_keep_text(p_parser)
+	    )
+		return -1;
+
+	if (p_safe_line_start == buf)
+		p_parser->column += p_safe - buf;
+	else
+		p_parser->column = p_safe - p_safe_line_start;
+	p_parser->line_nb = safe_line_nb;
+	*p_consumed       = p_safe - buf;
+	return 0;
+}
+
+static int stream_carry(struct ejson_parser *p_parser, const char *p_data, size_t len) {
+	if (len == 0)
+		return 0;
+	if (p_parser->carry_cap - p_parser->carry_len < len) {
+		size_t cap = (p_parser->carry_cap) ? p_parser->carry_cap : 256;
+		char  *p_carry;
+		while (cap - p_parser->carry_len < len)
+			cap *= 2;
+		if ((p_carry = realloc(p_parser->p_carry, cap)) == NULL)
+			return ejson_error(p_parser->p_error_handler, "out of memory\n");
+		p_parser->p_carry   = p_carry;
+		p_parser->carry_cap = cap;
+	}
+	memcpy(p_parser->p_carry + p_parser->carry_len, p_data, len);
+	p_parser->carry_len += len;
+	return 0;
+}
+
+struct ejson_parser *ejson_parser_create(struct evaluation_context *p_workspace, struct ejson_error_handler *p_error_handler) {
+	struct ejson_parser *p_parser;
+	struct tokeniser    *p_tokeniser;
+	if  (   (p_parser = cop_salloc(p_workspace->p_alloc, sizeof(struct ejson_parser), 0)) == NULL
+	    ||  (p_parser->p_tape = malloc(2 * STREAM_PARSE_TOKENS * sizeof(struct token))) == NULL
+	    )
+		return ejson_error_null(p_error_handler, "out of memory\n");
+	p_parser->p_workspace                    = p_workspace;
+	p_parser->p_error_handler                = p_error_handler;
+	p_parser->region_error_handler.p_context = p_parser;
+	p_parser->region_error_handler.on_parser_error = stream_region_error;
+	p_parser->p_region                       = NULL;
+	p_parser->failed                         = 0;
+	p_parser->line_nb                        = 1;
+	p_parser->column                         = 0;
+	p_parser->p_carry                        = NULL;
+	p_parser->carry_len                      = 0;
+	p_parser->carry_cap                      = 0;
+	p_parser->carry_wanted                   = 0;
+	p_parser->tape_len                       = 0;
+	p_parser->tape_cap                       = 2 * STREAM_PARSE_TOKENS;
+	p_parser->p_text                         = NULL;
+
+	p_tokeniser                              = &(p_parser->tokens);
+	p_tokeniser->p_tape                      = p_parser->p_tape;
+	p_tokeniser->tape_len                    = 0;
+	p_tokeniser->tape_pos                    = 0;
+	p_tokeniser->partial                     = 1;
+	p_tokeniser->p_current                   = &(p_tokeniser->curx);
+	p_tokeniser->p_current->posinfo.p_line   = NULL;
+	p_tokeniser->p_current->posinfo.char_pos = 0;
+	p_tokeniser->p_current->posinfo.line_nb  = 1;
+	p_tokeniser->p_current->posinfo.p_end    = NULL;
+	p_tokeniser->p_next                      = NULL;
+	tokeniser_init_scratch(p_tokeniser);
+	return p_parser;
+}
+
+int ejson_parser_feed(struct ejson_parser *p_parser, const char *p_chunk, size_t len) {
+	while (len && !p_parser->failed) {
+		size_t consumed, old_len, n;
+
+		if (p_parser->carry_len == 0) {
+			/* Tokenise directly from the chunk and hold on to whatever
+			 * follows the last complete token. */
+			p_parser->failed =
+				(   stream_tokenise(p_parser, p_chunk, len, 1, &consumed)
+				||  stream_carry(p_parser, p_chunk + consumed, len - consumed)
+				);
+			p_parser->carry_wanted = 2 * p_parser->carry_len;
+			break;
+		}
+
+		old_len = p_parser->carry_len;
+		n       = p_parser->carry_wanted - old_len;
+		if (n > len)
+			n = len;
+		if ((p_parser->failed = stream_carry(p_parser, p_chunk, n)) != 0)
+			break;
+		p_chunk += n;
+		len     -= n;
+		if (p_parser->carry_len < p_parser->carry_wanted)
+			break;
+
+		if ((p_parser->failed = stream_tokenise(p_parser, p_parser->p_carry, p_parser->carry_len, 1, &consumed)) != 0)
+			break;
+
+		if (consumed >= old_len) {
+			/* Everything which was carried over from earlier chunks has been
+			 * consumed; go back to tokenising this one in place. */
+			p_chunk            -= p_parser->carry_len - consumed;
+			len                += p_parser->carry_len - consumed;
+			p_parser->carry_len = 0;
+		} else {
+			memmove(p_parser->p_carry, p_parser->p_carry + consumed, p_parser->carry_len - consumed);
+			p_parser->carry_len   -= consumed;
+			p_parser->carry_wanted = 2 * p_parser->carry_len;
+		}
+	}
 
+	return (p_parser->failed) ? -1 : 0;
+}
+
+int ejson_parser_finish(struct ejson_parser *p_parser, struct jnode *p_node) {
+	size_t consumed;
+	int    ret = -1;
+
+	if  (   !p_parser->failed
+	    &&  !stream_tokenise(p_parser, p_parser->p_carry, p_parser->carry_len, 0, &consumed)
+	    ) {
+		assert(consumed == p_parser->carry_len);
+		ret = parse_document(p_node, p_parser->p_workspace, &(p_parser->tokens), p_parser->p_error_handler);
+	}
+
+	tokeniser_free(&(p_parser->tokens));
+	free(p_parser->p_tape);
+	free(p_parser->p_text);
+	free(p_parser->p_carry);
+	p_parser->p_tape    = NULL;
+	p_parser->p_text    = NULL;
+	p_parser->p_carry   = NULL;
+	p_parser->tape_len  = 0;
+	p_parser->tape_cap  = 0;
+	p_parser->carry_len = 0;
+	p_parser->carry_cap = 0;
+	p_parser->failed    = 1;
+
+	return ret;
 }
 
 #if EJSON_TEST
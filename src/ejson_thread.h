@@ -0,0 +1,134 @@
+#ifndef EJSON_THREAD_H
+#define EJSON_THREAD_H
+
+/* Just enough threading to read a document from several threads at once.
+ *
+ * The atomic operations are for the few words of lazily evaluated state
+ * which are shared between threads (see the uses in ejson.c): loads acquire,
+ * stores release and compare-and-swaps do both. Threads, mutexes and
+ * condition variables are thin wrappers over pthreads or Win32 for the
+ * worker pool of jnode_fprint_parallel(). */
+
+#include "cop/cop_attributes.h"
+
+#if defined(_WIN32)
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+#if defined(_MSC_VER) && !defined(__clang__)
+static COP_ATTR_UNUSED unsigned ejson_atomic_load(unsigned *p) {
+	return (unsigned)InterlockedCompareExchange((volatile LONG *)p, 0, 0);
+}
+static COP_ATTR_UNUSED void ejson_atomic_store(unsigned *p, unsigned value) {
+	InterlockedExchange((volatile LONG *)p, (LONG)value);
+}
+static COP_ATTR_UNUSED int ejson_atomic_cas(unsigned *p, unsigned expected, unsigned desired) {
+	return (unsigned)InterlockedCompareExchange((volatile LONG *)p, (LONG)desired, (LONG)expected) == expected;
+}
+static COP_ATTR_UNUSED void ejson_atomic_inc(unsigned long *p) {
+	InterlockedIncrement((volatile LONG *)p);
+}
+#define EJSON_THREAD_LOCAL __declspec(thread)
+#else
+static COP_ATTR_UNUSED unsigned ejson_atomic_load(unsigned *p) {
+	return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+static COP_ATTR_UNUSED void ejson_atomic_store(unsigned *p, unsigned value) {
+	__atomic_store_n(p, value, __ATOMIC_RELEASE);
+}
+static COP_ATTR_UNUSED int ejson_atomic_cas(unsigned *p, unsigned expected, unsigned desired) {
+	return __atomic_compare_exchange_n(p, &expected, desired, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+static COP_ATTR_UNUSED void ejson_atomic_inc(unsigned long *p) {
+	__atomic_fetch_add(p, 1, __ATOMIC_RELAXED);
+}
+#define EJSON_THREAD_LOCAL __thread
+#endif
+
+/* Returns non-zero if an error raised on the calling thread should be
+ * passed to the error handler. Only the first thread of a
+ * jnode_fprint_parallel() which fails reports its errors, so that printing
+ * on several threads reports one error as printing on one thread does.
+ * Defined in json_iface_utils.c. */
+int ejson_thread_may_report_error(void);
+
+#if defined(_WIN32)
+
+struct ejson_thread {
+	HANDLE             handle;
+	void             (*p_fn)(void *p_arg);
+	void              *p_arg;
+};
+typedef CRITICAL_SECTION   ejson_mutex;
+typedef CONDITION_VARIABLE ejson_cond;
+
+static COP_ATTR_UNUSED DWORD WINAPI ejson_thread_proc(LPVOID p_arg) {
+	struct ejson_thread *p_thread = p_arg;
+	p_thread->p_fn(p_thread->p_arg);
+	return 0;
+}
+static COP_ATTR_UNUSED int ejson_thread_start(struct ejson_thread *p_thread, void (*p_fn)(void *p_arg), void *p_arg) {
+	p_thread->p_fn   = p_fn;
+	p_thread->p_arg  = p_arg;
+	p_thread->handle = CreateThread(NULL, 0, ejson_thread_proc, p_thread, 0, NULL);
+	return p_thread->handle == NULL;
+}
+static COP_ATTR_UNUSED void ejson_thread_join(struct ejson_thread *p_thread) {
+	WaitForSingleObject(p_thread->handle, INFINITE);
+	CloseHandle(p_thread->handle);
+}
+static COP_ATTR_UNUSED int ejson_mutex_init(ejson_mutex *p_mutex) {
+	InitializeCriticalSection(p_mutex);
+	return 0;
+}
+#define ejson_mutex_destroy(p_mutex_) DeleteCriticalSection(p_mutex_)
+#define ejson_mutex_lock(p_mutex_)    EnterCriticalSection(p_mutex_)
+#define ejson_mutex_unlock(p_mutex_)  LeaveCriticalSection(p_mutex_)
+static COP_ATTR_UNUSED int ejson_cond_init(ejson_cond *p_cond) {
+	InitializeConditionVariable(p_cond);
+	return 0;
+}
+#define ejson_cond_destroy(p_cond_)
+#define ejson_cond_wait(p_cond_, p_mutex_) SleepConditionVariableCS((p_cond_), (p_mutex_), INFINITE)
+#define ejson_cond_broadcast(p_cond_)      WakeAllConditionVariable(p_cond_)
+
+#else
+
+struct ejson_thread {
+	pthread_t          handle;
+	void             (*p_fn)(void *p_arg);
+	void              *p_arg;
+};
+typedef pthread_mutex_t    ejson_mutex;
+typedef pthread_cond_t     ejson_cond;
+
+static COP_ATTR_UNUSED void *ejson_thread_proc(void *p_arg) {
+	struct ejson_thread *p_thread = p_arg;
+	p_thread->p_fn(p_thread->p_arg);
+	return NULL;
+}
+static COP_ATTR_UNUSED int ejson_thread_start(struct ejson_thread *p_thread, void (*p_fn)(void *p_arg), void *p_arg) {
+	p_thread->p_fn   = p_fn;
+	p_thread->p_arg  = p_arg;
+	return pthread_create(&(p_thread->handle), NULL, ejson_thread_proc, p_thread) != 0;
+}
+static COP_ATTR_UNUSED void ejson_thread_join(struct ejson_thread *p_thread) {
+	pthread_join(p_thread->handle, NULL);
+}
+#define ejson_mutex_init(p_mutex_)         (pthread_mutex_init((p_mutex_), NULL) != 0)
+#define ejson_mutex_destroy(p_mutex_)      pthread_mutex_destroy(p_mutex_)
+#define ejson_mutex_lock(p_mutex_)         pthread_mutex_lock(p_mutex_)
+#define ejson_mutex_unlock(p_mutex_)       pthread_mutex_unlock(p_mutex_)
+#define ejson_cond_init(p_cond_)           (pthread_cond_init((p_cond_), NULL) != 0)
+#define ejson_cond_destroy(p_cond_)        pthread_cond_destroy(p_cond_)
+#define ejson_cond_wait(p_cond_, p_mutex_) pthread_cond_wait((p_cond_), (p_mutex_))
+#define ejson_cond_broadcast(p_cond_)      pthread_cond_broadcast(p_cond_)
+
+#endif
+
+#endif /* EJSON_THREAD_H */
@@ -1,7 +1,9 @@
 #include "ejson/json_iface_utils.h"
+#include "ejson_thread.h"
 #include <string.h>
 #include <math.h>
 #include <stdio.h>
+#include <stdarg.h>
 
 struct are_different_enum_state {
 	int                      ret;
@@ -69,72 +71,567 @@ int are_different(struct jnode *p_x1, struct jnode *p_x2, struct cop_salloc_ifac
 	return 0;
 }
 
-struct jnodeenum_state {
-	struct cop_salloc_iface *p_alloc;
-	unsigned indent;
-	int has_printed_something;
+/* Where printed text goes: straight to a file or, for the parts of the
+ * document which are printed on worker threads, into a buffer which is
+ * written to the file once everything before it has been. */
+struct jnode_out {
+	FILE   *f;
+	char   *p_buf;
+	size_t  len;
+	size_t  cap;
+	int     failed; /* set if the buffer could not be grown */
 
 };
 
-static int jnode_print_jdict_enumerate(struct jnode *p_dest, const char *p_key, void *p_userctx) {
-	struct jnodeenum_state *p_s = p_userctx;
-	if (p_s->has_printed_something)
-		printf("%*s,", p_s->indent, "");
-	else
-		p_s->has_printed_something = 1;
-	printf("\"%s\": ", p_key);
-	return jnode_print(p_dest, p_s->p_alloc, p_s->indent + 1);
+/* Makes room in the buffer for more than n more bytes. */
+static int out_reserve(struct jnode_out *p_out, size_t n) {
+	size_t cap;
+	char  *p_buf;
+	if (p_out->failed)
+		return -1;
+	if (p_out->cap - p_out->len > n)
+		return 0;
+	cap = (p_out->cap) ? 2 * p_out->cap : 4096;
+	while (cap - p_out->len <= n)
+		cap *= 2;
+	if ((p_buf = realloc(p_out->p_buf, cap)) == NULL) {
+		p_out->failed = 1;
+		return -1;
+	}
+	p_out->p_buf = p_buf;
+	p_out->cap   = cap;
+	return 0;
 }
 
-int jnode_print(struct jnode *p_root, struct cop_salloc_iface *p_alloc, unsigned indent) {
+static void out_printf(struct jnode_out *p_out, const char *p_format, ...) {
+	va_list args;
+	if (p_out->f != NULL) {
+		va_start(args, p_format);
+		vfprintf(p_out->f, p_format, args);
+		va_end(args);
+		return;
+	}
+	for (;;) {
+		size_t room = p_out->cap - p_out->len;
+		int    n;
+		va_start(args, p_format);
+		n = vsnprintf((room) ? p_out->p_buf + p_out->len : NULL, room, p_format, args);
+		va_end(args);
+		if (n < 0) {
+			p_out->failed = 1;
+			return;
+		}
+		if ((size_t)n < room) {
+			p_out->len += n;
+			return;
+		}
+		if (out_reserve(p_out, n))
+			return;
+	}
+}
+
+static void out_write(struct jnode_out *p_out, const char *p_data, size_t len) {
+	if (p_out->f != NULL) {
+		fwrite(p_data, 1, len, p_out->f);
+	} else if (!out_reserve(p_out, len)) {
+		memcpy(p_out->p_buf + p_out->len, p_data, len);
+		p_out->len += len;
+	}
+}
+
+/* Prints everything about p_root other than the elements of a list with at
+ * least one element or the values of a dict with at least one key. Returns
+ * JNODE_CLS_LIST or JNODE_CLS_DICT if those still need printing (the
+ * opening bracket has been printed) or zero otherwise. */
+static int jnode_write_scalar(struct jnode_out *p_out, struct jnode *p_root) {
 	if (p_root->cls == JNODE_CLS_NULL) {
-		printf("null\n");
+		out_printf(p_out, "null\n");
 	} else if (p_root->cls == JNODE_CLS_BOOL) {
 		if (p_root->d.int_bool) {
-			printf("true\n");
+			out_printf(p_out, "true\n");
 		} else {
-			printf("false\n");
+			out_printf(p_out, "false\n");
 		}
 	} else if (p_root->cls == JNODE_CLS_INTEGER) {
-		printf("%lld\n", p_root->d.int_bool);
+		out_printf(p_out, "%lld\n", p_root->d.int_bool);
 	} else if (p_root->cls == JNODE_CLS_REAL) {
-		printf("%f\n", p_root->d.real);
+		out_printf(p_out, "%f\n", p_root->d.real);
 	} else if (p_root->cls == JNODE_CLS_STRING) {
-		printf("\"%s\"\n", p_root->d.string.buf);
+		out_printf(p_out, "\"%s\"\n", p_root->d.string.buf);
 	} else if (p_root->cls == JNODE_CLS_LIST) {
 		if (p_root->d.list.nb_elements == 0) {
-			printf("[]\n");
+			out_printf(p_out, "[]\n");
 		} else {
-			unsigned i;
-			printf("[");
-			for (i = 0; i < p_root->d.list.nb_elements; i++) {
-				struct jnode tmp;
-				size_t lap = cop_salloc_save(p_alloc);
-				if (i)
-					printf("%*s,", indent, "");
-				if  (   p_root->d.list.get_elemenent(&tmp, p_root->d.list.ctx, p_alloc, i)
-				    ||  jnode_print(&tmp, p_alloc, indent + 1)
-				    ) {
-					cop_salloc_restore(p_alloc, lap);
-					return -1;
-				}
-			}
-			printf("%*s]\n", indent, "");
+			out_printf(p_out, "[");
+			return JNODE_CLS_LIST;
 		}
 	} else if (p_root->cls == JNODE_CLS_DICT) {
 		if (p_root->d.dict.nb_keys == 0) {
-			printf("{}\n");
+			out_printf(p_out, "{}\n");
 		} else {
-			printf("{");
-			struct jnodeenum_state jes;
-			jes.indent = indent;
-			jes.p_alloc = p_alloc;
-			jes.has_printed_something = 0;
-			if (p_root->d.dict.enumerate(jnode_print_jdict_enumerate, p_root->d.dict.ctx, p_alloc, &jes))
-				return -1;
-			printf("%*s}\n", indent, "");
+			out_printf(p_out, "{");
+			return JNODE_CLS_DICT;
+		}
+	}
+	return 0;
+}
+
+/* Printing on several threads.
+ *
+ * Each worker has a deque of tasks. A task prints a run of consecutive
+ * elements of a list or values of a dict into its own buffer.
+ * Whenever a worker comes to a list or a dict while another worker is idle,
+ * it splits it into tasks which it pushes onto its own deque, then waits
+ * for each task in order and copies its text into its own output. While a
+ * worker waits, it runs tasks from the end of its own deque (its most
+ * recently split work) or steals them from the front of the deques of the
+ * others (their largest pieces of work), so no worker is idle while there
+ * is anything left to do. Which thread prints what depends on timing but
+ * the text of every piece is put back in document order, so the output
+ * does not.
+ *
+ * Each worker has its own allocator. A worker which waits for a task keeps
+ * the part of its allocator which holds the list or dict that the task
+ * reads from and runs other tasks above it, so all allocations are still
+ * made and rewound in stack order. Everything other than the allocators is
+ * protected by the lock of the pool. nb_idle is also read without the lock
+ * (see print_pool_wants_work()) so it is written atomically. failed is only
+ * ever accessed atomically. cond is
+ * signalled whenever tasks are pushed or finished, when the workers are
+ * asked to stop and when a worker which has just started becomes idle. */
+
+struct print_task {
+	struct jnode                *p_node;
+	const char                 **pp_keys; /* NULL for a run of list elements */
+	unsigned                     first;
+	unsigned                     end;
+	unsigned                     indent;
+	struct jnode_out             out;
+	int                          failed;
+	int                          done;
+
+};
+
+struct print_worker {
+	struct ejson_thread          thread;
+	struct print_pool           *p_pool;
+	struct cop_salloc_iface     *p_alloc;
+	struct cop_salloc_iface      alloc;
+	struct cop_alloc_grp_temps   mem;
+
+	/* Tasks which have not been started are pp_tasks[head] to
+	 * pp_tasks[tail - 1]. */
+	struct print_task          **pp_tasks;
+	size_t                       head;
+	size_t                       tail;
+	size_t                       cap;
+
+};
+
+/* Worker 0 is the thread which is printing the document. */
+struct print_pool {
+	ejson_mutex                  lock;
+	ejson_cond                   cond;
+	int                          stopping;
+	unsigned                     nb_idle;
+	unsigned                     nb_workers;
+	unsigned                     nb_started;
+	unsigned                     failed; /* 1 + index of the first worker which failed or 0 */
+	struct print_worker         *p_workers;
+
+};
+
+/* Number of runs a list or dict is split into for each worker. Having more
+ * than one evens out the work when some elements take longer than others. */
+#define PRINT_JOBS_PER_THREAD (4)
+
+static int jnode_write_node(struct print_worker *p_worker, struct jnode_out *p_out, struct jnode *p_root, struct cop_salloc_iface *p_alloc, unsigned indent);
+
+/* Returns non-zero if a worker is idle (so that p_worker should split what
+ * it is printing). This is asked for every list and dict which is printed,
+ * so it does not take the lock; a stale answer only means that something is
+ * split when it need not be or the other way round. */
+static int print_pool_wants_work(struct print_worker *p_worker) {
+	return p_worker != NULL && ejson_atomic_load(&(p_worker->p_pool->nb_idle)) > 0;
+}
+
+/* The worker of the calling thread while it is printing or NULL. */
+static EJSON_THREAD_LOCAL struct print_worker *p_thread_worker;
+
+/* Records that p_worker has failed unless another worker failed first.
+ * Returns non-zero if p_worker is the first to have failed. */
+static int print_pool_fail(struct print_worker *p_worker) {
+	struct print_pool *p_pool = p_worker->p_pool;
+	unsigned           id     = 1 + (unsigned)(p_worker - p_pool->p_workers);
+	return ejson_atomic_cas(&(p_pool->failed), 0, id) || ejson_atomic_load(&(p_pool->failed)) == id;
+}
+
+/* Returns non-zero if any worker has failed. Nothing more is fetched once
+ * one has, as the output is thrown away and any error it raises would not
+ * be reported. */
+static int print_pool_failed(struct print_worker *p_worker) {
+	return p_worker != NULL && ejson_atomic_load(&(p_worker->p_pool->failed)) != 0;
+}
+
+int ejson_thread_may_report_error(void) {
+	return p_thread_worker == NULL || print_pool_fail(p_thread_worker);
+}
+
+/* Marks a worker as idle and waits for cond. Called with the pool locked. */
+static void print_pool_idle(struct print_pool *p_pool) {
+	ejson_atomic_store(&(p_pool->nb_idle), p_pool->nb_idle + 1);
+	ejson_cond_wait(&(p_pool->cond), &(p_pool->lock));
+	ejson_atomic_store(&(p_pool->nb_idle), p_pool->nb_idle - 1);
+}
+
+/* Takes the most recently pushed task of p_worker or, if it has none, the
+ * oldest task of another worker. Called with the pool locked. */
+static struct print_task *print_pool_take(struct print_pool *p_pool, struct print_worker *p_worker) {
+	struct print_task *p_task = NULL;
+	unsigned           self   = (unsigned)(p_worker - p_pool->p_workers);
+	unsigned           i;
+	if (p_worker->tail > p_worker->head) {
+		p_task = p_worker->pp_tasks[--p_worker->tail];
+	} else {
+		for (i = 1; i < p_pool->nb_workers && p_task == NULL; i++) {
+			p_worker = &(p_pool->p_workers[(self + i) % p_pool->nb_workers]);
+			if (p_worker->tail > p_worker->head)
+				p_task = p_worker->pp_tasks[p_worker->head++];
+		}
+	}
+	if (p_worker->head == p_worker->tail)
+		p_worker->head = p_worker->tail = 0;
+	return p_task;
+}
+
+/* Fetches and prints element i of the list p_node or, if pp_keys is not
+ * NULL, the value of pp_keys[i] in the dict p_node (preceded by a comma
+ * unless it is the first). */
+static int jnode_write_member(struct print_worker *p_worker, struct jnode_out *p_out, struct jnode *p_node, const char **pp_keys, unsigned i, struct cop_salloc_iface *p_alloc, unsigned indent) {
+	struct jnode value;
+	size_t       lap;
+	int          failed;
+	if (print_pool_failed(p_worker))
+		return 1;
+	lap = cop_salloc_save(p_alloc);
+	if (i)
+		out_printf(p_out, "%*s,", indent, "");
+	if (pp_keys != NULL) {
+		out_printf(p_out, "\"%s\": ", pp_keys[i]);
+		failed = p_node->d.dict.get_by_key(&value, p_node->d.dict.ctx, p_alloc, pp_keys[i]) != 0;
+	} else {
+		failed = p_node->d.list.get_elemenent(&value, p_node->d.list.ctx, p_alloc, i) != 0;
+	}
+	if (failed && p_worker != NULL)
+		print_pool_fail(p_worker);
+	failed = failed || jnode_write_node(p_worker, p_out, &value, p_alloc, indent + 1);
+	cop_salloc_restore(p_alloc, lap);
+	return failed;
+}
+
+/* Runs p_task on p_worker and marks it as done. */
+static void print_task_run(struct print_worker *p_worker, struct print_task *p_task) {
+	unsigned i;
+	for (i = p_task->first; i < p_task->end && !p_task->failed; i++)
+		p_task->failed = jnode_write_member(p_worker, &(p_task->out), p_task->p_node, p_task->pp_keys, i, p_worker->p_alloc, p_task->indent);
+	p_task->failed |= p_task->out.failed;
+	ejson_mutex_lock(&(p_worker->p_pool->lock));
+	p_task->done = 1;
+	ejson_cond_broadcast(&(p_worker->p_pool->cond));
+	ejson_mutex_unlock(&(p_worker->p_pool->lock));
+}
+
+/* Pushes p_task onto the deque of p_worker (or runs it straight away if
+ * there is no memory to do so). */
+static void print_task_push(struct print_worker *p_worker, struct print_task *p_task) {
+	struct print_pool *p_pool = p_worker->p_pool;
+	int                pushed = 1;
+	ejson_mutex_lock(&(p_pool->lock));
+	if (p_worker->tail == p_worker->cap) {
+		size_t              cap = (p_worker->cap) ? 2 * p_worker->cap : 64;
+		struct print_task **pp_tasks;
+		if ((pp_tasks = realloc(p_worker->pp_tasks, sizeof(struct print_task *) * cap)) != NULL) {
+			p_worker->pp_tasks = pp_tasks;
+			p_worker->cap      = cap;
+		} else {
+			pushed = 0;
+		}
+	}
+	if (pushed) {
+		p_worker->pp_tasks[p_worker->tail++] = p_task;
+		ejson_cond_broadcast(&(p_pool->cond));
+	}
+	ejson_mutex_unlock(&(p_pool->lock));
+	if (!pushed)
+		print_task_run(p_worker, p_task);
+}
+
+/* Runs other tasks until p_task (which p_worker pushed) is done. */
+static void print_task_wait(struct print_worker *p_worker, struct print_task *p_task) {
+	struct print_pool *p_pool = p_worker->p_pool;
+	ejson_mutex_lock(&(p_pool->lock));
+	while (!p_task->done) {
+		struct print_task *p_other = print_pool_take(p_pool, p_worker);
+		if (p_other != NULL) {
+			ejson_mutex_unlock(&(p_pool->lock));
+			print_task_run(p_worker, p_other);
+			ejson_mutex_lock(&(p_pool->lock));
+		} else {
+			print_pool_idle(p_pool);
+		}
+	}
+	ejson_mutex_unlock(&(p_pool->lock));
+}
+
+/* Waits for p_task and copies its text to p_out unless an earlier piece of
+ * the output failed. Returns non-zero if either failed. */
+static int print_task_finish(struct print_worker *p_worker, struct jnode_out *p_out, struct print_task *p_task, int failed) {
+	print_task_wait(p_worker, p_task);
+	if (!failed) {
+		out_write(p_out, p_task->out.p_buf, p_task->out.len);
+		failed = p_task->failed;
+	}
+	free(p_task->out.p_buf);
+	return failed;
+}
+
+static void print_worker_main(void *p_arg) {
+	struct print_worker *p_worker = p_arg;
+	struct print_pool   *p_pool   = p_worker->p_pool;
+	int                  started  = 0;
+	p_thread_worker = p_worker;
+	ejson_mutex_lock(&(p_pool->lock));
+	while (!p_pool->stopping) {
+		struct print_task *p_task = print_pool_take(p_pool, p_worker);
+		if (p_task != NULL) {
+			ejson_mutex_unlock(&(p_pool->lock));
+			print_task_run(p_worker, p_task);
+			ejson_mutex_lock(&(p_pool->lock));
+		} else {
+			/* print_pool_start() waits for every worker to be idle. */
+			if (!started) {
+				started = 1;
+				ejson_cond_broadcast(&(p_pool->cond));
+			}
+			print_pool_idle(p_pool);
 		}
 	}
+	ejson_mutex_unlock(&(p_pool->lock));
+}
+
+static void print_pool_stop(struct print_pool *p_pool) {
+	unsigned i;
+	ejson_mutex_lock(&(p_pool->lock));
+	p_pool->stopping = 1;
+	ejson_cond_broadcast(&(p_pool->cond));
+	ejson_mutex_unlock(&(p_pool->lock));
+	for (i = 1; i <= p_pool->nb_started; i++) {
+		ejson_thread_join(&(p_pool->p_workers[i].thread));
+		cop_alloc_grp_temps_free(&(p_pool->p_workers[i].mem));
+	}
+	for (i = 0; i < p_pool->nb_workers; i++)
+		free(p_pool->p_workers[i].pp_tasks);
+	free(p_pool->p_workers);
+	ejson_cond_destroy(&(p_pool->cond));
+	ejson_mutex_destroy(&(p_pool->lock));
+}
+
+/* Starts nb_workers - 1 threads and waits until all of them are idle, so
+ * that the first list or dict which is printed is always split. The calling
+ * thread is worker 0 and uses p_alloc. */
+static int print_pool_start(struct print_pool *p_pool, unsigned nb_workers, struct cop_salloc_iface *p_alloc) {
+	unsigned i;
+	p_pool->stopping   = 0;
+	p_pool->nb_idle    = 0;
+	p_pool->nb_workers = nb_workers;
+	p_pool->nb_started = 0;
+	p_pool->failed     = 0;
+	if ((p_pool->p_workers = calloc(nb_workers, sizeof(struct print_worker))) == NULL)
+		return -1;
+	if (ejson_mutex_init(&(p_pool->lock))) {
+		free(p_pool->p_workers);
+		return -1;
+	}
+	if (ejson_cond_init(&(p_pool->cond))) {
+		ejson_mutex_destroy(&(p_pool->lock));
+		free(p_pool->p_workers);
+		return -1;
+	}
+	for (i = 0; i < nb_workers; i++) {
+		p_pool->p_workers[i].p_pool  = p_pool;
+		p_pool->p_workers[i].p_alloc = (i) ? &(p_pool->p_workers[i].alloc) : p_alloc;
+	}
+	for (i = 1; i < nb_workers; i++) {
+		struct print_worker *p_worker = &(p_pool->p_workers[i]);
+		if (cop_alloc_grp_temps_init(&(p_worker->mem), &(p_worker->alloc), 1024, 1024*1024, 16))
+			break;
+		if (ejson_thread_start(&(p_worker->thread), print_worker_main, p_worker)) {
+			cop_alloc_grp_temps_free(&(p_worker->mem));
+			break;
+		}
+		p_pool->nb_started++;
+	}
+	if (p_pool->nb_started + 1 < nb_workers) {
+		print_pool_stop(p_pool);
+		return -1;
+	}
+	ejson_mutex_lock(&(p_pool->lock));
+	while (p_pool->nb_idle < p_pool->nb_started)
+		ejson_cond_wait(&(p_pool->cond), &(p_pool->lock));
+	ejson_mutex_unlock(&(p_pool->lock));
 	return 0;
 }
 
+/* Prints the elements first to end - 1 of the list p_node or, if pp_keys
+ * is not NULL, the values of those keys of the dict p_node. If a worker is
+ * idle, they are split into runs and all but the first are pushed as
+ * tasks. */
+static int jnode_write_elements(struct print_worker *p_worker, struct jnode_out *p_out, struct jnode *p_node, const char **pp_keys, unsigned first, unsigned end, struct cop_salloc_iface *p_alloc, unsigned indent) {
+	struct print_task *p_tasks = NULL;
+	unsigned           nb_runs = 1;
+	unsigned           i;
+	int                failed  = 0;
+
+	if (end - first > 1 && print_pool_wants_work(p_worker)) {
+		nb_runs = p_worker->p_pool->nb_workers * PRINT_JOBS_PER_THREAD;
+		if (nb_runs > end - first)
+			nb_runs = end - first;
+		if ((p_tasks = calloc(nb_runs - 1, sizeof(struct print_task))) == NULL)
+			nb_runs = 1;
+	}
+
+	for (i = nb_runs - 1; i > 0; i--) {
+		struct print_task *p_task = &(p_tasks[i - 1]);
+		p_task->p_node  = p_node;
+		p_task->pp_keys = pp_keys;
+		p_task->first   = first + (unsigned)(((unsigned long long)(end - first) * i) / nb_runs);
+		p_task->end     = first + (unsigned)(((unsigned long long)(end - first) * (i + 1)) / nb_runs);
+		p_task->indent  = indent;
+		print_task_push(p_worker, p_task);
+	}
+	if (nb_runs > 1)
+		end = p_tasks[0].first;
+
+	for (i = first; i < end && !failed; i++)
+		failed = jnode_write_member(p_worker, p_out, p_node, pp_keys, i, p_alloc, indent);
+
+	for (i = 1; i < nb_runs; i++)
+		failed = print_task_finish(p_worker, p_out, &(p_tasks[i - 1]), failed);
+	free(p_tasks);
+	return (failed) ? -1 : 0;
+}
+
+struct jnodeenum_state {
+	struct print_worker     *p_worker;
+	struct jnode_out        *p_out;
+	struct cop_salloc_iface *p_alloc;
+	unsigned indent;
+	int has_printed_something;
+
+};
+
+static int jnode_print_jdict_enumerate(struct jnode *p_dest, const char *p_key, void *p_userctx) {
+	struct jnodeenum_state *p_s = p_userctx;
+	if (print_pool_failed(p_s->p_worker))
+		return -1;
+	if (p_s->has_printed_something)
+		out_printf(p_s->p_out, "%*s,", p_s->indent, "");
+	else
+		p_s->has_printed_something = 1;
+	out_printf(p_s->p_out, "\"%s\": ", p_key);
+	return jnode_write_node(p_s->p_worker, p_s->p_out, p_dest, p_s->p_alloc, p_s->indent + 1);
+}
+
+/* The keys of a dict which is being split into tasks. */
+struct split_dict_state {
+	const char             **pp_keys;
+	unsigned                 nb_keys;
+	unsigned                 max_keys;
+
+};
+
+static int jnode_split_jdict_enumerate(const char *p_key, void *p_userctx) {
+	struct split_dict_state *p_s = p_userctx;
+	if (p_s->nb_keys == p_s->max_keys)
+		return -1;
+	p_s->pp_keys[p_s->nb_keys++] = p_key;
+	return 0;
+}
+
+/* Prints the values of the dict p_dict. If a worker is idle and the dict
+ * can enumerate its keys alone, only its keys are enumerated and it is
+ * split into runs of keys like a list, so that every value is fetched once
+ * by the worker which prints it. */
+static int jnode_write_values(struct print_worker *p_worker, struct jnode_out *p_out, struct jnode *p_dict, struct cop_salloc_iface *p_alloc, unsigned indent) {
+	struct split_dict_state sds;
+	int                     failed;
+
+	if  (   p_dict->d.dict.nb_keys < 2
+	    ||  p_dict->d.dict.enumerate_keys == NULL
+	    ||  !print_pool_wants_work(p_worker)
+	    ||  (sds.pp_keys = malloc(p_dict->d.dict.nb_keys * sizeof(const char *))) == NULL
+	    ) {
+		struct jnodeenum_state jes;
+		if (print_pool_failed(p_worker))
+			return -1;
+		jes.p_worker = p_worker;
+		jes.p_out = p_out;
+		jes.indent = indent;
+		jes.p_alloc = p_alloc;
+		jes.has_printed_something = 0;
+		if (p_dict->d.dict.enumerate(jnode_print_jdict_enumerate, p_dict->d.dict.ctx, p_alloc, &jes)) {
+			if (p_worker != NULL)
+				print_pool_fail(p_worker);
+			return -1;
+		}
+		return 0;
+	}
+
+	sds.nb_keys  = 0;
+	sds.max_keys = p_dict->d.dict.nb_keys;
+	failed  =   p_dict->d.dict.enumerate_keys(jnode_split_jdict_enumerate, p_dict->d.dict.ctx, &sds) != 0
+	        ||  jnode_write_elements(p_worker, p_out, p_dict, sds.pp_keys, 0, sds.nb_keys, p_alloc, indent);
+	free(sds.pp_keys);
+	return (failed) ? -1 : 0;
+}
+
+/* Prints p_root. p_worker is NULL when printing on one thread. */
+static int jnode_write_node(struct print_worker *p_worker, struct jnode_out *p_out, struct jnode *p_root, struct cop_salloc_iface *p_alloc, unsigned indent) {
+	int cls = jnode_write_scalar(p_out, p_root);
+	if (cls == JNODE_CLS_LIST) {
+		if (jnode_write_elements(p_worker, p_out, p_root, NULL, 0, p_root->d.list.nb_elements, p_alloc, indent))
+			return -1;
+		out_printf(p_out, "%*s]\n", indent, "");
+	} else if (cls == JNODE_CLS_DICT) {
+		if (jnode_write_values(p_worker, p_out, p_root, p_alloc, indent))
+			return -1;
+		out_printf(p_out, "%*s}\n", indent, "");
+	}
+	return (p_out->failed) ? -1 : 0;
+}
+
+int jnode_fprint(FILE *f, struct jnode *p_root, struct cop_salloc_iface *p_alloc, unsigned indent) {
+	struct jnode_out out;
+	memset(&out, 0, sizeof(out));
+	out.f = f;
+	return jnode_write_node(NULL, &out, p_root, p_alloc, indent);
+}
+
+int jnode_print(struct jnode *p_root, struct cop_salloc_iface *p_alloc, unsigned indent) {
+	return jnode_fprint(stdout, p_root, p_alloc, indent);
+}
+
+int jnode_fprint_parallel(FILE *f, struct jnode *p_root, struct cop_salloc_iface *p_alloc, unsigned indent, unsigned nb_threads) {
+	struct print_pool pool;
+	struct jnode_out  out;
+	int               ret;
+	if (nb_threads < 2 || print_pool_start(&pool, nb_threads, p_alloc))
+		return jnode_fprint(f, p_root, p_alloc, indent);
+	memset(&out, 0, sizeof(out));
+	out.f = f;
+	p_thread_worker = &(pool.p_workers[0]);
+	ret = jnode_write_node(&(pool.p_workers[0]), &out, p_root, p_alloc, indent);
+	p_thread_worker = NULL;
+	print_pool_stop(&pool);
+	return ret;
+}
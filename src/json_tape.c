@@ -0,0 +1,335 @@
+#include "json_tape.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct json_tape_frame {
+	size_t                entry;         /* index of the container entry */
+	size_t                children_base; /* height of p_children when the container was opened */
+	uint32_t              nb_values;     /* number of values added to the container */
+	struct token_pos_info pos;
+};
+
+struct json_tape_key {
+	const char *p_key;
+	uint32_t    offset;
+};
+
+static int tape_list_get_element(struct jnode *p_dest, void *p_ctx, struct cop_salloc_iface *p_alloc, unsigned idx) {
+	const struct json_tape *p_list = p_ctx;
+	(void)p_alloc;
+	if (idx >= p_list->nb)
+		return -1;
+	json_tape_to_jnode(p_dest, json_tape_element(p_list, idx));
+	return 0;
+}
+
+static int tape_dict_enumerate(jdict_enumerate_fn *p_fn, void *p_ctx, struct cop_salloc_iface *p_alloc, void *p_userctx) {
+	const struct json_tape *p_dict = p_ctx;
+	uint32_t                i;
+	(void)p_alloc;
+	for (i = 0; i < p_dict->nb; i++) {
+		const struct json_tape *p_key = json_tape_element(p_dict, i);
+		struct jnode            value;
+		int                     ret;
+		json_tape_to_jnode(&value, p_key + 1);
+		if ((ret = p_fn(&value, p_key->d.p_str, p_userctx)) != 0)
+			return ret;
+	}
+	return 0;
+}
+
+static int tape_dict_enumerate_keys(jdict_key_fn *p_fn, void *p_ctx, void *p_userctx) {
+	const struct json_tape *p_dict = p_ctx;
+	uint32_t                i;
+	for (i = 0; i < p_dict->nb; i++) {
+		int ret;
+		if ((ret = p_fn(json_tape_element(p_dict, i)->d.p_str, p_userctx)) != 0)
+			return ret;
+	}
+	return 0;
+}
+
+static int tape_dict_get_by_key(struct jnode *p_dest, void *p_ctx, struct cop_salloc_iface *p_alloc, const char *p_key) {
+	const struct json_tape *p_value;
+	(void)p_alloc;
+	if ((p_value = json_tape_dict_find(p_ctx, p_key)) == NULL)
+		return 1;
+	json_tape_to_jnode(p_dest, p_value);
+	return 0;
+}
+
+void json_tape_to_jnode(struct jnode *p_dest, const struct json_tape *p_entry) {
+	p_dest->cls = p_entry->cls;
+	switch (p_entry->cls) {
+	case JNODE_CLS_INTEGER:
+	case JNODE_CLS_BOOL:
+		p_dest->d.int_bool = p_entry->d.i;
+		break;
+	case JNODE_CLS_REAL:
+		p_dest->d.real = p_entry->d.f;
+		break;
+	case JNODE_CLS_STRING:
+		p_dest->d.string.buf = p_entry->d.p_str;
+		break;
+	case JNODE_CLS_LIST:
+		p_dest->d.list.ctx           = (void *)p_entry;
+		p_dest->d.list.nb_elements   = p_entry->nb;
+		p_dest->d.list.get_elemenent = tape_list_get_element;
+		break;
+	case JNODE_CLS_DICT:
+		p_dest->d.dict.ctx            = (void *)p_entry;
+		p_dest->d.dict.nb_keys        = p_entry->nb;
+		p_dest->d.dict.enumerate      = tape_dict_enumerate;
+		p_dest->d.dict.get_by_key     = tape_dict_get_by_key;
+		p_dest->d.dict.enumerate_keys = tape_dict_enumerate_keys;
+		break;
+	default:
+		assert(p_entry->cls == JNODE_CLS_NULL);
+		break;
+	}
+}
+
+const struct json_tape *json_tape_dict_find(const struct json_tape *p_dict, const char *p_key) {
+	const uint32_t *p_sorted = p_dict->d.p_offsets;
+	uint32_t        lo       = 0;
+	uint32_t        hi       = p_dict->nb;
+	assert(p_dict->cls == JNODE_CLS_DICT);
+	while (lo < hi) {
+		uint32_t                mid   = lo + (hi - lo) / 2;
+		const struct json_tape *p_k   = p_dict + p_sorted[mid];
+		int                     c     = strcmp(p_key, p_k->d.p_str);
+		if (c == 0)
+			return p_k + 1;
+		if (c < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return NULL;
+}
+
+/* Makes room for at least one more element of size elsz in the buffer at
+ * *pp_buf which holds len elements and has space for *p_cap. */
+static int reserve_one(void **pp_buf, size_t len, size_t *p_cap, size_t elsz) {
+	if (len == *p_cap) {
+		size_t cap   = (*p_cap) ? *p_cap * 2 : 256;
+		void  *p_buf = realloc(*pp_buf, cap * elsz);
+		if (p_buf == NULL)
+			return -1;
+		*pp_buf = p_buf;
+		*p_cap  = cap;
+	}
+	return 0;
+}
+
+void json_tape_builder_init(struct json_tape_builder *p_builder) {
+	memset(p_builder, 0, sizeof(*p_builder));
+}
+
+void json_tape_builder_free(struct json_tape_builder *p_builder) {
+	free(p_builder->p_tape);
+	free(p_builder->p_offsets);
+	free(p_builder->p_children);
+	free(p_builder->p_frames);
+	free(p_builder->p_keys);
+	json_tape_builder_init(p_builder);
+}
+
+void json_tape_builder_reset(struct json_tape_builder *p_builder) {
+	p_builder->tape_len     = 0;
+	p_builder->offsets_len  = 0;
+	p_builder->children_len = 0;
+	p_builder->frames_len   = 0;
+}
+
+const struct token_pos_info *json_tape_builder_open_position(const struct json_tape_builder *p_builder, size_t depth) {
+	assert(depth < p_builder->frames_len);
+	return &(p_builder->p_frames[depth].pos);
+}
+
+int json_tape_builder_open_cls(const struct json_tape_builder *p_builder, size_t depth) {
+	assert(depth < p_builder->frames_len);
+	return p_builder->p_tape[p_builder->p_frames[depth].entry].cls;
+}
+
+const uint32_t *json_tape_builder_open_elements(const struct json_tape_builder *p_builder, size_t depth, size_t *p_nb, uint32_t *p_nb_values) {
+	const struct json_tape_frame *p_frame = &(p_builder->p_frames[depth]);
+	size_t                        end;
+	assert(depth < p_builder->frames_len);
+	end          = (depth + 1 < p_builder->frames_len) ? p_builder->p_frames[depth + 1].children_base : p_builder->children_len;
+	*p_nb        = end - p_frame->children_base;
+	*p_nb_values = p_frame->nb_values;
+	return p_builder->p_children + p_frame->children_base;
+}
+
+/* Appends an entry to the tape and records it as a child of the innermost
+ * open container if it is a list element or a dict key. */
+static struct json_tape *add_entry(struct json_tape_builder *p_builder, int cls) {
+	struct json_tape *p_entry;
+	if (reserve_one((void **)&(p_builder->p_tape), p_builder->tape_len, &(p_builder->tape_cap), sizeof(struct json_tape)))
+		return NULL;
+	if (p_builder->frames_len) {
+		struct json_tape_frame *p_frame = &(p_builder->p_frames[p_builder->frames_len - 1]);
+		int                     is_dict = p_builder->p_tape[p_frame->entry].cls == JNODE_CLS_DICT;
+		if (!is_dict || !(p_frame->nb_values & 1)) {
+			if (reserve_one((void **)&(p_builder->p_children), p_builder->children_len, &(p_builder->children_cap), sizeof(uint32_t)))
+				return NULL;
+			p_builder->p_children[p_builder->children_len++] = (uint32_t)p_builder->tape_len;
+		}
+		p_frame->nb_values++;
+	}
+	p_entry      = &(p_builder->p_tape[p_builder->tape_len++]);
+	p_entry->cls = cls;
+	p_entry->nb  = 0;
+	return p_entry;
+}
+
+int json_tape_add_null(struct json_tape_builder *p_builder) {
+	return add_entry(p_builder, JNODE_CLS_NULL) == NULL;
+}
+
+int json_tape_add_bool(struct json_tape_builder *p_builder, int value) {
+	struct json_tape *p_entry;
+	if ((p_entry = add_entry(p_builder, JNODE_CLS_BOOL)) == NULL)
+		return 1;
+	p_entry->d.i = (value != 0);
+	return 0;
+}
+
+int json_tape_add_int(struct json_tape_builder *p_builder, long long value) {
+	struct json_tape *p_entry;
+	if ((p_entry = add_entry(p_builder, JNODE_CLS_INTEGER)) == NULL)
+		return 1;
+	p_entry->d.i = value;
+	return 0;
+}
+
+int json_tape_add_real(struct json_tape_builder *p_builder, double value) {
+	struct json_tape *p_entry;
+	if ((p_entry = add_entry(p_builder, JNODE_CLS_REAL)) == NULL)
+		return 1;
+	p_entry->d.f = value;
+	return 0;
+}
+
+int json_tape_add_string(struct json_tape_builder *p_builder, const char *p_str, size_t len) {
+	struct json_tape *p_entry;
+	if ((p_entry = add_entry(p_builder, JNODE_CLS_STRING)) == NULL)
+		return 1;
+	p_entry->nb      = (uint32_t)len;
+	p_entry->d.p_str = p_str;
+	return 0;
+}
+
+int json_tape_open(struct json_tape_builder *p_builder, int cls, const struct token_pos_info *p_pos) {
+	struct json_tape_frame *p_frame;
+	assert(cls == JNODE_CLS_LIST || cls == JNODE_CLS_DICT);
+	if (reserve_one((void **)&(p_builder->p_frames), p_builder->frames_len, &(p_builder->frames_cap), sizeof(struct json_tape_frame)))
+		return 1;
+	if (add_entry(p_builder, cls) == NULL)
+		return 1;
+	p_frame                = &(p_builder->p_frames[p_builder->frames_len++]);
+	p_frame->entry         = p_builder->tape_len - 1;
+	p_frame->children_base = p_builder->children_len;
+	p_frame->nb_values     = 0;
+	p_frame->pos           = *p_pos;
+	return 0;
+}
+
+static int compare_keys(const void *p_a, const void *p_b) {
+	return strcmp(((const struct json_tape_key *)p_a)->p_key, ((const struct json_tape_key *)p_b)->p_key);
+}
+
+int json_tape_close(struct json_tape_builder *p_builder) {
+	struct json_tape_frame *p_frame;
+	struct json_tape       *p_entry;
+	size_t                  nb, need, i;
+
+	assert(p_builder->frames_len);
+	p_frame = &(p_builder->p_frames[p_builder->frames_len - 1]);
+	p_entry = &(p_builder->p_tape[p_frame->entry]);
+	nb      = p_builder->children_len - p_frame->children_base;
+	need    = p_builder->offsets_len + nb;
+	assert(p_entry->cls == JNODE_CLS_LIST || !(p_frame->nb_values & 1));
+
+	if (need > p_builder->offsets_cap) {
+		size_t    cap       = (p_builder->offsets_cap) ? p_builder->offsets_cap : 256;
+		uint32_t *p_offsets;
+		while (cap < need)
+			cap *= 2;
+		if ((p_offsets = realloc(p_builder->p_offsets, cap * sizeof(uint32_t))) == NULL)
+			return -1;
+		p_builder->p_offsets   = p_offsets;
+		p_builder->offsets_cap = cap;
+	}
+
+	/* The offset table is located by its index until json_tape_finish()
+	 * knows where the tables will end up. */
+	p_entry->nb  = (uint32_t)nb;
+	p_entry->d.i = (long long)p_builder->offsets_len;
+	for (i = 0; i < nb; i++)
+		p_builder->p_offsets[p_builder->offsets_len++] = (uint32_t)(p_builder->p_children[p_frame->children_base + i] - p_frame->entry);
+
+	if (p_entry->cls == JNODE_CLS_DICT && nb) {
+		if (nb > p_builder->keys_cap) {
+			struct json_tape_key *p_keys;
+			if ((p_keys = realloc(p_builder->p_keys, nb * sizeof(struct json_tape_key))) == NULL)
+				return -1;
+			p_builder->p_keys   = p_keys;
+			p_builder->keys_cap = nb;
+		}
+		for (i = 0; i < nb; i++) {
+			uint32_t offset = p_builder->p_offsets[p_builder->offsets_len - nb + i];
+			p_builder->p_keys[i].offset = offset;
+			p_builder->p_keys[i].p_key  = p_entry[offset].d.p_str;
+		}
+		qsort(p_builder->p_keys, nb, sizeof(struct json_tape_key), compare_keys);
+		for (i = 0; i < nb; i++) {
+			if (i && !strcmp(p_builder->p_keys[i - 1].p_key, p_builder->p_keys[i].p_key))
+				return 1;
+			p_builder->p_offsets[p_builder->offsets_len - nb + i] = p_builder->p_keys[i].offset;
+		}
+	}
+
+	p_builder->children_len = p_frame->children_base;
+	p_builder->frames_len--;
+	return 0;
+}
+
+/* Copies the tape and the offset tables of its closed containers into memory
+ * obtained from p_alloc. Containers which are still open have no elements as
+ * far as the copy is concerned. */
+static struct json_tape *tape_copy(const struct json_tape_builder *p_builder, struct cop_salloc_iface *p_alloc) {
+	struct json_tape *p_tape;
+	uint32_t         *p_offsets = NULL;
+	size_t            i;
+
+	if  (   (p_tape = cop_salloc(p_alloc, p_builder->tape_len * sizeof(struct json_tape), 0)) == NULL
+	    ||  (   p_builder->offsets_len
+	        &&  (p_offsets = cop_salloc(p_alloc, p_builder->offsets_len * sizeof(uint32_t), 0)) == NULL
+	        )
+	    )
+		return NULL;
+
+	memcpy(p_tape, p_builder->p_tape, p_builder->tape_len * sizeof(struct json_tape));
+	if (p_builder->offsets_len)
+		memcpy(p_offsets, p_builder->p_offsets, p_builder->offsets_len * sizeof(uint32_t));
+	for (i = 0; i < p_builder->tape_len; i++)
+		if (p_tape[i].cls == JNODE_CLS_LIST || p_tape[i].cls == JNODE_CLS_DICT)
+			p_tape[i].d.p_offsets = (p_tape[i].nb) ? (p_offsets + p_tape[i].d.i) : NULL;
+
+	return p_tape;
+}
+
+const struct json_tape *json_tape_finish(struct json_tape_builder *p_builder, struct cop_salloc_iface *p_alloc) {
+	struct json_tape *p_tape;
+	assert(p_builder->frames_len == 0 && p_builder->tape_len);
+	p_tape = tape_copy(p_builder, p_alloc);
+	json_tape_builder_reset(p_builder);
+	return p_tape;
+}
+
+const struct json_tape *json_tape_copy_open(const struct json_tape_builder *p_builder, struct cop_salloc_iface *p_alloc) {
+	return tape_copy(p_builder, p_alloc);
+}
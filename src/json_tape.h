@@ -0,0 +1,124 @@
+#ifndef JSON_TAPE_H
+#define JSON_TAPE_H
+
+#include "ejson/ejson.h"
+#include "cop/cop_attributes.h"
+#include <stdint.h>
+
+/* A tape holds a plain JSON value as a single contiguous array of entries in
+ * document order. Containers are followed by the entries of their elements
+ * (for dicts, each key entry is immediately followed by the entry of its
+ * value) and carry a table of offsets from the container entry to each of
+ * its elements so that any element can be reached in constant time. For
+ * dicts, the table holds the offsets to the keys sorted by key, so keys can
+ * be found with a binary search and are enumerated in the same order as the
+ * keys of dicts which are not on a tape. */
+struct json_tape {
+	int                 cls; /* JNODE_CLS_* */
+	uint32_t            nb;  /* string length, number of list elements or number of dict keys */
+	union {
+		long long       i;
+		double          f;
+		const char     *p_str;     /* JNODE_CLS_STRING (NUL terminated) */
+		const uint32_t *p_offsets; /* JNODE_CLS_LIST and JNODE_CLS_DICT */
+	} d;
+};
+
+/* Fills p_dest with a jnode which reads the value of p_entry directly from
+ * the tape. Nothing is allocated. */
+void json_tape_to_jnode(struct jnode *p_dest, const struct json_tape *p_entry);
+
+/* Returns the value entry for p_key in the dict p_dict or NULL if the dict
+ * does not contain the key. */
+const struct json_tape *json_tape_dict_find(const struct json_tape *p_dict, const char *p_key);
+
+static COP_ATTR_UNUSED const struct json_tape *json_tape_element(const struct json_tape *p_list, unsigned idx) {
+	return p_list + p_list->d.p_offsets[idx];
+}
+
+struct json_tape_frame;
+struct json_tape_key;
+
+/* Collects the entries of a tape as the value is parsed. The buffers are
+ * kept between tapes so that building a tape normally needs no allocations
+ * other than the final copy of the tape into the caller's allocator. */
+struct json_tape_builder {
+	struct json_tape       *p_tape;
+	size_t                  tape_len;
+	size_t                  tape_cap;
+
+	/* Offset tables of closed containers. */
+	uint32_t               *p_offsets;
+	size_t                  offsets_len;
+	size_t                  offsets_cap;
+
+	/* Indices of the elements (or keys) of the containers which are open. */
+	uint32_t               *p_children;
+	size_t                  children_len;
+	size_t                  children_cap;
+
+	struct json_tape_frame *p_frames;
+	size_t                  frames_len;
+	size_t                  frames_cap;
+
+	/* Space for sorting the keys of a dict when it is closed. */
+	struct json_tape_key   *p_keys;
+	size_t                  keys_cap;
+};
+
+void json_tape_builder_init(struct json_tape_builder *p_builder);
+void json_tape_builder_free(struct json_tape_builder *p_builder);
+
+/* Discards everything which has been added since the last tape was
+ * finished. */
+void json_tape_builder_reset(struct json_tape_builder *p_builder);
+
+/* Number of containers which have been opened but not closed. */
+static COP_ATTR_UNUSED size_t json_tape_builder_depth(const struct json_tape_builder *p_builder) {
+	return p_builder->frames_len;
+}
+
+/* Returns the position which was given when the depth'th open container
+ * (counting from the outermost) was opened. */
+const struct token_pos_info *json_tape_builder_open_position(const struct json_tape_builder *p_builder, size_t depth);
+
+/* Returns the class (JNODE_CLS_LIST or JNODE_CLS_DICT) of the depth'th open
+ * container. */
+int json_tape_builder_open_cls(const struct json_tape_builder *p_builder, size_t depth);
+
+/* Returns the indices into the tape of the elements (or, for a dict, of the
+ * keys; each value immediately follows its key) which have been added to the
+ * depth'th open container and sets *p_nb to their number. For every open
+ * container but the innermost, the last of them is the list which is open
+ * inside it or the key whose value is. *p_nb_values is set to the number of
+ * values which have been added to the container, counting keys as values. */
+const uint32_t *json_tape_builder_open_elements(const struct json_tape_builder *p_builder, size_t depth, size_t *p_nb, uint32_t *p_nb_values);
+
+/* The following return non-zero if memory could not be allocated. p_str must
+ * remain valid for the lifetime of the finished tape. */
+int json_tape_add_null(struct json_tape_builder *p_builder);
+int json_tape_add_bool(struct json_tape_builder *p_builder, int value);
+int json_tape_add_int(struct json_tape_builder *p_builder, long long value);
+int json_tape_add_real(struct json_tape_builder *p_builder, double value);
+int json_tape_add_string(struct json_tape_builder *p_builder, const char *p_str, size_t len);
+int json_tape_open(struct json_tape_builder *p_builder, int cls, const struct token_pos_info *p_pos);
+
+/* Closes the innermost open container. Returns < 0 if memory could not be
+ * allocated or > 0 if the container is a dict which contains a duplicate
+ * key. */
+int json_tape_close(struct json_tape_builder *p_builder);
+
+/* Copies the completed tape into memory obtained from p_alloc and returns
+ * its first entry or NULL if the memory could not be allocated. The builder
+ * is reset either way. */
+const struct json_tape *json_tape_finish(struct json_tape_builder *p_builder, struct cop_salloc_iface *p_alloc);
+
+/* Copies everything which has been added so far into memory obtained from
+ * p_alloc like json_tape_finish() does but leaves the builder alone, for a
+ * value which turns out not to be plain JSON part way through. The entries
+ * of the containers which are still open are incomplete but every element
+ * which they have been given (see json_tape_builder_open_elements()) can be
+ * used. Returns NULL if the memory could not be allocated. */
+const struct json_tape *json_tape_copy_open(const struct json_tape_builder *p_builder, struct cop_salloc_iface *p_alloc);
+
+#endif /* JSON_TAPE_H */
@@ -39,6 +39,14 @@ static COP_ATTR_UNUSED int expect_hex_digit_accumulate(const char **buf, unsigne
 	return 0;
 }
 
+/* Reads the four hex digits of a "\uXXXX" escape sequence. */
+static COP_ATTR_UNUSED int expect_codepoint_digits(const char **pp_buf, unsigned *p_cp) {
+	return  expect_hex_digit(pp_buf, p_cp)
+	    ||  expect_hex_digit_accumulate(pp_buf, p_cp)
+	    ||  expect_hex_digit_accumulate(pp_buf, p_cp)
+	    ||  expect_hex_digit_accumulate(pp_buf, p_cp);
+}
+
 static COP_ATTR_UNUSED int expect_char(const char **pp_buf, char c) {
 	const char *p_buf = *pp_buf;
 	if (*p_buf != c)
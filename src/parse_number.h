@@ -0,0 +1,32 @@
+#ifndef PARSE_NUMBER_H
+#define PARSE_NUMBER_H
+
+#include <stdint.h>
+
+/* Returns 0 and stores the double nearest to mantissa * 10^exp10 in
+ * *p_result (rounding to even on ties). Returns non-zero if the result can
+ * not be determined from the 64-bit mantissa alone; this can only happen if
+ * truncated is set, which indicates that non-zero digits were dropped from
+ * the mantissa. */
+int ejson_decimal_to_double(double *p_result, uint64_t mantissa, int64_t exp10, int truncated);
+
+#define EJSON_NUMBER_OK           (0)
+#define EJSON_NUMBER_MALFORMED    (-1)
+#define EJSON_NUMBER_OUT_OF_RANGE (1)
+
+/* Parses the unsigned decimal literal starting at *pp_buf and ending no later
+ * than p_end (the literal does not need to be terminated). The syntax is that
+ * of a JSON number without the sign, extended to allow leading zeros and a
+ * leading '.' (e.g. ".5").
+ *
+ * On success, *pp_buf is moved past the literal and EJSON_NUMBER_OK is
+ * returned. If the literal has no fraction or exponent and fits in a long
+ * long, *p_is_real is cleared and the value is stored in *p_int. Otherwise,
+ * *p_is_real is set and the correctly rounded value is stored in *p_real.
+ *
+ * Returns EJSON_NUMBER_MALFORMED if the literal is invalid or
+ * EJSON_NUMBER_OUT_OF_RANGE if it is too large to be represented by a
+ * double. */
+int ejson_parse_number(const char **pp_buf, const char *p_end, long long *p_int, double *p_real, int *p_is_real);
+
+#endif /* PARSE_NUMBER_H */
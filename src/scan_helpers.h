@@ -0,0 +1,269 @@
+#ifndef SCAN_HELPERS_H
+#define SCAN_HELPERS_H
+
+/* Block-at-a-time scanning primitives for the tokeniser.
+ *
+ * Each function classifies SCAN_BLOCK_SIZE bytes of the document at once to
+ * find the next byte of interest within [p, p_end). Blocks are loaded
+ * unaligned starting at p and only while a whole block is left before
+ * p_end; the remaining bytes are examined one at a time. No byte outside
+ * [p, p_end) is ever read.
+ *
+ * scan_highbit(v) gives a vector which scan_movemask() turns into a mask of
+ * the lanes of v which have their most significant bit set.
+ *
+ * Define EJSON_NO_SIMD (the EJSON_NO_SIMD CMake option) to force the scalar
+ * implementations. They are also used when building with AddressSanitizer so
+ * that it checks each byte which the tokeniser looks at. */
+
+#include "cop/cop_attributes.h"
+#include <stddef.h>
+#include <stdint.h>
+
+#if !defined(EJSON_NO_SIMD) && defined(__SANITIZE_ADDRESS__)
+#define EJSON_NO_SIMD
+#elif !defined(EJSON_NO_SIMD) && defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define EJSON_NO_SIMD
+#endif
+#endif
+
+#if !defined(EJSON_NO_SIMD) && defined(__AVX2__)
+#include <immintrin.h>
+#define SCAN_BLOCK_SIZE (32)
+typedef __m256i scan_vec;
+#define scan_load(p_)       _mm256_loadu_si256((const __m256i *)(p_))
+#define scan_cmpeq(v_, c_)  _mm256_cmpeq_epi8((v_), _mm256_set1_epi8(c_))
+#define scan_or(a_, b_)     _mm256_or_si256((a_), (b_))
+#define scan_movemask(v_)   ((uint32_t)_mm256_movemask_epi8(v_))
+#define scan_highbit(v_)    (v_)
+#elif !defined(EJSON_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#include <emmintrin.h>
+#define SCAN_BLOCK_SIZE (16)
+typedef __m128i scan_vec;
+#define scan_load(p_)       _mm_loadu_si128((const __m128i *)(p_))
+#define scan_cmpeq(v_, c_)  _mm_cmpeq_epi8((v_), _mm_set1_epi8(c_))
+#define scan_or(a_, b_)     _mm_or_si128((a_), (b_))
+#define scan_movemask(v_)   ((uint32_t)_mm_movemask_epi8(v_))
+#define scan_highbit(v_)    (v_)
+#elif !defined(EJSON_NO_SIMD) && defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define SCAN_BLOCK_SIZE (16)
+typedef uint8x16_t scan_vec;
+#define scan_load(p_)       vld1q_u8((const uint8_t *)(p_))
+#define scan_cmpeq(v_, c_)  vceqq_u8((v_), vdupq_n_u8((uint8_t)(c_)))
+#define scan_or(a_, b_)     vorrq_u8((a_), (b_))
+#define scan_highbit(v_)    vreinterpretq_u8_s8(vshrq_n_s8(vreinterpretq_s8_u8(v_), 7))
+static COP_ATTR_UNUSED uint32_t scan_movemask(uint8x16_t v) {
+	static const uint8_t weights[16] = {1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128};
+	uint8x16_t m = vandq_u8(v, vld1q_u8(weights));
+	return (uint32_t)vaddv_u8(vget_low_u8(m)) | ((uint32_t)vaddv_u8(vget_high_u8(m)) << 8);
+}
+#endif
+
+/* Scalar implementations, which are also used for the bytes after the last
+ * whole block. */
+
+static COP_ATTR_UNUSED const char *scan_skip_space_scalar(const char *p, const char *p_end, uint_fast32_t *p_line_nb, const char **pp_line_start) {
+	char c;
+	while (p < p_end && ((c = *p) == ' ' || c == '\t' || c == '\r' || c == '\n')) {
+		p++;
+		if (c == '\n' || (c == '\r' && (p == p_end || *p != '\n'))) {
+			(*p_line_nb)++;
+			*pp_line_start = p;
+		}
+	}
+	return p;
+}
+
+static COP_ATTR_UNUSED const char *scan_find_eol_scalar(const char *p, const char *p_end) {
+	char c;
+	while (p < p_end && (c = *p) != '\n' && c != '\r')
+		p++;
+	return p;
+}
+
+static COP_ATTR_UNUSED const char *scan_find_string_special_scalar(const char *p, const char *p_end) {
+	char c;
+	while (p < p_end && (c = *p) != '\"' && c != '\\' && c != '\n' && c != '\r' && c != '\0')
+		p++;
+	return p;
+}
+
+static COP_ATTR_UNUSED const char *scan_find_non_ascii_scalar(const char *p, const char *p_end) {
+	while (p < p_end && (unsigned char)*p < 0x80)
+		p++;
+	return p;
+}
+
+#ifdef SCAN_BLOCK_SIZE
+
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+static COP_ATTR_UNUSED unsigned scan_ctz(uint32_t x) {
+	unsigned long i;
+	_BitScanForward(&i, x);
+	return i;
+}
+static COP_ATTR_UNUSED unsigned scan_highest_bit(uint32_t x) {
+	unsigned long i;
+	_BitScanReverse(&i, x);
+	return i;
+}
+static COP_ATTR_UNUSED unsigned scan_popcount(uint32_t x) {
+	x = x - ((x >> 1) & 0x55555555u);
+	x = (x & 0x33333333u) + ((x >> 2) & 0x33333333u);
+	return (((x + (x >> 4)) & 0x0F0F0F0Fu) * 0x01010101u) >> 24;
+}
+#else
+#define scan_ctz(x_)         ((unsigned)__builtin_ctz(x_))
+#define scan_highest_bit(x_) (31u - (unsigned)__builtin_clz(x_))
+#define scan_popcount(x_)    ((unsigned)__builtin_popcount(x_))
+#endif
+
+#if SCAN_BLOCK_SIZE == 32
+#define SCAN_ALL_LANES (0xFFFFFFFFu)
+#else
+#define SCAN_ALL_LANES ((1u << SCAN_BLOCK_SIZE) - 1u)
+#endif
+
+/* Adds the line breaks which are flagged in the lf and cr masks (restricted
+ * to lanes) of the block at p_block to *p_line_nb and moves *pp_line_start
+ * to the character following the last of them. A "\r\n" pair is a single
+ * line break. */
+static COP_ATTR_UNUSED void scan_count_lines(const char *p_block, const char *p_end, uint32_t lf, uint32_t cr, uint32_t lanes, uint_fast32_t *p_line_nb, const char **pp_line_start) {
+	uint32_t breaks;
+	lf &= lanes;
+	cr &= lanes;
+	breaks = lf | cr;
+	if (!breaks)
+		return;
+	/* A CR in the final lane is only part of a pair if the byte which
+	 * follows the block is a LF. That byte is only read if it is before
+	 * p_end; if it is not, the document ends with the CR. */
+	cr &= ~(lf >> 1);
+	if ((cr >> (SCAN_BLOCK_SIZE - 1)) && p_block + SCAN_BLOCK_SIZE < p_end && p_block[SCAN_BLOCK_SIZE] == '\n')
+		cr &= ~(1u << (SCAN_BLOCK_SIZE - 1));
+	*p_line_nb     += scan_popcount(lf) + scan_popcount(cr);
+	*pp_line_start  = p_block + scan_highest_bit(breaks) + 1;
+}
+
+/* Returns a pointer to the first byte in [p, p_end) which is not a space,
+ * tab, carriage return or line feed (or p_end if there is none), counting
+ * the line breaks passed over. */
+static COP_ATTR_UNUSED const char *scan_skip_space(const char *p, const char *p_end, uint_fast32_t *p_line_nb, const char **pp_line_start) {
+	while (p_end - p >= SCAN_BLOCK_SIZE) {
+		scan_vec v     = scan_load(p);
+		scan_vec vlf   = scan_cmpeq(v, '\n');
+		scan_vec vcr   = scan_cmpeq(v, '\r');
+		uint32_t lf    = scan_movemask(vlf);
+		uint32_t cr    = scan_movemask(vcr);
+		uint32_t ws    = scan_movemask(scan_or(scan_or(vlf, vcr), scan_or(scan_cmpeq(v, ' '), scan_cmpeq(v, '\t'))));
+		uint32_t other = ~ws & SCAN_ALL_LANES;
+		if (other) {
+			unsigned pos = scan_ctz(other);
+			scan_count_lines(p, p_end, lf, cr, (1u << pos) - 1u, p_line_nb, pp_line_start);
+			return p + pos;
+		}
+		scan_count_lines(p, p_end, lf, cr, SCAN_ALL_LANES, p_line_nb, pp_line_start);
+		p += SCAN_BLOCK_SIZE;
+	}
+	return scan_skip_space_scalar(p, p_end, p_line_nb, pp_line_start);
+}
+
+/* Defines a function named name_ which returns a pointer to the first byte in
+ * [p, p_end) for which the scan_vec expression match_ (of the block v) has
+ * its lane set, or p_end if there is none. scalar_ is used for the bytes
+ * after the last whole block. */
+#define SCAN_DEFINE_FIND(name_, scalar_, match_) \
+	static COP_ATTR_UNUSED const char *name_(const char *p, const char *p_end) { \
+		while (p_end - p >= SCAN_BLOCK_SIZE) { \
+			scan_vec v = scan_load(p); \
+			uint32_t m = scan_movemask(match_); \
+			if (m) \
+				return p + scan_ctz(m); \
+			p += SCAN_BLOCK_SIZE; \
+		} \
+		return scalar_(p, p_end); \
+	}
+
+/* Returns a pointer to the first carriage return or line feed in [p, p_end)
+ * or p_end if there is none. */
+SCAN_DEFINE_FIND(scan_find_eol, scan_find_eol_scalar, scan_or(scan_cmpeq(v, '\n'), scan_cmpeq(v, '\r')))
+
+/* Returns a pointer to the first byte in [p, p_end) which needs attention
+ * while scanning a quoted string (a quote, backslash, carriage return, line
+ * feed or NUL) or p_end if there is none. */
+SCAN_DEFINE_FIND
+	(scan_find_string_special
+	,scan_find_string_special_scalar
+	,scan_or
+		(scan_or(scan_or(scan_cmpeq(v, '\"'), scan_cmpeq(v, '\\')), scan_or(scan_cmpeq(v, '\n'), scan_cmpeq(v, '\r')))
+		,scan_cmpeq(v, '\0')
+		)
+	)
+
+/* Returns a pointer to the first byte in [p, p_end) which is not ASCII or
+ * p_end if there is none. */
+SCAN_DEFINE_FIND(scan_find_non_ascii, scan_find_non_ascii_scalar, scan_highbit(v))
+
+#else
+
+#define scan_skip_space          scan_skip_space_scalar
+#define scan_find_eol            scan_find_eol_scalar
+#define scan_find_string_special scan_find_string_special_scalar
+#define scan_find_non_ascii      scan_find_non_ascii_scalar
+
+#endif
+
+/* Returns a pointer to the first byte in [p, p_end) which is neither
+ * whitespace nor part of a '#' comment, or p_end if there is none. */
+static COP_ATTR_UNUSED const char *scan_skip_space_and_comments(const char *p, const char *p_end, uint_fast32_t *p_line_nb, const char **pp_line_start) {
+	while ((p = scan_skip_space(p, p_end, p_line_nb, pp_line_start)) < p_end && *p == '#')
+		p = scan_find_eol(p + 1, p_end);
+	return p;
+}
+
+/* Returns a pointer to the byte following the well-formed UTF-8 sequence
+ * which starts with the non-ASCII byte at p, or NULL if the sequence is
+ * ill-formed or truncated by p_end (see table 3-7 of the Unicode standard).
+ * Overlong forms, surrogates and code points above U+10FFFF are all
+ * rejected. */
+static COP_ATTR_UNUSED const char *scan_utf8_sequence(const char *p, const char *p_end) {
+	const unsigned char *s     = (const unsigned char *)p;
+	size_t               avail = p_end - p;
+	unsigned             lo, hi;
+	if (s[0] >= 0xC2 && s[0] <= 0xDF)
+		return (avail >= 2 && (s[1] & 0xC0) == 0x80) ? p + 2 : NULL;
+	if (s[0] >= 0xE0 && s[0] <= 0xEF) {
+		lo = (s[0] == 0xE0) ? 0xA0 : 0x80;
+		hi = (s[0] == 0xED) ? 0x9F : 0xBF;
+		return (avail >= 3 && s[1] >= lo && s[1] <= hi && (s[2] & 0xC0) == 0x80) ? p + 3 : NULL;
+	}
+	if (s[0] >= 0xF0 && s[0] <= 0xF4) {
+		lo = (s[0] == 0xF0) ? 0x90 : 0x80;
+		hi = (s[0] == 0xF4) ? 0x8F : 0xBF;
+		return (avail >= 4 && s[1] >= lo && s[1] <= hi && (s[2] & 0xC0) == 0x80 && (s[3] & 0xC0) == 0x80) ? p + 4 : NULL;
+	}
+	return NULL;
+}
+
+/* Returns a pointer to the first byte in [p, p_end) which is not part of a
+ * well-formed UTF-8 sequence or p_end if there is no such byte. ASCII is
+ * skipped a block at a time; runs of multi-byte sequences are checked one
+ * sequence at a time until the next ASCII byte. */
+static COP_ATTR_UNUSED const char *scan_find_invalid_utf8(const char *p, const char *p_end) {
+	for (;;) {
+		p = scan_find_non_ascii(p, p_end);
+		if (p == p_end)
+			return p;
+		do {
+			const char *p_next = scan_utf8_sequence(p, p_end);
+			if (p_next == NULL)
+				return p;
+			p = p_next;
+		} while (p < p_end && (unsigned char)*p >= 0x80);
+	}
+}
+
+#endif /* SCAN_HELPERS_H */
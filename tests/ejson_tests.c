@@ -2,8 +2,12 @@
 #include "json_simple_load.h"
 #include "ejson/json_iface_utils.h"
 #include "ejson/ejson.h"
+#include "ejson/src/ejson_thread.h"
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 static int unexpected_fail(const char *p_fmt, ...) {
 	va_list args;
@@ -20,23 +24,50 @@ static void on_parser_error(void *p_context, const struct token_pos_info *p_loca
 		const char *p_line = p_location->p_line;
 		fprintf(p_context, "  on line %d character %d: ", p_location->line_nb, p_location->char_pos);
 		vfprintf(p_context, p_format, args);
-		printf("    '");
-		while (*p_line != '\0' && *p_line != '\n' && *p_line != '\r')
-			printf("%c", *p_line++);
-		printf("'\n");
-		printf("    %*s^\n", p_location->char_pos, "");
+		if (p_line != NULL) {
+			printf("    '");
+			while (p_line < p_location->p_end && *p_line != '\n' && *p_line != '\r')
+				printf("%c", *p_line++);
+			printf("'\n");
+			printf("    %*s^\n", p_location->char_pos, "");
+		}
 	} else {
 		fprintf(p_context, "  ");
 		vfprintf(p_context, p_format, args);
 	}
 }
 
-int run_test(const char *p_ejson, const char *p_ref, const char *p_name) {
+/* Loads the len byte document at p_ejson by feeding it to an ejson_parser in
+ * chunk_size byte pieces. */
+static int load_streamed(struct jnode *p_node, struct evaluation_context *p_ws, const char *p_ejson, size_t len, size_t chunk_size, struct ejson_error_handler *p_err) {
+	struct ejson_parser *p_parser;
+	if ((p_parser = ejson_parser_create(p_ws, p_err)) == NULL)
+		return -1;
+	while (len) {
+		size_t n = (len < chunk_size) ? len : chunk_size;
+		if (ejson_parser_feed(p_parser, p_ejson, n))
+			break;
+		p_ejson += n;
+		len     -= n;
+	}
+	return ejson_parser_finish(p_parser, p_node);
+}
+
+/* Runs a test. If len is (size_t)-1, p_ejson is NUL terminated and loaded
+ * with ejson_load(). Otherwise it is loaded with ejson_load_n() or, if
+ * chunk_size is not zero, fed to an ejson_parser chunk_size bytes at a
+ * time. If separate_scratch is set, the workspace is given its own scratch
+ * allocator which must be back where it started once the document has been
+ * loaded. */
+static int run_test_impl(const char *p_ejson, size_t len, size_t chunk_size, const char *p_ref, const char *p_name, unsigned flags, int separate_scratch) {
 	struct jnode dut;
 	struct evaluation_context ws;
 	struct ejson_error_handler err;
 	struct cop_salloc_iface alloc;
 	struct cop_alloc_grp_temps mem;
+	struct cop_salloc_iface scratch;
+	struct cop_alloc_grp_temps scratch_mem;
+	size_t scratch_start = 0;
 
 	int d;
 	
@@ -46,8 +77,18 @@ int run_test(const char *p_ejson, const char *p_ref, const char *p_name) {
 	cop_alloc_grp_temps_init(&mem, &alloc, 1024, 1024*1024, 16);
 
 	evaluation_context_init(&ws, &alloc);
+	ws.flags = flags;
 
-	if (ejson_load(&dut, &ws, p_ejson, &err)) {
+	if (separate_scratch) {
+		cop_alloc_grp_temps_init(&scratch_mem, &scratch, 1024, 1024*1024, 16);
+		ws.p_scratch  = &scratch;
+		scratch_start = cop_salloc_save(&scratch);
+	}
+
+	if  (   (len == (size_t)-1) ? ejson_load(&dut, &ws, p_ejson, &err)
+	    :   (chunk_size)        ? load_streamed(&dut, &ws, p_ejson, len, chunk_size, &err)
+	    :                         ejson_load_n(&dut, &ws, p_ejson, len, &err)
+	    ) {
 		if (p_ref != NULL) {
 			fprintf(stderr, "FAILED: test '%s' failed due to above messages.\n", p_name);
 			return 1;
@@ -59,6 +100,11 @@ int run_test(const char *p_ejson, const char *p_ref, const char *p_name) {
 		return 1;
 	}
 
+	if (separate_scratch && cop_salloc_save(&scratch) != scratch_start) {
+		fprintf(stderr, "FAILED: test '%s' left memory allocated in the scratch allocator.\n", p_name);
+		return 1;
+	}
+
 	if (p_ref != NULL) {
 		struct jnode ref;
 		struct cop_salloc_iface a1;
@@ -94,6 +140,503 @@ int run_test(const char *p_ejson, const char *p_ref, const char *p_name) {
 	return 0;
 }
 
+int run_test(const char *p_ejson, const char *p_ref, const char *p_name) {
+	return run_test_impl(p_ejson, (size_t)-1, 0, p_ref, p_name, 0, 0);
+}
+
+int run_test_with_flags(const char *p_ejson, const char *p_ref, const char *p_name, unsigned flags) {
+	return run_test_impl(p_ejson, (size_t)-1, 0, p_ref, p_name, flags, 0);
+}
+
+/* The document is copied into a buffer of exactly len bytes so that builds
+ * with AddressSanitizer catch any read outside of it. */
+int run_test_n(const char *p_ejson, size_t len, const char *p_ref, const char *p_name) {
+	char *p_copy = malloc(len);
+	int   ret;
+	if (p_copy == NULL)
+		return unexpected_fail("out of memory\n");
+	memcpy(p_copy, p_ejson, len);
+	ret = run_test_impl(p_copy, len, 0, p_ref, p_name, 0, 0);
+	free(p_copy);
+	return ret;
+}
+
+int run_test_with_scratch(const char *p_ejson, const char *p_ref, const char *p_name) {
+	return run_test_impl(p_ejson, (size_t)-1, 0, p_ref, p_name, 0, 1);
+}
+
+/* Runs a test which prints the document and compares it with p_ref using
+ * the allocator the document was loaded into, so anything which the
+ * document still needs but which was allocated while the allocator was
+ * saved (and then rewound) is overwritten before it is read again. */
+int run_test_in_document_alloc(const char *p_ejson, const char *p_ref, const char *p_name) {
+	struct jnode dut;
+	struct jnode ref;
+	struct evaluation_context ws;
+	struct ejson_error_handler err;
+	struct cop_salloc_iface alloc;
+	struct cop_alloc_grp_temps mem;
+	struct cop_salloc_iface a1;
+	struct cop_alloc_grp_temps m1;
+	struct cop_salloc_iface a2;
+	struct cop_alloc_grp_temps m2;
+	FILE *f;
+	int d;
+
+	err.p_context = stderr;
+	err.on_parser_error = on_parser_error;
+	cop_alloc_grp_temps_init(&mem, &alloc, 1024, 1024*1024, 16);
+	cop_alloc_grp_temps_init(&m1, &a1, 1024, 1024*1024, 16);
+	cop_alloc_grp_temps_init(&m2, &a2, 1024, 1024*1024, 16);
+	evaluation_context_init(&ws, &alloc);
+
+	if (parse_json(&ref, &a1, &a2, p_ref))
+		return unexpected_fail("could not parse reference JSON:\n  %s\n", p_ref);
+	if ((f = tmpfile()) == NULL)
+		return unexpected_fail("could not create a temporary file\n");
+	if (ejson_load(&dut, &ws, p_ejson, &err) || jnode_fprint(f, &dut, &alloc, 0) || (d = are_different(&ref, &dut, &alloc)) < 0) {
+		fprintf(stderr, "FAILED: test '%s' failed due to above messages.\n", p_name);
+		d = 1;
+	} else if (d) {
+		fprintf(stderr, "FAILED: test '%s' read differently after being printed.\n", p_name);
+	} else {
+		printf("PASSED: test '%s'.\n", p_name);
+	}
+	fclose(f);
+	cop_alloc_grp_temps_free(&m2);
+	cop_alloc_grp_temps_free(&m1);
+	cop_alloc_grp_temps_free(&mem);
+	return d != 0;
+}
+
+/* Runs a test which checks the exact text jnode_fprint() prints for the
+ * document (including the order of keys). */
+int run_test_printed(const char *p_ejson, const char *p_printed, const char *p_name) {
+	struct jnode dut;
+	struct evaluation_context ws;
+	struct ejson_error_handler err;
+	struct cop_salloc_iface alloc;
+	struct cop_alloc_grp_temps mem;
+	struct cop_salloc_iface print_alloc;
+	struct cop_alloc_grp_temps print_mem;
+	char buf[1024];
+	size_t len;
+	FILE *f;
+	int failed;
+
+	err.p_context = stderr;
+	err.on_parser_error = on_parser_error;
+	cop_alloc_grp_temps_init(&mem, &alloc, 1024, 1024*1024, 16);
+	cop_alloc_grp_temps_init(&print_mem, &print_alloc, 1024, 1024*1024, 16);
+	evaluation_context_init(&ws, &alloc);
+
+	if ((f = tmpfile()) == NULL)
+		return unexpected_fail("could not create a temporary file\n");
+	if (ejson_load(&dut, &ws, p_ejson, &err) || jnode_fprint(f, &dut, &print_alloc, 0)) {
+		fprintf(stderr, "FAILED: test '%s' failed due to above messages.\n", p_name);
+		failed = 1;
+	} else {
+		rewind(f);
+		len = fread(buf, 1, sizeof(buf) - 1, f);
+		buf[len] = '\0';
+		if ((failed = strcmp(buf, p_printed) != 0) != 0)
+			fprintf(stderr, "FAILED: test '%s' printed:\n%s", p_name, buf);
+		else
+			printf("PASSED: test '%s'.\n", p_name);
+	}
+	fclose(f);
+	cop_alloc_grp_temps_free(&print_mem);
+	cop_alloc_grp_temps_free(&mem);
+	return failed;
+}
+
+/* Runs a test with flags and checks the number of elements of maps which
+ * were taken from their memos once the document has been compared with
+ * p_ref. */
+int run_test_memo_hits(const char *p_ejson, const char *p_ref, const char *p_name, unsigned flags, unsigned long memo_hits) {
+	struct jnode dut;
+	struct jnode ref;
+	struct evaluation_context ws;
+	struct ejson_error_handler err;
+	struct cop_salloc_iface alloc;
+	struct cop_alloc_grp_temps mem;
+	struct cop_salloc_iface a1;
+	struct cop_alloc_grp_temps m1;
+	struct cop_salloc_iface a2;
+	struct cop_alloc_grp_temps m2;
+	int failed;
+
+	err.p_context = stderr;
+	err.on_parser_error = on_parser_error;
+	cop_alloc_grp_temps_init(&mem, &alloc, 1024, 1024*1024, 16);
+	cop_alloc_grp_temps_init(&m1, &a1, 1024, 1024*1024, 16);
+	cop_alloc_grp_temps_init(&m2, &a2, 1024, 1024*1024, 16);
+	evaluation_context_init(&ws, &alloc);
+	ws.flags = flags;
+
+	if (parse_json(&ref, &a1, &a2, p_ref))
+		return unexpected_fail("could not parse reference JSON:\n  %s\n", p_ref);
+	if (ejson_load(&dut, &ws, p_ejson, &err) || are_different(&ref, &dut, &a2)) {
+		fprintf(stderr, "FAILED: test '%s' did not match the reference.\n", p_name);
+		failed = 1;
+	} else if ((failed = (ws.stats.memo_hits != memo_hits)) != 0) {
+		fprintf(stderr, "FAILED: test '%s' took %lu elements from memos (expected %lu).\n", p_name, ws.stats.memo_hits, memo_hits);
+	} else {
+		printf("PASSED: test '%s'.\n", p_name);
+	}
+	cop_alloc_grp_temps_free(&m2);
+	cop_alloc_grp_temps_free(&m1);
+	cop_alloc_grp_temps_free(&mem);
+	return failed;
+}
+
+/* Runs a test by streaming the document in chunks of several sizes so that
+ * the chunk boundaries fall everywhere within it. */
+int run_test_streamed(const char *p_ejson, const char *p_ref, const char *p_name, unsigned flags) {
+	static const size_t chunk_sizes[] = {1, 2, 3, 5, 8, 13, 64};
+	size_t i;
+	int    failed = 0;
+	for (i = 0; i < sizeof(chunk_sizes) / sizeof(chunk_sizes[0]); i++)
+		failed |= run_test_impl(p_ejson, strlen(p_ejson), chunk_sizes[i], p_ref, p_name, flags, 0);
+	return failed;
+}
+
+/* The location of the first error which was reported (see
+ * on_located_error()). */
+struct error_location {
+	int                   reported;
+	struct token_pos_info location;
+};
+
+static void on_located_error(void *p_context, const struct token_pos_info *p_location, const char *p_format, va_list args) {
+	struct error_location *p_error = p_context;
+	if (!p_error->reported && p_location != NULL) {
+		p_error->reported = 1;
+		p_error->location = *p_location;
+	}
+	on_parser_error(stdout, p_location, p_format, args);
+}
+
+/* Runs a test which loads and prints a document which must fail and checks
+ * the line and character position (counting from 1) of the first error which
+ * is reported. The document is loaded both with ejson_load(), where the
+ * location must also point at the text of the line starting with p_line, and
+ * through an ejson_parser, where the text is not kept. */
+int run_test_error_location(const char *p_ejson, unsigned line_nb, unsigned char_pos, const char *p_line, const char *p_name) {
+	int streamed;
+	int failed = 0;
+	for (streamed = 0; streamed < 2; streamed++) {
+		struct jnode dut;
+		struct evaluation_context ws;
+		struct ejson_error_handler err;
+		struct error_location error;
+		struct cop_salloc_iface alloc;
+		struct cop_alloc_grp_temps mem;
+		const struct token_pos_info *p_loc = &(error.location);
+		FILE *f;
+		int loaded;
+
+		error.reported = 0;
+		err.p_context = &error;
+		err.on_parser_error = on_located_error;
+		cop_alloc_grp_temps_init(&mem, &alloc, 1024, 1024*1024, 16);
+		evaluation_context_init(&ws, &alloc);
+		if ((f = tmpfile()) == NULL)
+			return unexpected_fail("could not create a temporary file\n");
+		/* Elements of lists and dicts are only evaluated as they are printed. */
+		loaded =
+			(   !((streamed) ? load_streamed(&dut, &ws, p_ejson, strlen(p_ejson), 3, &err) : ejson_load(&dut, &ws, p_ejson, &err))
+			&&  !jnode_fprint(f, &dut, &alloc, 0)
+			);
+		fclose(f);
+
+		if (loaded || !error.reported) {
+			fprintf(stderr, "FAILED: xtest '%s' %s.\n", p_name, (loaded) ? "generated a node" : "reported no location");
+			failed = 1;
+		} else if
+		    (   p_loc->line_nb != line_nb
+		    ||  p_loc->char_pos != char_pos
+		    ||  (   (streamed)
+		        ?   p_loc->p_line != NULL
+		        :   (p_loc->p_line == NULL || strncmp(p_loc->p_line, p_line, strlen(p_line)))
+		        )
+		    ) {
+			fprintf(stderr, "FAILED: xtest '%s' reported the error on line %u character %u (expected line %u character %u)%s.\n", p_name, (unsigned)p_loc->line_nb, (unsigned)p_loc->char_pos, line_nb, char_pos, (streamed) ? " when streamed" : "");
+			failed = 1;
+		}
+		cop_alloc_grp_temps_free(&mem);
+		if (failed)
+			return 1;
+	}
+	printf("PASSED: xtest '%s'\n", p_name);
+	return 0;
+}
+
+/* Loads p_ejson and prints it into f on nb_threads threads. Maps keep memos
+ * so that they are filled in by several threads at once. If no_key_enum is
+ * set and the root is a dict, it is given no enumerate_keys (as a dict
+ * implemented outside of ejson may not have one). */
+static int print_to_file(FILE *f, const char *p_ejson, unsigned nb_threads, int no_key_enum) {
+	struct jnode dut;
+	struct evaluation_context ws;
+	struct ejson_error_handler err;
+	struct cop_salloc_iface alloc;
+	struct cop_alloc_grp_temps mem;
+	struct cop_salloc_iface print_alloc;
+	struct cop_alloc_grp_temps print_mem;
+	int ret;
+
+	err.p_context = stderr;
+	err.on_parser_error = on_parser_error;
+	cop_alloc_grp_temps_init(&mem, &alloc, 1024, 1024*1024, 16);
+	cop_alloc_grp_temps_init(&print_mem, &print_alloc, 1024, 1024*1024, 16);
+	evaluation_context_init(&ws, &alloc);
+	ws.flags = EJSON_FLAG_MEMO_MAPS;
+	if ((ret = ejson_load(&dut, &ws, p_ejson, &err)) == 0) {
+		if (no_key_enum && dut.cls == JNODE_CLS_DICT)
+			dut.d.dict.enumerate_keys = NULL;
+		ret = jnode_fprint_parallel(f, &dut, &print_alloc, 0, nb_threads);
+	}
+	cop_alloc_grp_temps_free(&print_mem);
+	cop_alloc_grp_temps_free(&mem);
+	return ret;
+}
+
+/* Runs a test by printing the document into one temporary file on a single
+ * thread and into another on nb_threads threads (after loading it again so
+ * that nothing has been evaluated yet). The two must be identical. */
+static int run_test_parallel_impl(const char *p_ejson, const char *p_name, unsigned nb_threads, int no_key_enum) {
+	FILE  *f1 = tmpfile();
+	FILE  *f2 = tmpfile();
+	int    failed;
+	if (f1 == NULL || f2 == NULL)
+		return unexpected_fail("could not create temporary files\n");
+	if (print_to_file(f1, p_ejson, 1, no_key_enum) || print_to_file(f2, p_ejson, nb_threads, no_key_enum)) {
+		fprintf(stderr, "FAILED: test '%s' failed due to above messages.\n", p_name);
+		failed = 1;
+	} else {
+		int c1, c2;
+		rewind(f1);
+		rewind(f2);
+		do {
+			c1 = getc(f1);
+			c2 = getc(f2);
+		} while (c1 == c2 && c1 != EOF);
+		if ((failed = (c1 != c2)) != 0)
+			fprintf(stderr, "FAILED: test '%s' printed differently on %u threads.\n", p_name, nb_threads);
+		else
+			printf("PASSED: test '%s'.\n", p_name);
+	}
+	fclose(f1);
+	fclose(f2);
+	return failed;
+}
+
+int run_test_parallel(const char *p_ejson, const char *p_name, unsigned nb_threads) {
+	return run_test_parallel_impl(p_ejson, p_name, nb_threads, 0);
+}
+
+/* As run_test_parallel() but the root dict cannot enumerate its keys alone
+ * so it must not be split. */
+int run_test_parallel_no_key_enum(const char *p_ejson, const char *p_name, unsigned nb_threads) {
+	return run_test_parallel_impl(p_ejson, p_name, nb_threads, 1);
+}
+
+static void on_counted_error(void *p_context, const struct token_pos_info *p_location, const char *p_format, va_list args) {
+	unsigned *p_count = p_context;
+	unsigned  count;
+	do {
+		count = ejson_atomic_load(p_count);
+	} while (!ejson_atomic_cas(p_count, count, count + 1));
+	on_parser_error(stdout, p_location, p_format, args);
+}
+
+/* Runs a test which prints a document which fails on nb_threads threads and
+ * checks that exactly one error is reported, as it is on one thread. */
+int run_test_parallel_error(const char *p_ejson, const char *p_name, unsigned nb_threads) {
+	struct jnode dut;
+	struct evaluation_context ws;
+	struct ejson_error_handler err;
+	struct cop_salloc_iface alloc;
+	struct cop_alloc_grp_temps mem;
+	struct cop_salloc_iface print_alloc;
+	struct cop_alloc_grp_temps print_mem;
+	unsigned nb_errors = 0;
+	FILE *f;
+	int printed;
+
+	if ((f = tmpfile()) == NULL)
+		return unexpected_fail("could not create a temporary file\n");
+	err.p_context = &nb_errors;
+	err.on_parser_error = on_counted_error;
+	cop_alloc_grp_temps_init(&mem, &alloc, 1024, 1024*1024, 16);
+	cop_alloc_grp_temps_init(&print_mem, &print_alloc, 1024, 1024*1024, 16);
+	evaluation_context_init(&ws, &alloc);
+	printed = !ejson_load(&dut, &ws, p_ejson, &err) && !jnode_fprint_parallel(f, &dut, &print_alloc, 0, nb_threads);
+	cop_alloc_grp_temps_free(&print_mem);
+	cop_alloc_grp_temps_free(&mem);
+	fclose(f);
+	if (printed || nb_errors != 1) {
+		fprintf(stderr, "FAILED: xtest '%s' %s and reported %u errors on %u threads.\n", p_name, (printed) ? "printed" : "failed", nb_errors, nb_threads);
+		return 1;
+	}
+	printf("PASSED: xtest '%s'\n", p_name);
+	return 0;
+}
+
+/* A list whose elements record whether they were fetched by a worker other
+ * than the one which started printing (every worker has its own
+ * allocator). */
+struct split_list {
+	struct cop_salloc_iface *p_alloc;
+	unsigned                 stolen;
+};
+
+static int split_list_get_element(struct jnode *p_dest, void *ctx, struct cop_salloc_iface *p_alloc, unsigned idx) {
+	struct split_list *p_list = ctx;
+	if (p_alloc != p_list->p_alloc) {
+		ejson_atomic_store(&(p_list->stolen), 1);
+	} else if (idx == 0) {
+		/* Hold up the first element until another worker has taken part of
+		 * the list, which it can only do if the list was split. */
+		clock_t start = clock();
+		while (!ejson_atomic_load(&(p_list->stolen)) && clock() - start < 5 * CLOCKS_PER_SEC)
+			;
+	}
+	p_dest->cls        = JNODE_CLS_INTEGER;
+	p_dest->d.int_bool = idx;
+	return 0;
+}
+
+/* Runs a test which checks that the first list printed on nb_threads threads
+ * is split so that other threads print some of it. */
+int run_test_split(const char *p_name, unsigned nb_threads) {
+	struct split_list list;
+	struct jnode root;
+	struct cop_salloc_iface alloc;
+	struct cop_alloc_grp_temps mem;
+	FILE *f;
+	int failed;
+
+	if ((f = tmpfile()) == NULL)
+		return unexpected_fail("could not create a temporary file\n");
+	cop_alloc_grp_temps_init(&mem, &alloc, 1024, 1024*1024, 16);
+	list.p_alloc                = &alloc;
+	list.stolen                 = 0;
+	root.cls                    = JNODE_CLS_LIST;
+	root.d.list.ctx             = &list;
+	root.d.list.nb_elements     = 1000;
+	root.d.list.get_elemenent   = split_list_get_element;
+	if (jnode_fprint_parallel(f, &root, &alloc, 0, nb_threads)) {
+		fprintf(stderr, "FAILED: test '%s' could not be printed.\n", p_name);
+		failed = 1;
+	} else if ((failed = !list.stolen) != 0) {
+		fprintf(stderr, "FAILED: test '%s' was printed on one thread.\n", p_name);
+	} else {
+		printf("PASSED: test '%s'.\n", p_name);
+	}
+	cop_alloc_grp_temps_free(&mem);
+	fclose(f);
+	return failed;
+}
+
+/* A thread which reads a frozen document through its own root, allocator
+ * and error handler and compares it with p_ref. */
+struct document_reader {
+	struct ejson_thread          thread;
+	const struct ejson_document *p_document;
+	const char                  *p_ref;
+	unsigned                     nb_errors; /* raised through its own handler */
+	int                          result;    /* as are_different() */
+};
+
+static void on_reader_error(void *p_context, const struct token_pos_info *p_location, const char *p_format, va_list args) {
+	((struct document_reader *)p_context)->nb_errors++;
+}
+
+static void document_reader_main(void *p_arg) {
+	struct document_reader *p_reader = p_arg;
+	struct ejson_error_handler err;
+	struct jnode ref;
+	struct jnode dut;
+	struct cop_salloc_iface a1;
+	struct cop_alloc_grp_temps m1;
+	struct cop_salloc_iface a2;
+	struct cop_alloc_grp_temps m2;
+	struct cop_salloc_iface alloc;
+	struct cop_alloc_grp_temps mem;
+
+	err.p_context = p_reader;
+	err.on_parser_error = on_reader_error;
+	cop_alloc_grp_temps_init(&m1, &a1, 1024, 1024*1024, 16);
+	cop_alloc_grp_temps_init(&m2, &a2, 1024, 1024*1024, 16);
+	cop_alloc_grp_temps_init(&mem, &alloc, 1024, 1024*1024, 16);
+	if (parse_json(&ref, &a1, &a2, p_reader->p_ref))
+		unexpected_fail("could not parse reference JSON:\n  %s\n", p_reader->p_ref);
+	p_reader->result = (ejson_document_root(&dut, p_reader->p_document, &alloc, &err)) ? -1 : are_different(&ref, &dut, &alloc);
+	cop_alloc_grp_temps_free(&mem);
+	cop_alloc_grp_temps_free(&m2);
+	cop_alloc_grp_temps_free(&m1);
+}
+
+/* Runs a test by freezing the document and reading it on nb_threads threads
+ * at once. If should_fail is set, reading the document must fail on every
+ * thread and raise an error through the handler of that thread; p_ref is
+ * still needed for the thread to compare against. */
+int run_test_document(const char *p_ejson, const char *p_ref, const char *p_name, unsigned nb_threads, int should_fail) {
+	struct ejson_document *p_document;
+	struct evaluation_context ws;
+	struct ejson_error_handler err;
+	struct cop_salloc_iface alloc;
+	struct cop_alloc_grp_temps mem;
+	struct document_reader readers[8];
+	unsigned i;
+	int failed = 0;
+
+	if (nb_threads > sizeof(readers) / sizeof(readers[0]))
+		return unexpected_fail("too many threads\n");
+
+	err.p_context = stderr;
+	err.on_parser_error = on_parser_error;
+	cop_alloc_grp_temps_init(&mem, &alloc, 1024, 1024*1024, 16);
+	evaluation_context_init(&ws, &alloc);
+	/* Ignored by frozen documents (readers must not write to them). */
+	ws.flags = EJSON_FLAG_MEMO_MAPS;
+	if ((p_document = ejson_document_load(&ws, p_ejson, &err)) == NULL) {
+		fprintf(stderr, "FAILED: test '%s' failed due to above messages.\n", p_name);
+		cop_alloc_grp_temps_free(&mem);
+		return 1;
+	}
+
+	for (i = 0; i < nb_threads; i++) {
+		readers[i].p_document = p_document;
+		readers[i].p_ref      = p_ref;
+		readers[i].nb_errors  = 0;
+		if (ejson_thread_start(&(readers[i].thread), document_reader_main, &(readers[i])))
+			return unexpected_fail("could not start a thread\n");
+	}
+	for (i = 0; i < nb_threads; i++) {
+		ejson_thread_join(&(readers[i].thread));
+		if (should_fail)
+			failed |= readers[i].result >= 0 || readers[i].nb_errors == 0;
+		else
+			failed |= readers[i].result != 0 || readers[i].nb_errors != 0;
+	}
+	cop_alloc_grp_temps_free(&mem);
+	if (ws.stats.memo_hits != 0) {
+		fprintf(stderr, "FAILED: test '%s' kept memos in a frozen document.\n", p_name);
+		return 1;
+	}
+
+	if (failed)
+		fprintf(stderr, "FAILED: %stest '%s' read differently on one of %u threads.\n", (should_fail) ? "x" : "", p_name, nb_threads);
+	else if (should_fail)
+		printf("PASSED: xtest '%s'\n", p_name);
+	else
+		printf("PASSED: test '%s'.\n", p_name);
+	return failed;
+}
+
 static int test_main(int argc, char *argv[]) {
 	int errors = 0;
 	int tests = 0;
@@ -164,6 +707,599 @@ static int test_main(int argc, char *argv[]) {
 		,"[1,-2,3.4,-4.5,5.6e2,-7.8e-2]"
 		,"numeric objects in a list"
 		);
+	tests++; errors += run_test
+		("[0.3, 1e23, 8.589973e9, 1.7976931348623157e308, 9007199254740993.0, 0.1e1]"
+		,"[0.3, 1e23, 8.589973e9, 1.7976931348623157e308, 9007199254740993.0, 0.1e1]"
+		,"reals are correctly rounded"
+		);
+	tests++; errors += run_test
+		("[3.1415926535897932384626433832795028841971, 1000000000000000000000000000000000000000000001e-45, 9007199254740993.00000000000000000000001]"
+		,"[3.1415926535897932384626433832795028841971, 1000000000000000000000000000000000000000000001e-45, 9007199254740993.00000000000000000000001]"
+		,"reals with more than 19 significant digits"
+		);
+	tests++; errors += run_test
+		("[9223372036854775807, 9223372036854775808, 00012, .5e1]"
+		,"[9223372036854775807, 9223372036854775808.0, 12, 5.0]"
+		,"integers which do not fit in a long long become reals"
+		);
+	tests++; errors += run_test
+		("1e400"
+		,NULL
+		,"reals which are too large fail to parse"
+		);
+	tests++; errors += run_test
+		("1.e3"
+		,NULL
+		,"reals must have digits after the decimal point"
+		);
+
+	/* Codepoint escapes */
+	tests++; errors += run_test
+		("[\"\\u0041\\u00e9\\u20AC\\ud83d\\ude00\", \"a\\u002fb\\n\\u07FF\\u0800\\uFFFF\\uDBFF\\uDFFF\"]"
+		,"[\"A\xc3\xa9\xe2\x82\xac\xf0\x9f\x98\x80\", \"a/b\n\xdf\xbf\xe0\xa0\x80\xef\xbf\xbf\xf4\x8f\xbf\xbf\"]"
+		,"codepoint escapes are converted to UTF-8"
+		);
+	tests++; errors += run_test
+		("access {\"\\u00fcber\": 1} \"\xc3\xbc" "ber\""
+		,"1"
+		,"codepoint escapes in dictionary keys"
+		);
+	tests++; errors += run_test
+		("\"\\ud83d\""
+		,NULL
+		,"unpaired high surrogate"
+		);
+	tests++; errors += run_test
+		("\"\\ud83d\\u0041\""
+		,NULL
+		,"high surrogate followed by a non-surrogate"
+		);
+	tests++; errors += run_test
+		("\"\\ude00\""
+		,NULL
+		,"unpaired low surrogate"
+		);
+	tests++; errors += run_test
+		("\"\\u0000\""
+		,NULL
+		,"NUL codepoint escape"
+		);
+	tests++; errors += run_test
+		("\"\\u12G4\""
+		,NULL
+		,"malformed codepoint escape"
+		);
+
+	/* UTF-8 validation */
+	tests++; errors += run_test_with_flags
+		("# \xe2\x82\xac comment\n[\"0123456789abcdef0123456789abcdef\xc3\xa9\xf0\x9f\x98\x80\xed\x9f\xbf\"]"
+		,"[\"0123456789abcdef0123456789abcdef\xc3\xa9\xf0\x9f\x98\x80\xed\x9f\xbf\"]"
+		,"valid UTF-8 passes validation"
+		,EJSON_FLAG_VALIDATE_UTF8
+		);
+	tests++; errors += run_test
+		("\"\xff\""
+		,"\"\xff\""
+		,"invalid UTF-8 is passed through when not validating"
+		);
+	tests++; errors += run_test_with_flags
+		("[\"0123456789abcdef0123456789abcdef\",\n \"\xff\"]"
+		,NULL
+		,"invalid byte fails validation"
+		,EJSON_FLAG_VALIDATE_UTF8
+		);
+	tests++; errors += run_test_with_flags
+		("\"\xc0\xaf\""
+		,NULL
+		,"overlong sequence fails validation"
+		,EJSON_FLAG_VALIDATE_UTF8
+		);
+	tests++; errors += run_test_with_flags
+		("\"\xed\xa0\x80\""
+		,NULL
+		,"encoded surrogate fails validation"
+		,EJSON_FLAG_VALIDATE_UTF8
+		);
+	tests++; errors += run_test_with_flags
+		("\"\xf4\x90\x80\x80\""
+		,NULL
+		,"codepoint above U+10FFFF fails validation"
+		,EJSON_FLAG_VALIDATE_UTF8
+		);
+	tests++; errors += run_test_with_flags
+		("\"\xe2\x82\""
+		,NULL
+		,"truncated sequence fails validation"
+		,EJSON_FLAG_VALIDATE_UTF8
+		);
+
+	/* Length delimited documents. Each document is followed by bytes which
+	 * would change the result (or make it invalid) if they were examined. */
+	tests++; errors += run_test_n
+		("[1, 2]garbage"
+		,6
+		,"[1, 2]"
+		,"length delimited document"
+		);
+	tests++; errors += run_test_n
+		("12345"
+		,3
+		,"123"
+		,"length delimited document ending in an integer"
+		);
+	tests++; errors += run_test_n
+		("1.2e12"
+		,5
+		,"1.2e1"
+		,"length delimited document ending in an exponent"
+		);
+	tests++; errors += run_test_n
+		("1.2e+5"
+		,5
+		,NULL
+		,"length delimited document ending in an incomplete exponent"
+		);
+	tests++; errors += run_test_n
+		("0x1234"
+		,4
+		,"18"
+		,"length delimited document ending in a hex integer"
+		);
+	tests++; errors += run_test_n
+		("truest"
+		,4
+		,"true"
+		,"length delimited document ending in a keyword"
+		);
+	tests++; errors += run_test_n
+		("define x = 5; x2"
+		,15
+		,"5"
+		,"length delimited document ending in an identifier"
+		);
+	tests++; errors += run_test_n
+		("\"abc\""
+		,4
+		,NULL
+		,"length delimited document ending inside a string"
+		);
+	tests++; errors += run_test_n
+		("\"a\\u0041\""
+		,7
+		,NULL
+		,"length delimited document ending inside a codepoint escape"
+		);
+	tests++; errors += run_test_n
+		("1 # comment\n+ 1"
+		,11
+		,"1"
+		,"length delimited document ending inside a comment"
+		);
+	tests++; errors += run_test_n
+		("1 >= 1"
+		,3
+		,NULL
+		,"length delimited document ending inside an operator"
+		);
+	tests++; errors += run_test_n
+		("[\"a\", \"b\0c\"]"
+		,12
+		,NULL
+		,"length delimited document with a NUL in a string"
+		);
+	tests++; errors += run_test_n
+		("                                        [\"0123456789012345678901234567890123456789\"]                                        garbage"
+		,124
+		,"[\"0123456789012345678901234567890123456789\"]"
+		,"length delimited document with long runs of whitespace and a long string"
+		);
+	tests++; errors += run_test_n
+		("1 # a comment which is longer than any block the scanner loads at once\n"
+		,70
+		,"1"
+		,"length delimited document ending in a long comment"
+		);
+
+	/* Streamed documents */
+	tests++; errors += run_test_streamed
+		("# leading comment\r\n"
+		 "define xs = [0x1F, 1.25e2, .5, 123456789012];\r\n"
+		 "define truest = true;\n"
+		 "{ \"list\": xs + (range [1, 3])  # comment\r\n"
+		 ", \"cmp\": [3 <= 4, 3 >= 4, 1 == 1, 1 != 1, 2 < 1, 2 > 1, not truest]\r"
+		 ", \"str\": \"a\\tb \\ud83d\\ude00 \\u00e9 \xc3\xa9\"\n"
+		 ", \"dict\": access {\"k\\u00fcy\": format [\"%d-%s\", 12, \"x\"]} \"k\xc3\xbcy\"\n"
+		 "}   # trailing comment"
+		,"{\"list\": [31, 125.0, 0.5, 123456789012, 1, 2, 3]"
+		 ",\"cmp\": [true, false, true, false, false, true, false]"
+		 ",\"str\": \"a\tb \xf0\x9f\x98\x80 \xc3\xa9 \xc3\xa9\""
+		 ",\"dict\": \"12-x\"}"
+		,"streamed document"
+		,EJSON_FLAG_VALIDATE_UTF8
+		);
+	tests++; errors += run_test_streamed
+		("[1, \"unterminated]"
+		,NULL
+		,"streamed document ending inside a string"
+		,0
+		);
+	tests++; errors += run_test_streamed
+		("[\"0123456789abcdef\",\n \"\xe2\x82\"]"
+		,NULL
+		,"streamed document with a truncated UTF-8 sequence"
+		,EJSON_FLAG_VALIDATE_UTF8
+		);
+	tests++; errors += run_test_streamed
+		("  # nothing\r\n"
+		,NULL
+		,"streamed document with no tokens"
+		,0
+		);
+
+	/* Literals with more children than fit in a fixed size parser buffer */
+	{
+		static char big_ejson[1200000];
+		static char big_ref[1200000];
+		size_t      el = 0, rl = 0;
+		int         i;
+		el += sprintf(big_ejson + el, "[");
+		for (i = 0; i < 100000; i++)
+			el += sprintf(big_ejson + el, (i) ? ",%d" : "%d", i);
+		sprintf(big_ejson + el, "]");
+		tests++; errors += run_test
+			(big_ejson
+			,big_ejson
+			,"list with 100000 elements"
+			);
+
+		el = 0;
+		rl = 0;
+		el += sprintf(big_ejson + el, "[{");
+		rl += sprintf(big_ref + rl, "[{");
+		for (i = 0; i < 1000; i++) {
+			el += sprintf(big_ejson + el, "%s\"k%d\": [%d, {\"v\": %d}]", (i) ? ", " : "", i, i, i);
+			rl += sprintf(big_ref + rl, "%s\"k%d\": [%d, {\"v\": %d}]", (i) ? ", " : "", i, i, i);
+		}
+		el += sprintf(big_ejson + el, "}, call func [");
+		for (i = 0; i < 200; i++)
+			el += sprintf(big_ejson + el, (i) ? ",a%d" : "a%d", i);
+		el += sprintf(big_ejson + el, "] a0 + a199 [");
+		for (i = 0; i < 200; i++)
+			el += sprintf(big_ejson + el, (i) ? ",%d" : "%d", i);
+		sprintf(big_ejson + el, "]]");
+		sprintf(big_ref + rl, "}, 199]");
+		tests++; errors += run_test
+			(big_ejson
+			,big_ref
+			,"nested dict with 1000 keys and a function with 200 parameters"
+			);
+	}
+
+	/* Lists and dicts which are plain JSON are parsed straight into tapes.
+	 * These mix them with EJSON so that parsing has to fall back part way
+	 * through values which looked like plain JSON. */
+	tests++; errors += run_test
+		("[[1, -2, 3.5e1, \"a\", null, true, {}], [], {\"b\": {\"c\": [false]}, \"a\": -0.5}] + [[4]]"
+		,"[[1, -2, 35.0, \"a\", null, true, {}], [], {\"a\": -0.5, \"b\": {\"c\": [false]}}, [4]]"
+		,"plain JSON values combined with EJSON"
+		);
+	tests++; errors += run_test
+		("define x = {\"k1\": [1, 2], \"k0\": {\"n\": [3, [4, 5]]}, \"k2\": \"s\"}; [access access x \"k0\" \"n\", access x \"k2\", access access x \"k1\" 1, access {\"a\": [6]} \"a\"]"
+		,"[[3, [4, 5]], \"s\", 2, [6]]"
+		,"access into plain JSON values"
+		);
+	tests++; errors += run_test_with_flags
+		("define t = [1, 2.5, \"s\", null, true]; define f = func [a, b] [b, a * 2 - 1];\n"
+		 "(map func [x] call f [x, access t x] range [5]) + [(access t 1) * 2, not access t 4, -(access t 0)]"
+		,"[[1, -1], [2.5, 1], [\"s\", 3], [null, 5], [true, 7], 5.0, false, -1]"
+		,"scalars passed through functions, ranges and plain JSON lists"
+		,EJSON_FLAG_NO_FOLD
+		);
+	tests++; errors += run_test
+		("define xs = map func [x] x * x range [4]; define g = func [n] (access xs n) + n;\n"
+		 "[call g [1], call g [3], xs + xs, map func [i] access xs i [3, 0]]"
+		,"[2, 12, [0, 1, 4, 9, 0, 1, 4, 9], [9, 0]]"
+		,"defines which are used from several places"
+		);
+	tests++; errors += run_test_in_document_alloc
+		("define d = map func [x] [x*10, x*10+1, x*10+2] range [3];\n"
+		 "access [d, d] ((0 * access (access d 1) 1) + (0 * access (range [50]) 7))"
+		,"[[0, 1, 2], [10, 11, 12], [20, 21, 22]]"
+		,"define first used while the document allocator was saved"
+		);
+	tests++; errors += run_test_with_flags
+		("define m = map func [x] if x % 2 == 0 x * 1.5 x == 3 range [6]; define big = map func [x] x * x range [2000];\n"
+		 "[access m 0, access m 1, access m 2, access m 3, m, m, access big 1999, access big 1999, map func [x] x range [0]]"
+		,"[0.0, false, 3.0, true, [0.0, false, 3.0, true, 6.0, false], [0.0, false, 3.0, true, 6.0, false], 3996001, 3996001, []]"
+		,"elements of maps which are read more than once"
+		,EJSON_FLAG_MEMO_MAPS
+		);
+	tests++; errors += run_test_memo_hits
+		("define m = map func [x] x * 2 range [4]; define big = map func [x] x range [2000];\n"
+		 "[access m 1, access m 1, m, access big 1999, access big 1999]"
+		,"[2, 2, [0, 2, 4, 6], 1999, 1999]"
+		,"elements of a map are taken from its memo when they are read again"
+		,EJSON_FLAG_MEMO_MAPS
+		,2
+		);
+	tests++; errors += run_test_memo_hits
+		("define m = map func [x] x * 2 range [4];\n"
+		 "[access m 1, access m 1, m]"
+		,"[2, 2, [0, 2, 4, 6]]"
+		,"maps do not keep memos unless asked to"
+		,0
+		,0
+		);
+	tests++; errors += run_test
+		("define g = func [a, b] map func [c] call func [d, e] [a, b, c, d, e] [c * 2, c * 3] range [2];\n"
+		 "[call g [7, 8], map func [i] map func [j] map func [k] i * 100 + j * 10 + k range [2] range [2] range [2]]"
+		,"[[[7, 8, 0, 0, 0], [7, 8, 1, 2, 3]], [[[0, 1], [10, 11]], [[100, 101], [110, 111]]]]"
+		,"arguments of nested functions"
+		);
+	tests++; errors += run_test
+		("define inner = map func [x] x * 10 range [4]; define g = func [k] map func [y] [k, y] map func [x] x + k inner;\n"
+		 "[map func [x] x + 1 inner, call g [5], map func [x] x - 1 map func [x] x * 2 [3, 2.5, 1], map func [f] call f [2] map func [x] func [y] x * y range [3], inner]"
+		,"[[1, 11, 21, 31], [[5, 5], [5, 15], [5, 25], [5, 35]], [5, 4.0, 1], [0, 2, 4], [0, 10, 20, 30]]"
+		,"maps of maps"
+		);
+	tests++; errors += run_test
+		("[(range [3]) + (range [3, 5]) + (range [7, 2, 11]) + (range [0]) + (range [2]), access ((range [4, 4]) + (range [6, 6]) + (range [8, 2, 10])) 3, (range [3, 1]) + (range [0, -2]), (range [2]) + (range [2])]"
+		,"[[0, 1, 2, 3, 4, 5, 7, 9, 11, 0, 1], 10, [3, 2, 1, 0, -1, -2], [0, 1, 0, 1]]"
+		,"concatenations of ranges"
+		);
+	tests++; errors += run_test
+		("[[1, [2, [3, {\"a\": [4, 1 + 1]}]], [5, 6]], {\"b\": [7, {\"c\": -(8)}]}]"
+		,"[[1, [2, [3, {\"a\": [4, 2]}]], [5, 6]], {\"b\": [7, {\"c\": -8}]}]"
+		,"EJSON deep inside values which start as plain JSON"
+		);
+	tests++; errors += run_test
+		("[-2 ^ 2, {\"a\": 1}]"
+		,"[-4.0, {\"a\": 1}]"
+		,"negative number followed by an operator"
+		);
+	tests++; errors += run_test
+		("{\"a\": [1], \"b\": 2, \"a\": 3}"
+		,NULL
+		,"duplicate keys in a plain JSON dict"
+		);
+	tests++; errors += run_test_printed
+		("[{\"b\": 1, \"a\": 2, \"ab\": [3]}, {\"b\": (1), \"a\": 2, \"ab\": [3]}]"
+		,"[{\"a\": 2\n ,\"ab\": [3\n  ]\n ,\"b\": 1\n }\n,{\"a\": 2\n ,\"ab\": [3\n  ]\n ,\"b\": 1\n }\n]\n"
+		,"plain JSON dicts print their keys in the same order as other dicts"
+		);
+	tests++; errors += run_test_streamed
+		("[{\"a\": [1, 2, {\"b\": 3}]}, [[4], 5 * 6], \"x\"]"
+		,"[{\"a\": [1, 2, {\"b\": 3}]}, [[4], 30], \"x\"]"
+		,"streamed mix of plain JSON and EJSON"
+		,0
+		);
+	tests++; errors += run_test_streamed
+		("[1, [-2 ^ 2], {\"a\": -3 ^ 2, \"b\": -1}]"
+		,"[1, [-4.0], {\"a\": -9.0, \"b\": -1}]"
+		,"streamed negative numbers followed by an operator"
+		,0
+		);
+	tests++; errors += run_test_error_location
+		("[1,\n  2 3]"
+		,2, 5, "  2 3]"
+		,"location of a parse error"
+		);
+	tests++; errors += run_test_error_location
+		("define a = 1;\n[a,\n  a + true]"
+		,3, 5, "  a + true]"
+		,"location of an evaluation error"
+		);
+	tests++; errors += run_test_error_location
+		("[1, 2,\n 3, {\"a\": 1,\n  \"b\": -\"x\"}]"
+		,3, 8, "  \"b\": -\"x\"}]"
+		,"location of an error in a unary negation inside plain JSON"
+		);
+	tests++; errors += run_test_error_location
+		("[true,\n   not 1]"
+		,2, 4, "   not 1]"
+		,"location of an error in a unary not"
+		);
+	tests++; errors += run_test_with_flags
+		(" {\"a\": [1, 2.5, -3, true, false, null], \"b\": {\"\": \"c\"}} "
+		,"{\"a\": [1, 2.5, -3, true, false, null], \"b\": {\"\": \"c\"}}"
+		,"plain JSON document"
+		,EJSON_FLAG_PLAIN_JSON
+		);
+	tests++; errors += run_test_with_flags
+		("-12"
+		,"-12"
+		,"plain JSON scalar document"
+		,EJSON_FLAG_PLAIN_JSON
+		);
+	tests++; errors += run_test_with_flags
+		("[1, 2] + [3]"
+		,NULL
+		,"EJSON expression in a plain JSON document"
+		,EJSON_FLAG_PLAIN_JSON
+		);
+	tests++; errors += run_test_with_flags
+		("[1, {\"a\": x}]"
+		,NULL
+		,"identifier in a plain JSON document"
+		,EJSON_FLAG_PLAIN_JSON
+		);
+
+	/* Constant list and dict literals which are not plain JSON are built
+	 * once when they are parsed. */
+	tests++; errors += run_test
+		("define t = {(\"a\"): [(1), 2], \"b\": {(\"c\"): (3)}}; [access access t \"b\" \"c\", access access t \"a\" 1, t]"
+		,"[3, 2, {\"a\": [1, 2], \"b\": {\"c\": 3}}]"
+		,"access into a constant dict"
+		);
+	tests++; errors += run_test
+		("map func [x] [access {(\"a\"): [(1), 2], \"b\": [(3)]} x, [(x), (4)]] [\"a\", \"b\"]"
+		,"[[[1, 2], [\"a\", 4]], [[3], [\"b\", 4]]]"
+		,"constant literals in a function body"
+		);
+	tests++; errors += run_test
+		("call func [x] {(\"a\"): 1, (\"a\"): x} [2]"
+		,NULL
+		,"duplicate keys in a constant dict literal"
+		);
+
+	/* Expressions with constant operands are folded while parsing. Those
+	 * which would raise an error must only do so if they are evaluated. */
+	tests++; errors += run_test
+		("define k = 3; [k * 2 + 1, -(4 - k), not (k > 2), format [\"%d%s\", k, \"x\"], access [5, 6, 7] (k - 2), if k == 3 \"y\" \"n\", range [k]]"
+		,"[7, -1, false, \"3x\", 6, \"y\", [0, 1, 2]]"
+		,"folding constant expressions"
+		);
+	tests++; errors += run_test_with_flags
+		("define k = 3; [k * 2 + 1, -(4 - k), not (k > 2), format [\"%d%s\", k, \"x\"], access [5, 6, 7] (k - 2), if k == 3 \"y\" \"n\", range [k]]"
+		,"[7, -1, false, \"3x\", 6, \"y\", [0, 1, 2]]"
+		,"constant expressions without folding"
+		,EJSON_FLAG_NO_FOLD
+		);
+	tests++; errors += run_test_with_scratch
+		("define k = 3; [k * 2 + 1, -(4 - k), not (k > 2), format [\"%d%s\", k, \"x\"], access [5, 6, 7] (k - 2), if k == 3 \"y\" \"n\", range [k], access {\"a\": format [\"%s!\", \"b\"]} \"a\", [1] + [k]]"
+		,"[7, -1, false, \"3x\", 6, \"y\", [0, 1, 2], \"b!\", [1, 3]]"
+		,"folding constant expressions with a separate scratch allocator"
+		);
+	tests++; errors += run_test
+		("[if false 1 % 0 2, if true 3 (\"a\" + 1), call func [x] if x 4 (1 % 0) [true]]"
+		,"[2, 3, 4]"
+		,"constant expressions which fail are not evaluated unless needed"
+		);
+	tests++; errors += run_test
+		("2 % (1 - 1)"
+		,NULL
+		,"modulo by zero"
+		);
+
+	/* Deeply nested documents */
+	{
+		static char deep_ejson[400000];
+		size_t      el = 0;
+		int         i;
+		for (i = 0; i < EJSON_DEFAULT_MAX_DEPTH - 1; i++)
+			el += sprintf(deep_ejson + el, "[");
+		el += sprintf(deep_ejson + el, "1");
+		for (i = 0; i < EJSON_DEFAULT_MAX_DEPTH - 1; i++)
+			el += sprintf(deep_ejson + el, "]");
+		tests++; errors += run_test
+			(deep_ejson
+			,deep_ejson
+			,"lists nested up to the maximum depth"
+			);
+
+		el = 0;
+		for (i = 0; i < EJSON_DEFAULT_MAX_DEPTH + 1; i++)
+			el += sprintf(deep_ejson + el, "[\n");
+		for (i = 0; i < EJSON_DEFAULT_MAX_DEPTH + 1; i++)
+			el += sprintf(deep_ejson + el, "]\n");
+		tests++; errors += run_test
+			(deep_ejson
+			,NULL
+			,"lists nested beyond the maximum depth"
+			);
+
+		el = 0;
+		for (i = 0; i < 2000; i++)
+			el += sprintf(deep_ejson + el, "-");
+		el += sprintf(deep_ejson + el, "(");
+		for (i = 0; i < 2000; i++)
+			el += sprintf(deep_ejson + el, "(");
+		el += sprintf(deep_ejson + el, "1");
+		for (i = 0; i < 2000; i++)
+			el += sprintf(deep_ejson + el, ")");
+		el += sprintf(deep_ejson + el, ")");
+		tests++; errors += run_test
+			(deep_ejson
+			,"1"
+			,"deeply nested unary operators and parentheses"
+			);
+
+		el = sprintf(deep_ejson, "0");
+		for (i = 0; i < 100000; i++)
+			el += sprintf(deep_ejson + el, "+1");
+		tests++; errors += run_test
+			(deep_ejson
+			,"100000"
+			,"long chains of binary operators do not count towards the depth"
+			);
+
+		el = sprintf(deep_ejson, "map func [x] x");
+		for (i = 0; i < 40; i++)
+			el += sprintf(deep_ejson + el, " + x");
+		sprintf(deep_ejson + el, " range [4]");
+		tests++; errors += run_test
+			(deep_ejson
+			,"[0, 41, 82, 123]"
+			,"chains of binary operators which are evaluated for every element"
+			);
+
+		tests++; errors += run_test
+			("define f = func [f, n] if n == 0 0 call f [f, n + 1];\n"
+			 "call f [f, 1]"
+			,NULL
+			,"unbounded recursion is stopped at the maximum depth"
+			);
+	}
+	tests++; errors += run_test
+		("1 + @"
+		,NULL
+		,"invalid token after a binary operator"
+		);
+
+	/* Keywords and identifiers */
+	tests++; errors += run_test
+		("define nul = 1; define nulls = 2; define iff = 3; define tru = 4; define falsey = 5; define mapp = 6; define o = 7;\n"
+		 "[nul, nulls, iff, tru, falsey, mapp, o]"
+		,"[1,2,3,4,5,6,7]"
+		,"identifiers which are prefixes or extensions of keywords"
+		);
+	tests++; errors += run_test
+		("define tree = 1; define cool = 2; define nut = 3; define mop = 4; define fade = 5; [tree, cool, nut, mop, fade]"
+		,"[1,2,3,4,5]"
+		,"identifiers which share a keyword hash slot but not the keyword"
+		);
+
+	/* Whitespace and comments */
+	tests++; errors += run_test
+		("# leading comment\r\n[1,\t# trailing comment\n  2,\r\n\r\n                                        3]   # end"
+		,"[1,2,3]"
+		,"comments and mixed line endings between tokens"
+		);
+	tests++; errors += run_test
+		("[1, 2] #"
+		,"[1,2]"
+		,"comment at end of document"
+		);
+
+	/* String escapes and lengths */
+	tests++; errors += run_test
+		("\"tab\\there \\\\ and a \\/ slash\""
+		,"\"tab\there \\ and a / slash\""
+		,"string escape sequences are decoded"
+		);
+	tests++; errors += run_test
+		("{\"key\\n\": [\"a\\rb\", \"\"]}"
+		,"{\"key\n\": [\"a\rb\", \"\"]}"
+		,"escaped dictionary keys and empty strings"
+		);
+	{
+		static char long_ejson[20010];
+		static char long_ref[20010];
+		memset(long_ejson, 'x', 20005);
+		long_ejson[0]     = '\"';
+		long_ejson[20004] = '\"';
+		long_ejson[20005] = '\0';
+		memcpy(long_ref, long_ejson, sizeof(long_ejson));
+		long_ejson[9000]  = '\\';
+		long_ejson[9001]  = 'n';
+		long_ref[9000]    = '\n';
+		memmove(long_ref + 9001, long_ref + 9002, 20005 - 9001);
+		tests++; errors += run_test
+			(long_ejson
+			,long_ref
+			,"strings longer than 4096 characters"
+			);
+	}
 
 	/* Hexadecimal numeric extensions */
 	tests++; errors += run_test
@@ -186,6 +1322,16 @@ static int test_main(int argc, char *argv[]) {
 		,"79"
 		,"hex int objects"
 		);
+	tests++; errors += run_test
+		("0x7FFFFFFFFFFFFFFF"
+		,"9223372036854775807"
+		,"hex int objects"
+		);
+	tests++; errors += run_test
+		("0x10000000000000000"
+		,NULL
+		,"hex int objects which do not fit in 64 bits fail to parse"
+		);
 
 	/* Binary and unary expression tests */
 	tests++; errors += run_test
@@ -290,6 +1436,26 @@ static int test_main(int argc, char *argv[]) {
 		,"[1,2,3,4,5,6,7,8,9,10]"
 		,"list concatenation incl. a range and function"
 		);
+	tests++; errors += run_test
+		("define f = func [x] [x, x + 1]; define a = [1] + call f [2];\n"
+		 "[a + [3], a + call f [4], a, (call f [5]) + a + a]"
+		,"[[1, 2, 3, 3], [1, 2, 3, 4, 5], [1, 2, 3], [5, 6, 1, 2, 3, 1, 2, 3]]"
+		,"list concatenation of lists which refer to function arguments"
+		);
+	{
+		static char cat_ejson[20000];
+		size_t      el = 0;
+		int         i;
+		el += sprintf(cat_ejson + el, "define l = [0]");
+		for (i = 1; i < 1000; i++)
+			el += sprintf(cat_ejson + el, " + [%d]", i);
+		sprintf(cat_ejson + el, "; [access l 0, access l 1, access l 500, access l 999, access (l + l) 1999]");
+		tests++; errors += run_test
+			(cat_ejson
+			,"[0, 1, 500, 999, 999]"
+			,"long chains of list concatenations"
+			);
+	}
 
 	/* range tests */
 	tests++; errors += run_test
@@ -579,6 +1745,28 @@ static int test_main(int argc, char *argv[]) {
 		,"[\"036-c.wav\", \"037-d.wav\", \"038-e.wav\", \"039-c.wav\", \"040-d.wav\"]"
 		,"test using format to generate mapped strings"
 		);
+	tests++; errors += run_test
+		("format[\"%99999d\", 1]"
+		,NULL
+		,"format with a result which is too long"
+		);
+	tests++; errors += run_test
+		("format[\"%0000000000000000000000000000000000000001d\", 1]"
+		,NULL
+		,"format with a specifier which is too long"
+		);
+	{
+		/* A string argument which is longer than any formatted string. */
+		static char long_format[20100];
+		size_t n = sprintf(long_format, "format[\"<%%s>\", \"");
+		memset(long_format + n, 'x', 20000);
+		strcpy(long_format + n + 20000, "\"]");
+		tests++; errors += run_test
+			(long_format
+			,NULL
+			,"format with a string argument which is too long"
+			);
+	}
 	tests++; errors += run_test
 		("call access [func[x] x+1, func[x] x+2, func[x] x+3] 1 [10]"
 		,"12"
@@ -617,6 +1805,68 @@ static int test_main(int argc, char *argv[]) {
 		,"test if with a greater than condition that is false"
 		);
 
+	tests++; errors += run_test_split
+		("the first list printed on several threads is split"
+		,4
+		);
+
+	/* Printing on several threads. The defines, the memo of b and the
+	 * concatenation c are first used by several threads at once. */
+	tests++; errors += run_test_parallel
+		("define a = map func [x] x + 1 range [100]; define b = map func [x] (access a x) * 2.5 range [100]; define c = [0] + [1];\n"
+		 "map func [i] [access b (i % 100), c + [i], format [\"%d\", i], map func [j] j * i range [i % 4]] range [2000]"
+		,"map over a range printed on several threads"
+		,4
+		);
+	tests++; errors += run_test_parallel
+		("define g = func [r] {\"id\": r, \"sq\": r * r};\n"
+		 "{\"empty\": [], \"one\": [1], \"records\": map func [r] call g [r] range [500], \"rows\": [[1, 2], [3, 4], {\"x\": [5]}]}"
+		,"lists inside a dict printed on several threads"
+		,3
+		);
+	tests++; errors += run_test_parallel
+		("define s = func [n] {\"n\": n, \"sum\": map func [x] x * n range [300], \"sub\": {\"a\": [n], \"b\": {}, \"c\": \"n\"}};\n"
+		 "{\"s1\": call s [1], \"flag\": true, \"s2\": call s [2], \"s3\": {\"x\": call s [3], \"y\": call s [4], \"z\": null}, \"s5\": [call s [5], call s [6]], \"r\": 2.5}"
+		,"sibling dict values printed on several threads"
+		,4
+		);
+	tests++; errors += run_test_parallel
+		("define t = {\"a\": 1, \"b\": [2, 3], \"c\": {\"d\": 4}, \"e\": \"f\", \"g\": null, \"h\": [], \"i\": {}, \"j\": [[5], {\"k\": 6}], \"l\": true, \"m\": 7.5};\n"
+		 "define w = func [n] {\"k0\": n, \"k1\": [n], \"k2\": t, \"k3\": \"s\", \"k4\": map func [x] x + n range [50], \"k5\": false, \"k6\": {\"v\": n * 2}, \"k7\": null, \"k8\": range [n % 7], \"k9\": {}};\n"
+		 "{\"t\": t, \"w1\": call w [1], \"w2\": call w [2], \"x\": 0, \"ws\": map func [n] call w [n] range [200], \"y\": \"z\", \"w3\": call w [3]}"
+		,"dicts of scalars and containers split by key on several threads"
+		,4
+		);
+	tests++; errors += run_test_parallel_no_key_enum
+		("{\"a\": map func [x] [x, {\"y\": x}] range [300], \"b\": 1, \"c\": {\"d\": range [200], \"e\": \"f\"}, \"g\": null}"
+		,"dict without enumerate_keys printed on several threads"
+		,4
+		);
+	tests++; errors += run_test_parallel_error
+		("define f = func [x] access [1] (x + 1);\n"
+		 "{\"a\": 1, \"b\": map func [x] call f [x] range [2000], \"c\": map func [x] call f [x] range [2000]}"
+		,"every element failing on several threads reports one error"
+		,4
+		);
+
+	/* Frozen documents read on several threads at once. */
+	tests++; errors += run_test_document
+		("define a = map func [x] x * 3 range [5]; define b = {\"k\": a, \"n\": access a 4}; define c = [1] + [2];\n"
+		 "{\"b\": b, \"sum\": c + [access a 2], \"again\": c + [4], \"c\": c}"
+		,"{\"b\": {\"k\": [0, 3, 6, 9, 12], \"n\": 12}, \"sum\": [1, 2, 6], \"again\": [1, 2, 4], \"c\": [1, 2]}"
+		,"frozen document read on several threads"
+		,4
+		,0
+		);
+	tests++; errors += run_test_document
+		("define bad = access [1] 5; define worse = bad + [1];\n"
+		 "{\"ok\": 1, \"bad\": worse}"
+		,"{\"ok\": 1, \"bad\": [1]}"
+		,"errors in the defines of a frozen document are raised by each reader"
+		,3
+		,1
+		);
+
 
 
 
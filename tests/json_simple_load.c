@@ -1,6 +1,6 @@
 #include "json_simple_load.h"
 #include <string.h>
-#include <math.h>
+#include <stdlib.h>
 #include "ejson/src/parse_helpers.h"
 #include "cop/cop_strdict.h"
 
@@ -85,6 +85,31 @@ static int dict_enumerate(jdict_enumerate_fn *p_fn, void *p_ctx, struct cop_sall
 			);
 }
 
+struct jenum_keys_ctx {
+	void                    *p_userctx;
+	jdict_key_fn            *p_fn;
+
+};
+
+static int dict_enumerate_keys_sub(void *p_context, struct cop_strdict_node *p_node, int depth) {
+	struct jenum_keys_ctx *p_ctx = p_context;
+	struct cop_strh        key;
+	cop_strdict_node_to_key(p_node, &key);
+	return p_ctx->p_fn((char *)key.ptr, p_ctx->p_userctx) ? 1 : 0;
+}
+
+static int dict_enumerate_keys(jdict_key_fn *p_fn, void *p_ctx, void *p_userctx) {
+	struct jenum_keys_ctx ctx;
+	ctx.p_userctx = p_userctx;
+	ctx.p_fn = p_fn;
+	return
+		cop_strdict_enumerate
+			((struct cop_strdict_node *)p_ctx
+			,dict_enumerate_keys_sub
+			,&ctx
+			);
+}
+
 /* <0 for error >0 for not found 0 for found. */
 static int dict_get_by_key(struct jnode *p_dest, void *ctx, struct cop_salloc_iface *p_alloc, const char *p_key) {
 	struct jdictnode *data;
@@ -180,41 +205,37 @@ static int expect_object(const char **pp_buf, struct jnode *p_root, struct cop_s
 			}
 		}
 		p_root->cls               = JNODE_CLS_DICT;
-		p_root->d.dict.nb_keys    = nb_keys;
-		p_root->d.dict.ctx        = p_dict_root;
-		p_root->d.dict.enumerate  = dict_enumerate;
-		p_root->d.dict.get_by_key = dict_get_by_key;
+		p_root->d.dict.nb_keys        = nb_keys;
+		p_root->d.dict.ctx            = p_dict_root;
+		p_root->d.dict.enumerate      = dict_enumerate;
+		p_root->d.dict.get_by_key     = dict_get_by_key;
+		p_root->d.dict.enumerate_keys = dict_enumerate_keys;
 	} else {
 		int neg = !expect_char(pp_buf, '-');
+		const char *p_num = *pp_buf;
 		unsigned d;
 		unsigned long long ipart;
 		if (expect_num(pp_buf, &ipart))
 			return -1;
 		p_root->cls = JNODE_CLS_INTEGER;
 		if (!expect_char(pp_buf, '.')) {
-			double frac = 0.1;
-			double fp = 0.0;
 			if (expect_decimal_digit(pp_buf, &d))
 				return -1;
-			do {
-				fp   += frac * (int)d;
-				frac *= 0.1;
-			} while (!expect_decimal_digit(pp_buf, &d));
+			while (!expect_decimal_digit(pp_buf, &d));
 			p_root->cls = JNODE_CLS_REAL;
-			p_root->d.real = fp + ipart;
 		}
 		if ((!expect_char(pp_buf, 'e')) || (!expect_char(pp_buf, 'E'))) {
-			int pos_exp = (!expect_char(pp_buf, '+')) || expect_char(pp_buf, '-');
 			unsigned long long num;
-			int expval;
+			if (expect_char(pp_buf, '+'))
+				(void)expect_char(pp_buf, '-');
 			if (expect_num(pp_buf, &num))
 				return -1;
-			expval = (pos_exp) ? (int)num : -(int)num;
-			if (p_root->cls != JNODE_CLS_REAL)
-				p_root->d.real = ipart;
-			p_root->d.real *= pow(10.0, expval);
 			p_root->cls = JNODE_CLS_REAL;
 		}
+		/* Reals are converted by the C library so that the tests can check
+		 * that ejson rounds correctly. */
+		if (p_root->cls == JNODE_CLS_REAL)
+			p_root->d.real = strtod(p_num, NULL);
 		if (p_root->cls == JNODE_CLS_INTEGER) {
 			p_root->d.int_bool = (long long)ipart;
 			if (neg)
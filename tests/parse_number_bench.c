@@ -0,0 +1,129 @@
+/* Microbenchmark comparing ejson_parse_number() against strtod().
+ *
+ * Usage: parse_number_bench [count] [iterations]
+ *
+ * Generates count random decimal literals (a mix of 17 digit representations
+ * of random doubles and random digit strings), verifies that
+ * every literal converts to the same value as strtod() and then reports the
+ * time taken by each converter over the given number of passes. Returns
+ * non-zero if any conversion differed. */
+
+#include "ejson/src/parse_number.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static uint64_t rng_state = 0x9E3779B97F4A7C15ull;
+
+static uint64_t rng_next(void) {
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 7;
+	rng_state ^= rng_state << 17;
+	return rng_state;
+}
+
+static size_t make_literal(char *p_buf, size_t buf_size) {
+	uint64_t r = rng_next();
+	if (r & 1) {
+		/* 17 significant digits of a random finite double */
+		uint64_t bits = rng_next() & 0x7FFFFFFFFFFFFFFFull;
+		double   d;
+		if ((bits >> 52) == 0x7FF)
+			bits &= ~(1ull << 62);
+		memcpy(&d, &bits, sizeof(d));
+		return (size_t)snprintf(p_buf, buf_size, "%.17g", d);
+	} else {
+		/* Random digits with a random decimal point and exponent */
+		unsigned nb_digits = 1 + (unsigned)((r >> 1) % 24);
+		unsigned point     = (unsigned)((r >> 8) % (nb_digits + 1));
+		int      exponent  = (int)((r >> 16) % 700) - 350;
+		size_t   len       = 0;
+		unsigned i;
+		for (i = 0; i < nb_digits; i++) {
+			if (i == point && i != 0)
+				p_buf[len++] = '.';
+			p_buf[len++] = (char)('0' + rng_next() % 10);
+		}
+		if ((r >> 32) & 1)
+			len += (size_t)snprintf(p_buf + len, buf_size - len, "e%d", exponent);
+		p_buf[len] = '\0';
+		return len;
+	}
+}
+
+int main(int argc, char *argv[]) {
+	size_t   count      = (argc > 1) ? (size_t)strtoul(argv[1], NULL, 10) : 1000000;
+	unsigned iterations = (argc > 2) ? (unsigned)strtoul(argv[2], NULL, 10) : 10;
+	char    *p_text;
+	char   **pp_literals;
+	size_t  *p_lengths;
+	size_t   total_len  = 0;
+	size_t   i, mismatches = 0;
+	unsigned iter;
+	double   sink = 0.0;
+	clock_t  start;
+	double   t_ejson, t_strtod;
+
+	p_text      = malloc(count * 64);
+	pp_literals = malloc(count * sizeof(char *));
+	p_lengths   = malloc(count * sizeof(size_t));
+	if (p_text == NULL || pp_literals == NULL || p_lengths == NULL) {
+		fprintf(stderr, "out of memory\n");
+		return EXIT_FAILURE;
+	}
+
+	for (i = 0; i < count; i++) {
+		pp_literals[i] = p_text + total_len;
+		p_lengths[i]   = make_literal(pp_literals[i], 64);
+		total_len     += p_lengths[i] + 1;
+	}
+
+	for (i = 0; i < count; i++) {
+		const char *p = pp_literals[i];
+		long long   ival;
+		double      dval;
+		double      ref = strtod(pp_literals[i], NULL);
+		int         is_real;
+		int         err = ejson_parse_number(&p, p + p_lengths[i], &ival, &dval, &is_real);
+		if (!is_real)
+			dval = (double)ival;
+		if (err == EJSON_NUMBER_OUT_OF_RANGE && ref > 1.7976931348623157e308)
+			continue;
+		if (err != EJSON_NUMBER_OK || *p != '\0' || memcmp(&dval, &ref, sizeof(dval)) != 0) {
+			if (mismatches++ < 10)
+				fprintf(stderr, "mismatch: '%s' gave %.17g (error %d) expected %.17g\n", pp_literals[i], dval, err, ref);
+		}
+	}
+
+	start = clock();
+	for (iter = 0; iter < iterations; iter++) {
+		for (i = 0; i < count; i++) {
+			const char *p = pp_literals[i];
+			long long   ival;
+			double      dval;
+			int         is_real;
+			ejson_parse_number(&p, p + p_lengths[i], &ival, &dval, &is_real);
+			sink += (is_real) ? dval : (double)ival;
+		}
+	}
+	t_ejson = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+	start = clock();
+	for (iter = 0; iter < iterations; iter++) {
+		for (i = 0; i < count; i++)
+			sink += strtod(pp_literals[i], NULL);
+	}
+	t_strtod = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+	printf("%lu literals (%.1f MiB), %u passes\n", (unsigned long)count, total_len / (1024.0 * 1024.0), iterations);
+	printf("ejson_parse_number: %8.3f s %8.1f MiB/s %6.1f ns/number\n", t_ejson, (total_len * (double)iterations) / (1024.0 * 1024.0 * t_ejson), 1e9 * t_ejson / ((double)count * iterations));
+	printf("strtod:             %8.3f s %8.1f MiB/s %6.1f ns/number\n", t_strtod, (total_len * (double)iterations) / (1024.0 * 1024.0 * t_strtod), 1e9 * t_strtod / ((double)count * iterations));
+	printf("%lu mismatches (checksum %g)\n", (unsigned long)mismatches, sink);
+
+	free(p_lengths);
+	free(pp_literals);
+	free(p_text);
+
+	return (mismatches) ? EXIT_FAILURE : EXIT_SUCCESS;
+}